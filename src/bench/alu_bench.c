@@ -0,0 +1,188 @@
+// Microbenchmark for the flag tables in cpu.h
+//
+// Runs every 8 bit ALU helper over all operand pairs and reads F back, once
+// with the table driven flags_value() and once with the arithmetic version it
+// replaced (kept below as flags_value_computed()). Both are first checked to
+// agree on every input.
+//
+// make bench-alu
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cpu.h"
+
+static unsigned char parity(unsigned char p){
+    p = ((p >> 1) & 0x55)+(p & 0x55);
+    p = ((p >> 2) & 0x33)+(p & 0x33);
+    p = ((p >> 4) & 0x0f)+(p & 0x0f);
+    p = !(p & 1);
+
+    return p;
+}
+
+// flags_value() as it was before the tables
+static unsigned char flags_value_computed(const struct cpu *cpu){
+    unsigned res = cpu->lf_res;
+    unsigned dst = cpu->lf_dst;
+    unsigned src = cpu->lf_src;
+
+    switch ((enum lazy_flag_op)cpu->lf_op){
+    case LF_NONE:
+        return cpu->f;
+    case LF_ADD8:
+        return (res & (FLAG_S | FLAG_5 | FLAG_3))
+            | (!(res & 0xff) << 6)
+            | ((dst ^ src ^ res) & FLAG_H)
+            | (((dst ^ res) & (src ^ res) & 0x80) >> 5)
+            | (res >> 8 & FLAG_C);
+    case LF_SUB8:
+    case LF_CP8:
+        return (res & FLAG_S)
+            | ((cpu->lf_op == LF_CP8 ? src : res) & (FLAG_5 | FLAG_3))
+            | (!(res & 0xff) << 6)
+            | ((dst ^ src ^ res) & FLAG_H)
+            | (((dst ^ src) & (dst ^ res) & 0x80) >> 5)
+            | FLAG_N
+            | (res >> 8 & FLAG_C);
+    case LF_INC8:
+        return (res & (FLAG_S | FLAG_5 | FLAG_3))
+            | (!(res & 0xff) << 6)
+            | (!(res & 0x0f) << 4)
+            | ((res & 0xff) == 0x80) << 2
+            | src;
+    case LF_DEC8:
+        return (res & (FLAG_S | FLAG_5 | FLAG_3))
+            | (!(res & 0xff) << 6)
+            | (!(dst & 0x0f) << 4)
+            | ((dst & 0xff) == 0x80) << 2
+            | FLAG_N
+            | src;
+    case LF_LOGIC:
+        return (res & (FLAG_S | FLAG_5 | FLAG_3))
+            | (!res << 6)
+            | (src << 4)
+            | (parity(res) << 2);
+    case LF_ROT8:
+        return (res & (FLAG_S | FLAG_5 | FLAG_3))
+            | (!res << 6)
+            | (parity(res) << 2)
+            | src;
+    default:
+        return flags_value(cpu); // 16 bit ops did not change
+    }
+}
+
+enum bench_op{ B_ADD, B_ADC, B_SUB, B_SBC, B_CP, B_AND, B_OR, B_XOR, B_INC, B_DEC, B_SRL, N_BENCH_OPS };
+static const char *const bench_op_names[N_BENCH_OPS] = {
+    "add", "adc", "sub", "sbc", "cp", "and", "or", "xor", "inc", "dec", "srl",
+};
+
+// Run one helper on cpu->a and x, the carry going in is taken from bit 8 of x
+static inline void run_op(struct cpu *cpu, enum bench_op op, unsigned x){
+    unsigned char tmp;
+
+    cpu->lf_op = LF_NONE;
+    cpu->f = x >> 8 & FLAG_C;
+    switch (op){
+    case B_ADD: cpu->a = add_8(cpu, cpu->a, x); break;
+    case B_ADC: cpu->a = adc_8(cpu, cpu->a, x); break;
+    case B_SUB: cpu->a = sub_8(cpu, cpu->a, x & 0xff); break;
+    case B_SBC: cpu->a = sbc_8(cpu, cpu->a, x & 0xff); break;
+    case B_CP:  cp_8(cpu, cpu->a, x); break;
+    case B_AND: cpu->a = and_8(cpu, cpu->a, x); break;
+    case B_OR:  cpu->a = or_8(cpu, cpu->a, x); break;
+    case B_XOR: cpu->a = xor_8(cpu, cpu->a, x); break;
+    case B_INC: tmp = inc_8(cpu, x); cpu->a ^= tmp; break;
+    case B_DEC: tmp = dec_8(cpu, x); cpu->a ^= tmp; break;
+    case B_SRL: tmp = x; rot_8(cpu, tmp >> 1, tmp & 1); cpu->a ^= tmp >> 1; break;
+    default: abort();
+    }
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define ROUNDS 200
+
+// The timed loop, stamped out for every op and both flag functions so the
+// compiler sees a constant op and only the flag code differs
+#define TIME_OP(name, op, flags_fn) \
+static double name(unsigned *sink){\
+    struct cpu cpu = {0};\
+    unsigned acc = 0;\
+    double start = now();\
+    for(int round = 0; round < ROUNDS; round++){\
+        for(unsigned a = 0; a < 0x100; a++){\
+            for(unsigned x = 0; x < 0x200; x++){\
+                cpu.a = a;\
+                run_op(&cpu, op, x);\
+                acc += flags_fn(&cpu);\
+            }\
+        }\
+    }\
+    *sink += acc;\
+    return (now() - start) * 1e9 / (ROUNDS * 0x100 * 0x200);\
+}
+
+#define BENCH_OP(op) \
+    TIME_OP(op##_computed, op, flags_value_computed)\
+    TIME_OP(op##_tables, op, flags_value)
+
+BENCH_OP(B_ADD)
+BENCH_OP(B_ADC)
+BENCH_OP(B_SUB)
+BENCH_OP(B_SBC)
+BENCH_OP(B_CP)
+BENCH_OP(B_AND)
+BENCH_OP(B_OR)
+BENCH_OP(B_XOR)
+BENCH_OP(B_INC)
+BENCH_OP(B_DEC)
+BENCH_OP(B_SRL)
+
+static double (*const bench_fns[N_BENCH_OPS][2])(unsigned *) = {
+    {B_ADD_computed, B_ADD_tables},
+    {B_ADC_computed, B_ADC_tables},
+    {B_SUB_computed, B_SUB_tables},
+    {B_SBC_computed, B_SBC_tables},
+    {B_CP_computed, B_CP_tables},
+    {B_AND_computed, B_AND_tables},
+    {B_OR_computed, B_OR_tables},
+    {B_XOR_computed, B_XOR_tables},
+    {B_INC_computed, B_INC_tables},
+    {B_DEC_computed, B_DEC_tables},
+    {B_SRL_computed, B_SRL_tables},
+};
+
+int main(void){
+    struct cpu c1 = {0}, c2 = {0};
+    unsigned sink = 0;
+
+    for(int op = 0; op < N_BENCH_OPS; op++){
+        for(unsigned a = 0; a < 0x100; a++){
+            for(unsigned x = 0; x < 0x200; x++){
+                c1.a = c2.a = a;
+                run_op(&c1, op, x);
+                run_op(&c2, op, x);
+                if(flags_value_computed(&c1) != flags_value(&c2)){
+                    printf("%s a=%02x x=%03x: computed %02x tables %02x\n",
+                        bench_op_names[op], a, x, flags_value_computed(&c1), flags_value(&c2));
+                    return 1;
+                }
+            }
+        }
+    }
+
+    printf("%-4s %12s %12s\n", "op", "computed ns", "tables ns");
+    for(int op = 0; op < N_BENCH_OPS; op++){
+        double computed = bench_fns[op][0](&sink);
+        double tables = bench_fns[op][1](&sink);
+        printf("%-4s %12.3f %12.3f\n", bench_op_names[op], computed, tables);
+    }
+    return sink == 42; // keep sink alive
+}
@@ -0,0 +1,108 @@
+#!/bin/sh
+# Fixed guest workloads for catching slowdowns, see `make bench`
+#
+# usage: bench.sh emulator [baseline]
+#
+# Runs every workload BENCH_RUNS times (3) and keeps the fastest run. Prints
+# one line per workload, key=value like the -s stats it comes from.
+# host_calls is the emulator's own count of what it did on the host for the
+# guest: console writes plus the reads, writes, opens and directory scans
+# behind the BDOS file functions. It is not every system call the process
+# makes, the console reader thread, the loader and the memory mappings are
+# not in it. Given a baseline, the output of an earlier run, it fails when a
+# workload ran a different number of instructions or its MIPS dropped by more
+# than BENCH_THRESHOLD percent (10), or ran then and is missing now.
+#
+# ZEXDOC and ZEXALL are part of the suite but not shipped here. Without
+# bench/zexdoc.com and bench/zexall.com they get a status=missing line, so
+# the report and any baseline made from it show they did not run.
+
+emu=$1
+baseline=$2
+runs=${BENCH_RUNS:-3}
+threshold=${BENCH_THRESHOLD:-10}
+if [ -z "$emu" ]; then
+    echo "usage: $0 emulator [baseline]" >&2
+    exit 2
+fi
+
+cd "$(dirname "$0")" || exit 2
+scratch=$(mktemp -d) || exit 2 # the guests' files
+trap 'rm -rf "$scratch"' EXIT
+results=$scratch/results
+failed=0
+
+# One run of program, its stats on one line
+measure(){
+    stats=$("$emu" -s -b -d "$scratch" "$1" < /dev/null 2>&1 > /dev/null) || return 1
+    echo "$stats" | awk '
+        { for(i = 2; i <= NF; i++){ split($i, kv, "="); v[$1 kv[1]] = kv[2] } }
+        END {
+            printf "instructions=%s cycles=%s seconds=%s mips=%s mhz=%s host_calls=%d\n",
+                v["stats:instructions"], v["stats:cycles"], v["stats:seconds"],
+                v["stats:mips"], v["stats:mhz"], v["console:writes"] + v["files:host_calls"]
+        }'
+}
+
+workload(){
+    name=$1
+    program=$2
+    if [ ! -f "$program" ]; then
+        echo "$name: required, but bench/$program is missing" >&2
+        echo "name=$name status=missing" | tee -a "$results"
+        return
+    fi
+
+    i=0
+    while [ $i -lt "$runs" ]; do
+        if ! measure "$program"; then
+            echo "$name: $program failed" >&2
+            echo failed > "$scratch/failed"
+        fi
+        i=$((i + 1))
+    done | awk -v name="$name" '
+        { split($4, kv, "="); if(!n++ || kv[2] + 0 > best){ best = kv[2] + 0; line = $0 } }
+        END { if(n) print "name=" name " " line }' | tee -a "$results"
+}
+
+workload zexdoc zexdoc.com # the instruction exercisers, not shipped here
+workload zexall zexall.com
+workload loop loop.com     # CPU bound kernel
+workload print print.com   # console output
+workload files files.com   # BDOS file traffic
+workload numeric numeric.com # runtime library calls, see -N
+
+[ -f "$scratch/failed" ] && failed=1
+if [ -n "$baseline" ] && [ -f "$results" ]; then
+    awk -v threshold="$threshold" '
+        function field(line, key,    i, n, kv, parts){
+            n = split(line, parts, " ")
+            for(i = 1; i <= n; i++){
+                split(parts[i], kv, "=")
+                if(kv[1] == key)
+                    return kv[2]
+            }
+        }
+        FNR == NR { base[field($0, "name")] = $0; next }
+        {
+            name = field($0, "name")
+            if(!(name in base) || field(base[name], "status") == "missing")
+                next
+            if(field($0, "status") == "missing"){
+                printf "%s: missing, the baseline ran it\n", name
+                bad = 1
+                next
+            }
+            if(field($0, "instructions") != field(base[name], "instructions")){
+                printf "%s: ran %s instructions, the baseline %s\n", name, field($0, "instructions"), field(base[name], "instructions")
+                bad = 1
+            }
+            floor = field(base[name], "mips") * (100 - threshold) / 100
+            if(field($0, "mips") + 0 < floor){
+                printf "%s: %s MIPS, more than %s%% below the baseline %s\n", name, field($0, "mips"), threshold, field(base[name], "mips")
+                bad = 1
+            }
+        }
+        END { exit bad }' "$baseline" "$results" >&2 || failed=1
+fi
+exit $failed
@@ -0,0 +1,144 @@
+; files.asm - fixed BDOS file workload for comparing emulator builds
+;
+; What an assembler does to its files, forty times over: make BENCH.DAT,
+; write 512 records to it, close it, read it back sequentially, then read
+; every seventh record backwards with random reads. Prints a 16 bit
+; checksum of everything read and deletes the file.
+;
+; Assembled with zasm.py: python3 zasm.py files.asm files.com
+
+        org 100h
+        ld de,buf
+        ld c,1ah                ; set DMA
+        call 5
+        ld a,40
+        ld (passes),a
+again:  call clear
+        ld de,fcb
+        ld c,13h                ; delete, in case an earlier run left it
+        call 5
+        call clear
+        ld de,fcb
+        ld c,16h                ; make
+        call 5
+        ld hl,512
+        ld (count),hl
+write:  ld hl,buf               ; a pattern that differs per record
+        ld a,(count)
+        ld b,128
+fill:   ld (hl),a
+        add a,3
+        inc hl
+        djnz fill
+        ld de,fcb
+        ld c,15h                ; write sequential
+        call 5
+        ld hl,(count)
+        dec hl
+        ld (count),hl
+        ld a,h
+        or l
+        jr nz,write
+        ld de,fcb
+        ld c,10h                ; close
+        call 5
+
+        call clear
+        ld de,fcb
+        ld c,0fh                ; open
+        call 5
+read:   ld de,fcb
+        ld c,14h                ; read sequential
+        call 5
+        or a
+        jr nz,random
+        ld hl,buf
+        ld b,128
+        ld de,(sum)
+sum8:   ld a,(hl)
+        add a,e
+        ld e,a
+        ld a,d
+        adc a,0
+        ld d,a
+        inc hl
+        djnz sum8
+        ld (sum),de
+        jr read
+
+random: ld hl,511
+rnext:  ld (fcb+33),hl
+        xor a
+        ld (fcb+35),a
+        push hl
+        ld de,fcb
+        ld c,21h                ; read random
+        call 5
+        ld hl,(buf)             ; fold the first two bytes in
+        ld de,(sum)
+        add hl,de
+        ld (sum),hl
+        pop hl
+        ld de,7
+        or a
+        sbc hl,de
+        jr nc,rnext
+        ld de,fcb
+        ld c,10h
+        call 5
+        ld a,(passes)
+        dec a
+        ld (passes),a
+        jp nz,again
+
+        ld de,fcb
+        ld c,13h
+        call 5
+        ld hl,(sum)
+        ld a,h
+        call hex
+        ld a,l
+        call hex
+        ld e,13
+        ld c,2
+        call 5
+        ld e,10
+        ld c,2
+        call 5
+        ld c,0
+        call 5
+
+clear:  ld hl,fcb+12            ; extent, record counts and random record
+        ld b,24
+        xor a
+zero:   ld (hl),a
+        inc hl
+        djnz zero
+        ret
+
+hex:    push af                 ; print A as two hex digits
+        srl a
+        srl a
+        srl a
+        srl a
+        call nib
+        pop af
+        and 0fh
+nib:    cp 10
+        jr c,dig
+        add a,7
+dig:    add a,'0'
+        push hl
+        ld e,a
+        ld c,2
+        call 5
+        pop hl
+        ret
+
+passes: db 0
+count:  dw 0
+sum:    dw 0
+fcb:    db 0
+        db "BENCH   DAT"
+        ds 24
+buf:    ds 128
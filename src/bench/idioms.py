@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Count the runs of instructions a program keeps executing back to back.
+
+Usage: ./CPM_emu -t 1000000 prog.com; ./trace_dump trace.bin | python3 idioms.py [n]
+
+Reads trace_dump output and prints the n (25) most common straight-line runs
+of 2 to 4 instructions, by opcode, as a share of the traced instructions. A
+run stops at any jump that was taken. This is how the superinstructions in
+decode.h were picked.
+"""
+import collections, sys
+
+PREFIXES = (0xcb, 0xed, 0xdd, 0xfd)
+
+def length(b):
+    """Bytes in the instruction that starts with b, like decode_length()"""
+    op, nx = b[0], b[1]
+    if op == 0xcb: return 2
+    if op == 0xed: return 4 if (nx & 0xc7) == 0x43 else 2
+    if op in (0xdd, 0xfd):
+        if nx in (0x21, 0x22, 0x2a, 0x36, 0xcb): return 4
+        if nx in (0x26, 0x2e, 0x34, 0x35): return 3
+        if nx == 0x76: return 2
+        if (nx & 0xc7) in (0x46, 0x86) or (nx & 0xf8) == 0x70: return 3
+        return 2
+    if op in (0x01, 0x11, 0x21, 0x31, 0x22, 0x2a, 0x32, 0x3a, 0xc3, 0xcd): return 3
+    if op in (0x10, 0x18, 0x20, 0x28, 0x30, 0x38, 0xd3, 0xdb): return 2
+    if (op & 0xc7) in (0x06, 0xc6): return 2
+    if (op & 0xc7) in (0xc2, 0xc4): return 3
+    return 1
+
+def opcode(b):
+    return ' '.join('%02x' % x for x in b[:2 if b[0] in PREFIXES else 1])
+
+records = []  # (pc, first four bytes)
+for line in sys.stdin:
+    f = line.split()
+    records.append((int(f[6][3:], 16), [int(x, 16) for x in f[2:6]]))
+
+runs = collections.Counter()
+for n in (2, 3, 4):
+    for i in range(len(records) - n + 1):
+        names = []
+        for j in range(n):
+            pc, b = records[i + j]
+            names.append(opcode(b))
+            if j < n - 1 and records[i + j + 1][0] != (pc + length(b)) & 0xffff:
+                break
+        else:
+            runs[' | '.join(names)] += 1
+
+for run, count in runs.most_common(int(sys.argv[1]) if len(sys.argv) > 1 else 25):
+    print('%6.2f%% %s' % (100.0 * count / max(len(records), 1), run))
@@ -0,0 +1,88 @@
+; loop.asm - fixed CPU bound workload for comparing emulator builds
+;
+; Mixes the common Z80 instruction classes: 8 and 16 bit arithmetic,
+; CB prefix shifts, conditional relative jumps, DJNZ, stack traffic,
+; LDIR and CPIR. Prints a 16 bit checksum at the end so a broken core
+; shows up as a wrong answer rather than a fast time.
+;
+; Assembled with zasm.py: python3 zasm.py loop.asm loop.com
+
+        org 100h
+        ld hl,0
+        ld (sum),hl
+        ld hl,10000
+        ld (count),hl
+outer:  ld b,0
+        ld hl,(sum)
+        ld de,1234h
+inner:  ld a,b
+        xor e
+        ld e,a
+        add hl,de
+        sla l
+        rl h
+        ld a,l
+        or h
+        jr nz,nz1
+        inc hl
+nz1:    ld a,h
+        cp 80h
+        jr c,small
+        sbc hl,de
+small:  push hl
+        ex de,hl
+        pop de
+        ex de,hl
+        djnz inner
+        ld (sum),hl
+        ld hl,buf               ; smear a byte through buf, then search it
+        ld (hl),a
+        ld de,buf+1
+        ld bc,255
+        ldir
+        ld hl,buf
+        ld bc,256
+        ld a,(sum)
+        cpir
+        ld hl,(count)
+        dec hl
+        ld (count),hl
+        ld a,h
+        or l
+        jr nz,outer
+        ld hl,(sum)
+        ld a,h
+        call hex
+        ld a,l
+        call hex
+        ld e,13
+        ld c,2
+        call 5
+        ld e,10
+        ld c,2
+        call 5
+        ld c,0
+        call 5
+
+hex:    push af                 ; print A as two hex digits
+        srl a
+        srl a
+        srl a
+        srl a
+        call nib
+        pop af
+        and 0fh
+nib:    cp 10
+        jr c,dig
+        add a,7
+dig:    add a,'0'
+        push hl
+        ld e,a
+        ld c,2
+        call 5
+        pop hl
+        ret
+
+sum:    dw 0
+count:  dw 0
+buf:    ds 256
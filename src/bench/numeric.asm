@@ -0,0 +1,153 @@
+; numeric.asm - fixed runtime library workload for comparing emulator builds
+;
+; Spends its time in the kind of helpers every Z80 compiler links in: a 16
+; bit multiply and divide, a block fill and a string compare. Those four are
+; the routines native.c knows, byte for byte, so `-N run` can take the calls
+; over and `-N verify` can check it against them. Prints a checksum of all
+; the results, which has to come out the same either way.
+;
+; Assembled with zasm.py: python3 zasm.py numeric.asm numeric.com
+
+        org 100h
+        ld hl,0
+        ld (sum),hl
+        ld hl,20000
+        ld (count),hl
+outer:  ld bc,(count)               ; product of count and 3 * count + 7
+        ld h,b
+        ld l,c
+        add hl,hl
+        add hl,bc
+        ld de,7
+        add hl,de
+        ex de,hl
+        call mul16
+        call addsum
+        ld bc,(count)               ; 0ffffh - count over its low byte + 1
+        ld hl,0ffffh
+        or a
+        sbc hl,bc
+        ld b,h
+        ld c,l
+        ld a,(count)
+        ld e,a
+        ld d,0
+        inc de
+        call div16
+        call addsum                 ; the remainder
+        ld h,b
+        ld l,c
+        call addsum                 ; the quotient
+        ld hl,buffer                ; 64 copies of the count's low byte
+        ld bc,64
+        ld a,(count)
+        call fill
+        ld hl,(buffer+63)
+        call addsum
+        ld a,(count)                ; only the last byte differs, every other pass
+        and 1
+        ld (text2+38),a
+        ld hl,text1
+        ld de,text2
+        call strcmp
+        push af
+        pop hl
+        call addsum
+        ld hl,(count)
+        dec hl
+        ld (count),hl
+        ld a,h
+        or l
+        jr nz,outer
+
+        ld hl,(sum)                 ; print the checksum
+        ld a,h
+        call hex
+        ld a,(sum)
+        call hex
+        ld e,13
+        ld c,2
+        call 5
+        ld e,10
+        ld c,2
+        call 5
+        ld c,0
+        call 5
+
+addsum: ld de,(sum)
+        add hl,de
+        ld (sum),hl
+        ret
+
+hex:    push af
+        srl a
+        srl a
+        srl a
+        srl a
+        call digit
+        pop af
+digit:  and 0fh
+        add a,'0'
+        cp '9'+1
+        jr c,digit1
+        add a,'a'-'9'-1
+digit1: ld e,a
+        ld c,2
+        jp 5
+
+; The library, native.c has these bytes
+
+; HL = DE * BC, low 16 bits
+mul16:  ld hl,0
+        ld a,16
+mul1:   add hl,hl
+        ex de,hl
+        add hl,hl
+        ex de,hl
+        jr nc,mul2
+        add hl,bc
+mul2:   dec a
+        jr nz,mul1
+        ret
+
+; BC = BC / DE, HL = BC % DE, unsigned, DE up to 7fffh
+div16:  ld hl,0
+        ld a,16
+div1:   sla c
+        rl b
+        adc hl,hl
+        sbc hl,de
+        jr nc,div2
+        add hl,de
+        jr div3
+div2:   inc c
+div3:   dec a
+        jr nz,div1
+        ret
+
+; Store A in the BC bytes from HL on, 65536 of them when BC is 0
+fill:   ld e,a
+fill1:  ld (hl),e
+        inc hl
+        dec bc
+        ld a,b
+        or c
+        jr nz,fill1
+        ret
+
+; Compare the zero terminated strings at DE and HL: Z when they are the
+; same, C when the one at DE sorts first
+strcmp: ld a,(de)
+        cp (hl)
+        ret nz
+        or a
+        ret z
+        inc hl
+        inc de
+        jr strcmp
+
+count:  dw 0
+sum:    dw 0
+text1:  db "The quick brown fox jumps over the dog",0,0
+text2:  db "The quick brown fox jumps over the dog",0,0
+buffer: ds 64
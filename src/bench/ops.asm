@@ -0,0 +1,189 @@
+; ops.asm - self-checking test of the 8080 instructions a real CCP and BDOS use
+;
+; Not a workload: each case checks its result and the program prints OK,
+; or FAIL and the case number as a character from '0' on. Run it on the
+; interpreter and with -j, the JIT translates the same cases. Covers DAA,
+; the accumulator rotates with the H and N flags they clear, register
+; moves, 8 bit arithmetic, the P/M and PE/PO conditions, IN/OUT and the
+; 16 bit and memory increments.
+;
+; Assembled with zasm.py: python3 zasm.py ops.asm ops.com
+
+        org 100h
+        ld a,1
+        ld (case),a
+        ld a,15h            ; daa after add
+        add a,27h
+        daa
+        cp 42h
+        jp nz,fail
+        call next
+        ld a,42h            ; daa after sub
+        sub 15h
+        daa
+        cp 27h
+        jp nz,fail
+        call next
+        ld a,99h            ; daa with a carry out
+        add a,1
+        daa
+        jp nc,fail
+        or a
+        jp nz,fail
+        call next
+        ld a,1              ; rrca
+        rrca
+        jp nc,fail
+        cp 80h
+        jp nz,fail
+        call next
+        scf                 ; rla
+        ccf
+        ld a,80h
+        rla
+        jp nc,fail
+        or a
+        jp nz,fail
+        call next
+        ld a,10h            ; rlca rrca rla rra clear H and N
+        sub 1
+        rlca
+        push af
+        pop bc
+        ld a,c
+        and 12h
+        jp nz,fail
+        ld a,10h
+        sub 1
+        rrca
+        push af
+        pop bc
+        ld a,c
+        and 12h
+        jp nz,fail
+        ld a,10h
+        sub 1
+        rla
+        push af
+        pop bc
+        ld a,c
+        and 12h
+        jp nz,fail
+        ld a,10h
+        sub 1
+        rra
+        push af
+        pop bc
+        ld a,c
+        and 12h
+        jp nz,fail
+        call next
+        ld b,5              ; ld c,b / ld e,c / ld a,e
+        ld c,b
+        ld e,c
+        ld a,e
+        cp 5
+        jp nz,fail
+        call next
+        ld a,10h            ; add a,l / add a,(hl) / adc a,d / sub (hl) / sbc a,a
+        ld l,5
+        add a,l
+        ld hl,three
+        add a,(hl)
+        ld d,1
+        scf
+        adc a,d
+        cp 1ah
+        jp nz,fail
+        sub (hl)
+        cp 17h
+        jp nz,fail
+        scf
+        sbc a,a
+        cp 0ffh
+        jp nz,fail
+        and (hl)
+        cp 3
+        jp nz,fail
+        call next
+        ld a,1              ; jp p / jp m
+        or a
+        jp m,fail
+        jp p,p1
+        jp fail
+p1:     ld a,80h
+        or a
+        jp p,fail
+        jp m,p2
+        jp fail
+p2:     call next
+        ld a,3              ; ret pe / ret po / call pe / call po
+        or a
+        call pe,rpe
+        call po,fail
+        ld a,7
+        or a
+        call po,rpo
+        call pe,fail
+        call next
+        call next
+        in a,(0)            ; in / out
+        cp 0ffh
+        jp nz,fail
+        out (0),a
+        call next
+        ld de,1             ; dec de / inc sp / dec sp / dec (hl)
+        dec de
+        ld a,d
+        or e
+        jp nz,fail
+        inc sp
+        dec sp
+        ld hl,three
+        dec (hl)
+        ld a,(hl)
+        cp 2
+        jp nz,fail
+        call next
+        ld a,0f0h           ; xor * / or * / cp b / and a
+        xor 0ffh
+        or 80h
+        ld b,8fh
+        cp b
+        jp nz,fail
+        and a
+        jp p,fail
+        call next
+        ld hl,okmsg
+        call print
+        ld c,0
+        call 5
+rpe:    ret pe
+        jp fail
+rpo:    ret po
+        jp fail
+next:   ld hl,case
+        inc (hl)
+        ret
+fail:   ld a,(case)
+        add a,'0'
+        ld (num),a
+        ld hl,failmsg
+        call print
+        ld c,0
+        call 5
+print:  ld a,(hl)
+        cp 24h
+        ret z
+        push hl
+        ld e,a
+        ld c,2
+        call 5
+        pop hl
+        inc hl
+        jp print
+case:   db 0
+three:  db 3
+okmsg:  db "OK$"
+failmsg: db "FAIL "
+num:    db "0$"
@@ -0,0 +1,40 @@
+; print.asm - fixed console output workload for comparing emulator builds
+;
+; Prints 20000 lines of 56 characters one BDOS 2 call at a time, so the
+; time goes on the BDOS entry, the console ring and its flushes rather
+; than on computing anything. Ends with a line count check like loop.asm.
+;
+; Assembled with zasm.py: python3 zasm.py print.asm print.com
+
+        org 100h
+        ld hl,20000
+        ld (count),hl
+outer:  ld hl,line
+next:   ld a,(hl)
+        or a
+        jr z,done
+        ld e,a
+        push hl
+        ld c,2
+        call 5
+        pop hl
+        inc hl
+        jr next
+done:   ld hl,line+44           ; count the lines in the last digits
+        inc (hl)
+        ld a,(hl)
+        cp '9'+1
+        jr nz,same
+        ld (hl),'0'
+same:   ld hl,(count)
+        dec hl
+        ld (count),hl
+        ld a,h
+        or l
+        jr nz,outer
+        ld c,0
+        call 5
+
+count:  dw 0
+line:   db "The quick brown fox jumps over the lazy dog 0123456789"
+        db 13,10,0
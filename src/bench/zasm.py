@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""Minimal two pass Z80 assembler for the benchmark programs.
+
+Usage: python3 zasm.py in.asm out.com
+
+Understands labels, org, equ, db, dw, ds and the documented Z80 instruction
+set (plus sll). Output is a flat image that starts at org 100h, i.e. a .COM.
+"""
+import re, sys
+
+R = ['b','c','d','e','h','l','(hl)','a']
+RP = ['bc','de','hl','sp']
+RP2 = ['bc','de','hl','af']
+CC = ['nz','z','nc','c','po','pe','p','m']
+ALU = ['add a,','adc a,','sub ','sbc a,','and ','xor ','or ','cp ']
+ROT = ['rlc','rrc','rl','rr','sla','sra','sll','srl']
+
+T = {}  # pattern -> list of byte templates
+def add(p, *b): T[p] = list(b)
+
+add('nop', 0x00); add('halt', 0x76); add('di', 0xf3); add('ei', 0xfb)
+add('rlca',0x07); add('rrca',0x0f); add('rla',0x17); add('rra',0x1f)
+add('daa',0x27); add('cpl',0x2f); add('scf',0x37); add('ccf',0x3f)
+add('ex af,af\'',0x08); add('exx',0xd9); add('ex de,hl',0xeb); add('ex (sp),hl',0xe3)
+add('jp (hl)',0xe9); add('ld sp,hl',0xf9); add('ret',0xc9)
+add('djnz E',0x10,'E'); add('jr E',0x18,'E')
+for i,c in enumerate(['nz','z','nc','c']): add('jr %s,E'%c, 0x20+8*i,'E')
+add('ld (bc),a',0x02); add('ld (de),a',0x12); add('ld a,(bc)',0x0a); add('ld a,(de)',0x1a)
+add('ld (NN),hl',0x22,'NL','NH'); add('ld hl,(NN)',0x2a,'NL','NH')
+add('ld (NN),a',0x32,'NL','NH'); add('ld a,(NN)',0x3a,'NL','NH')
+add('jp NN',0xc3,'NL','NH'); add('call NN',0xcd,'NL','NH')
+add('out (N),a',0xd3,'N'); add('in a,(N)',0xdb,'N')
+for i,rp in enumerate(RP):
+    add('ld %s,NN'%rp, 0x01+16*i,'NL','NH')
+    add('inc %s'%rp, 0x03+16*i); add('dec %s'%rp, 0x0b+16*i)
+    add('add hl,%s'%rp, 0x09+16*i)
+    add('sbc hl,%s'%rp, 0xed,0x42+16*i); add('adc hl,%s'%rp, 0xed,0x4a+16*i)
+    if rp!='hl':
+        add('ld (NN),%s'%rp, 0xed,0x43+16*i,'NL','NH'); add('ld %s,(NN)'%rp, 0xed,0x4b+16*i,'NL','NH')
+for i,rp in enumerate(RP2):
+    add('push %s'%rp, 0xc5+16*i); add('pop %s'%rp, 0xc1+16*i)
+for i,r in enumerate(R):
+    add('inc %s'%r, 0x04+8*i); add('dec %s'%r, 0x05+8*i); add('ld %s,N'%r, 0x06+8*i,'N')
+    for j,r2 in enumerate(R):
+        if not (i==6 and j==6): add('ld %s,%s'%(r,r2), 0x40+8*i+j)
+    add(ALU[i][:-1].strip()+' N' if ALU[i].endswith(' ') else ALU[i]+'N', 0xc6+8*i,'N')
+    for j,r2 in enumerate(R):
+        add(ALU[i]+r2, 0x80+8*i+j)
+        add(ROT[i]+' '+r2, 0xcb, 8*i+j)
+for b in range(8):
+    for j,r2 in enumerate(R):
+        add('bit %d,%s'%(b,r2),0xcb,0x40+8*b+j); add('res %d,%s'%(b,r2),0xcb,0x80+8*b+j); add('set %d,%s'%(b,r2),0xcb,0xc0+8*b+j)
+for i,c in enumerate(CC):
+    add('ret %s'%c, 0xc0+8*i); add('jp %s,NN'%c, 0xc2+8*i,'NL','NH'); add('call %s,NN'%c, 0xc4+8*i,'NL','NH')
+for i in range(8): add('rst %d'%(8*i), 0xc7+8*i)
+for op,b in [('ldi',0xa0),('cpi',0xa1),('ini',0xa2),('outi',0xa3),('ldd',0xa8),('cpd',0xa9),('ind',0xaa),('outd',0xab),
+             ('ldir',0xb0),('cpir',0xb1),('inir',0xb2),('otir',0xb3),('lddr',0xb8),('cpdr',0xb9),('indr',0xba),('otdr',0xbb),
+             ('neg',0x44),('ld a,i',0x57),('ld sp,(NN)',0x7b),('rld',0x6f),('rrd',0x67)]:
+    add(op,0xed,b,*(['NL','NH'] if 'NN' in op else []))
+# index registers
+for pre,ix in [(0xdd,'ix'),(0xfd,'iy')]:
+    add('ld %s,NN'%ix,pre,0x21,'NL','NH'); add('ld (NN),%s'%ix,pre,0x22,'NL','NH'); add('ld %s,(NN)'%ix,pre,0x2a,'NL','NH')
+    add('push %s'%ix,pre,0xe5); add('pop %s'%ix,pre,0xe1); add('jp (%s)'%ix,pre,0xe9); add('ld sp,%s'%ix,pre,0xf9)
+    add('inc %s'%ix,pre,0x23); add('dec %s'%ix,pre,0x2b); add('ex (sp),%s'%ix,pre,0xe3)
+    for i,rp in enumerate(['bc','de',ix,'sp']): add('add %s,%s'%(ix,rp),pre,0x09+16*i)
+    for i,r in enumerate(R):
+        if r=='(hl)': continue
+        add('ld %s,(%s+D)'%(r,ix),pre,0x46+8*i,'D'); add('ld (%s+D),%s'%(ix,r),pre,0x70+i,'D')
+    add('ld (%s+D),N'%ix,pre,0x36,'D','N')
+    add('inc (%s+D)'%ix,pre,0x34,'D'); add('dec (%s+D)'%ix,pre,0x35,'D')
+    for i in range(8): add(ALU[i]+'(%s+D)'%ix,pre,0x86+8*i,'D')
+
+def norm(s):
+    s = s.strip().lower()
+    s = re.sub(r'\s+',' ',s)
+    s = re.sub(r'\s*,\s*',',',s)
+    s = re.sub(r'\(\s*','(',s); s = re.sub(r'\s*\)',')',s)
+    return s
+
+# compile patterns into regexes
+PATS = []
+for p,b in T.items():
+    rx = re.escape(p)
+    rx = rx.replace('NN',r'(?P<nn>[^,()]+?)').replace('E',r'(?P<e>[^,()]+)')
+    rx = re.sub(r'(?<![a-z])N(?![a-z])', r'(?P<n>[^,()]+?)', rx)
+    rx = rx.replace(r'\+D',r'(?P<d>[+-][^,()]+?)')
+    PATS.append((re.compile('^'+rx+'$'), b, p))
+# prefer patterns with fewer placeholders: literal matches first
+PATS.sort(key=lambda x: ('N' in x[2]) + ('E' in x[2]) + ('D' in x[2]))
+
+def evaluate(expr, syms, pc):
+    expr = expr.strip().replace('$', str(pc))
+    expr = re.sub(r"'(.)'", lambda m: str(ord(m.group(1))), expr)
+    expr = re.sub(r'\b([0-9][0-9a-f]*)h\b', lambda m: str(int(m.group(1),16)), expr)
+    return int(eval(expr, {}, syms))
+
+def assemble(src):
+    lines = src.split('\n')
+    syms = {}
+    for passno in (1,2):
+        pc = 0x100; out = bytearray()
+        for ln in lines:
+            ln = re.sub(r';.*$','',ln).rstrip()
+            if not ln.strip(): continue
+            m = re.match(r'^([A-Za-z_.][\w.]*):(.*)$', ln.strip())
+            if m:
+                syms[m.group(1).lower()] = pc; ln = m.group(2)
+                if not ln.strip(): continue
+            s = norm(ln)
+            m = re.match(r'^([a-z_][\w]*) equ (.*)$', s)
+            if m:
+                syms[m.group(1)] = evaluate(m.group(2), syms, pc)
+                continue
+            if s.startswith('org '):
+                pc = evaluate(s[4:], syms, pc); continue
+            if s.startswith('db ') or s.startswith('dw ') or s.startswith('ds '):
+                kind, args = s[:2], ln.strip()[3:]
+                if kind=='ds':
+                    n = evaluate(args, syms, pc)
+                    out += bytes(n); pc += n; continue
+                for a in re.findall(r'"[^"]*"|[^,]+', args):
+                    a = a.strip()
+                    if a.startswith('"'):
+                        out += a[1:-1].encode(); pc += len(a)-2
+                    else:
+                        v = evaluate(a.lower(), syms, pc) if passno==2 else 0
+                        if kind=='db': out.append(v & 0xff); pc += 1
+                        else: out += bytes([v&0xff,(v>>8)&0xff]); pc += 2
+                continue
+            for rx,b,p in PATS:
+                m = rx.match(s)
+                if not m: continue
+                g = m.groupdict(); bs = []
+                def ev(k):
+                    if passno==1: return 0
+                    return evaluate(g[k], syms, pc)
+                for t in b:
+                    if t=='N': bs.append(ev('n') & 0xff)
+                    elif t=='NL': bs.append(ev('nn') & 0xff)
+                    elif t=='NH': bs.append((ev('nn')>>8) & 0xff)
+                    elif t=='D': bs.append(ev('d') & 0xff)
+                    elif t=='E':
+                        if passno==1: bs.append(0)
+                        else:
+                            d = evaluate(g['e'], syms, pc) - (pc+len(b))
+                            assert -128 <= d < 128, ln
+                            bs.append(d & 0xff)
+                    else: bs.append(t)
+                out += bytes(bs); pc += len(bs); break
+            else:
+                raise SystemExit('cannot assemble: %r (%s)' % (ln, s))
+    return bytes(out)
+
+if __name__ == '__main__':
+    data = assemble(open(sys.argv[1]).read())
+    open(sys.argv[2],'wb').write(data)
@@ -0,0 +1,188 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "machine.h"
+#include "memory.h"
+#include "jit.h"
+
+// ldir, lddr, cpir and cpdr as bulk memory operations, shared by the
+// interpreter and the JIT. The outcome is the same as running the
+// instruction one iteration at a time: registers, flags, overlapping copies,
+// wraparound at 0xffff and the debug maps all end up where they would.
+//
+// Guest memory has its mirror (see memory.h), so a run that wraps is still
+// one memcpy or memchr. Addresses here are offsets into the two copies,
+// up to 0x1ffff, and only the maps wrap them back.
+
+// Book n accesses from lo upwards in the debug maps, and for stores drop
+// the translations of any of them that was code
+static inline void block_touched(struct cpu *cpu, unsigned lo, unsigned n, bool stored){
+    struct machine *m = machine_of(cpu);
+
+#if MEMORY_CHECKS
+    for(unsigned i = 0; i < n; i++){
+        unsigned short a = lo + i;
+        m->mem_tracker[a] |= stored ? 0x02 : 0x01;
+        if(stored)
+            m->writers[a] = cpu->pc;
+    }
+#endif
+
+    if(stored){
+        for(unsigned i = 0; i < n; i++){
+            unsigned short a = lo + i;
+            if(m->code_map[a])
+                jit_invalidate(m->jit, a);
+        }
+    }
+#if DISPATCH_PREDECODED
+    if(stored){
+        for(unsigned i = 0; i < n; i++){
+            unsigned short a = lo + i;
+            if(m->decoded->map[a])
+                decode_invalidate(m->decoded, a);
+        }
+    }
+#endif
+}
+
+// Copy len bytes one at a time from src to dst, both moving in direction
+// dir, both offsets into the mirrored ram and placed so that the ranges only
+// meet where they overlap in ram, see block_copy(). Where the writes run ahead of the reads by
+// fewer than len bytes the reads pick up bytes this copy already wrote, so
+// the first `gap` bytes repeat through the destination, the usual way of
+// filling memory with ldir.
+static inline void block_move(unsigned char *ram, unsigned src, unsigned dst, unsigned len, int dir){
+    unsigned gap = dir > 0 ? dst - src : src - dst; // huge when the writes trail the reads
+    unsigned have;
+
+    if(!gap || gap >= len){
+        if(dir > 0)
+            memmove(ram + dst, ram + src, len);
+        else
+            memmove(ram + dst - len + 1, ram + src - len + 1, len);
+        return;
+    }
+
+    if(gap == 1){
+        memset(dir > 0 ? ram + dst : ram + dst - len + 1, ram[src], len);
+        return;
+    }
+
+    if(dir > 0){
+        memcpy(ram + dst, ram + src, gap);
+        for(have = gap; have < len; have += have < len - have ? have : len - have)
+            memcpy(ram + dst + have, ram + dst, have < len - have ? have : len - have);
+    }else{
+        memcpy(ram + dst - gap + 1, ram + src - gap + 1, gap);
+        for(have = gap; have < len; have += have < len - have ? have : len - have){
+            unsigned k = have < len - have ? have : len - have;
+            memcpy(ram + dst - have - k + 1, ram + dst - k + 1, k);
+        }
+    }
+}
+
+// ldir (dir 1) or lddr (dir -1) at insn. Runs to the end unless the copy
+// would overwrite the instruction itself, then it stops just before that so
+// the caller fetches it again, one byte per run from there. Returns the
+// iterations done, BC is nonzero when the instruction has to repeat.
+static inline unsigned block_copy(struct cpu *restrict cpu, unsigned char *restrict ram, int dir, unsigned short insn){
+    unsigned count = cpu->bc ? cpu->bc : 0x10000;
+    unsigned done = 0;
+
+    // Iterations before the destination reaches the ED byte or the one after it
+    unsigned to_insn = (unsigned short)(dir > 0 ? insn - cpu->de : cpu->de - insn);
+    unsigned to_next = (unsigned short)(dir > 0 ? insn + 1 - cpu->de : cpu->de - insn - 1);
+    if(to_next < to_insn)
+        to_insn = to_next;
+    if(to_insn < count)
+        count = to_insn ? to_insn : 1;
+
+    while(done < count){
+        // Place the two ranges in the mirrored ram so whichever is behind
+        // comes first, the other at most 0xffff after it, and no byte of ram
+        // is in both copies. Only copies close to 64 KiB with their ends far
+        // apart take a second round.
+        unsigned short ahead = dir > 0 ? cpu->de - cpu->hl : cpu->hl - cpu->de; // writes ahead of reads
+        unsigned short behind = -ahead;
+        unsigned gap = ahead < behind ? ahead : behind;
+        unsigned len = count - done;
+        if(len > 0x10000u - gap)
+            len = 0x10000u - gap;
+
+        unsigned src, dst;
+        if(dir > 0){
+            src = ahead < behind ? cpu->hl : cpu->de + gap;
+            dst = ahead < behind ? cpu->hl + gap : cpu->de;
+        }else{ // from the top copy down
+            src = 0x10000u + (ahead < behind ? cpu->hl : cpu->de - gap);
+            dst = 0x10000u + (ahead < behind ? cpu->hl - gap : cpu->de);
+        }
+
+        block_move(ram, src, dst, len, dir);
+        block_touched(cpu, dir > 0 ? cpu->hl : cpu->hl - len + 1, len, false);
+        block_touched(cpu, dir > 0 ? cpu->de : cpu->de - len + 1, len, true);
+
+        cpu->hl += dir * (int)len;
+        cpu->de += dir * (int)len;
+        cpu->bc -= len;
+        done += len;
+    }
+
+    flags_commit(cpu);
+    cpu->f_n = 0;
+    cpu->f_h = 0;
+    cpu->f_pv = cpu->bc != 0;
+    return done;
+}
+
+// cpir (dir 1) or cpdr (dir -1) to the end: A found or BC run out. S, Z and
+// H come from comparing A with the last byte read, P/V is BC != 0, C is left
+// alone. Returns the iterations done.
+static inline unsigned block_compare(struct cpu *restrict cpu, const unsigned char *restrict ram, int dir){
+    unsigned count = cpu->bc ? cpu->bc : 0x10000;
+    unsigned done = 0;
+    unsigned char last = 0;
+    bool found = false;
+
+    while(done < count && !found){
+        unsigned len = count - done; // at most 0x10000, the mirror covers the wrap
+
+        unsigned n;
+        if(dir > 0){
+            const unsigned char *hit = memchr(ram + cpu->hl, cpu->a, len);
+            n = hit ? (unsigned)(hit - (ram + cpu->hl)) + 1 : len;
+        }else{
+            const unsigned char *from = ram + 0x10000 + cpu->hl;
+            for(n = 1; n < len && from[1 - (int)n] != cpu->a; n++)
+                ;
+        }
+        last = ram[(unsigned short)(cpu->hl + dir * (int)(n - 1))];
+        found = last == cpu->a;
+
+        block_touched(cpu, dir > 0 ? cpu->hl : cpu->hl - n + 1, n, false);
+        cpu->hl += dir * (int)n;
+        cpu->bc -= n;
+        done += n;
+    }
+
+    unsigned char carry = flag_c(cpu);
+    cp_8(cpu, cpu->a, last);
+    flags_commit(cpu);
+    cpu->f_c = carry;
+    cpu->f_pv = cpu->bc != 0;
+    return done;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
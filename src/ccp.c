@@ -0,0 +1,331 @@
+// The console command processor
+//
+// CP/M's CCP reads a command line, loads NAME.COM at 0x100 with the rest of
+// the line as its command tail and jumps to it. When the program is done it
+// warm boots, through BDOS function 0 or a jump to 0, and the CCP takes the
+// next line: from $$$.SUB, left on drive A by SUBMIT, or else the console.
+// Here the lines come from $$$.SUB or else the host file given with -C, and
+// the machine exits once there are none. The next program loads into the
+// same machine, so a build that runs M80 then L80 a few dozen times pays for
+// one process and one set of BIOS, BDOS and disk tables.
+//
+// Like the real one, the CCP echoes each command after a prompt, selects a
+// drive for `B:`, says `NAME?` for a program it can not find, and has
+// SUBMIT built in: `SUBMIT NAME args` writes NAME.SUB to $$$.SUB with $1 to
+// $9 replaced by the arguments, last line first, as SUBMIT.COM would.
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "machine.h"
+#include "memory.h"
+#include "ccp.h"
+
+#define RECORD 128
+#define SUBMIT_LINES 256 // lines in one SUBMIT file
+
+static const char submit_name[FS_NAME] = "$$$     SUB";
+
+bool ccp_open(struct ccp *ccp, const char *path){
+    ccp->commands = fopen(path, "r");
+    return ccp->commands;
+}
+
+void ccp_free(struct ccp *ccp){
+    if(ccp->commands)
+        fclose(ccp->commands);
+    ccp->commands = NULL;
+}
+
+
+// Command lines and file names
+
+static bool delimiter(char c){
+    return !c || strchr(" =_.:;<>,", c);
+}
+
+// Up to n characters of a name or type from *text into field, * as ?s
+static void fill_field(unsigned char *field, int n, const char **text){
+    int i = 0;
+    for(; !delimiter(**text); (*text)++){
+        if(**text == '*'){
+            while(i < n)
+                field[i++] = '?';
+        }else if(i < n){
+            field[i++] = **text;
+        }
+    }
+}
+
+// The file name at text as the first 16 bytes of an FCB: drive (0 for the
+// current one), name and type blank padded, the rest zero. Returns where it
+// ends.
+static const char *parse_fcb(const char *text, unsigned char fcb[16]){
+    memset(fcb, 0, 16);
+    memset(fcb + 1, ' ', FS_NAME);
+    while(*text == ' ')
+        text++;
+    if(text[0] >= 'A' && text[0] <= 'P' && text[1] == ':'){
+        fcb[0] = text[0] - 'A' + 1;
+        text += 2;
+    }
+    fill_field(fcb + 1, 8, &text);
+    if(*text == '.'){
+        text++;
+        fill_field(fcb + 9, 3, &text);
+    }
+    return text;
+}
+
+void ccp_set_tail(struct machine *m, const char *tail){
+    char line[CCP_LINE + 1];
+    unsigned char buffer[RECORD];
+    unsigned char fcbs[33]; // two FCBs and the cr of the first
+    size_t n = 0;
+
+    for(; tail[n] && n < CCP_LINE; n++)
+        line[n] = toupper((unsigned char)tail[n]);
+    line[n] = '\0';
+
+    const char *text = parse_fcb(line, fcbs);
+    while(*text && *text != ' ') // what is left of the first argument
+        text++;
+    parse_fcb(text, fcbs + 16);
+    fcbs[32] = 0;
+
+    memset(buffer, 0, sizeof buffer);
+    buffer[0] = n;
+    memcpy(buffer + 1, line, n);
+    copy_to_guest(m, 0x5c, fcbs, sizeof fcbs);
+    copy_to_guest(m, 0x80, buffer, sizeof buffer);
+}
+
+
+// Where the lines come from
+
+// The last record of $$$.SUB, which it loses, and the file goes once empty.
+// If the record can not be taken off the batch stops there, the file left
+// as it is, rather than running the line again or losing the rest.
+static bool next_submitted(struct machine *m, char line[CCP_LINE + 1]){
+    char host[256];
+    struct stat st;
+    unsigned char record[RECORD];
+
+    fs_host_name(&m->fs, submit_name, host);
+    int fd = openat(m->fs.dir_fd, host, O_RDWR);
+    if(fd == -1 && errno != ENOENT){
+        console_printf(&m->console, "$$$.SUB: can not open it, batch stopped\n");
+        m->ccp.stopped = true;
+    }
+    if(fd == -1)
+        return false;
+    off_t records = fstat(fd, &st) ? 0 : st.st_size / RECORD;
+    bool ok = records && pread(fd, record, RECORD, (records - 1) * RECORD) == RECORD;
+    if(ok){
+        size_t n = record[0] < CCP_LINE ? record[0] : CCP_LINE;
+        memcpy(line, record + 1, n);
+        line[n] = '\0';
+    }
+
+    bool removed = records > 1 ? !ftruncate(fd, (records - 1) * RECORD) : true;
+    close(fd);
+    if(records <= 1 && unlinkat(m->fs.dir_fd, host, 0))
+        removed = false;
+    if(!removed){
+        console_printf(&m->console, "$$$.SUB: can not take the line off, batch stopped\n");
+        m->ccp.stopped = true;
+        return false;
+    }
+    return ok;
+}
+
+static bool next_listed(struct ccp *ccp, char line[CCP_LINE + 1]){
+    char text[1024];
+    if(!ccp->commands || !fgets(text, sizeof text, ccp->commands))
+        return false;
+    size_t n = strcspn(text, "\r\n");
+    if(n > CCP_LINE)
+        n = CCP_LINE;
+    memcpy(line, text, n);
+    line[n] = '\0';
+    return true;
+}
+
+
+// Built in SUBMIT
+
+// line with $1 to $9 replaced by arguments[0] to [8], $$ by $ and ^X by
+// control-X, at most CCP_LINE characters
+static size_t substitute(const char *line, char *const arguments[9], char out[CCP_LINE + 1]){
+    size_t n = 0;
+    for(; *line && n < CCP_LINE; line++){
+        if(line[0] == '$' && line[1] >= '1' && line[1] <= '9'){
+            const char *argument = arguments[line[1] - '1'];
+            line++;
+            for(; argument && *argument && n < CCP_LINE; argument++)
+                out[n++] = *argument;
+        }else if(line[0] == '$' && line[1] == '$'){
+            line++;
+            out[n++] = '$';
+        }else if(line[0] == '^' && isalpha((unsigned char)line[1])){
+            line++;
+            out[n++] = toupper((unsigned char)*line) & 0x1f;
+        }else{
+            out[n++] = *line;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static void submit(struct machine *m, char *tail){
+    char *arguments[9] = { NULL };
+    unsigned char fcb[16];
+    char host[256];
+
+    parse_fcb(tail, fcb);
+    strtok(tail, " ");
+    for(int i = 0; i < 9 && (arguments[i] = strtok(NULL, " ")); i++)
+        ;
+    if(fcb[9] == ' ')
+        memcpy(fcb + 9, "SUB", 3);
+    fs_host_name(&m->fs, (const char *)fcb + 1, host);
+    int fd = openat(m->fs.dir_fd, host, O_RDONLY);
+    FILE *fp = fd == -1 ? NULL : fdopen(fd, "r");
+    if(!fp){
+        if(fd != -1)
+            close(fd);
+        console_printf(&m->console, "No 'SUB' File Present\n");
+        return;
+    }
+
+    // Last line first, the CCP reads from the end: count the lines, then
+    // put each one that far from the end
+    char text[1024];
+    int n = 0;
+    while(n < SUBMIT_LINES && fgets(text, sizeof text, fp))
+        n++;
+    rewind(fp);
+
+    fs_host_name(&m->fs, submit_name, host);
+    fd = openat(m->fs.dir_fd, host, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok = fd != -1;
+    for(int i = 0; ok && i < n && fgets(text, sizeof text, fp); i++){
+        unsigned char record[RECORD] = { 0 };
+        char line[CCP_LINE + 1];
+        text[strcspn(text, "\r\n")] = '\0';
+        record[0] = substitute(text, arguments, line);
+        memcpy(record + 1, line, record[0]);
+        ok = pwrite(fd, record, RECORD, (off_t)(n - 1 - i) * RECORD) == RECORD;
+    }
+    fclose(fp);
+    if(fd != -1)
+        close(fd);
+    if(!ok)
+        console_printf(&m->console, "Disk Write Error\n");
+}
+
+
+// Running a program
+
+// NAME.COM into the TPA. False, having said why, when there is no such file
+// or it does not fit.
+static bool load(struct machine *m, const char name[FS_NAME], const char *command){
+    char host[256];
+    unsigned char chunk[4096];
+    struct stat st;
+    unsigned size = m->tpa_top - PROGRAM_START;
+
+    fs_host_name(&m->fs, name, host);
+    int fd = openat(m->fs.dir_fd, host, O_RDONLY);
+    if(fd == -1){
+        console_printf(&m->console, "%s?\n", command);
+        return false;
+    }
+
+    // Straight into the TPA a chunk at a time, like the CCP reading records
+    ssize_t n = fstat(fd, &st) || st.st_size > size ? -1 : 1;
+    unsigned got = 0;
+    while(n > 0 && got < size){
+        n = read(fd, chunk, size - got < sizeof chunk ? size - got : sizeof chunk);
+        if(n > 0)
+            copy_to_guest(m, PROGRAM_START + got, chunk, n);
+        got += n > 0 ? n : 0;
+    }
+    close(fd);
+    if(n < 0){
+        console_printf(&m->console, "Bad load\n");
+        return false;
+    }
+    return true;
+}
+
+// Page zero, the stack and the registers for a program loaded at 0x100. A
+// return from it goes to 0, a warm boot.
+static void start(struct machine *m, const char *tail){
+    struct cpu *cpu = &m->cpu;
+    unsigned char wboot[3] = { 0xc3, (BIOS_BASE + 3) & 0xff, (BIOS_BASE + 3) >> 8 };
+    unsigned char bdos[3] = { 0xc3, m->tpa_top & 0xff, m->tpa_top >> 8 };
+    unsigned char exit_address[2] = { 0, 0 };
+
+    copy_to_guest(m, 0, wboot, sizeof wboot);
+    copy_to_guest(m, 5, bdos, sizeof bdos);
+    copy_to_guest(m, m->tpa_top - 2, exit_address, sizeof exit_address);
+    ccp_set_tail(m, tail);
+    cpu->sp = m->tpa_top - 2;
+    cpu->pc = PROGRAM_START;
+}
+
+bool ccp_warm_boot(struct machine *m){
+    char line[CCP_LINE + 1];
+    unsigned char drive = m->fs.drive;
+
+    fs_reset(m); // everything written back, DMA at 0x80
+    m->fs.drive = drive;
+
+    while(!m->ccp.stopped && (next_submitted(m, line) || (!m->ccp.stopped && next_listed(&m->ccp, line)))){
+        for(char *c = line; *c; c++)
+            *c = toupper((unsigned char)*c);
+        console_printf(&m->console, "%c>%s\n", 'A' + m->fs.drive, line);
+
+        char *command = line + strspn(line, " ");
+        char *tail = command + strcspn(command, " ");
+        unsigned char fcb[16];
+        if(!*command)
+            continue;
+        if(command[1] == ':' && tail == command + 2){ // B:
+            if(command[0] >= 'A' && command[0] <= 'P')
+                m->fs.drive = command[0] - 'A';
+            else
+                console_printf(&m->console, "%s?\n", command);
+            continue;
+        }
+        if(tail - command == 6 && !memcmp(command, "SUBMIT", 6)){
+            submit(m, tail);
+            continue;
+        }
+
+        // Every drive is the same directory, the drive in B:NAME does not matter
+        const char *end = parse_fcb(command, fcb);
+        if(end != tail || fcb[1] == ' ' || fcb[9] != ' ' || memchr(fcb + 1, '?', FS_NAME)){
+            *tail = '\0';
+            console_printf(&m->console, "%s?\n", command);
+            continue;
+        }
+        memcpy(fcb + 9, "COM", 3);
+        char saved = *tail;
+        *tail = '\0';
+        if(!load(m, (const char *)fcb + 1, command))
+            continue;
+        *tail = saved;
+        start(m, tail);
+        m->ccp.warm_loads++;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,40 @@
+#ifndef CCP_H
+#define CCP_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// The console command processor, see ccp.c
+
+#define CCP_LINE 127 // longest command line, what a $$$.SUB record and the tail at 0x80 hold
+
+struct ccp{
+    FILE *commands;                  // -C list, NULL without one
+    unsigned long long warm_loads;   // programs a warm boot loaded
+    bool stopped;                    // $$$.SUB could not be cut short, no more commands
+};
+
+struct machine;
+
+// Run the commands in the host file path, one per line, once there is
+// nothing left in $$$.SUB. False if it can not be read.
+bool ccp_open(struct ccp *ccp, const char *path);
+void ccp_free(struct ccp *ccp);
+
+// Upper case tail and put it at 0x80, with the default FCBs at 0x5c and 0x6c
+// made from its first two arguments, like the CCP hands them to a program
+void ccp_set_tail(struct machine *m, const char *tail);
+
+// Warm boot: load the next command from $$$.SUB or the -C list and set the
+// machine up to run it from 0x100, in place of whatever ran before. False
+// when there is none left.
+bool ccp_warm_boot(struct machine *m);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,199 @@
+// Guest console
+//
+// Characters from BDOS 2, BDOS 6 and BIOS CONOUT collect in a ring buffer
+// and go out with one write(2) per flush instead of one per character. The
+// buffer is flushed when it reaches CONSOLE_FLUSH_AT, whenever the guest
+// looks at the keyboard (so a prompt is visible before the guest waits on an
+// answer) and when the guest exits. Interactive consoles also flush on every
+// newline. A short write leaves the rest in the ring for the next flush.
+//
+// Input comes the other way through a single producer, single consumer ring.
+// The reader thread blocks in poll() on the guest's input fd and publishes
+// whatever arrives by moving tail, the guest side consumes by moving head.
+// Console status and input are then a couple of loads instead of select(),
+// fcntl() and read() on every poll.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "console.h"
+
+void console_init(struct console *con, int fd){
+    con->fd = fd;
+    con->interactive = isatty(fd);
+    con->head = 0;
+    con->len = 0;
+    con->bytes = 0;
+    con->writes = 0;
+}
+
+void console_flush(struct console *con){
+    while(con->len){
+        unsigned first = CONSOLE_RING - con->head; // bytes before the ring wraps
+        struct iovec parts[2] = {
+            { con->ring + con->head, first < con->len ? first : con->len },
+            { con->ring, first < con->len ? con->len - first : 0 },
+        };
+
+        ssize_t n = writev(con->fd, parts, parts[1].iov_len ? 2 : 1);
+        con->writes++;
+        if(n == -1){
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            con->len = 0; // nowhere to put it, drop it like putchar() would
+            return;
+        }
+
+        con->bytes += n;
+        con->head = (con->head + n) & (CONSOLE_RING - 1);
+        con->len -= n;
+    }
+}
+
+void console_printf(struct console *con, const char *format, ...){
+    char text[512];
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof text, format, args);
+    va_end(args);
+
+    if(n > (int)sizeof text - 1)
+        n = sizeof text - 1;
+    for(int i = 0; i < n; i++)
+        console_putc(con, text[i]);
+}
+
+void console_input_init(struct console_input *in, int fd){
+    in->fd = fd;
+    in->started = false;
+    atomic_init(&in->head, 0);
+    atomic_init(&in->tail, 0);
+    atomic_init(&in->eof, false);
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->arrived, NULL);
+}
+
+static void input_wake(struct console_input *in){
+    pthread_mutex_lock(&in->lock);
+    pthread_cond_broadcast(&in->arrived);
+    pthread_mutex_unlock(&in->lock);
+}
+
+static void *input_reader(void *arg){
+    struct console_input *in = arg;
+    struct pollfd fds[2] = {
+        { .fd = in->fd, .events = POLLIN },
+        { .fd = in->stop_pipe[0], .events = POLLIN },
+    };
+
+    for(;;){
+        unsigned tail = atomic_load_explicit(&in->tail, memory_order_relaxed);
+        unsigned head = atomic_load_explicit(&in->head, memory_order_acquire);
+        unsigned space = INPUT_RING - (tail - head);
+
+        // Wait for input, or just for the stop pipe while the guest has not
+        // made room yet
+        fds[0].events = space ? POLLIN : 0;
+        if(poll(fds, 2, space ? -1 : 10) == -1){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(fds[1].revents)
+            return NULL;
+        if(!space || !fds[0].revents)
+            continue;
+
+        unsigned start = tail & (INPUT_RING - 1);
+        unsigned chunk = INPUT_RING - start < space ? INPUT_RING - start : space;
+        ssize_t n = read(in->fd, in->ring + start, chunk);
+        if(n == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(n <= 0)
+            break;
+
+        atomic_store_explicit(&in->tail, tail + n, memory_order_release);
+        input_wake(in);
+    }
+
+    atomic_store_explicit(&in->eof, true, memory_order_release);
+    input_wake(in);
+    return NULL;
+}
+
+static void input_start(struct console_input *in){
+    in->started = true;
+    if(pipe(in->stop_pipe) == -1){
+        atomic_store(&in->eof, true); // no way to stop a reader, so no reader
+        in->stop_pipe[0] = in->stop_pipe[1] = -1;
+        return;
+    }
+    if(pthread_create(&in->reader, NULL, &input_reader, in)){
+        atomic_store(&in->eof, true);
+        close(in->stop_pipe[0]);
+        close(in->stop_pipe[1]);
+        in->stop_pipe[0] = in->stop_pipe[1] = -1;
+    }
+}
+
+void console_input_close(struct console_input *in){
+    if(in->started && in->stop_pipe[1] != -1){
+        while(write(in->stop_pipe[1], "", 1) == -1 && errno == EINTR)
+            ;
+        pthread_join(in->reader, NULL);
+        close(in->stop_pipe[0]);
+        close(in->stop_pipe[1]);
+    }
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->arrived);
+}
+
+bool console_input_ready(struct console_input *in){
+    if(!in->started)
+        input_start(in);
+    return atomic_load_explicit(&in->tail, memory_order_acquire) != atomic_load_explicit(&in->head, memory_order_relaxed)
+        || atomic_load_explicit(&in->eof, memory_order_acquire);
+}
+
+unsigned char console_input_getc(struct console_input *in){
+    unsigned head = atomic_load_explicit(&in->head, memory_order_relaxed);
+
+    if(!in->started)
+        input_start(in);
+    if(atomic_load_explicit(&in->tail, memory_order_acquire) == head)
+        return '\0';
+
+    unsigned char c = in->ring[head & (INPUT_RING - 1)];
+    atomic_store_explicit(&in->head, head + 1, memory_order_release);
+    return c;
+}
+
+bool console_input_ended(struct console_input *in){
+    if(!in->started)
+        input_start(in);
+    return atomic_load_explicit(&in->eof, memory_order_acquire)
+        && atomic_load_explicit(&in->tail, memory_order_acquire) == atomic_load_explicit(&in->head, memory_order_relaxed);
+}
+
+void console_input_wait(struct console_input *in, int timeout_ms){
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&in->lock);
+    while(!console_input_ready(in))
+        if(pthread_cond_timedwait(&in->arrived, &in->lock, &deadline))
+            break;
+    pthread_mutex_unlock(&in->lock);
+}
@@ -0,0 +1,82 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Guest console output and input, see console.c
+
+#define CONSOLE_RING 8192     // power of two
+#define CONSOLE_FLUSH_AT 4096 // write out once this much is waiting
+
+struct console{
+    int fd;
+    bool interactive; // also flush on every newline, for a person watching
+    unsigned head;    // oldest byte not written yet
+    unsigned len;     // bytes waiting
+    unsigned long long bytes;  // everything the guest printed
+    unsigned long long writes; // write(2) calls it took
+    unsigned char ring[CONSOLE_RING];
+};
+
+// interactive defaults to whether fd is a terminal
+void console_init(struct console *con, int fd);
+
+// Write out everything waiting. Called on input polls, at the threshold and
+// when the guest exits.
+void console_flush(struct console *con);
+
+void console_printf(struct console *con, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static inline void console_putc(struct console *con, unsigned char c){
+    con->ring[(con->head + con->len) & (CONSOLE_RING - 1)] = c;
+    con->len++;
+    if(con->len >= CONSOLE_FLUSH_AT || (c == '\n' && con->interactive))
+        console_flush(con);
+}
+
+#define INPUT_RING 4096 // power of two
+
+// Keyboard side. A reader thread, started on the first poll, moves bytes from
+// fd into the ring. The guest side only looks at the ring.
+struct console_input{
+    int fd;
+    bool started;
+    pthread_t reader;
+    int stop_pipe[2]; // written to by console_input_close()
+
+    _Atomic unsigned head; // next byte to hand the guest, only the guest side moves it
+    _Atomic unsigned tail; // next free slot, only the reader moves it
+    atomic_bool eof;       // fd has nothing more, also set when reading failed
+
+    pthread_mutex_t lock;  // only for console_input_wait()
+    pthread_cond_t arrived;
+
+    unsigned char ring[INPUT_RING];
+};
+
+void console_input_init(struct console_input *in, int fd);
+void console_input_close(struct console_input *in);
+
+// True when console_input_getc() has something for the guest. At the end
+// of the input that is always the case, like select() on a file at EOF.
+bool console_input_ready(struct console_input *in);
+
+// Next byte, '\0' when nothing is waiting
+unsigned char console_input_getc(struct console_input *in);
+
+// True once the input has ended and every byte of it has been taken
+bool console_input_ended(struct console_input *in);
+
+// Sleep until a byte arrives, the input ends or timeout_ms pass
+void console_input_wait(struct console_input *in, int timeout_ms);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
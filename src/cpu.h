@@ -0,0 +1,415 @@
+#ifndef CPU_H
+#define CPU_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Z80 register file plus the ALU helpers and lazy flag machinery the cores share
+//
+// The helpers take their operands, the accumulator included, by value and
+// return the result, and never point into the register file. So a core can
+// keep the registers in locals that stay in host registers even where the
+// compiler does not inline a helper (see LOCAL_REGISTERS in main.c). Only the
+// flags always live in struct cpu.
+
+struct cpu{
+    unsigned short pc; // Instruction Pointer  /  Program Counter
+    unsigned short sp; // stack pointer
+
+    unsigned short ix; // index x
+    unsigned short iy; // index y
+
+
+    // main registers
+    union{
+        unsigned short af;
+        struct{
+            unsigned char f;
+            unsigned char a;
+        };
+        //flags
+        struct{
+            unsigned short f_c : 1; // carry flag
+            unsigned short f_n : 1; // 1 for addition, 0 for subtraction
+            unsigned short f_pv : 1; // parity / overflow
+            unsigned short f_bit3 : 1;
+            unsigned short f_h : 1; // half carry
+            unsigned short f_bit5 : 1;
+            unsigned short f_z : 1; // zero flag
+            unsigned short f_s : 1; // negative flag
+            unsigned short f_ : 8;
+        };
+    };
+    union{
+        unsigned short bc;
+        struct{
+            unsigned char c;
+            unsigned char b;
+        };
+    };
+    union{
+        unsigned short de;
+        struct{
+            unsigned char e;
+            unsigned char d;
+        };
+    };
+    union{
+        unsigned short hl;
+        struct{
+            unsigned char l;
+            unsigned char h;
+        };
+    };
+
+    // Alternate registers
+    unsigned short af_prime;
+    unsigned short bc_prime;
+    unsigned short de_prime;
+    unsigned short hl_prime;
+
+    // Lazy flags, the ALU helpers record the operation, its operands and the
+    // unmasked result. F is only worked out when something reads it, see
+    // flags_value(). While lf_op is LF_NONE the bits in f are the real flags.
+    unsigned lf_res;
+    unsigned lf_dst;
+    unsigned lf_src;
+    unsigned char lf_op;
+
+    unsigned long long ran;    // instructions retired
+    unsigned long long cycles; // T-states they took, see cycles.h
+};
+
+enum lazy_flag_op{
+    LF_NONE,
+    LF_ADD8,  // add, adc, lf_res has the carry out in bit 8
+    LF_SUB8,  // sub, sbc, neg, lf_res has the borrow in bit 8
+    LF_CP8,   // like LF_SUB8, but bits 3 and 5 come from the operand
+    LF_INC8,  // lf_src holds the untouched carry
+    LF_DEC8,  // lf_src holds the untouched carry
+    LF_LOGIC, // and, or, xor, lf_src holds H
+    LF_ROT8,  // CB rotates and shifts, lf_src holds the carry out
+    LF_ADD16, // adc hl,rr, carry out in bit 16
+    LF_SUB16, // sbc hl,rr, borrow in bit 16
+};
+
+#define FLAG_C  0x01
+#define FLAG_N  0x02
+#define FLAG_PV 0x04
+#define FLAG_3  0x08
+#define FLAG_H  0x10
+#define FLAG_5  0x20
+#define FLAG_Z  0x40
+#define FLAG_S  0x80
+
+// Flag tables, the compiler works out every entry from the expressions below
+#define PARITY_FLAG(i) ((~((i) ^ (i) >> 1 ^ (i) >> 2 ^ (i) >> 3 ^ (i) >> 4 ^ (i) >> 5 ^ (i) >> 6 ^ (i) >> 7) & 1) << 2)
+#define SZ53(i) (((i) & (FLAG_S | FLAG_5 | FLAG_3)) | ((i) == 0) << 6)
+#define SZ53P(i) (SZ53(i) | PARITY_FLAG(i))
+#define SZHV_INC(i) (SZ53(i) | (((i) & 0x0f) == 0x00) << 4 | ((i) == 0x80) << 2)
+#define SZHV_DEC(i) (SZ53(i) | (((i) & 0x0f) == 0x0f) << 4 | ((i) == 0x7f) << 2 | FLAG_N)
+
+#define TABLE_4(f, i) f(i), f((i) + 1), f((i) + 2), f((i) + 3)
+#define TABLE_16(f, i) TABLE_4(f, i), TABLE_4(f, (i) + 4), TABLE_4(f, (i) + 8), TABLE_4(f, (i) + 12)
+#define TABLE_64(f, i) TABLE_16(f, i), TABLE_16(f, (i) + 16), TABLE_16(f, (i) + 32), TABLE_16(f, (i) + 48)
+#define TABLE_256(f) TABLE_64(f, 0), TABLE_64(f, 64), TABLE_64(f, 128), TABLE_64(f, 192)
+
+static const unsigned char sz53_table[256] = { TABLE_256(SZ53) };
+static const unsigned char sz53p_table[256] = { TABLE_256(SZ53P) };
+static const unsigned char szhv_inc_table[256] = { TABLE_256(SZHV_INC) }; // indexed by the result
+static const unsigned char szhv_dec_table[256] = { TABLE_256(SZHV_DEC) }; // indexed by the result
+
+// H and P/V of an 8 bit add or subtract only depend on bits 3 and 7 of both
+// operands and the result. Index with carry_index().
+static const unsigned char halfcarry_add_table[8] = { 0, FLAG_H, FLAG_H, FLAG_H, 0, 0, 0, FLAG_H };
+static const unsigned char halfcarry_sub_table[8] = { 0, 0, FLAG_H, 0, FLAG_H, 0, FLAG_H, FLAG_H };
+static const unsigned char overflow_add_table[8] = { 0, 0, 0, FLAG_PV, FLAG_PV, 0, 0, 0 };
+static const unsigned char overflow_sub_table[8] = { 0, FLAG_PV, 0, 0, 0, 0, FLAG_PV, 0 };
+
+static inline unsigned carry_index(unsigned dst, unsigned src, unsigned res){
+    return (dst & 0x88) >> 3 | (src & 0x88) >> 2 | (res & 0x88) >> 1;
+}
+
+// Work out F from what the last flag setting instruction recorded
+static inline unsigned char flags_value(const struct cpu *cpu){
+    unsigned res = cpu->lf_res;
+    unsigned dst = cpu->lf_dst;
+    unsigned src = cpu->lf_src;
+    unsigned idx;
+
+    switch ((enum lazy_flag_op)cpu->lf_op){
+    case LF_NONE:
+        return cpu->f;
+    case LF_ADD8:
+        idx = carry_index(dst, src, res);
+        return sz53_table[res & 0xff] | halfcarry_add_table[idx & 7] | overflow_add_table[idx >> 4] | (res >> 8 & FLAG_C);
+    case LF_SUB8:
+        idx = carry_index(dst, src, res);
+        return sz53_table[res & 0xff] | halfcarry_sub_table[idx & 7] | overflow_sub_table[idx >> 4] | FLAG_N | (res >> 8 & FLAG_C);
+    case LF_CP8:
+        idx = carry_index(dst, src, res);
+        return (sz53_table[res & 0xff] & ~(FLAG_5 | FLAG_3)) | (src & (FLAG_5 | FLAG_3))
+            | halfcarry_sub_table[idx & 7] | overflow_sub_table[idx >> 4] | FLAG_N | (res >> 8 & FLAG_C);
+    case LF_INC8:
+        return szhv_inc_table[res] | src;
+    case LF_DEC8:
+        return szhv_dec_table[res] | src;
+    case LF_LOGIC:
+        return sz53p_table[res] | src << 4;
+    case LF_ROT8:
+        return sz53p_table[res] | src;
+    case LF_ADD16:
+        return (res >> 8 & (FLAG_S | FLAG_5 | FLAG_3))
+            | (!(res & 0xffff) << 6)
+            | ((dst ^ src ^ res) >> 8 & FLAG_H)
+            | (((dst ^ res) & (src ^ res) & 0x8000) >> 13)
+            | (res >> 16 & FLAG_C);
+    case LF_SUB16:
+        return (res >> 8 & (FLAG_S | FLAG_5 | FLAG_3))
+            | (!(res & 0xffff) << 6)
+            | ((dst ^ src ^ res) >> 8 & FLAG_H)
+            | (((dst ^ src) & (dst ^ res) & 0x8000) >> 13)
+            | FLAG_N
+            | (res >> 16 & FLAG_C);
+    default:
+        __builtin_unreachable();
+    }
+}
+
+// Store the real flags in F so they can be read or changed bit by bit
+static inline void flags_commit(struct cpu *cpu){
+    cpu->f = flags_value(cpu);
+    cpu->lf_op = LF_NONE;
+}
+
+// The two flags conditional instructions mostly test, without building all of F
+static inline unsigned flag_c(const struct cpu *cpu){
+    switch ((enum lazy_flag_op)cpu->lf_op){
+    case LF_NONE:
+        return cpu->f_c;
+    case LF_ADD8:
+    case LF_SUB8:
+    case LF_CP8:
+        return cpu->lf_res >> 8 & 1;
+    case LF_INC8:
+    case LF_DEC8:
+    case LF_ROT8:
+        return cpu->lf_src;
+    case LF_LOGIC:
+        return 0;
+    case LF_ADD16:
+    case LF_SUB16:
+        return cpu->lf_res >> 16 & 1;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+static inline unsigned flag_z(const struct cpu *cpu){
+    switch ((enum lazy_flag_op)cpu->lf_op){
+    case LF_NONE:
+        return cpu->f_z;
+    case LF_ADD16:
+    case LF_SUB16:
+        return !(cpu->lf_res & 0xffff);
+    default:
+        return !(cpu->lf_res & 0xff);
+    }
+}
+
+static inline unsigned flag_pv(const struct cpu *cpu){
+    return flags_value(cpu) >> 2 & 1;
+}
+
+static inline unsigned flag_s(const struct cpu *cpu){
+    return flags_value(cpu) >> 7 & 1;
+}
+
+static inline void set_lazy_flags(struct cpu *cpu, enum lazy_flag_op op, unsigned dst, unsigned src, unsigned res){
+    cpu->lf_op = op;
+    cpu->lf_dst = dst;
+    cpu->lf_src = src;
+    cpu->lf_res = res;
+}
+
+static inline unsigned alu_8_add(struct cpu *cpu, unsigned x, unsigned y, unsigned carry_in){
+    unsigned res = (x & 0xff) + (y & 0xff) + (carry_in & 1);
+    set_lazy_flags(cpu, LF_ADD8, x & 0xff, y & 0xff, res);
+    return res & 0xff;
+}
+
+static inline unsigned alu_8_sub(struct cpu *cpu, unsigned x, unsigned y, unsigned borrow_in){
+    unsigned res = ((x & 0xff) - (y & 0xff) - (borrow_in & 1)) & 0x1ff; // bit 8 is the borrow
+    set_lazy_flags(cpu, LF_SUB8, x & 0xff, y & 0xff, res);
+    return res & 0xff;
+}
+
+static inline unsigned add_8(struct cpu *cpu, unsigned x, unsigned y){
+    return alu_8_add(cpu, x, y, 0);
+}
+
+static inline unsigned sub_8(struct cpu *cpu, unsigned a, unsigned x){
+    return alu_8_sub(cpu, a, x, 0);
+}
+
+static inline unsigned char inc_8(struct cpu *cpu, unsigned char x){
+    unsigned char c = flag_c(cpu);
+    set_lazy_flags(cpu, LF_INC8, x, c, (unsigned char)(x + 1));
+    return x + 1;
+}
+
+static inline unsigned char dec_8(struct cpu *cpu, unsigned char x){
+    unsigned char c = flag_c(cpu);
+    set_lazy_flags(cpu, LF_DEC8, x, c, (unsigned char)(x - 1));
+    return x - 1;
+}
+
+static inline void cp_8(struct cpu *cpu, unsigned char a, unsigned char b){
+    alu_8_sub(cpu, a, b, 0);
+    cpu->lf_op = LF_CP8;
+}
+
+static inline unsigned char neg_8(struct cpu *cpu, unsigned char a){
+    return alu_8_sub(cpu, 0, a, 0);
+}
+
+static inline unsigned char adc_8(struct cpu *cpu, unsigned char a, unsigned char src){
+    return alu_8_add(cpu, a, src, flag_c(cpu));
+}
+
+static inline unsigned sbc_8(struct cpu *cpu, unsigned a, unsigned x){
+    return alu_8_sub(cpu, a, x, flag_c(cpu));
+}
+
+// daa, A made BCD again after an add or subtract, from N, H and C
+static inline unsigned char daa_8(struct cpu *cpu, unsigned char a){
+    flags_commit(cpu);
+    unsigned char fix = 0;
+    unsigned carry = cpu->f_c;
+    if(cpu->f_h || (a & 0x0f) > 9)
+        fix |= 0x06;
+    if(carry || a > 0x99){
+        fix |= 0x60;
+        carry = 1;
+    }
+    unsigned char result = cpu->f_n ? a - fix : a + fix;
+    unsigned half = cpu->f_n ? cpu->f_h && (a & 0x0f) < 6 : (a & 0x0f) > 9;
+    cpu->f = sz53p_table[result] | half << 4 | (cpu->f & FLAG_N) | carry;
+    return result;
+}
+
+// add hl,rr and friends, only H, N and C change
+static inline unsigned add16(struct cpu *cpu, unsigned x, unsigned y, unsigned carry_in){
+    uint64_t hsum = (x & 0xfff) + (y & 0xfff) + carry_in;
+    int hcarry = hsum >> 12;
+    uint64_t usum = (x & 0xffff) + (y & 0xffff) + carry_in;
+    unsigned carry_out = usum != (uint16_t)usum;
+    
+    uint16_t result = usum;
+
+    flags_commit(cpu);
+    cpu->f_c = carry_out;
+    cpu->f_h = hcarry;
+    cpu->f_n = 0;
+
+    return result;
+}
+
+static inline unsigned adc_16(struct cpu *cpu, unsigned x, unsigned y){
+    unsigned res = (x & 0xffff) + (y & 0xffff) + flag_c(cpu);
+    set_lazy_flags(cpu, LF_ADD16, x & 0xffff, y & 0xffff, res);
+    return res & 0xffff;
+}
+
+static inline unsigned sbc_16(struct cpu *cpu, unsigned x, unsigned y){
+    unsigned res = ((x & 0xffff) - (y & 0xffff) - flag_c(cpu)) & 0x1ffff; // bit 16 is the borrow
+    set_lazy_flags(cpu, LF_SUB16, x & 0xffff, y & 0xffff, res);
+    return res & 0xffff;
+}
+
+static inline unsigned char or_8(struct cpu *cpu, unsigned char a, unsigned char val){
+    a |= val;
+    set_lazy_flags(cpu, LF_LOGIC, 0, 0, a);
+    return a;
+}
+
+static inline unsigned char xor_8(struct cpu *cpu, unsigned char a, unsigned char val){
+    a ^= val;
+    set_lazy_flags(cpu, LF_LOGIC, 0, 0, a);
+    return a;
+}
+
+static inline unsigned char and_8(struct cpu *cpu, unsigned char a, unsigned char val){
+    a &= val;
+    set_lazy_flags(cpu, LF_LOGIC, 0, 1, a); // and sets H
+    return a;
+}
+
+// CB prefix rotates and shifts
+static inline void rot_8(struct cpu *cpu, unsigned char result, unsigned carry_out){
+    set_lazy_flags(cpu, LF_ROT8, 0, carry_out & 1, result);
+}
+
+// Everything after a CB prefix: op is the byte after CB, value the operand.
+// Returns what to write back, bit leaves the operand alone.
+static inline unsigned char cb_apply(struct cpu *cpu, unsigned char op, unsigned char value){
+    unsigned bit = op >> 3 & 0x07;
+    unsigned char result;
+
+    switch (op >> 6){
+    case 0:
+        switch (bit){
+        case 0: // rlc
+            result = value << 1 | value >> 7;
+            rot_8(cpu, result, value >> 7);
+            return result;
+        case 1: // rrc
+            result = value >> 1 | value << 7;
+            rot_8(cpu, result, value & 1);
+            return result;
+        case 2: // rl
+            result = value << 1 | flag_c(cpu);
+            rot_8(cpu, result, value >> 7);
+            return result;
+        case 3: // rr
+            result = value >> 1 | flag_c(cpu) << 7;
+            rot_8(cpu, result, value & 1);
+            return result;
+        case 4: // sla
+        case 6: // sll ( undocumented )
+            result = value << 1;
+            rot_8(cpu, result, value >> 7);
+            return result;
+        case 5: // sra
+            result = value >> 1 | (value & 0x80);
+            rot_8(cpu, result, value & 1);
+            return result;
+        case 7: // srl
+            result = value >> 1;
+            rot_8(cpu, result, value & 1);
+            return result;
+        default:
+            __builtin_unreachable();
+        }
+    case 1: // bit
+        flags_commit(cpu);
+        cpu->f_z = ~value >> bit & 1;
+        cpu->f_h = 1;
+        cpu->f_n = 0;
+        return value;
+    case 2: // res
+        return value & ~(1 << bit);
+    case 3: // set
+        return value | 1 << bit;
+    default:
+        __builtin_unreachable();
+    }
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,99 @@
+#ifndef CYCLES_H
+#define CYCLES_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Z80 T-states, shared by the interpreter cores and the JIT. Every
+// instruction is charged its not taken / single iteration time when it
+// starts, the handlers add the rest when a branch is taken or a block
+// instruction repeats.
+
+#define CYCLES_JR_TAKEN 5   // jr cc and djnz, 12 or 13 instead of 7 or 8
+#define CYCLES_CALL_TAKEN 7 // call cc, 17 instead of 10
+#define CYCLES_RET_TAKEN 6  // ret cc, 11 instead of 5
+#define CYCLES_BLOCK_REPEAT 21 // ldir and friends per iteration that goes again, 16 for the last
+
+// Unprefixed instructions, 0 for the prefixes
+static const unsigned char main_cycles[256] = {
+//   0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f
+     4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4, // 0x00
+     8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4, // 0x10
+     7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4, // 0x20
+     7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4, // 0x30
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x40
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x50
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x60
+     7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4, // 0x70
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x80
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x90
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0xa0
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0xb0
+     5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  0, 10, 17,  7, 11, // 0xc0
+     5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  0,  7, 11, // 0xd0
+     5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11, // 0xe0
+     5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  0,  7, 11, // 0xf0
+};
+
+static inline unsigned cb_cycles(unsigned char op){
+    if((op & 0x07) != 6)
+        return 8;
+    return op >> 6 == 1 ? 12 : 15; // bit n,(hl) only reads
+}
+
+static inline unsigned ed_cycles(unsigned char op){
+    if(op >= 0x40 && op < 0x80){
+        switch (op & 0x07){
+        case 0: case 1: return 12; // in r,(c) / out (c),r
+        case 2: return 15;         // sbc / adc hl,rr
+        case 3: return 20;         // ld (**),rr / ld rr,(**)
+        case 4: return 8;          // neg
+        case 5: return 14;         // retn / reti
+        case 6: return 8;          // im
+        default: return op == 0x67 || op == 0x6f ? 18 : 9; // rrd rld / ld i,a and friends
+        }
+    }
+    if(op >= 0xa0 && op < 0xc0 && (op & 0x07) < 4)
+        return 16; // ldi cpi ini outi and the repeating ones, one iteration
+    return 8;
+}
+
+// dd and fd: the hl instruction plus 4, or plus 12 when (hl) becomes (ix+*)
+static inline unsigned index_cycles(unsigned char op, unsigned char cb_op){
+    if(op == 0xcb)
+        return cb_op >> 6 == 1 ? 20 : 23;
+    if(op == 0x36) // ld (ix+*),*
+        return 19;
+    if(op == 0x34 || op == 0x35 || (op != 0x76 && ((op & 0xc7) == 0x46 || (op & 0xf8) == 0x70)) || (op & 0xc7) == 0x86)
+        return main_cycles[op] + 12;
+    return main_cycles[op] + 4;
+}
+
+// The instruction at pc, taken / repeating extras left out
+static inline unsigned instruction_cycles(const unsigned char *ram, unsigned short pc){
+    unsigned char op = ram[pc];
+    if(main_cycles[op])
+        return main_cycles[op];
+
+    unsigned char next = ram[(unsigned short)(pc + 1)];
+    switch (op){
+    case 0xcb:
+        return cb_cycles(next);
+    case 0xed:
+        return ed_cycles(next);
+    default:
+        return index_cycles(next, ram[(unsigned short)(pc + 3)]);
+    }
+}
+
+// What a block instruction that ran `done` iterations takes beyond the 16
+// charged when it started. It repeats when it stopped early and goes again.
+static inline unsigned long long block_cycles(unsigned done, int repeats){
+    return (done - 1) * (unsigned long long)CYCLES_BLOCK_REPEAT + (repeats ? CYCLES_BLOCK_REPEAT - 16 : 0);
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
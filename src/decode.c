@@ -0,0 +1,113 @@
+// Predecoded instruction cache, see decode.h. The decoding itself needs the
+// handler labels and lives in do_emulation() in main.c.
+
+#include <stdlib.h>
+
+#include "decode.h"
+
+struct decode_cache *decode_new(void){
+    return calloc(1, sizeof(struct decode_cache));
+}
+
+void decode_free(struct decode_cache *d){
+    free(d);
+}
+
+// The standard Z80 lengths, whether or not the interpreter has a handler
+unsigned decode_length(const unsigned char *ram, unsigned short pc){
+    unsigned char op = ram[pc];
+    unsigned char next = ram[(unsigned short)(pc + 1)];
+
+    switch (op){
+    case 0xcb:
+        return 2;
+    case 0xed:
+        return (next & 0xc7) == 0x43 ? 4 : 2; // ld (**),rr / ld rr,(**)
+    case 0xdd:
+    case 0xfd:
+        switch (next){
+        case 0x21: case 0x22: case 0x2a: // ld ix,** / ld (**),ix / ld ix,(**)
+        case 0x36:                       // ld (ix+*),*
+        case 0xcb:                       // bit ops on (ix+*)
+            return 4;
+        case 0x26: case 0x2e:            // ld ixh,* / ld ixl,*
+        case 0x34: case 0x35:            // inc / dec (ix+*)
+            return 3;
+        }
+        if(next == 0x76)
+            return 2;
+        if((next & 0xc7) == 0x46 || (next & 0xf8) == 0x70 || (next & 0xc7) == 0x86) // ld r,(ix+*) / ld (ix+*),r / alu (ix+*)
+            return 3;
+        return 2;
+    case 0x01: case 0x11: case 0x21: case 0x31: // ld rr,**
+    case 0x22: case 0x2a: case 0x32: case 0x3a: // ld (**) forms
+    case 0xc3: case 0xcd:                       // jp / call
+        return 3;
+    case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // djnz / jr
+    case 0xd3: case 0xdb:                                             // out / in
+        return 2;
+    }
+
+    switch (op & 0xc7){
+    case 0x06: // ld r,*
+    case 0xc6: // alu *
+        return 2;
+    case 0xc2: // jp cc
+    case 0xc4: // call cc
+        return 3;
+    }
+    return 1;
+}
+
+// The runs, with the operands their handlers take
+enum fused decode_fuse(const unsigned char *ram, unsigned short pc, unsigned *length, unsigned char operand[3]){
+    unsigned char b[DECODE_LONGEST];
+    for(unsigned i = 0; i < DECODE_LONGEST; i++)
+        b[i] = ram[(unsigned short)(pc + i)];
+
+    switch (b[0]){
+    case 0x7e:
+        if(b[1] == 0xb7 && b[2] == 0x28){
+            *length = 4;
+            operand[0] = b[3]; // displacement
+            return FUSE_LD_A_HL_OR_A_JR_Z;
+        }
+        if(b[1] == 0x83 && b[2] == 0x5f){
+            *length = 3;
+            return FUSE_LD_A_HL_ADD_A_E_LD_E_A;
+        }
+        break;
+    case 0x23:
+        if(b[1] == 0x10 || b[1] == 0x18){
+            *length = 3;
+            operand[0] = b[2]; // displacement
+            return b[1] == 0x10 ? FUSE_INC_HL_DJNZ : FUSE_INC_HL_JR;
+        }
+        break;
+    case 0xfe:
+        if(b[2] == 0x38){
+            *length = 4;
+            operand[0] = b[1]; // compared with
+            operand[1] = b[3]; // displacement
+            return FUSE_CP_JR_C;
+        }
+        break;
+    case 0x7d:
+        if(b[1] == 0xb4 && b[2] == 0x20){
+            *length = 4;
+            operand[0] = b[3]; // displacement
+            return FUSE_LD_A_L_OR_H_JR_NZ;
+        }
+        break;
+    case 0x0e:
+        if(b[2] == 0xcd){
+            *length = 5;
+            operand[0] = b[1]; // c
+            operand[1] = b[3]; // where to, low byte first
+            operand[2] = b[4];
+            return FUSE_LD_C_CALL;
+        }
+        break;
+    }
+    return FUSE_NONE;
+}
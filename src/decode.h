@@ -0,0 +1,85 @@
+#ifndef DECODE_H
+#define DECODE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// Predecoded instruction cache for the interpreter, built with
+// `make DISPATCH=predecoded`. The first time an instruction at some address
+// runs it is decoded once: prefixes resolved to the handler, length known,
+// operand bytes copied out. From then on dispatch is one indexed load and an
+// indirect jump, with no imm_8 per byte. See do_emulation() in main.c.
+#ifndef DISPATCH_PREDECODED
+#define DISPATCH_PREDECODED 0
+#endif
+
+// Superinstructions, `make DISPATCH=fused`: the predecoded core plus entries
+// that cover a short run of instructions the bench/ workloads keep running
+// back to back (see bench/idioms.py). One dispatch runs the whole run, and
+// the handler tests what a conditional branch at the end needs directly
+// instead of asking the flags for it.
+#ifndef DISPATCH_FUSED
+#define DISPATCH_FUSED 0
+#endif
+
+#define DECODE_LONGEST 5 // bytes in an entry, a fused one is the longest
+
+enum fused{
+    FUSE_NONE,
+    FUSE_LD_A_HL_OR_A_JR_Z,     // ld a,(hl); or a; jr z,*   end of a string
+    FUSE_LD_A_HL_ADD_A_E_LD_E_A, // ld a,(hl); add a,e; ld e,a   byte sums
+    FUSE_INC_HL_DJNZ,           // inc hl; djnz *
+    FUSE_INC_HL_JR,             // inc hl; jr *
+    FUSE_CP_JR_C,               // cp *; jr c,*
+    FUSE_LD_A_L_OR_H_JR_NZ,     // ld a,l; or h; jr nz,*   16 bit loop counter
+    FUSE_LD_C_CALL,             // ld c,*; call **   BDOS calls
+    FUSE_COUNT
+};
+
+struct decoded{
+    const void *handler;      // label in do_emulation(), NULL until decoded
+    unsigned char length;     // pc moves on by this much before the handler runs
+    unsigned char operand[3]; // bytes after the opcode and its prefix, in order, see decode_fuse() for fused entries
+    unsigned char cycles;     // T-states, see cycles.h
+};
+
+struct decode_cache{
+    struct decoded entry[0x10000]; // one per guest address
+    unsigned char map[0x10000];    // nonzero for every byte of a decoded instruction
+    unsigned long long decodes;
+    unsigned long long invalidations;
+    unsigned long long fused; // decodes that made a fused entry
+};
+
+// NULL when out of memory
+struct decode_cache *decode_new(void);
+void decode_free(struct decode_cache *d);
+
+// Length of the Z80 instruction at pc, prefixes and operands included
+unsigned decode_length(const unsigned char *ram, unsigned short pc);
+
+// The run of instructions at pc fused into one entry: FUSE_NONE, or which one
+// with its length in *length and the operands its handler takes from the
+// run in operand[], in order
+enum fused decode_fuse(const unsigned char *ram, unsigned short pc, unsigned *length, unsigned char operand[3]);
+
+// The guest wrote to addr. Every entry that covers it starts at most
+// DECODE_LONGEST - 1 bytes before it, drop those so they get decoded again.
+static inline void decode_invalidate(struct decode_cache *d, unsigned short addr){
+    for(unsigned back = 0; back < DECODE_LONGEST; back++){
+        struct decoded *e = &d->entry[(unsigned short)(addr - back)];
+        if(e->handler && back < e->length){
+            e->handler = 0;
+            d->invalidations++;
+        }
+    }
+    d->map[addr] = 0;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
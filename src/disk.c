@@ -0,0 +1,382 @@
+// CP/M disk images behind the BIOS
+//
+// Each drive is a raw image, track after track of 128 byte sectors, mapped
+// shared into the host. READ and WRITE are a copy between the mapping and the
+// DMA buffer. The page cache is the sector cache: nothing is read or written
+// through system calls while the guest runs, and disk_free() syncs the
+// mapping back to the image.
+//
+// The disk parameter headers, DPBs, skew tables, checksum and allocation
+// vectors live in guest memory like in a real BIOS, in a block between the
+// top of the TPA and the BDOS. The jump at 0x0005 moves down to the start
+// of that block, so programs that size memory from it leave it alone.
+//
+// With -B the guest runs the CCP and BDOS off drive A:'s system tracks
+// instead of the emulator's own. They go where MOVCPM built them to run,
+// below those tables, and the BIOS jump table above them leads into the
+// trapped BIOS, so it is the guest BDOS that calls SELDSK, READ and WRITE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portable.h"
+#include "machine.h"
+#include "memory.h"
+#include "disk.h"
+
+#define SECTOR 128
+#define DIRBUF_SIZE 128
+
+static const struct{
+    const char *name;
+    struct disk_format format;
+} formats[] = {
+    { "ibm-3740", { .tracks = 77, .sectors = 26, .skew = 6, .first_sector = 1, .block = 1024, .dirs = 64, .boot = 2 } },
+    { "4mb-hd", { .tracks = 1024, .sectors = 32, .block = 2048, .dirs = 256, .fixed = true } },
+};
+
+static bool parse_option(struct disk_format *f, const char *option){
+    for(size_t i = 0; i < sizeof formats / sizeof *formats; i++){
+        if(!strcmp(option, formats[i].name)){
+            *f = formats[i].format;
+            return true;
+        }
+    }
+
+    static const struct{
+        const char *key;
+        size_t offset;
+    } keys[] = {
+        { "tracks", offsetof(struct disk_format, tracks) },
+        { "sectors", offsetof(struct disk_format, sectors) },
+        { "skew", offsetof(struct disk_format, skew) },
+        { "first", offsetof(struct disk_format, first_sector) },
+        { "block", offsetof(struct disk_format, block) },
+        { "dirs", offsetof(struct disk_format, dirs) },
+        { "boot", offsetof(struct disk_format, boot) },
+    };
+    const char *value = strchr(option, '=');
+    if(!value)
+        return false;
+    if(!strncmp(option, "fixed=", 6)){
+        f->fixed = atoi(value + 1);
+        return true;
+    }
+    for(size_t i = 0; i < sizeof keys / sizeof *keys; i++){
+        if(strlen(keys[i].key) == (size_t)(value - option) && !strncmp(option, keys[i].key, value - option)){
+            *(unsigned *)((char *)f + keys[i].offset) = strtoul(value + 1, NULL, 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Blocks on the data tracks, the DSM field is one less
+static unsigned n_blocks(const struct disk_format *f){
+    return (f->tracks - f->boot) * f->sectors * SECTOR / f->block;
+}
+
+static bool format_ok(const struct disk_format *f){
+    unsigned block = f->block;
+    return f->tracks > f->boot && f->sectors && f->sectors <= 0xff
+        && block >= 1024 && block <= 16384 && !(block & (block - 1))
+        && f->dirs && f->dirs * 32 <= 16 * block
+        && n_blocks(f) > 1 && n_blocks(f) <= 0x10000
+        && !(n_blocks(f) > 256 && block == 1024); // not allowed by the DPB
+}
+
+bool disk_attach(struct disks *d, const char *spec){
+    if(d->n == DISK_DRIVES){
+        fprintf(stderr, "%s: no drive left\n", spec);
+        return false;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof path, "%s", spec);
+    char *options = strchr(path, ':');
+    if(options)
+        *options++ = '\0';
+
+    struct disk_format format = formats[0].format;
+    for(char *option = options ? strtok(options, ",") : NULL; option; option = strtok(NULL, ",")){
+        if(!parse_option(&format, option)){
+            fprintf(stderr, "%s: unknown disk option \"%s\"\n", path, option);
+            return false;
+        }
+    }
+    if(!format_ok(&format)){
+        fprintf(stderr, "%s: that is no CP/M disk format\n", path);
+        return false;
+    }
+
+    struct disk *disk = &d->drive[d->n];
+    disk->image = map_a_disk_image(path, &disk->n_bytes);
+    if(!disk->image){
+        fprintf(stderr, "%s: can not map the image\n", path);
+        return false;
+    }
+    if(disk->n_bytes < (size_t)format.tracks * format.sectors * SECTOR){
+        fprintf(stderr, "%s: %zu bytes, too small for %u tracks of %u sectors\n", path, disk->n_bytes, format.tracks, format.sectors);
+        unmap_a_disk_image(disk->image, disk->n_bytes);
+        disk->image = NULL;
+        return false;
+    }
+    disk->format = format;
+    d->n++;
+    return true;
+}
+
+void disk_free(struct disks *d){
+    for(int i = 0; i < d->n; i++)
+        unmap_a_disk_image(d->drive[i].image, d->drive[i].n_bytes);
+    d->n = 0;
+}
+
+
+// Guest tables
+
+static unsigned checksum_size(const struct disk_format *f){
+    return f->fixed ? 0 : (f->dirs + 3) / 4;
+}
+
+static unsigned allocation_size(const struct disk_format *f){
+    return n_blocks(f) / 8 + 1;
+}
+
+static unsigned skew_size(const struct disk_format *f){
+    return f->skew ? f->sectors : 0;
+}
+
+static void put_16(unsigned char *p, unsigned value){
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+// The usual skew table: each sector skew places after the last one, moving
+// on to the next free place on collisions
+static void make_skew(const struct disk_format *f, unsigned char *table){
+    bool used[256] = {0};
+    unsigned place = 0;
+    for(unsigned i = 0; i < f->sectors; i++){
+        while(used[place])
+            place = (place + 1) % f->sectors;
+        used[place] = true;
+        table[i] = place + f->first_sector;
+        place = (place + f->skew) % f->sectors;
+    }
+}
+
+static void make_dpb(const struct disk_format *f, unsigned char *dpb){
+    unsigned records = f->block / SECTOR;
+    unsigned blocks = n_blocks(f);
+    unsigned dir_blocks = (f->dirs * 32 + f->block - 1) / f->block;
+    unsigned al = (0xffff0000u >> dir_blocks) & 0xffff; // a bit per directory block from the top
+
+    put_16(dpb + 0, f->sectors);        // SPT
+    dpb[2] = __builtin_ctz(records);    // BSH
+    dpb[3] = records - 1;               // BLM
+    dpb[4] = f->block / (blocks > 256 ? 2048 : 1024) - 1; // EXM
+    put_16(dpb + 5, blocks - 1);        // DSM
+    put_16(dpb + 7, f->dirs - 1);       // DRM
+    dpb[9] = al >> 8;                   // AL0
+    dpb[10] = al;                       // AL1
+    put_16(dpb + 11, checksum_size(f)); // CKS
+    put_16(dpb + 13, f->boot);          // OFF
+}
+
+unsigned short disk_install(struct machine *m){
+    struct disks *d = &m->disks;
+    if(!d->n)
+        return BDOS_BASE;
+
+    unsigned size = 3 + DIRBUF_SIZE;
+    for(int i = 0; i < d->n; i++){
+        const struct disk_format *f = &d->drive[i].format;
+        size += 16 + 15 + skew_size(f) + checksum_size(f) + allocation_size(f);
+    }
+
+    // jp BDOS_BASE, then the shared directory buffer, then each drive's
+    // DPH, DPB, skew table, checksum vector and allocation vector
+    unsigned short top = (BDOS_BASE - size) & 0xff00;
+    static const unsigned char zeros[256];
+
+    // Built in place, nothing to allocate. Cleared through copy_to_guest()
+    // first, so the code caches and the debug maps hear about all of it.
+    for(unsigned at = top; at < BDOS_BASE; at += sizeof zeros)
+        copy_to_guest(m, at, zeros, BDOS_BASE - at < sizeof zeros ? BDOS_BASE - at : sizeof zeros);
+    unsigned char *tables = m->ram + top;
+    unsigned short dirbuf = top + 3;
+    unsigned short next = dirbuf + DIRBUF_SIZE;
+    tables[0] = 0xc3;
+    put_16(tables + 1, BDOS_BASE);
+
+    for(int i = 0; i < d->n; i++){
+        struct disk *disk = &d->drive[i];
+        const struct disk_format *f = &disk->format;
+        unsigned short dph = next;
+        unsigned short dpb = dph + 16;
+        unsigned short xlt = dpb + 15;
+        unsigned short csv = xlt + skew_size(f);
+        unsigned short alv = csv + checksum_size(f);
+        next = alv + allocation_size(f);
+
+        unsigned char *p = tables + (dph - top);
+        put_16(p + 0, f->skew ? xlt : 0);
+        put_16(p + 8, dirbuf);
+        put_16(p + 10, dpb);
+        put_16(p + 12, csv);
+        put_16(p + 14, alv);
+        make_dpb(f, tables + (dpb - top));
+        if(f->skew)
+            make_skew(f, tables + (xlt - top));
+        disk->dph = dph;
+    }
+
+    return top;
+}
+
+
+// Booting from the system tracks
+
+// CP/M 2.2: the cold start loader in the first sector, then the CCP and
+// the BDOS, which starts with its serial number and a jump to its entry
+#define CCP_SIZE 0x800
+#define SYSTEM_SIZE 0x1600   // CCP and BDOS
+#define BDOS_ENTRY 0x11      // from the start of the BDOS
+#define BIOS_ENTRIES 17      // BOOT to SECTRAN
+
+// The CCP and BDOS off the tracks, page zero's jumps to them and the DMA
+// address at 0x80, then on to the CCP with the drive in C, like the BIOS
+// does on every boot
+static void load_system(struct machine *m){
+    struct disks *d = &m->disks;
+    unsigned short bios = d->system + SYSTEM_SIZE;
+    unsigned short bdos = d->system + CCP_SIZE + 6;
+    unsigned char wboot_jump[3] = { 0xc3, (bios + 3) & 0xff, (bios + 3) >> 8 };
+    unsigned char bdos_jump[3] = { 0xc3, bdos & 0xff, bdos >> 8 };
+
+    copy_to_guest(m, d->system, d->drive[0].image + SECTOR, SYSTEM_SIZE);
+    copy_to_guest(m, 0, wboot_jump, sizeof wboot_jump);
+    copy_to_guest(m, 5, bdos_jump, sizeof bdos_jump);
+    d->dma = 0x80;
+    m->cpu.c = m->ram[4];
+    m->cpu.pc = d->system;
+}
+
+bool disk_boot(struct machine *m){
+    struct disks *d = &m->disks;
+    if(!d->n){
+        fprintf(stderr, "-B: no disk image to boot from\n");
+        return false;
+    }
+
+    const struct disk_format *f = &d->drive[0].format;
+    if((size_t)f->boot * f->sectors * SECTOR < SECTOR + SYSTEM_SIZE){
+        fprintf(stderr, "A: has no room for CP/M on its %u system tracks\n", f->boot);
+        return false;
+    }
+    const unsigned char *bdos = d->drive[0].image + SECTOR + CCP_SIZE;
+    unsigned entry = bdos[7] | bdos[8] << 8;
+    if(bdos[6] != 0xc3 || (entry - BDOS_ENTRY) & 0xff || entry < PROGRAM_START + CCP_SIZE + BDOS_ENTRY){
+        fprintf(stderr, "A: has no CP/M 2.2 BDOS on its system tracks\n");
+        return false;
+    }
+
+    // The size MOVCPM built it for puts the BIOS right after the BDOS. It has
+    // to end below the disk tables, the top of the TPA until now.
+    unsigned short ccp = entry - BDOS_ENTRY - CCP_SIZE;
+    unsigned bios = ccp + SYSTEM_SIZE;
+    if(bios + BIOS_ENTRIES * 3 > m->tpa_top){
+        fprintf(stderr, "A: has CP/M for %uK, its BIOS at %04x would run into the disk tables at %04hx, %uK fits\n",
+            (bios + 0x600) / 1024, bios, m->tpa_top, (m->tpa_top - BIOS_ENTRIES * 3 + 0x600) / 1024);
+        return false;
+    }
+
+    unsigned char jumps[BIOS_ENTRIES * 3];
+    for(int i = 0; i < BIOS_ENTRIES; i++){
+        jumps[i * 3] = 0xc3;
+        put_16(jumps + i * 3 + 1, BIOS_RETURNS + i);
+    }
+    static const unsigned char iobyte_and_drive[2];
+    copy_to_guest(m, bios, jumps, sizeof jumps);
+    copy_to_guest(m, 3, iobyte_and_drive, sizeof iobyte_and_drive);
+    d->system = ccp;
+    m->tpa_top = ccp + CCP_SIZE + 6; // where the jump at 5 goes, as without -B
+    load_system(m);
+    return true;
+}
+
+void disk_warm_boot(struct machine *m){
+    load_system(m);
+}
+
+
+// BIOS functions
+
+void disk_home(struct machine *m){
+    m->disks.track = 0;
+}
+
+void disk_select(struct machine *m){
+    struct disks *d = &m->disks;
+    unsigned char drive = m->cpu.c;
+    if(drive < d->n){
+        d->selected = drive;
+        m->cpu.hl = d->drive[drive].dph;
+    }else{
+        m->cpu.hl = 0; // no such drive, the BDOS reports the select error
+    }
+}
+
+void disk_set_track(struct machine *m){
+    m->disks.track = m->cpu.bc;
+}
+
+void disk_set_sector(struct machine *m){
+    m->disks.sector = m->cpu.bc;
+}
+
+void disk_set_dma(struct machine *m){
+    m->disks.dma = m->cpu.bc;
+}
+
+// The selected sector in the image, NULL when there is no such sector
+static unsigned char *sector_at(struct disks *d){
+    struct disk *disk = &d->drive[d->selected];
+    const struct disk_format *f = &disk->format;
+    unsigned sector = d->sector - f->first_sector;
+
+    if(d->selected >= d->n || d->track >= f->tracks || sector >= f->sectors)
+        return NULL;
+    return disk->image + ((size_t)d->track * f->sectors + sector) * SECTOR;
+}
+
+void disk_read(struct machine *m){
+    unsigned char *sector = sector_at(&m->disks);
+    m->cpu.a = !sector;
+    if(sector){
+        copy_to_guest(m, m->disks.dma, sector, SECTOR);
+        m->disks.reads++;
+    }
+}
+
+void disk_write(struct machine *m){
+    unsigned char *sector = sector_at(&m->disks);
+    m->cpu.a = !sector;
+    if(sector){
+        copy_from_guest(m, m->disks.dma, sector, SECTOR);
+        m->disks.writes++;
+    }
+}
+
+// BC is the logical sector from 0, the result what SETSEC takes: from the
+// skew table at DE, or offset by the first sector number when there is none
+void disk_translate(struct machine *m){
+    struct cpu *cpu = &m->cpu;
+    struct disks *d = &m->disks;
+    if(cpu->de)
+        cpu->hl = m->ram[(unsigned short)(cpu->de + cpu->bc)];
+    else
+        cpu->hl = cpu->bc + (d->selected < d->n ? d->drive[d->selected].format.first_sector : 0);
+}
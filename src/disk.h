@@ -0,0 +1,82 @@
+#ifndef DISK_H
+#define DISK_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Disk images behind the BIOS disk functions, see disk.c
+
+#define DISK_DRIVES 16 // A: to P:
+
+// Geometry, the DPB and skew table are worked out from it like cpmtools does
+struct disk_format{
+    unsigned tracks;
+    unsigned sectors;      // 128 byte sectors per track
+    unsigned skew;         // 0 for no translation table
+    unsigned first_sector; // number of the first sector on a track
+    unsigned block;        // allocation block size in bytes
+    unsigned dirs;         // directory entries
+    unsigned boot;         // reserved system tracks
+    bool fixed;            // not removable, so no directory checksums
+};
+
+struct disk{
+    unsigned char *image; // NULL for no drive
+    size_t n_bytes;
+    struct disk_format format;
+    unsigned short dph;   // guest address of its disk parameter header
+};
+
+struct disks{
+    struct disk drive[DISK_DRIVES];
+    int n;
+    unsigned char selected;
+    unsigned short track;
+    unsigned short sector;
+    unsigned short dma;
+    unsigned long long reads;
+    unsigned long long writes;
+    unsigned short system; // where the CCP from drive A: runs after -B, 0 otherwise
+};
+
+struct machine;
+
+// Add the next drive. spec is image[:option,...], options are a format
+// name (ibm-3740, the default, or 4mb-hd) or key=value for any field of
+// struct disk_format. False, after saying why on stderr, if it is unusable.
+bool disk_attach(struct disks *d, const char *spec);
+// Write the images back and unmap them
+void disk_free(struct disks *d);
+
+// Put the disk parameter headers and everything they point at in guest
+// memory, just below the BDOS. Returns the new top of the TPA, where the
+// jump at 0x0005 should go. BDOS_BASE when there are no drives.
+unsigned short disk_install(struct machine *m);
+
+// -B: CP/M from drive A:'s system tracks. The CCP and BDOS are loaded where
+// they were built to run, under a BIOS jump table into the trapped BIOS,
+// and the CCP is next. Call after disk_install(). False, after saying why
+// on stderr, when there is no CP/M 2.2 there or it does not fit.
+bool disk_boot(struct machine *m);
+// WBOOT after -B: the CCP and BDOS loaded again and the CCP next
+void disk_warm_boot(struct machine *m);
+
+// BIOS disk functions, results go to the guest's registers like the BIOS
+// returns them
+void disk_home(struct machine *m);       // 0x18
+void disk_select(struct machine *m);     // 0x1b
+void disk_set_track(struct machine *m);  // 0x1e
+void disk_set_sector(struct machine *m); // 0x21
+void disk_set_dma(struct machine *m);    // 0x24
+void disk_read(struct machine *m);       // 0x27
+void disk_write(struct machine *m);      // 0x2a
+void disk_translate(struct machine *m);  // 0x30
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,705 @@
+// CP/M 2.2 files on a host directory
+//
+// Every drive is the one host directory. A CP/M name matches a host file when
+// the host name fits 8.3 and agrees ignoring case, new files get upper case
+// names. File positions live in the guest's FCB like on a real system (ex,
+// s2 and cr for sequential access, r0 to r2 for random access), the host
+// side only keeps a cache of open files keyed by name. That way FCBs the
+// guest copies, reuses or never closes all still work.
+//
+// Each cached file has a window of one extent (16K) of its data. Reads and
+// writes of 128 byte records go to the window, the host only sees a read when
+// the guest moves to another extent and a write when the window moves, the
+// file is closed or evicted, or the machine goes away. A sequential pass
+// over a file costs one read() per 128 records.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "machine.h"
+#include "memory.h"
+#include "fs.h"
+
+#define RECORD 128
+#define EOF_BYTE 0x1a // fills the last record past the end of the host file
+#define ENTRY_RECORDS (8ul * FS_BLOCK / RECORD) // one directory entry's, eight 16 bit block numbers
+
+// FCB fields
+#define FCB_DR 0
+#define FCB_NAME 1
+#define FCB_EX 12
+#define FCB_S2 14
+#define FCB_RC 15
+#define FCB_AL 16 // the allocation map, in a directory entry
+#define FCB_NEW_NAME 17 // rename puts the new name in the second half
+#define FCB_CR 32
+#define FCB_R0 33
+#define FCB_SIZE 36
+
+bool fs_init(struct fs *fs, const char *dir){
+    memset(fs, 0, sizeof *fs);
+    fs->dma = 0x80;
+    fs->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    return fs->dir_fd != -1;
+}
+
+
+// Names
+
+static void fcb_name(const unsigned char *fcb, char name[FS_NAME]){
+    for(int i = 0; i < FS_NAME; i++){
+        char c = fcb[FCB_NAME + i] & 0x7f; // the top bits of the type are attributes
+        name[i] = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    }
+}
+
+// The CP/M name for a host name, false when it does not have one
+static bool host_to_cpm(const char *host, char name[FS_NAME]){
+    const char *dot = strchr(host, '.');
+    size_t base = dot ? (size_t)(dot - host) : strlen(host);
+    size_t type = dot ? strlen(dot + 1) : 0;
+
+    if(!base || base > 8 || type > 3 || (dot && strchr(dot + 1, '.')))
+        return false;
+    memset(name, ' ', FS_NAME);
+    for(size_t i = 0; i < base + type; i++){
+        char c = i < base ? host[i] : dot[1 + i - base];
+        if(c <= ' ' || c > '~' || strchr("<>,;:=?*[]", c))
+            return false;
+        name[i < base ? i : 8 + i - base] = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    }
+    return true;
+}
+
+static void cpm_to_host(const char name[FS_NAME], char *host){
+    int n = 0;
+    for(int i = 0; i < 8 && name[i] != ' '; i++)
+        host[n++] = name[i];
+    if(name[8] != ' '){
+        host[n++] = '.';
+        for(int i = 8; i < FS_NAME && name[i] != ' '; i++)
+            host[n++] = name[i];
+    }
+    host[n] = '\0';
+}
+
+static bool name_matches(const char pattern[FS_NAME], const char name[FS_NAME]){
+    for(int i = 0; i < FS_NAME; i++)
+        if(pattern[i] != '?' && pattern[i] != name[i])
+            return false;
+    return true;
+}
+
+// Call found() for every host file matching pattern, stops when it returns false
+static void scan_directory(struct fs *fs, const char pattern[FS_NAME], bool (*found)(void *arg, const char *host, const char name[FS_NAME]), void *arg){
+    int fd = dup(fs->dir_fd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if(!dir){
+        if(fd != -1)
+            close(fd);
+        return;
+    }
+    rewinddir(dir); // the dup shares its position with dir_fd, left at the end by the last scan
+    fs->host_calls++;
+
+    struct dirent *entry;
+    char name[FS_NAME];
+    while((entry = readdir(dir))){
+        if(entry->d_name[0] == '.' || !host_to_cpm(entry->d_name, name) || !name_matches(pattern, name))
+            continue;
+        struct stat st;
+        if(fstatat(fs->dir_fd, entry->d_name, &st, 0) || !S_ISREG(st.st_mode))
+            continue;
+        if(!found(arg, entry->d_name, name))
+            break;
+    }
+    closedir(dir);
+}
+
+static bool copy_host_name(void *arg, const char *host, const char name[FS_NAME]){
+    (void)name;
+    strcpy(arg, host);
+    return false;
+}
+
+// Host name of the file called name, false when there is none
+static bool find_host_name(struct fs *fs, const char name[FS_NAME], char *host){
+    host[0] = '\0';
+    scan_directory(fs, name, &copy_host_name, host);
+    return host[0];
+}
+
+
+// The cache of open files
+
+static bool flush_window(struct fs *fs, struct fs_file *f){
+    bool ok = true;
+    if(f->dirty_hi > f->dirty_lo){
+        unsigned n = f->dirty_hi - f->dirty_lo;
+        ok = pwrite(f->fd, f->window + f->dirty_lo, n, f->window_start + f->dirty_lo) == (ssize_t)n;
+        fs->host_calls++;
+    }
+    f->dirty_lo = f->dirty_hi = 0;
+    return ok;
+}
+
+// Close the host file, writing back what is pending when keep is set
+static bool drop_file(struct fs *fs, struct fs_file *f, bool keep){
+    bool ok = !keep || flush_window(fs, f);
+    close(f->fd);
+    free(f->window);
+    memset(f, 0, sizeof *f);
+    return ok;
+}
+
+static struct fs_file *cached_file(struct fs *fs, const char name[FS_NAME]){
+    for(int i = 0; i < FS_FILES; i++){
+        if(!memcmp(fs->files[i].name, name, FS_NAME)){
+            fs->files[i].last_used = ++fs->uses;
+            return &fs->files[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_cached(struct fs *fs, const char name[FS_NAME], bool keep){
+    struct fs_file *f = cached_file(fs, name);
+    if(f)
+        drop_file(fs, f, keep);
+}
+
+// Put an open host file in the cache, in the least recently used slot
+static struct fs_file *add_file(struct fs *fs, const char name[FS_NAME], int fd, bool writable){
+    struct fs_file *f = &fs->files[0];
+    for(int i = 1; i < FS_FILES && f->name[0]; i++)
+        if(!fs->files[i].name[0] || fs->files[i].last_used < f->last_used)
+            f = &fs->files[i];
+    if(f->name[0])
+        drop_file(fs, f, true);
+
+    struct stat st;
+    unsigned char *window = malloc(FS_WINDOW);
+    if(fstat(fd, &st) || !window){
+        free(window);
+        close(fd);
+        return NULL;
+    }
+
+    memcpy(f->name, name, FS_NAME);
+    f->fd = fd;
+    f->writable = writable;
+    f->size = st.st_size;
+    f->window = window;
+    f->last_used = ++fs->uses;
+    return f;
+}
+
+// The cached file for name, opening the host file if needed. create makes it
+// empty, or new when there is none.
+static struct fs_file *get_file(struct fs *fs, const char name[FS_NAME], bool create){
+    struct fs_file *f = cached_file(fs, name);
+    if(f && !create)
+        return f;
+    if(f)
+        drop_file(fs, f, false);
+
+    char host[256];
+    if(!find_host_name(fs, name, host)){
+        if(!create)
+            return NULL;
+        cpm_to_host(name, host);
+    }
+
+    int flags = create ? O_CREAT | O_TRUNC : 0;
+    int fd = openat(fs->dir_fd, host, O_RDWR | flags, 0666);
+    bool writable = fd != -1;
+    if(fd == -1 && !create)
+        fd = openat(fs->dir_fd, host, O_RDONLY);
+    fs->host_calls++;
+    return fd == -1 ? NULL : add_file(fs, name, fd, writable);
+}
+
+// Point the window at the extent holding offset
+static bool move_window(struct fs *fs, struct fs_file *f, unsigned long long offset){
+    unsigned long long start = offset & ~(unsigned long long)(FS_WINDOW - 1);
+    if(f->window_valid && f->window_start == start)
+        return true;
+
+    bool ok = flush_window(fs, f);
+    ssize_t n = 0;
+    if(start < f->size){
+        n = pread(f->fd, f->window, FS_WINDOW, start);
+        fs->host_calls++;
+        if(n == -1){
+            f->window_valid = false;
+            return false;
+        }
+    }
+    memset(f->window + n, 0, FS_WINDOW - n);
+    f->window_start = start;
+    f->window_valid = true;
+    return ok;
+}
+
+void fs_free(struct fs *fs){
+    for(int i = 0; i < FS_FILES; i++)
+        if(fs->files[i].name[0])
+            drop_file(fs, &fs->files[i], true);
+    free(fs->found);
+    free(fs->found_size);
+    if(fs->dir_fd != -1)
+        close(fs->dir_fd);
+}
+
+void fs_host_name(struct fs *fs, const char name[FS_NAME], char host[256]){
+    drop_cached(fs, name, true);
+    if(!find_host_name(fs, name, host))
+        cpm_to_host(name, host);
+}
+
+
+// Positions. A record number is s2:ex:cr, 128 records to an extent and 32
+// extents to a module.
+
+static unsigned long records_of(unsigned long long size){
+    return (size + RECORD - 1) / RECORD;
+}
+
+static unsigned long position(const unsigned char *fcb){
+    return (unsigned long)(fcb[FCB_S2] & 0x3f) << 12 | (fcb[FCB_EX] & 0x1f) << 7 | (fcb[FCB_CR] & 0x7f);
+}
+
+static unsigned long random_record(const unsigned char *fcb){
+    return fcb[FCB_R0] | fcb[FCB_R0 + 1] << 8 | (unsigned long)fcb[FCB_R0 + 2] << 16;
+}
+
+// Move the FCB to record, with rc the records of that extent that exist
+static void set_position(unsigned char *fcb, unsigned long record, unsigned long long size){
+    unsigned long extent_start = record & ~0x7ful;
+    unsigned long records = records_of(size);
+
+    fcb[FCB_S2] = record >> 12 & 0x3f;
+    fcb[FCB_EX] = record >> 7 & 0x1f;
+    fcb[FCB_CR] = record & 0x7f;
+    fcb[FCB_RC] = records <= extent_start ? 0 : records - extent_start >= 0x80 ? 0x80 : records - extent_start;
+}
+
+// Record to or from the DMA buffer: 0 done, 1 reading past the end, 2 no
+// space (or any other host error), 0xff no such file
+static unsigned char transfer(struct machine *m, unsigned char *fcb, unsigned long record, bool write){
+    struct fs *fs = &m->fs;
+    char name[FS_NAME];
+    fcb_name(fcb, name);
+
+    struct fs_file *f = get_file(fs, name, false);
+    if(!f)
+        return 0xff;
+    if(write && !f->writable)
+        return 2;
+
+    unsigned long long offset = (unsigned long long)record * RECORD;
+    if(!write && offset >= f->size)
+        return 1;
+    if(!move_window(fs, f, offset))
+        return 2;
+
+    unsigned char *data = f->window + (offset - f->window_start);
+    fs->records++;
+    if(write){
+        unsigned char buf[RECORD];
+        copy_from_guest(m, fs->dma, buf, RECORD);
+        memcpy(data, buf, RECORD);
+        unsigned lo = offset - f->window_start;
+        if(f->dirty_hi == f->dirty_lo || lo < f->dirty_lo)
+            f->dirty_lo = lo;
+        if(lo + RECORD > f->dirty_hi)
+            f->dirty_hi = lo + RECORD;
+        if(offset + RECORD > f->size)
+            f->size = offset + RECORD;
+    }else{
+        unsigned char buf[RECORD];
+        unsigned n = f->size - offset < RECORD ? f->size - offset : RECORD;
+        memcpy(buf, data, n);
+        memset(buf + n, EOF_BYTE, RECORD - n);
+        copy_to_guest(m, fs->dma, buf, RECORD);
+    }
+    return 0;
+}
+
+
+// BDOS functions
+
+unsigned char fs_reset(struct machine *m){
+    struct fs *fs = &m->fs;
+    for(int i = 0; i < FS_FILES; i++)
+        if(fs->files[i].name[0])
+            flush_window(fs, &fs->files[i]);
+    fs->dma = 0x80;
+    fs->drive = 0;
+    return 0;
+}
+
+unsigned char fs_open(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    char name[FS_NAME];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+    fcb_name(fcb, name);
+
+    // Open takes wildcards and opens the first match
+    char host[256];
+    if(memchr(name, '?', FS_NAME)){
+        if(!find_host_name(&m->fs, name, host) || !host_to_cpm(host, name))
+            return 0xff;
+        memcpy(fcb + FCB_NAME, name, FS_NAME);
+    }
+
+    struct fs_file *f = get_file(&m->fs, name, false);
+    if(!f)
+        return 0xff;
+    unsigned char cr = fcb[FCB_CR];
+    fcb[FCB_S2] = 0;
+    set_position(fcb, position(fcb), f->size);
+    fcb[FCB_CR] = cr; // the guest sets cr itself
+    copy_to_guest(m, addr, fcb, FCB_SIZE);
+    return 0;
+}
+
+unsigned char fs_close_file(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    char name[FS_NAME];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+    fcb_name(fcb, name);
+
+    // The host file stays open in the cache in case it is opened again
+    struct fs_file *f = cached_file(&m->fs, name);
+    char host[256];
+    if(!f)
+        return find_host_name(&m->fs, name, host) ? 0 : 0xff;
+    return flush_window(&m->fs, f) ? 0 : 0xff;
+}
+
+// Room for one more match, false when there is no memory for it. The
+// lists keep what they had either way.
+static bool grow_found(struct fs *fs){
+    int capacity = fs->found_capacity ? fs->found_capacity * 2 : 64;
+    char (*found)[FS_NAME] = realloc(fs->found, capacity * sizeof *fs->found);
+    if(!found)
+        return false;
+    fs->found = found;
+    unsigned long long *found_size = realloc(fs->found_size, capacity * sizeof *fs->found_size);
+    if(!found_size)
+        return false;
+    fs->found_size = found_size;
+    fs->found_capacity = capacity;
+    return true;
+}
+
+static bool add_found(void *arg, const char *host, const char name[FS_NAME]){
+    struct fs *fs = arg;
+    struct stat st;
+
+    if(fs->n_found == fs->found_capacity && !grow_found(fs)){
+        fs->n_found = -1; // fs_search_first() gives up
+        return false;
+    }
+    memcpy(fs->found[fs->n_found], name, FS_NAME);
+
+    // A cached file can be bigger than the host file says
+    struct fs_file *f = cached_file(fs, name);
+    fs->found_size[fs->n_found] = f ? f->size : fstatat(fs->dir_fd, host, &st, 0) ? 0 : (unsigned long long)st.st_size;
+    fs->n_found++;
+    return true;
+}
+
+static int by_name(const void *a, const void *b){
+    return memcmp(a, b, FS_NAME);
+}
+
+// Directory entry for the next match at the start of the DMA buffer. One
+// entry per file, describing its last extent. Its allocation map has the
+// blocks of the extents the entry holds, numbered on from the files listed
+// before it and around again past the end of the drive, so a directory
+// lister that counts blocks sees the file's size.
+unsigned char fs_search_next(struct machine *m){
+    struct fs *fs = &m->fs;
+    if(fs->next_found >= fs->n_found)
+        return 0xff;
+
+    int i = fs->next_found++;
+    unsigned long records = records_of(fs->found_size[i]);
+    unsigned long last = records ? records - 1 : 0;
+    unsigned char entry[32] = {0};
+
+    memcpy(entry + FCB_NAME, fs->found[i], FS_NAME);
+    entry[FCB_EX] = last >> 7 & 0x1f;
+    entry[FCB_S2] = last >> 12 & 0x3f;
+    entry[FCB_RC] = records - (last & ~0x7ful);
+
+    const unsigned long block_records = FS_BLOCK / RECORD;
+    unsigned long blocks = (records + block_records - 1) / block_records;
+    for(unsigned long b = (last & ~(ENTRY_RECORDS - 1)) / block_records, slot = 0; b < blocks; b++, slot++){
+        unsigned block = FS_DIR_BLOCKS + (fs->next_block + b) % (FS_BLOCKS - FS_DIR_BLOCKS);
+        entry[FCB_AL + 2 * slot] = block & 0xff;
+        entry[FCB_AL + 2 * slot + 1] = block >> 8;
+    }
+    fs->next_block += blocks;
+    copy_to_guest(m, fs->dma, entry, sizeof entry);
+    return 0;
+}
+
+unsigned char fs_search_first(struct machine *m, unsigned short addr){
+    struct fs *fs = &m->fs;
+    unsigned char fcb[FCB_SIZE];
+    char pattern[FS_NAME];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+    fcb_name(fcb, pattern);
+    if(fcb[FCB_DR] == '?')
+        memset(pattern, '?', FS_NAME);
+
+    fs->n_found = fs->next_found = 0;
+    fs->next_block = 0;
+    scan_directory(fs, pattern, &add_found, fs);
+    if(fs->n_found == -1){ // only this machine goes, not the others in the process
+        fs->n_found = 0;
+        console_flush(&m->console);
+        fprintf(stderr, "Out of memory listing the directory\n");
+        machine_exit(m, 1);
+    }
+
+    // Sorted, with the same name for two host files only once
+    char (*names)[FS_NAME] = fs->found;
+    for(int i = 0; i < fs->n_found; i++){
+        for(int j = i; j > 0 && by_name(names[j - 1], names[j]) > 0; j--){
+            char name[FS_NAME];
+            unsigned long long size = fs->found_size[j];
+            memcpy(name, names[j], FS_NAME);
+            memcpy(names[j], names[j - 1], FS_NAME);
+            memcpy(names[j - 1], name, FS_NAME);
+            fs->found_size[j] = fs->found_size[j - 1];
+            fs->found_size[j - 1] = size;
+        }
+    }
+    int n = 0;
+    for(int i = 0; i < fs->n_found; i++){
+        if(n && !by_name(names[n - 1], names[i]))
+            continue;
+        memmove(names[n], names[i], FS_NAME);
+        fs->found_size[n++] = fs->found_size[i];
+    }
+    fs->n_found = n;
+
+    return fs_search_next(m);
+}
+
+struct usage{
+    struct fs *fs;
+    unsigned long long blocks;
+};
+
+static bool add_blocks(void *arg, const char *host, const char name[FS_NAME]){
+    struct usage *usage = arg;
+    struct fs_file *f = cached_file(usage->fs, name);
+    struct stat st;
+    unsigned long long size = f ? f->size : fstatat(usage->fs->dir_fd, host, &st, 0) ? 0 : (unsigned long long)st.st_size;
+    usage->blocks += (size + FS_BLOCK - 1) / FS_BLOCK;
+    return true;
+}
+
+// The directory's blocks and then as many as the host files take up, those
+// past the end of the drive left out
+unsigned short fs_allocation(struct machine *m){
+    struct usage usage = { .fs = &m->fs, .blocks = FS_DIR_BLOCKS };
+    char all[FS_NAME];
+    unsigned char alv[FS_BLOCKS / 8] = {0};
+
+    memset(all, '?', FS_NAME);
+    scan_directory(&m->fs, all, &add_blocks, &usage);
+    for(unsigned long long i = 0; i < usage.blocks && i < FS_BLOCKS; i++)
+        alv[i / 8] |= 0x80 >> i % 8;
+    copy_to_guest(m, FS_TABLES + FS_DPB_SIZE, alv, sizeof alv);
+    return FS_TABLES + FS_DPB_SIZE;
+}
+
+unsigned short fs_dpb(struct machine *m){
+    const unsigned block_records = FS_BLOCK / RECORD;
+    const unsigned dir_entries = FS_DIR_BLOCKS * FS_BLOCK / 32;
+    const unsigned short al = 0xffffu << (16 - FS_DIR_BLOCKS) & 0xffff; // the directory's blocks
+    unsigned char dpb[FS_DPB_SIZE] = {
+        block_records, 0,                                   // SPT, a block a track
+        7, block_records - 1,                               // BSH, BLM: 128 << 7 byte blocks
+        FS_BLOCK / 1024 / 2 - 1,                            // EXM, 16 bit block numbers
+        (FS_BLOCKS - 1) & 0xff, (FS_BLOCKS - 1) >> 8,       // DSM
+        (dir_entries - 1) & 0xff, (dir_entries - 1) >> 8,   // DRM
+        al >> 8, al & 0xff,                                 // AL0, AL1
+        0, 0,                                               // CKS, nothing to check
+        0, 0,                                               // OFF
+    };
+    copy_to_guest(m, FS_TABLES, dpb, sizeof dpb);
+    return FS_TABLES;
+}
+
+struct deletion{
+    struct fs *fs;
+    bool deleted;
+};
+
+static bool delete_one(void *arg, const char *host, const char name[FS_NAME]){
+    struct deletion *deletion = arg;
+    struct fs *fs = deletion->fs;
+    drop_cached(fs, name, false);
+    if(!unlinkat(fs->dir_fd, host, 0))
+        deletion->deleted = true;
+    fs->host_calls++;
+    return true;
+}
+
+unsigned char fs_delete(struct machine *m, unsigned short addr){
+    struct fs *fs = &m->fs;
+    unsigned char fcb[FCB_SIZE];
+    char pattern[FS_NAME];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+    fcb_name(fcb, pattern);
+
+    struct deletion deletion = { .fs = fs };
+    fs->n_found = fs->next_found = 0; // a search does not survive a delete
+    scan_directory(fs, pattern, &delete_one, &deletion);
+    return deletion.deleted ? 0 : 0xff;
+}
+
+unsigned char fs_read_next(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+
+    unsigned long record = position(fcb);
+    unsigned char result = transfer(m, fcb, record, false);
+    if(!result){
+        char name[FS_NAME];
+        fcb_name(fcb, name);
+        set_position(fcb, record + 1, cached_file(&m->fs, name)->size);
+        copy_to_guest(m, addr, fcb, FCB_SIZE);
+    }
+    return result;
+}
+
+unsigned char fs_write_next(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+
+    unsigned long record = position(fcb);
+    unsigned char result = transfer(m, fcb, record, true);
+    if(!result){
+        char name[FS_NAME];
+        fcb_name(fcb, name);
+        set_position(fcb, record + 1, cached_file(&m->fs, name)->size);
+        copy_to_guest(m, addr, fcb, FCB_SIZE);
+    }
+    return result;
+}
+
+unsigned char fs_make(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    char name[FS_NAME];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+    fcb_name(fcb, name);
+    if(memchr(name, '?', FS_NAME))
+        return 0xff;
+
+    if(!get_file(&m->fs, name, true))
+        return 0xff;
+    fcb[FCB_S2] = 0;
+    fcb[FCB_RC] = 0;
+    copy_to_guest(m, addr, fcb, FCB_SIZE);
+    return 0;
+}
+
+unsigned char fs_rename(struct machine *m, unsigned short addr){
+    struct fs *fs = &m->fs;
+    unsigned char fcb[FCB_SIZE];
+    char name[FS_NAME], new_name[FS_NAME];
+    char host[256], new_host[256];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+    fcb_name(fcb, name);
+    fcb_name(fcb + FCB_NEW_NAME - FCB_NAME, new_name);
+
+    if(memchr(new_name, '?', FS_NAME) || !find_host_name(fs, name, host))
+        return 0xff;
+    if(find_host_name(fs, new_name, new_host)) // never over another file, the BDOS would not
+        return 0xff;
+    drop_cached(fs, name, true);
+    cpm_to_host(new_name, new_host);
+    fs->host_calls++;
+    return renameat(fs->dir_fd, host, fs->dir_fd, new_host) ? 0xff : 0;
+}
+
+unsigned char fs_read_random(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+
+    unsigned long record = random_record(fcb);
+    if(record > 0xffff)
+        return 6; // past the end of the disk
+
+    // Sequential access carries on from this record, so it reads it again
+    unsigned char result = transfer(m, fcb, record, false);
+    if(result != 0xff){
+        char name[FS_NAME];
+        fcb_name(fcb, name);
+        set_position(fcb, record, cached_file(&m->fs, name)->size);
+        copy_to_guest(m, addr, fcb, FCB_SIZE);
+    }
+    return result;
+}
+
+unsigned char fs_write_random(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+
+    unsigned long record = random_record(fcb);
+    if(record > 0xffff)
+        return 6;
+
+    // Records skipped over read back as zeros, so this also does 0x28
+    unsigned char result = transfer(m, fcb, record, true);
+    if(result != 0xff){
+        char name[FS_NAME];
+        fcb_name(fcb, name);
+        set_position(fcb, record, cached_file(&m->fs, name)->size);
+        copy_to_guest(m, addr, fcb, FCB_SIZE);
+    }
+    return result;
+}
+
+unsigned char fs_size(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    char name[FS_NAME];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+    fcb_name(fcb, name);
+
+    struct fs_file *f = get_file(&m->fs, name, false);
+    if(!f)
+        return 0xff;
+    unsigned long records = records_of(f->size);
+    fcb[FCB_R0] = records;
+    fcb[FCB_R0 + 1] = records >> 8;
+    fcb[FCB_R0 + 2] = records >> 16;
+    copy_to_guest(m, addr, fcb, FCB_SIZE);
+    return 0;
+}
+
+unsigned char fs_set_random(struct machine *m, unsigned short addr){
+    unsigned char fcb[FCB_SIZE];
+    copy_from_guest(m, addr, fcb, FCB_SIZE);
+
+    unsigned long record = position(fcb);
+    fcb[FCB_R0] = record;
+    fcb[FCB_R0 + 1] = record >> 8;
+    fcb[FCB_R0 + 2] = record >> 16;
+    copy_to_guest(m, addr, fcb, FCB_SIZE);
+    return 0;
+}
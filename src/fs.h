@@ -0,0 +1,94 @@
+#ifndef FS_H
+#define FS_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// CP/M files on a host directory, see fs.c
+
+#define FS_FILES 8      // host files kept open at once
+#define FS_WINDOW 16384 // bytes cached per file, one extent
+#define FS_NAME 11      // CP/M name and type, blank padded
+
+// The drive the host directory poses as for BDOS 0x1b and 0x1f: 8M in 16K
+// blocks, the first two of them the directory's 1024 entries
+#define FS_BLOCK 16384
+#define FS_BLOCKS 512
+#define FS_DIR_BLOCKS 2
+#define FS_DPB_SIZE 15
+#define FS_TABLES_SIZE (FS_DPB_SIZE + FS_BLOCKS / 8) // DPB, then allocation vector, at FS_TABLES
+
+struct fs_file{
+    char name[FS_NAME]; // upper case, all zero for a free slot
+    int fd;
+    bool writable;
+    unsigned long long size;
+    unsigned long long last_used;
+
+    // FS_WINDOW bytes of the file from window_start, what is past the end of
+    // the file reads as zero. Bytes dirty_lo to dirty_hi still have to be
+    // written back.
+    unsigned char *window;
+    unsigned long long window_start;
+    bool window_valid;
+    unsigned dirty_lo;
+    unsigned dirty_hi;
+};
+
+struct fs{
+    int dir_fd;
+    unsigned short dma;
+    unsigned char drive;
+    unsigned long long uses; // clock for last_used
+    struct fs_file files[FS_FILES];
+
+    // Search first / search next
+    char (*found)[FS_NAME];
+    unsigned long long *found_size;
+    int n_found;
+    int found_capacity;
+    int next_found;
+    unsigned long next_block; // blocks the files listed so far take up
+
+    unsigned long long records;    // 128 byte records read and written by the guest
+    unsigned long long host_calls; // reads, writes, opens and directory scans it took
+};
+
+struct machine;
+
+// dir is the host directory behind every drive. False if it can not be opened.
+bool fs_init(struct fs *fs, const char *dir);
+// Write back everything and close the files
+void fs_free(struct fs *fs);
+// The host file behind name in the directory, or the one it would create,
+// for the CCP to open itself. Anything the guest has pending for it is
+// written back and the cached copy dropped first.
+void fs_host_name(struct fs *fs, const char name[FS_NAME], char host[256]);
+
+// BDOS functions, fcb is the guest address of the FCB. The return value goes
+// to the guest in A.
+unsigned char fs_reset(struct machine *m);                            // 0x0d
+unsigned char fs_open(struct machine *m, unsigned short fcb);         // 0x0f
+unsigned char fs_close_file(struct machine *m, unsigned short fcb);   // 0x10
+unsigned char fs_search_first(struct machine *m, unsigned short fcb); // 0x11
+unsigned char fs_search_next(struct machine *m);                      // 0x12
+unsigned char fs_delete(struct machine *m, unsigned short fcb);       // 0x13
+unsigned char fs_read_next(struct machine *m, unsigned short fcb);    // 0x14
+unsigned char fs_write_next(struct machine *m, unsigned short fcb);   // 0x15
+unsigned char fs_make(struct machine *m, unsigned short fcb);         // 0x16
+unsigned char fs_rename(struct machine *m, unsigned short fcb);       // 0x17
+unsigned char fs_read_random(struct machine *m, unsigned short fcb);  // 0x21
+unsigned char fs_write_random(struct machine *m, unsigned short fcb); // 0x22, 0x28
+unsigned char fs_size(struct machine *m, unsigned short fcb);         // 0x23
+unsigned char fs_set_random(struct machine *m, unsigned short fcb);   // 0x24
+// The guest addresses of the tables, filled in for the call
+unsigned short fs_allocation(struct machine *m);                      // 0x1b
+unsigned short fs_dpb(struct machine *m);                             // 0x1f
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,1248 @@
+// Basic block JIT, Z80 to x86-64
+//
+// A block is the straight line run of guest instructions starting at some pc,
+// up to the first jump, call, return or instruction the translator does not
+// know. Blocks are cached by guest address in block_at[]. Exits to a fixed
+// address are chained: they start out jumping to a stub that hands the pc
+// back to jit_run(), and get patched to jump straight into the target block
+// once that has been translated.
+//
+// Inside translated code rbx holds the struct cpu pointer and r12 the guest
+// ram, everything else is scratch. Guest registers stay in struct cpu and the
+// flags use the same lazy scheme as the interpreter, so either side can pick
+// up where the other stopped. Memory accesses call small helpers built on
+// memory.h, so the debug maps and code invalidation work exactly like they do
+// in the interpreter. Without MEMORY_CHECKS plain byte loads and stores are
+// emitted inline instead.
+//
+// A store to translated code drops the blocks covering that byte: their
+// entries go, the chained exits into them are pointed back at their stubs,
+// and the block doing the store returns to jit_run() right after that
+// instruction. Blocks are filed by the 256 byte pages they cover to find
+// them. Their host code stays where it is, anything still running in it
+// finishes, and the space comes back when the buffer fills and everything
+// is flushed.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portable.h"
+#include "cpu.h"
+#include "machine.h"
+#include "memory.h"
+#include "jit.h"
+#include "block.h"
+#include "cycles.h"
+#include "decode.h"
+#include "trace.h"
+#include "profile.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#define CODE_SIZE (16 << 20)
+#define MAX_BLOCK_INSNS 100
+#define MAX_INSN_CODE 256    // most host code one guest instruction can turn into
+#define NO_BLOCK ((void *)1) // can not translate here, the interpreter takes over
+#define MAX_LINKS (1 << 16)
+#define MAX_BLOCKS (1 << 16)
+#define BLOCK_PAGES 3 // most pages a block can cover, MAX_BLOCK_INSNS four byte instructions
+_Static_assert(MAX_BLOCK_INSNS * 4 <= (BLOCK_PAGES - 1) * 256 + 1, "a block fits in BLOCK_PAGES pages");
+
+#define CPU(field) offsetof(struct cpu, field)
+_Static_assert(sizeof(struct cpu) < 128, "struct cpu fields are addressed with 8 bit displacements");
+
+// x86 registers and condition codes used by the emitter
+enum{ EAX, ECX, EDX };
+enum{ CC_Z = 0x4, CC_NZ = 0x5, CC_BE = 0x6 };
+
+// Lazy flag op the last instruction left behind, when known while translating
+#define FLAGS_UNKNOWN -1
+
+// Chained exits, by target. They stay listed once patched, so they can be
+// pointed back at their stub when the target block is dropped.
+struct link{
+    uint32_t site; // offset of the rel32 to patch, the stub follows it
+    unsigned short target;
+    int from;      // block the exit is in
+    int next;
+};
+
+// Everything translated since the last flush, so a flush only clears that
+struct block_record{
+    unsigned short start;
+    unsigned short length; // guest bytes covered, for NO_BLOCK the instruction it stopped at
+    bool dropped;          // a store hit it, see drop_block()
+    int next_in_page[BLOCK_PAGES]; // page lists, see page_head
+};
+
+// One per machine, translations are never shared
+struct jit{
+    void *block_at[0x10000]; // host entry point per guest pc, NULL or NO_BLOCK
+    unsigned char code_map[0x10000];
+    unsigned generation; // bumped every time translations are dropped
+
+    unsigned char *code_rw;
+    unsigned char *code_rx;
+    size_t code_used;
+    size_t code_start; // first byte after the trampolines
+    size_t exit_offset;
+    unsigned short limit;
+    void (*enter_code)(struct cpu *cpu, unsigned char *ram, void *entry);
+
+    struct link links[MAX_LINKS];
+    int n_links;
+    int link_head[0x10000];
+
+    struct block_record blocks[MAX_BLOCKS];
+    int n_blocks;
+    // Blocks covering each page, entries are block * BLOCK_PAGES + which of
+    // its pages, -1 ends a list
+    int page_head[0x100];
+
+    // T-states of the first n instructions of the block being translated,
+    // what an exit after instruction n adds to cpu->cycles
+    unsigned long long block_cycles[MAX_BLOCK_INSNS + 1];
+};
+
+static const unsigned char reg8_offset[8] = {
+    CPU(b), CPU(c), CPU(d), CPU(e), CPU(h), CPU(l), 0xff, CPU(a),
+};
+static const unsigned char reg16_offset[4] = { CPU(bc), CPU(de), CPU(hl), CPU(sp) };
+static const unsigned char push_offset[4] = { CPU(bc), CPU(de), CPU(hl), CPU(af) };
+
+static void flush_all(struct jit *j){
+    for(int i = 0; i < j->n_blocks; i++){
+        j->block_at[j->blocks[i].start] = NULL;
+        memset(j->code_map + j->blocks[i].start, 0, j->blocks[i].length);
+    }
+    j->n_blocks = 0;
+
+    for(int i = 0; i < j->n_links; i++)
+        j->link_head[j->links[i].target] = -1;
+    j->n_links = 0;
+    memset(j->page_head, 0xff, sizeof j->page_head);
+
+    j->code_used = j->code_start;
+    j->generation++;
+}
+
+static void patch_rel32(struct jit *j, size_t site, size_t target);
+
+// File block b under every page it covers
+static void add_to_pages(struct jit *j, int b){
+    const struct block_record *r = &j->blocks[b];
+    unsigned first = r->start >> 8;
+    unsigned last = (r->start + (r->length ? r->length - 1 : 0)) >> 8;
+
+    for(unsigned page = first, k = 0; page <= last; page++, k++){
+        j->blocks[b].next_in_page[k] = j->page_head[page];
+        j->page_head[page] = b * BLOCK_PAGES + k;
+    }
+}
+
+// Call f on every live block covering page, unlisting the dropped ones on the way
+static void for_page_blocks(struct jit *j, unsigned page, void (*f)(struct jit *j, int b, unsigned short addr), unsigned short addr){
+    int *entry = &j->page_head[page];
+    while(*entry != -1){
+        int b = *entry / BLOCK_PAGES;
+        int *next = &j->blocks[b].next_in_page[*entry % BLOCK_PAGES];
+        if(j->blocks[b].dropped){
+            *entry = *next;
+            continue;
+        }
+        f(j, b, addr);
+        entry = next;
+    }
+}
+
+static void drop_block(struct jit *j, int b, unsigned short addr){
+    struct block_record *r = &j->blocks[b];
+    if(addr < r->start || addr >= r->start + r->length)
+        return;
+
+    r->dropped = true;
+    j->block_at[r->start] = NULL;
+    memset(j->code_map + r->start, 0, r->length);
+    for(int i = j->link_head[r->start]; i != -1; i = j->links[i].next)
+        patch_rel32(j, j->links[i].site, j->links[i].site + 4);
+}
+
+static void mark_block(struct jit *j, int b, unsigned short addr){
+    (void)addr;
+    memset(j->code_map + j->blocks[b].start, 1, j->blocks[b].length);
+}
+
+void jit_invalidate(struct jit *j, unsigned short addr){
+    // Blocks over addr are all filed under its page. Dropping one clears its
+    // bytes in code_map, which may leave out bytes other blocks on the pages
+    // it covered still have.
+    for_page_blocks(j, addr >> 8, drop_block, addr);
+    for(int page = (addr >> 8) - BLOCK_PAGES + 1; page < (addr >> 8) + BLOCK_PAGES; page++)
+        if(page >= 0 && page < 0x100)
+            for_page_blocks(j, page, mark_block, addr);
+    j->generation++;
+}
+
+static struct jit *jit_of(struct cpu *cpu){
+    return machine_of(cpu)->jit;
+}
+
+
+// Helpers called from translated code. Store helpers return nonzero when the
+// store dropped translations.
+
+#if MEMORY_CHECKS
+static unsigned h_load8(struct cpu *cpu, unsigned char *ram, unsigned addr){
+    return load_8(cpu, ram, addr);
+}
+#endif
+
+static unsigned h_load16(struct cpu *cpu, unsigned char *ram, unsigned addr){
+    return load_16(cpu, ram, addr);
+}
+
+static unsigned h_store8(struct cpu *cpu, unsigned char *ram, unsigned addr, unsigned val){
+    unsigned generation = jit_of(cpu)->generation;
+    store_8(cpu, ram, val, addr);
+    return generation != jit_of(cpu)->generation;
+}
+
+#if !MEMORY_CHECKS
+// Inline stores found translated code at addr
+static unsigned h_code_written(struct cpu *cpu, unsigned char *ram, unsigned addr){
+    (void)ram;
+    jit_invalidate(jit_of(cpu), addr);
+    return 1;
+}
+#endif
+
+static unsigned h_store16(struct cpu *cpu, unsigned char *ram, unsigned addr, unsigned val){
+    unsigned generation = jit_of(cpu)->generation;
+    store_16(cpu, ram, val, addr);
+    return generation != jit_of(cpu)->generation;
+}
+
+static unsigned h_push16(struct cpu *cpu, unsigned char *ram, unsigned val){
+    unsigned generation = jit_of(cpu)->generation;
+    push_16(cpu, ram, val);
+    return generation != jit_of(cpu)->generation;
+}
+
+static unsigned h_push_af(struct cpu *cpu, unsigned char *ram){
+    flags_commit(cpu);
+    return h_push16(cpu, ram, cpu->af);
+}
+
+static unsigned h_pop16(struct cpu *cpu, unsigned char *ram){
+    return pop_16(cpu, ram);
+}
+
+// 1 when condition cc (nz z nc c po pe p m) holds
+static unsigned h_cond(struct cpu *cpu, unsigned char *ram, unsigned cc){
+    (void)ram;
+    unsigned flag;
+
+    switch (cc >> 1){
+    case 0:
+        flag = flag_z(cpu);
+        break;
+    case 1:
+        flag = flag_c(cpu);
+        break;
+    case 2:
+        flag = flag_pv(cpu);
+        break;
+    default:
+        flag = flags_value(cpu) >> 7;
+        break;
+    }
+    return flag == (cc & 1);
+}
+
+static unsigned h_alu8(struct cpu *cpu, unsigned char *ram, unsigned op, unsigned val){
+    (void)ram;
+    switch (op){
+    case 0: cpu->a = add_8(cpu, cpu->a, val); break;
+    case 1: cpu->a = adc_8(cpu, cpu->a, val); break;
+    case 2: cpu->a = sub_8(cpu, cpu->a, val); break;
+    case 3: cpu->a = sbc_8(cpu, cpu->a, val); break;
+    case 4: cpu->a = and_8(cpu, cpu->a, val); break;
+    case 5: cpu->a = xor_8(cpu, cpu->a, val); break;
+    case 6: cpu->a = or_8(cpu, cpu->a, val); break;
+    default: cp_8(cpu, cpu->a, val); break;
+    }
+    return 0;
+}
+
+static unsigned h_inc_dec_hl(struct cpu *cpu, unsigned char *ram, unsigned opcode){
+    unsigned char val = load_8(cpu, ram, cpu->hl);
+    if(opcode & 1)
+        val = dec_8(cpu, val);
+    else
+        val = inc_8(cpu, val);
+    return h_store8(cpu, ram, cpu->hl, val);
+}
+
+static unsigned short *reg16(struct cpu *cpu, unsigned p){
+    return (unsigned short *)((unsigned char *)cpu + reg16_offset[p]);
+}
+
+static unsigned h_add16(struct cpu *cpu, unsigned char *ram, unsigned p){
+    (void)ram;
+    cpu->hl = add16(cpu, cpu->hl, *reg16(cpu, p), 0);
+    return 0;
+}
+
+static unsigned h_adc16(struct cpu *cpu, unsigned char *ram, unsigned p){
+    (void)ram;
+    cpu->hl = adc_16(cpu, cpu->hl, *reg16(cpu, p));
+    return 0;
+}
+
+static unsigned h_sbc16(struct cpu *cpu, unsigned char *ram, unsigned p){
+    (void)ram;
+    cpu->hl = sbc_16(cpu, cpu->hl, *reg16(cpu, p));
+    return 0;
+}
+
+static unsigned h_neg(struct cpu *cpu, unsigned char *ram){
+    (void)ram;
+    cpu->a = neg_8(cpu, cpu->a);
+    return 0;
+}
+
+// Record instruction n of the block, at pc. The block adds to ran when it
+// leaves, so the count is made up here.
+static unsigned h_trace(struct cpu *cpu, unsigned char *ram, unsigned pc, unsigned n){
+    trace_add(machine_of(cpu)->trace, cpu, ram, pc, cpu->ran + n);
+    return 0;
+}
+
+static unsigned h_cb(struct cpu *cpu, unsigned char *ram, unsigned op){
+    unsigned char *reg;
+    unsigned char val;
+
+    if((op & 0x07) == 6){
+        val = cb_apply(cpu, op, load_8(cpu, ram, cpu->hl));
+        if(op >> 6 != 1) // bit only reads
+            return h_store8(cpu, ram, cpu->hl, val);
+        return 0;
+    }
+
+    reg = (unsigned char *)cpu + reg8_offset[op & 0x07];
+    *reg = cb_apply(cpu, op, *reg);
+    return 0;
+}
+
+// Single byte instructions that only shuffle registers or F
+static unsigned h_misc(struct cpu *cpu, unsigned char *ram, unsigned opcode){
+    unsigned short tmp;
+    unsigned char carry;
+
+    switch (opcode){
+    case 0x07: // rlca
+        cpu->a = cpu->a << 1 | cpu->a >> 7;
+        flags_commit(cpu);
+        cpu->f_c = cpu->a & 1;
+        cpu->f_n = 0;
+        cpu->f_h = 0;
+        break;
+    case 0x1f: // rra
+        flags_commit(cpu);
+        carry = cpu->f_c;
+        cpu->f_c = cpu->a;
+        cpu->a = cpu->a >> 1 | carry << 7;
+        cpu->f_n = 0;
+        cpu->f_h = 0;
+        break;
+    case 0x2f: // cpl
+        cpu->a = ~cpu->a;
+        flags_commit(cpu);
+        cpu->f_n = 1;
+        cpu->f_h = 1;
+        break;
+    case 0x37: // scf
+        flags_commit(cpu);
+        cpu->f_n = 0;
+        cpu->f_h = 0;
+        cpu->f_c = 1;
+        break;
+    case 0x3f: // ccf
+        flags_commit(cpu);
+        cpu->f_h = cpu->f_c;
+        cpu->f_c = !cpu->f_c;
+        break;
+    case 0x08: // ex af,af'
+        flags_commit(cpu);
+        tmp = cpu->af;
+        cpu->af = cpu->af_prime;
+        cpu->af_prime = tmp;
+        break;
+    case 0xd9: // exx
+        tmp = cpu->bc;
+        cpu->bc = cpu->bc_prime;
+        cpu->bc_prime = tmp;
+        tmp = cpu->de;
+        cpu->de = cpu->de_prime;
+        cpu->de_prime = tmp;
+        tmp = cpu->hl;
+        cpu->hl = cpu->hl_prime;
+        cpu->hl_prime = tmp;
+        break;
+    case 0xe3: // ex (sp),hl
+        tmp = cpu->hl;
+        cpu->hl = load_16(cpu, ram, cpu->sp);
+        return h_store16(cpu, ram, cpu->sp, tmp);
+    }
+    return 0;
+}
+
+// ldir, lddr, cpir and cpdr run to completion in one call, the extra
+// iterations are counted here since the interpreter counts each one as an
+// instruction
+static unsigned h_block(struct cpu *cpu, unsigned char *ram, unsigned opcode){
+    unsigned generation = jit_of(cpu)->generation;
+    unsigned short insn = cpu->pc - 2;
+    int dir = opcode & 0x08 ? -1 : 1;
+    unsigned done = 0;
+
+    if(opcode & 0x01){
+        done = block_compare(cpu, ram, dir);
+        cpu->cycles += block_cycles(done, 0);
+    }else{
+        do
+            done += block_copy(cpu, ram, dir, insn);
+        while(cpu->bc && generation == jit_of(cpu)->generation);
+        if(cpu->bc)
+            cpu->pc = insn; // it overwrote itself, fetch it again
+        cpu->cycles += block_cycles(done, cpu->bc != 0);
+    }
+    cpu->ran += done - 1;
+    return generation != jit_of(cpu)->generation;
+}
+
+
+// Emitter
+
+static void emit_8(struct jit *j, unsigned x){
+    j->code_rw[j->code_used++] = x;
+}
+
+static void emit_16(struct jit *j, unsigned x){
+    emit_8(j, x);
+    emit_8(j, x >> 8);
+}
+
+static void emit_32(struct jit *j, uint32_t x){
+    memcpy(j->code_rw + j->code_used, &x, 4);
+    j->code_used += 4;
+}
+
+static void emit_64(struct jit *j, uint64_t x){
+    memcpy(j->code_rw + j->code_used, &x, 8);
+    j->code_used += 8;
+}
+
+// ModRM and displacement for [rbx + offset into struct cpu]
+static void emit_cpu_operand(struct jit *j, unsigned reg, unsigned offset){
+    emit_8(j, 0x43 | reg << 3);
+    emit_8(j, offset);
+}
+
+static void emit_load_u8(struct jit *j, unsigned reg, unsigned offset){ // movzx reg, byte [rbx+offset]
+    emit_8(j, 0x0f);
+    emit_8(j, 0xb6);
+    emit_cpu_operand(j, reg, offset);
+}
+
+static void emit_load_u16(struct jit *j, unsigned reg, unsigned offset){ // movzx reg, word [rbx+offset]
+    emit_8(j, 0x0f);
+    emit_8(j, 0xb7);
+    emit_cpu_operand(j, reg, offset);
+}
+
+static void emit_load_32(struct jit *j, unsigned reg, unsigned offset){
+    emit_8(j, 0x8b);
+    emit_cpu_operand(j, reg, offset);
+}
+
+static void emit_store_8(struct jit *j, unsigned reg, unsigned offset){
+    emit_8(j, 0x88);
+    emit_cpu_operand(j, reg, offset);
+}
+
+static void emit_store_16(struct jit *j, unsigned reg, unsigned offset){
+    emit_8(j, 0x66);
+    emit_8(j, 0x89);
+    emit_cpu_operand(j, reg, offset);
+}
+
+static void emit_store_32(struct jit *j, unsigned reg, unsigned offset){
+    emit_8(j, 0x89);
+    emit_cpu_operand(j, reg, offset);
+}
+
+static void emit_store_imm8(struct jit *j, unsigned offset, unsigned imm){
+    emit_8(j, 0xc6);
+    emit_cpu_operand(j, 0, offset);
+    emit_8(j, imm);
+}
+
+static void emit_store_imm16(struct jit *j, unsigned offset, unsigned imm){
+    emit_8(j, 0x66);
+    emit_8(j, 0xc7);
+    emit_cpu_operand(j, 0, offset);
+    emit_16(j, imm);
+}
+
+static void emit_store_imm32(struct jit *j, unsigned offset, uint32_t imm){
+    emit_8(j, 0xc7);
+    emit_cpu_operand(j, 0, offset);
+    emit_32(j, imm);
+}
+
+static void emit_test_imm8(struct jit *j, unsigned offset, unsigned imm){
+    emit_8(j, 0xf6);
+    emit_cpu_operand(j, 0, offset);
+    emit_8(j, imm);
+}
+
+static void emit_test_imm32(struct jit *j, unsigned offset, uint32_t imm){
+    emit_8(j, 0xf7);
+    emit_cpu_operand(j, 0, offset);
+    emit_32(j, imm);
+}
+
+static void emit_mov_imm32(struct jit *j, unsigned reg, uint32_t imm){
+    emit_8(j, 0xb8 + reg);
+    emit_32(j, imm);
+}
+
+// add/or/and/sub/xor dst, src with the 32 bit opcode byte
+static void emit_alu_rr(struct jit *j, unsigned opcode, unsigned dst, unsigned src){
+    emit_8(j, opcode);
+    emit_8(j, 0xc0 | src << 3 | dst);
+}
+
+static void emit_add_ran(struct jit *j, unsigned n){ // add qword [rbx+ran], n and the T-states for cycles
+    emit_8(j, 0x48);
+    emit_8(j, 0x81);
+    emit_cpu_operand(j, 0, CPU(ran));
+    emit_32(j, n);
+    emit_8(j, 0x48);
+    emit_8(j, 0x81);
+    emit_cpu_operand(j, 0, CPU(cycles));
+    emit_32(j, j->block_cycles[n]);
+}
+
+// Call a helper with (cpu, ram, edx, ecx), result in eax
+static void emit_call(struct jit *j, uintptr_t fn){
+    emit_8(j, 0x48); emit_8(j, 0x89); emit_8(j, 0xdf); // mov rdi, rbx
+    emit_8(j, 0x4c); emit_8(j, 0x89); emit_8(j, 0xe6); // mov rsi, r12
+    emit_8(j, 0x48); emit_8(j, 0xb8); emit_64(j, fn);  // mov rax, fn
+    emit_8(j, 0xff); emit_8(j, 0xd0);                  // call rax
+}
+
+static size_t emit_jmp32(struct jit *j){
+    emit_8(j, 0xe9);
+    emit_32(j, 0);
+    return j->code_used - 4;
+}
+
+static size_t emit_jcc32(struct jit *j, unsigned cc){
+    emit_8(j, 0x0f);
+    emit_8(j, 0x80 | cc);
+    emit_32(j, 0);
+    return j->code_used - 4;
+}
+
+static void patch_rel32(struct jit *j, size_t site, size_t target){
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(j->code_rw + site, &rel, 4);
+}
+
+// Leave with the guest at pc after n instructions
+static void emit_exit(struct jit *j, unsigned short pc, unsigned n){
+    emit_add_ran(j, n);
+    emit_store_imm16(j, CPU(pc), pc);
+    patch_rel32(j, emit_jmp32(j), j->exit_offset);
+}
+
+// Same, but the jump gets pointed straight at the block for pc once there is one
+static void emit_chained_exit(struct jit *j, unsigned short pc, unsigned n){
+    emit_add_ran(j, n);
+    size_t site = emit_jmp32(j);
+    patch_rel32(j, site, j->code_used);
+    emit_store_imm16(j, CPU(pc), pc);
+    patch_rel32(j, emit_jmp32(j), j->exit_offset);
+
+    if(j->n_links == MAX_LINKS) // not chained, translate() flushes before it comes to this
+        return;
+    j->links[j->n_links] = (struct link){ .site = site, .target = pc, .from = j->n_blocks, .next = j->link_head[pc] };
+    j->link_head[pc] = j->n_links++;
+    if(j->block_at[pc] && j->block_at[pc] != NO_BLOCK)
+        patch_rel32(j, site, (unsigned char *)j->block_at[pc] - j->code_rx);
+}
+
+// Exit on the taken side of a conditional branch, which takes `extra`
+// T-states more than falling through
+static void emit_taken_exit(struct jit *j, unsigned short pc, unsigned n, unsigned extra){
+    j->block_cycles[n] += extra;
+    emit_chained_exit(j, pc, n);
+    j->block_cycles[n] -= extra;
+}
+
+// cpu->pc was computed at run time, look its block up inline
+static void emit_indirect_exit(struct jit *j, unsigned n){
+    emit_add_ran(j, n);
+    emit_load_u16(j, EAX, CPU(pc));
+    emit_8(j, 0x48); emit_8(j, 0xb9); emit_64(j, (uintptr_t)j->block_at); // mov rcx, block_at
+    emit_8(j, 0x48); emit_8(j, 0x8b); emit_8(j, 0x0c); emit_8(j, 0xc1);   // mov rcx, [rcx+rax*8]
+    emit_8(j, 0x48); emit_8(j, 0x83); emit_8(j, 0xf9); emit_8(j, 0x01);   // cmp rcx, NO_BLOCK
+    patch_rel32(j, emit_jcc32(j, CC_BE), j->exit_offset);
+    emit_8(j, 0xff); emit_8(j, 0xe1);                                 // jmp rcx
+}
+
+// After a store helper, stop if it dropped translations
+static void emit_check_invalidated(struct jit *j, unsigned short next_pc, unsigned n){
+    emit_8(j, 0x85); emit_8(j, 0xc0); // test eax, eax
+    size_t site = emit_jcc32(j, CC_Z);
+    emit_exit(j, next_pc, n);
+    patch_rel32(j, site, j->code_used);
+}
+
+// Guest byte at edx into eax. Without the debug maps this is a plain load.
+static void emit_guest_load8(struct jit *j){
+#if MEMORY_CHECKS
+    emit_call(j, (uintptr_t)&h_load8);
+#else
+    emit_8(j, 0x41); emit_8(j, 0x0f); emit_8(j, 0xb6); emit_8(j, 0x04); emit_8(j, 0x14); // movzx eax, byte [r12+rdx]
+#endif
+}
+
+// Guest byte in ecx to edx, leaving the block if that hit translated code
+static void emit_guest_store8(struct jit *j, unsigned short next_pc, unsigned n){
+#if MEMORY_CHECKS
+    emit_call(j, (uintptr_t)&h_store8);
+    emit_check_invalidated(j, next_pc, n);
+#else
+    emit_8(j, 0x41); emit_8(j, 0x88); emit_8(j, 0x0c); emit_8(j, 0x14);   // mov [r12+rdx], cl
+    emit_8(j, 0x48); emit_8(j, 0xb8); emit_64(j, (uintptr_t)j->code_map); // mov rax, code_map
+    emit_8(j, 0x80); emit_8(j, 0x3c); emit_8(j, 0x10); emit_8(j, 0x00);   // cmp byte [rax+rdx], 0
+    size_t site = emit_jcc32(j, CC_Z);
+    emit_call(j, (uintptr_t)&h_code_written);
+    emit_exit(j, next_pc, n);
+    patch_rel32(j, site, j->code_used);
+#endif
+}
+
+// Sets the host flags for guest condition cc, returns the jcc that means it holds
+static unsigned emit_condition(struct jit *j, unsigned cc, int known){
+    unsigned flag_set; // jcc for "the guest flag is 1"
+
+    switch (cc >> 1){
+    case 0: // z
+        if(known == LF_NONE){
+            emit_test_imm8(j, CPU(f), FLAG_Z);
+            flag_set = CC_NZ;
+        }else if(known == LF_ADD16 || known == LF_SUB16){
+            emit_test_imm32(j, CPU(lf_res), 0xffff);
+            flag_set = CC_Z;
+        }else if(known != FLAGS_UNKNOWN){
+            emit_test_imm32(j, CPU(lf_res), 0xff);
+            flag_set = CC_Z;
+        }else{
+            goto helper;
+        }
+        break;
+    case 1: // c
+        if(known == LF_NONE){
+            emit_test_imm8(j, CPU(f), FLAG_C);
+        }else if(known == LF_ADD8 || known == LF_SUB8 || known == LF_CP8){
+            emit_test_imm32(j, CPU(lf_res), 0x100);
+        }else if(known == LF_INC8 || known == LF_DEC8 || known == LF_ROT8){
+            emit_test_imm32(j, CPU(lf_src), 1);
+        }else if(known == LF_LOGIC){
+            emit_8(j, 0x31); emit_8(j, 0xc0); // xor eax, eax, carry is always clear
+        }else if(known == LF_ADD16 || known == LF_SUB16){
+            emit_test_imm32(j, CPU(lf_res), 0x10000);
+        }else{
+            goto helper;
+        }
+        flag_set = CC_NZ;
+        break;
+    default:
+        goto helper;
+    }
+    return cc & 1 ? flag_set : flag_set ^ 1;
+
+helper:
+    emit_mov_imm32(j, EDX, cc);
+    emit_call(j, (uintptr_t)&h_cond);
+    emit_8(j, 0x85); emit_8(j, 0xc0); // test eax, eax
+    return CC_NZ;
+}
+
+// Guest carry flag into eax
+static void emit_carry(struct jit *j, int known){
+    switch (known){
+    case LF_NONE:
+        emit_load_u8(j, EAX, CPU(f));
+        emit_8(j, 0x83); emit_8(j, 0xe0); emit_8(j, 0x01); // and eax, 1
+        break;
+    case LF_ADD8:
+    case LF_SUB8:
+    case LF_CP8:
+        emit_load_32(j, EAX, CPU(lf_res));
+        emit_8(j, 0xc1); emit_8(j, 0xe8); emit_8(j, 8);    // shr eax, 8
+        emit_8(j, 0x83); emit_8(j, 0xe0); emit_8(j, 0x01); // and eax, 1
+        break;
+    case LF_INC8:
+    case LF_DEC8:
+    case LF_ROT8:
+        emit_load_32(j, EAX, CPU(lf_src));
+        break;
+    case LF_LOGIC:
+        emit_8(j, 0x31); emit_8(j, 0xc0); // xor eax, eax
+        break;
+    default:
+        emit_mov_imm32(j, EDX, 3); // c
+        emit_call(j, (uintptr_t)&h_cond);
+        break;
+    }
+}
+
+// 8 bit operand r (6 is (hl)) into ecx
+static void emit_operand(struct jit *j, unsigned r){
+    if(r == 6){
+        emit_load_u16(j, EDX, CPU(hl));
+        emit_guest_load8(j);
+        emit_8(j, 0x89); emit_8(j, 0xc1); // mov ecx, eax
+    }else{
+        emit_load_u8(j, ECX, reg8_offset[r]);
+    }
+}
+
+// add adc sub sbc and xor or cp, with the operand in ecx
+static int emit_alu(struct jit *j, unsigned op){
+    static const unsigned char logic_opcode[3] = { 0x21, 0x31, 0x09 }; // and xor or
+
+    switch (op){
+    case 0: // add
+        emit_load_u8(j, EAX, CPU(a));
+        emit_store_32(j, EAX, CPU(lf_dst));
+        emit_store_32(j, ECX, CPU(lf_src));
+        emit_alu_rr(j, 0x01, EAX, ECX);
+        emit_store_32(j, EAX, CPU(lf_res));
+        emit_store_8(j, EAX, CPU(a));
+        emit_store_imm8(j, CPU(lf_op), LF_ADD8);
+        return LF_ADD8;
+    case 2: // sub
+    case 7: // cp
+        emit_load_u8(j, EAX, CPU(a));
+        emit_store_32(j, EAX, CPU(lf_dst));
+        emit_store_32(j, ECX, CPU(lf_src));
+        emit_alu_rr(j, 0x29, EAX, ECX);
+        emit_8(j, 0x25); emit_32(j, 0x1ff); // and eax, 0x1ff, bit 8 is the borrow
+        emit_store_32(j, EAX, CPU(lf_res));
+        if(op == 2)
+            emit_store_8(j, EAX, CPU(a));
+        emit_store_imm8(j, CPU(lf_op), op == 2 ? LF_SUB8 : LF_CP8);
+        return op == 2 ? LF_SUB8 : LF_CP8;
+    case 4:
+    case 5:
+    case 6:
+        emit_load_u8(j, EAX, CPU(a));
+        emit_alu_rr(j, logic_opcode[op - 4], EAX, ECX);
+        emit_store_8(j, EAX, CPU(a));
+        emit_store_32(j, EAX, CPU(lf_res));
+        emit_store_imm32(j, CPU(lf_src), op == 4); // and sets H
+        emit_store_imm8(j, CPU(lf_op), LF_LOGIC);
+        return LF_LOGIC;
+    default: // adc, sbc need the carry, leave them to C
+        emit_mov_imm32(j, EDX, op);
+        emit_call(j, (uintptr_t)&h_alu8);
+        return op == 1 ? LF_ADD8 : LF_SUB8;
+    }
+}
+
+static int emit_inc_dec(struct jit *j, unsigned r, bool dec, int known, unsigned short next_pc, unsigned n){
+    if(r == 6){
+        emit_store_imm16(j, CPU(pc), next_pc);
+        emit_mov_imm32(j, EDX, dec);
+        emit_call(j, (uintptr_t)&h_inc_dec_hl);
+        emit_check_invalidated(j, next_pc, n);
+        return dec ? LF_DEC8 : LF_INC8;
+    }
+
+    emit_carry(j, known);
+    emit_store_32(j, EAX, CPU(lf_src));
+    emit_load_u8(j, EAX, reg8_offset[r]);
+    emit_store_32(j, EAX, CPU(lf_dst));
+    emit_8(j, 0xfe); emit_8(j, dec ? 0xc8 : 0xc0); // inc/dec al
+    emit_store_8(j, EAX, reg8_offset[r]);
+    emit_8(j, 0x0f); emit_8(j, 0xb6); emit_8(j, 0xc0); // movzx eax, al
+    emit_store_32(j, EAX, CPU(lf_res));
+    emit_store_imm8(j, CPU(lf_op), dec ? LF_DEC8 : LF_INC8);
+    return dec ? LF_DEC8 : LF_INC8;
+}
+
+// Store to a fixed or register address, value in ecx, address in edx
+static void emit_store_call(struct jit *j, uintptr_t helper, unsigned short next_pc, unsigned n){
+    emit_call(j, helper);
+    emit_check_invalidated(j, next_pc, n);
+}
+
+// Bytes taken by the instruction at pc, 0 when the translator does not handle it
+static unsigned insn_length(const unsigned char *ram, unsigned short pc){
+    unsigned char op = ram[pc];
+    unsigned char ed;
+
+    switch (op){
+    case 0x0f: case 0x17: case 0x27: // rrca rla daa
+    case 0x76:                       // halt
+    case 0xd3: case 0xdb:            // out in
+    case 0xdd: case 0xfd:            // index registers
+        return 0;
+    case 0xcb:
+        return 2;
+    case 0xed:
+        ed = ram[(unsigned short)(pc + 1)];
+        if(ed >= 0x40 && ed < 0x80){
+            switch (ed & 0x0f){
+            case 0x02: case 0x0a: return 2; // sbc/adc hl,rr
+            case 0x03: case 0x0b: return 4; // ld (**),rr / ld rr,(**)
+            }
+            return ed == 0x44 ? 2 : 0; // neg
+        }
+        return ed == 0xb0 || ed == 0xb8 || ed == 0xb1 || ed == 0xb9 ? 2 : 0;
+    }
+
+    if((op & 0xc7) == 0xc7) // rst
+        return 0;
+
+    switch (op >> 6){
+    case 0:
+        switch (op & 0x07){
+        case 0: return op < 0x10 ? 1 : 2;                      // nop, ex af,af', djnz, jr
+        case 1: return op & 0x08 ? 1 : 3;                      // add hl,rr / ld rr,**
+        case 2: return op >= 0x20 ? 3 : 1;                     // ld (**) forms / ld (rr),a forms
+        case 6: return 2;                                      // ld r,*
+        default: return 1;
+        }
+    case 1:
+    case 2:
+        return 1;
+    default:
+        switch (op & 0x07){
+        case 2: case 4: return 3;                              // jp cc / call cc
+        case 3: return op == 0xc3 ? 3 : 1;
+        case 5: return op == 0xcd ? 3 : 1;
+        case 6: return 2;
+        default: return 1;
+        }
+    }
+}
+
+static void *translate(struct jit *j, struct cpu *cpu, unsigned short start, unsigned char *ram){
+    if(CODE_SIZE - j->code_used < MAX_BLOCK_INSNS * MAX_INSN_CODE || j->n_blocks == MAX_BLOCKS || MAX_LINKS - j->n_links < 2 * MAX_BLOCK_INSNS)
+        flush_all(j);
+
+    size_t entry = j->code_used;
+    unsigned short pc = start;
+    unsigned n = 0;
+    int known = FLAGS_UNKNOWN;
+    bool ended = false;
+
+    j->block_cycles[0] = 0;
+
+    while(!ended){
+        unsigned len = n < MAX_BLOCK_INSNS && pc < j->limit ? insn_length(ram, pc) : 0;
+
+        // Stop before code that was written since loading, the interpreter
+        // catches that and reports it, same as without the JIT
+        for(unsigned i = 0; i < len; i++){
+            unsigned short addr = pc + i;
+            if(addr >= j->limit || !fetch_ok(cpu, addr))
+                len = 0;
+        }
+
+        if(!len){
+            if(!n)
+                break;
+            emit_chained_exit(j, pc, n);
+            break;
+        }
+
+        for(unsigned i = 0; i < len; i++){
+            mark_executed(cpu, pc + i);
+            j->code_map[(unsigned short)(pc + i)] = 1;
+        }
+
+        unsigned char op = ram[pc];
+        unsigned char byte1 = ram[(unsigned short)(pc + 1)];
+        unsigned short word = byte1 | ram[(unsigned short)(pc + 2)] << 8;
+        unsigned short next_pc = pc + len;
+        unsigned short target = next_pc + (signed char)byte1; // for the relative jumps
+        unsigned y = op >> 3 & 0x07;
+        unsigned z = op & 0x07;
+        unsigned p = y >> 1;
+        size_t site;
+
+        n++;
+        j->block_cycles[n] = j->block_cycles[n - 1] + instruction_cycles(ram, pc);
+
+        if(machine_of(cpu)->trace){
+            emit_mov_imm32(j, EDX, pc);
+            emit_mov_imm32(j, ECX, n);
+            emit_call(j, (uintptr_t)&h_trace);
+        }
+        if(machine_of(cpu)->profile){
+            emit_8(j, 0x48); emit_8(j, 0xb8); emit_64(j, (uintptr_t)&machine_of(cpu)->profile->hits[pc]); // mov rax, &hits[pc]
+            emit_8(j, 0x48); emit_8(j, 0x83); emit_8(j, 0x00); emit_8(j, 0x01);                          // add qword [rax], 1
+        }
+
+        if(op == 0x00 || op == 0xf3 || op == 0xfb){ // nop, di, ei
+        }else if(op == 0x07 || op == 0x1f || op == 0x2f || op == 0x37 || op == 0x3f || op == 0x08 || op == 0xd9){
+            emit_mov_imm32(j, EDX, op);
+            emit_call(j, (uintptr_t)&h_misc);
+            if(op != 0xd9)
+                known = LF_NONE;
+        }else if(op == 0xe3){ // ex (sp),hl
+            emit_store_imm16(j, CPU(pc), next_pc);
+            emit_mov_imm32(j, EDX, op);
+            emit_store_call(j, (uintptr_t)&h_misc, next_pc, n);
+        }else if(op == 0x10){ // djnz
+            emit_8(j, 0xfe); emit_cpu_operand(j, 1, CPU(b)); // dec byte [b]
+            site = emit_jcc32(j, CC_Z);
+            emit_taken_exit(j, target, n, CYCLES_JR_TAKEN);
+            patch_rel32(j, site, j->code_used);
+            emit_chained_exit(j, next_pc, n);
+            ended = true;
+        }else if(op == 0x18){ // jr
+            emit_chained_exit(j, target, n);
+            ended = true;
+        }else if(op >= 0x20 && op < 0x40 && z == 0){ // jr cc
+            site = emit_jcc32(j, emit_condition(j, y - 4, known) ^ 1);
+            emit_taken_exit(j, target, n, CYCLES_JR_TAKEN);
+            patch_rel32(j, site, j->code_used);
+            emit_chained_exit(j, next_pc, n);
+            ended = true;
+        }else if(op < 0x40 && z == 1){
+            if(op & 0x08){ // add hl,rr
+                emit_mov_imm32(j, EDX, p);
+                emit_call(j, (uintptr_t)&h_add16);
+                known = LF_NONE;
+            }else{ // ld rr,**
+                emit_store_imm16(j, reg16_offset[p], word);
+            }
+        }else if(op < 0x40 && z == 2){
+            switch (op){
+            case 0x02: // ld (bc),a
+            case 0x12: // ld (de),a
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_load_u16(j, EDX, reg16_offset[p]);
+                emit_load_u8(j, ECX, CPU(a));
+                emit_guest_store8(j, next_pc, n);
+                break;
+            case 0x0a: // ld a,(bc)
+            case 0x1a: // ld a,(de)
+                emit_load_u16(j, EDX, reg16_offset[p]);
+                emit_guest_load8(j);
+                emit_store_8(j, EAX, CPU(a));
+                break;
+            case 0x22: // ld (**),hl
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_mov_imm32(j, EDX, word);
+                emit_load_u16(j, ECX, CPU(hl));
+                emit_store_call(j, (uintptr_t)&h_store16, next_pc, n);
+                break;
+            case 0x2a: // ld hl,(**)
+                emit_mov_imm32(j, EDX, word);
+                emit_call(j, (uintptr_t)&h_load16);
+                emit_store_16(j, EAX, CPU(hl));
+                break;
+            case 0x32: // ld (**),a
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_mov_imm32(j, EDX, word);
+                emit_load_u8(j, ECX, CPU(a));
+                emit_guest_store8(j, next_pc, n);
+                break;
+            default: // ld a,(**)
+                emit_mov_imm32(j, EDX, word);
+                emit_guest_load8(j);
+                emit_store_8(j, EAX, CPU(a));
+                break;
+            }
+        }else if(op < 0x40 && z == 3){ // inc rr / dec rr
+            emit_8(j, 0x66); emit_8(j, 0xff);
+            emit_cpu_operand(j, op & 0x08 ? 1 : 0, reg16_offset[p]);
+        }else if(op < 0x40 && (z == 4 || z == 5)){
+            known = emit_inc_dec(j, y, z == 5, known, next_pc, n);
+        }else if(op < 0x40 && z == 6){ // ld r,*
+            if(y == 6){
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_load_u16(j, EDX, CPU(hl));
+                emit_mov_imm32(j, ECX, byte1);
+                emit_guest_store8(j, next_pc, n);
+            }else{
+                emit_store_imm8(j, reg8_offset[y], byte1);
+            }
+        }else if(op < 0x80){ // ld r,r'
+            if(y == 6){
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_load_u16(j, EDX, CPU(hl));
+                emit_load_u8(j, ECX, reg8_offset[z]);
+                emit_guest_store8(j, next_pc, n);
+            }else if(z == 6){
+                emit_load_u16(j, EDX, CPU(hl));
+                emit_guest_load8(j);
+                emit_store_8(j, EAX, reg8_offset[y]);
+            }else{
+                emit_load_u8(j, EAX, reg8_offset[z]);
+                emit_store_8(j, EAX, reg8_offset[y]);
+            }
+        }else if(op < 0xc0){ // alu r
+            emit_operand(j, z);
+            known = emit_alu(j, y);
+        }else if(z == 6){ // alu *
+            emit_mov_imm32(j, ECX, byte1);
+            known = emit_alu(j, y);
+        }else if(z == 0 || z == 2 || z == 4){ // ret cc / jp cc / call cc
+            site = emit_jcc32(j, emit_condition(j, y, known) ^ 1);
+            if(z == 0){
+                emit_call(j, (uintptr_t)&h_pop16);
+                emit_store_16(j, EAX, CPU(pc));
+                j->block_cycles[n] += CYCLES_RET_TAKEN; // like emit_taken_exit()
+                emit_indirect_exit(j, n);
+                j->block_cycles[n] -= CYCLES_RET_TAKEN;
+            }else if(z == 2){
+                emit_chained_exit(j, word, n);
+            }else{
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_mov_imm32(j, EDX, next_pc);
+                emit_call(j, (uintptr_t)&h_push16);
+                j->block_cycles[n] += CYCLES_CALL_TAKEN;
+                emit_check_invalidated(j, word, n);
+                emit_chained_exit(j, word, n);
+                j->block_cycles[n] -= CYCLES_CALL_TAKEN;
+            }
+            patch_rel32(j, site, j->code_used);
+            emit_chained_exit(j, next_pc, n);
+            ended = true;
+        }else if(op == 0xc9){ // ret
+            emit_call(j, (uintptr_t)&h_pop16);
+            emit_store_16(j, EAX, CPU(pc));
+            emit_indirect_exit(j, n);
+            ended = true;
+        }else if(op == 0xe9){ // jp (hl)
+            emit_load_u16(j, EAX, CPU(hl));
+            emit_store_16(j, EAX, CPU(pc));
+            emit_indirect_exit(j, n);
+            ended = true;
+        }else if(op == 0xf9){ // ld sp,hl
+            emit_load_u16(j, EAX, CPU(hl));
+            emit_store_16(j, EAX, CPU(sp));
+        }else if(z == 1){ // pop
+            emit_call(j, (uintptr_t)&h_pop16);
+            emit_store_16(j, EAX, push_offset[p]);
+            if(p == 3){
+                emit_store_imm8(j, CPU(lf_op), LF_NONE);
+                known = LF_NONE;
+            }
+        }else if(z == 5 && !(op & 0x08)){ // push
+            emit_store_imm16(j, CPU(pc), next_pc);
+            if(p == 3){
+                emit_call(j, (uintptr_t)&h_push_af);
+                known = LF_NONE;
+            }else{
+                emit_load_u16(j, EDX, push_offset[p]);
+                emit_call(j, (uintptr_t)&h_push16);
+            }
+            emit_check_invalidated(j, next_pc, n);
+        }else if(op == 0xcd){ // call
+            emit_store_imm16(j, CPU(pc), next_pc);
+            emit_mov_imm32(j, EDX, next_pc);
+            emit_call(j, (uintptr_t)&h_push16);
+            emit_check_invalidated(j, word, n);
+            emit_chained_exit(j, word, n);
+            ended = true;
+        }else if(op == 0xc3){ // jp
+            emit_chained_exit(j, word, n);
+            ended = true;
+        }else if(op == 0xeb){ // ex de,hl
+            emit_load_u16(j, EAX, CPU(de));
+            emit_load_u16(j, ECX, CPU(hl));
+            emit_store_16(j, ECX, CPU(de));
+            emit_store_16(j, EAX, CPU(hl));
+        }else if(op == 0xcb){
+            emit_store_imm16(j, CPU(pc), next_pc);
+            emit_mov_imm32(j, EDX, byte1);
+            emit_store_call(j, (uintptr_t)&h_cb, next_pc, n);
+            if(byte1 >> 6 == 0)
+                known = LF_ROT8;
+            else if(byte1 >> 6 == 1)
+                known = LF_NONE;
+        }else{ // ed
+            unsigned rr = byte1 >> 4 & 0x03;
+            word = ram[(unsigned short)(pc + 2)] | ram[(unsigned short)(pc + 3)] << 8;
+
+            if(byte1 == 0x44){ // neg
+                emit_call(j, (uintptr_t)&h_neg);
+                known = LF_SUB8;
+            }else if(byte1 >= 0xb0){ // ldir lddr cpir cpdr
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_mov_imm32(j, EDX, byte1);
+                emit_call(j, (uintptr_t)&h_block);
+                emit_8(j, 0x85); emit_8(j, 0xc0); // test eax, eax
+                size_t stay = emit_jcc32(j, CC_Z);
+                emit_add_ran(j, n); // leave with cpu->pc where h_block put it
+                patch_rel32(j, emit_jmp32(j), j->exit_offset);
+                patch_rel32(j, stay, j->code_used);
+                known = LF_NONE;
+            }else if((byte1 & 0x0f) == 0x02){ // sbc hl,rr
+                emit_mov_imm32(j, EDX, rr);
+                emit_call(j, (uintptr_t)&h_sbc16);
+                known = LF_SUB16;
+            }else if((byte1 & 0x0f) == 0x0a){ // adc hl,rr
+                emit_mov_imm32(j, EDX, rr);
+                emit_call(j, (uintptr_t)&h_adc16);
+                known = LF_ADD16;
+            }else if((byte1 & 0x0f) == 0x03){ // ld (**),rr
+                emit_store_imm16(j, CPU(pc), next_pc);
+                emit_mov_imm32(j, EDX, word);
+                emit_load_u16(j, ECX, reg16_offset[rr]);
+                emit_store_call(j, (uintptr_t)&h_store16, next_pc, n);
+            }else{ // ld rr,(**)
+                emit_mov_imm32(j, EDX, word);
+                emit_call(j, (uintptr_t)&h_load16);
+                emit_store_16(j, EAX, reg16_offset[rr]);
+            }
+        }
+
+        pc = next_pc;
+    }
+
+    // A NO_BLOCK covers the instruction it could not take, so a store that
+    // puts other code there drops it like a block
+    unsigned length = n ? (unsigned)(pc - start) : decode_length(ram, start);
+    if(length > 0x10000u - start)
+        length = 0x10000u - start;
+    j->blocks[j->n_blocks] = (struct block_record){ .start = start, .length = length };
+    add_to_pages(j, j->n_blocks++);
+
+    if(!n){
+        memset(j->code_map + start, 1, length);
+        j->code_used = entry;
+        j->block_at[start] = NO_BLOCK;
+        return NULL;
+    }
+
+    j->block_at[start] = j->code_rx + entry;
+
+    // Point every exit into here at it, dropping the ones in dropped blocks
+    for(int *i = &j->link_head[start]; *i != -1;){
+        struct link *l = &j->links[*i];
+        if(j->blocks[l->from].dropped){
+            *i = l->next;
+            continue;
+        }
+        patch_rel32(j, l->site, entry);
+        i = &l->next;
+    }
+
+    return j->block_at[start];
+}
+
+struct jit *jit_new(unsigned short limit){
+    void *read_write;
+    void *read_exec;
+    struct jit *j = calloc(1, sizeof *j);
+
+    if(!j)
+        return NULL;
+    map_jit_buffers(&read_write, &read_exec, CODE_SIZE);
+    if(!read_write){
+        free(j);
+        return NULL;
+    }
+
+    j->code_rw = read_write;
+    j->code_rx = read_exec;
+    j->limit = limit;
+    memset(j->link_head, 0xff, sizeof j->link_head);
+    memset(j->page_head, 0xff, sizeof j->page_head);
+
+    // enter(cpu, ram, entry)
+    j->enter_code = (void (*)(struct cpu *, unsigned char *, void *))j->code_rx;
+    emit_8(j, 0x53);                                   // push rbx
+    emit_8(j, 0x41); emit_8(j, 0x54);                  // push r12
+    emit_8(j, 0x55);                                   // push rbp, keeps the stack 16 byte aligned for the helpers
+    emit_8(j, 0x48); emit_8(j, 0x89); emit_8(j, 0xfb); // mov rbx, rdi
+    emit_8(j, 0x49); emit_8(j, 0x89); emit_8(j, 0xf4); // mov r12, rsi
+    emit_8(j, 0xff); emit_8(j, 0xe2);                  // jmp rdx
+
+    j->exit_offset = j->code_used;
+    emit_8(j, 0x5d);                  // pop rbp
+    emit_8(j, 0x41); emit_8(j, 0x5c); // pop r12
+    emit_8(j, 0x5b);                  // pop rbx
+    emit_8(j, 0xc3);                  // ret
+
+    j->code_start = j->code_used;
+    return j;
+}
+
+void jit_free(struct jit *j){
+    if(!j)
+        return;
+    free_jit_buffers((char *)j->code_rw, (const char *)j->code_rx, CODE_SIZE);
+    free(j);
+}
+
+unsigned char *jit_code_map(struct jit *j){
+    return j->code_map;
+}
+
+void jit_run(struct jit *j, struct cpu *cpu, unsigned char *ram){
+    void *entry;
+
+    for(;;){
+        entry = j->block_at[cpu->pc];
+        if(entry == NO_BLOCK)
+            return;
+        if(!entry && !(entry = translate(j, cpu, cpu->pc, ram)))
+            return;
+        j->enter_code(cpu, ram, entry);
+    }
+}
+
+#else
+
+struct jit *jit_new(unsigned short limit){
+    (void)limit;
+    return NULL;
+}
+
+void jit_free(struct jit *j){
+    (void)j;
+}
+
+unsigned char *jit_code_map(struct jit *j){
+    (void)j;
+    return NULL;
+}
+
+void jit_run(struct jit *j, struct cpu *cpu, unsigned char *ram){
+    (void)j;
+    (void)cpu;
+    (void)ram;
+}
+
+void jit_invalidate(struct jit *j, unsigned short addr){
+    (void)j;
+    (void)addr;
+}
+
+#endif
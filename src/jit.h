@@ -0,0 +1,36 @@
+#ifndef JIT_H
+#define JIT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "cpu.h"
+
+// Basic block translator from Z80 to x86-64, see jit.c. Every machine gets
+// its own, the translations and the code buffer are not shared.
+struct jit;
+
+// Set up a code buffer. Nothing at or above limit gets translated, that is
+// where the BIOS and BDOS traps live. NULL when this host can not JIT.
+struct jit *jit_new(unsigned short limit);
+void jit_free(struct jit *jit);
+
+// Nonzero for every guest byte that is part of a translated block. store_8
+// checks it and has the blocks over a byte dropped when it gets overwritten.
+unsigned char *jit_code_map(struct jit *jit);
+
+// Run translated code starting at cpu->pc for as long as possible. Returns
+// with cpu->pc on an instruction the interpreter has to do itself.
+void jit_run(struct jit *jit, struct cpu *cpu, unsigned char *ram);
+
+// The guest wrote to addr, which holds translated code: drop the blocks
+// covering it
+void jit_invalidate(struct jit *jit, unsigned short addr);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
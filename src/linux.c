@@ -1,9 +1,11 @@
 #ifdef __linux__
 
+#define _GNU_SOURCE // memfd_create
 
 #include "portable.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -68,18 +70,32 @@ void *map_a_new_file_readonly(const char *restrict const filename, size_t n_byte
 }
 */
 
+// Both views of the mirror over fh, at region and region + n_bytes
+static void map_both_views(char *region, size_t n_bytes, int mmap_flags, HANDLE fh){
+    if(mmap(region,           n_bytes, PROT_READ | PROT_WRITE, mmap_flags, fh, 0) == MAP_FAILED
+    || mmap(region + n_bytes, n_bytes, PROT_READ | PROT_WRITE, mmap_flags, fh, 0) == MAP_FAILED){
+        puts("failed, 35");
+        exit(35);
+    }
+}
+
+// Without a file the memory is a memfd mapped MAP_SHARED, not private
+// anonymous memory: both views have to be the same pages. fork() shares
+// them too, see unshare_a_mirrored_memory().
 void *map_a_new_file_shared(const char *restrict const filename, size_t n_bytes){
     HANDLE fh = INVALID_FILE_HANDLE;
     int mmap_flags;
     if(filename){
         fh = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
-        ftruncate(fh, n_bytes);
 		mmap_flags = MAP_SHARED | MAP_FIXED | MAP_FILE;
     }else{
-		mmap_flags = MAP_SHARED | MAP_FIXED | MAP_ANONYMOUS;
-		printf("bad, not done correctly\n");
-		exit(1);
-	}
+        fh = memfd_create("guest memory", 0);
+        mmap_flags = MAP_SHARED | MAP_FIXED;
+    }
+    if(fh == INVALID_FILE_HANDLE || ftruncate(fh, n_bytes)){
+        puts("failed, 33");
+        exit(33);
+    }
 
     // char *whole_region = VirtualAlloc2(NULL, NULL, 2 * n_bytes, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, NULL, 0);
     char *whole_region = mmap(NULL, 2 * n_bytes, PROT_NONE, MAP_SHARED | MAP_ANONYMOUS, INVALID_FILE_HANDLE, 0);
@@ -91,8 +107,7 @@ void *map_a_new_file_shared(const char *restrict const filename, size_t n_bytes)
     // int thing = VirtualFree(whole_region, n_btyes, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER);
     HANDLE section = fh;
 
-    mmap(whole_region,           n_bytes, PROT_READ | PROT_WRITE, mmap_flags, section, 0);
-    mmap(whole_region + n_bytes, n_bytes, PROT_READ | PROT_WRITE, mmap_flags, section, 0);
+    map_both_views(whole_region, n_bytes, mmap_flags, section);
     close(fh);
 
     return whole_region;
@@ -176,18 +191,85 @@ void *map_an_existing_shared(const char *restrict const filename, size_t *n_byte
 
     return whole_region;
 }
+*/
+
+void unmap_a_file(void *region, size_t n_bytes){
+    munmap(region, 2 * n_bytes); // both views
+}
+
+void *map_a_disk_image(const char *restrict const filename, size_t *n_bytes){
+    HANDLE fh = open(filename, O_RDWR);
+    struct stat st;
+    if(fh == INVALID_FILE_HANDLE)
+        return NULL;
+    if(fstat(fh, &st) || !st.st_size){
+        close(fh);
+        return NULL;
+    }
+
+    char *region = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fh, 0);
+    close(fh);
+    if(region == MAP_FAILED)
+        return NULL;
+    *n_bytes = st.st_size;
+    return region;
+}
+
+void unmap_a_disk_image(void *region, size_t n_bytes){
+    msync(region, n_bytes, MS_SYNC);
+    munmap(region, n_bytes);
+}
+
+void unshare_a_mirrored_memory(void *region, size_t n_bytes){
+    char *copy = malloc(n_bytes);
+    HANDLE fh = memfd_create("guest memory", 0);
+    if(!copy || fh == INVALID_FILE_HANDLE || ftruncate(fh, n_bytes)){
+        puts("failed, 33");
+        exit(33);
+    }
+    memcpy(copy, region, n_bytes);
+
+    map_both_views(region, n_bytes, MAP_SHARED | MAP_FIXED, fh);
+    close(fh);
+
+    memcpy(region, copy, n_bytes);
+    free(copy);
+}
 
-void map_jit_buffers(char **read_write, const char **read_exec, size_t n_bytes){
-    char *mapping = mmap(0, sz, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, 0, 0);
+void *map_a_snapshot(const char *restrict const filename, size_t *n_bytes){
+    HANDLE fh = open(filename, O_RDONLY);
+    struct stat st;
+    if(fh == INVALID_FILE_HANDLE)
+        return NULL;
+    if(fstat(fh, &st) || !st.st_size){
+        close(fh);
+        return NULL;
+    }
+
+    char *region = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fh, 0);
+    close(fh);
+    if(region == MAP_FAILED)
+        return NULL;
+    *n_bytes = st.st_size;
+    return region;
+}
+
+void unmap_a_snapshot(void *region, size_t n_bytes){
+    munmap(region, n_bytes);
+}
+
+// One RWX mapping, so the writable and executable views are the same address
+void map_jit_buffers(void **read_write, void **read_exec, size_t n_bytes){
+    char *mapping = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, INVALID_FILE_HANDLE, 0);
     if(mapping == MAP_FAILED){
         *read_exec = NULL;
         *read_write = NULL;
+        return;
     }
 
     *read_exec = mapping;
     *read_write = mapping;
 }
-*/
 
 void free_jit_buffers(char *read_write, const char *read_exec, size_t n_bytes){
     (void)read_exec;
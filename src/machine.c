@@ -0,0 +1,209 @@
+// Creating, loading and tearing down one emulated machine, see machine.h
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portable.h"
+#include "machine.h"
+#include "memory.h"
+#include "jit.h"
+#include "decode.h"
+#include "trace.h"
+#include "profile.h"
+#include "native.h"
+
+// code_map for machines without a JIT, nothing is ever translated
+static unsigned char no_code_map[RAM_SIZE];
+
+struct machine *machine_new(bool file_backed, bool use_jit, int in_fd, int out_fd){
+    struct machine *m = calloc(1, sizeof *m);
+    if(!m){
+        puts("out of memory");
+        exit(1);
+    }
+
+    m->file_backed = file_backed;
+    m->throttle_at = ULLONG_MAX;
+    m->job_fd = -1;
+    console_init(&m->console, out_fd);
+    console_input_init(&m->input, in_fd);
+    if(!fs_init(&m->fs, ".")){
+        puts("can not open the current directory");
+        exit(1);
+    }
+
+    if(file_backed){
+        m->ram = map_a_new_file_shared("ram.bin", RAM_SIZE);
+#if MEMORY_CHECKS
+        m->writers = map_a_new_file_shared("writers.bin", RAM_SIZE * sizeof(short)); // debug stuff
+        m->mem_tracker = map_a_new_file_shared("mem_tracker.bin", RAM_SIZE); // debug stuff
+#endif
+    }else{
+        m->ram = map_a_new_file_shared(NULL, RAM_SIZE); // no file, same mirror
+#if MEMORY_CHECKS
+        m->writers = calloc(RAM_SIZE, sizeof(short));
+        m->mem_tracker = calloc(RAM_SIZE, 1);
+#endif
+    }
+    if(!m->ram || (MEMORY_CHECKS && (!m->writers || !m->mem_tracker))){
+        puts("out of memory");
+        exit(1);
+    }
+    memset(m->ram, 0x76, RAM_SIZE); // Set all of ram to the HALT instruction
+
+    m->code_map = no_code_map;
+#if DISPATCH_PREDECODED
+    m->decoded = decode_new();
+    if(!m->decoded){
+        puts("out of memory");
+        exit(1);
+    }
+    // The JIT's stores only look at its own code map and would leave stale
+    // decoded instructions behind
+    if(use_jit){
+        machine_free(m);
+        return NULL;
+    }
+#endif
+    if(use_jit){
+        m->jit = jit_new(BDOS_BASE);
+        if(!m->jit){
+            machine_free(m);
+            return NULL;
+        }
+        m->code_map = jit_code_map(m->jit);
+    }
+
+    return m;
+}
+
+void machine_free(struct machine *m){
+    if(!m)
+        return;
+
+    console_input_close(&m->input);
+    fs_free(&m->fs);
+    disk_free(&m->disks);
+    jit_free(m->jit);
+    decode_free(m->decoded);
+    trace_close(m->trace);
+    profile_free(m->profile);
+    native_free(m->native);
+    ccp_free(&m->ccp);
+    free(m->snapshot_path);
+    unmap_a_file(m->ram, RAM_SIZE);
+    if(m->file_backed){
+#if MEMORY_CHECKS
+        unmap_a_file(m->writers, RAM_SIZE * sizeof(short));
+        unmap_a_file(m->mem_tracker, RAM_SIZE);
+#endif
+    }else{
+        free(m->writers);
+        free(m->mem_tracker);
+    }
+    free(m);
+}
+
+#define PLACE_JMP(addr, value) do {\
+    ram[(addr) + 0] = 0xc3;\
+    ram[(addr) + 1] = (value) & 0xff;\
+    ram[(addr) + 2] = ((value) & 0xff00) >> 8;\
+} while (0)
+
+static void setup_bios_and_bdos(struct machine *m, const char *argument){
+    struct cpu *cpu = &m->cpu;
+    unsigned char *ram = m->ram;
+
+    // Place magic opcodes (RET instructions intercepted by emulator) for BIOS
+    memset(ram + BIOS_RETURNS, RET_OPCODE, N_OF_BIOS_FN);
+
+    // Place the BIOS jump table, pointing at magic opcodes
+    for(int i = 0; i < N_OF_BIOS_FN; i++)
+        PLACE_JMP(JUMPS_TO_BIOS_RETURNS + i * 3, BIOS_RETURNS + i);
+
+    // place the BDOS entry point magic opcode
+    memset(ram + BDOS_RETURN, RET_OPCODE, N_OF_BDOS_FN);
+
+    // place the BDOS entry point jump
+    PLACE_JMP(JUMP_TO_BDOS_RETURN, BDOS_RETURN);
+
+    // Disk tables go below the BDOS and the TPA shrinks to make room
+    m->tpa_top = disk_install(m);
+
+    // A return address of 0 on the stack, so a program that returns warm boots
+    ram[m->tpa_top - 2] = 0;
+    ram[m->tpa_top - 1] = 0;
+    cpu->sp = m->tpa_top - 2;
+    cpu->pc = PROGRAM_START;
+    cpu->af = 0x0000; // Not needed, already 0
+
+    PLACE_JMP(0, BIOS_BASE + 3); // Place jump to WBOOT
+    PLACE_JMP(5, m->tpa_top); // Place JMP to BDOS, or to the jump past the disk tables
+
+    machine_set_argument(m, argument);
+}
+
+void machine_set_argument(struct machine *m, const char *argument){
+    char tail[CCP_LINE + 1];
+
+    // The CCP leaves the blank after the program name in the tail
+    snprintf(tail, sizeof tail, "%s%s", argument && *argument ? " " : "", argument ? argument : "");
+    ccp_set_tail(m, tail);
+}
+
+bool machine_load(struct machine *m, const char *program, const char *argument){
+    FILE *fp = program ? fopen(program, "rb") : NULL;
+    if(!fp)
+        return false;
+
+    console_printf(&m->console, "got %zd bytes\n", fread(m->ram + 256, 1, RAM_SIZE - PROGRAM_START, fp));
+    fclose(fp);
+
+    setup_bios_and_bdos(m, argument);
+    return true;
+}
+
+bool machine_boot(struct machine *m){
+    setup_bios_and_bdos(m, NULL);
+    return ccp_warm_boot(m);
+}
+
+bool machine_boot_disk(struct machine *m){
+    setup_bios_and_bdos(m, NULL);
+    return disk_boot(m);
+}
+
+bool machine_stop_at(struct machine *m, const char *when, void (*at_stop)(struct machine *m)){
+    char *end;
+
+    m->stop_pc = 0x10000;
+    m->stop_ran = ULLONG_MAX;
+    if(!when){
+        m->stop_ran = 0;
+    }else if(!strncmp(when, "pc=", 3)){
+        unsigned long pc = strtoul(when + 3, &end, 16);
+        if(*end || end == when + 3 || pc > 0xffff)
+            return false;
+        m->stop_pc = pc;
+    }else if(!strncmp(when, "ran=", 4)){
+        m->stop_ran = strtoull(when + 4, &end, 0);
+        if(*end || end == when + 4)
+            return false;
+    }else{
+        return false;
+    }
+    m->at_stop = at_stop;
+    machine_hooks_changed(m);
+    return true;
+}
+
+void machine_hooks_changed(struct machine *m){
+    m->hooks = m->at_stop || m->jit || m->throttle_at != ULLONG_MAX || m->trace || m->profile;
+}
+
+_Noreturn void machine_exit(struct machine *m, int status){
+    m->exit_status = status;
+    longjmp(m->exit_jump, 1);
+}
@@ -0,0 +1,189 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "cpu.h"
+#include "console.h"
+#include "fs.h"
+#include "disk.h"
+#include "ccp.h"
+
+// LAYOUT OF MEMORY
+/*
+
++========== 0x0
+| 0x01 -- 0x3 holds location BIOS_BASE + 3, WBOOT
+| 0x06 -- 0x08 holds location of BDOS_BASE
+| 0x100 -- Where guest program is placed in memory
+|
+|
+|
+|
+|
+| STACK -- The stack grows from here up, up to lower addresses
+| CCP, BDOS, BIOS jumps -- only with -B, off drive A:'s system tracks, see disk.c
+| Disk tables -- only with disk images, behind a jump to the BDOS jump, see disk.c
+| BDOS jump
+| Host directory DPB and allocation vector -- for BDOS 0x1f and 0x1b, see fs.c
+| BDOS return
+| BIOS jumps
+| BIOS returns
++========== 0xffff
+*/
+
+
+#define SIZE_OF_RT 1
+#define SIZE_OF_JUMP 3
+#define RAM_SIZE 0x10000
+
+#define N_OF_BIOS_FN 33
+#define BIOS_RETURNS (RAM_SIZE - N_OF_BIOS_FN * SIZE_OF_RT)
+#define JUMPS_TO_BIOS_RETURNS (BIOS_RETURNS - N_OF_BIOS_FN * SIZE_OF_JUMP)
+
+#define N_OF_BDOS_FN 1
+#define BDOS_RETURN (JUMPS_TO_BIOS_RETURNS - N_OF_BDOS_FN * SIZE_OF_RT)
+#define FS_TABLES (BDOS_RETURN - FS_TABLES_SIZE)
+#define JUMP_TO_BDOS_RETURN (FS_TABLES - N_OF_BDOS_FN * SIZE_OF_JUMP)
+
+#define BIOS_BASE JUMPS_TO_BIOS_RETURNS
+#define BDOS_BASE JUMP_TO_BDOS_RETURN
+#define INITIAL_SP JUMP_TO_BDOS_RETURN
+#define PROGRAM_START 0x100
+#define RET_OPCODE 0xc9
+
+struct jit;
+struct decode_cache;
+struct trace;
+struct profile;
+struct native;
+
+// Where a console status poll came from, see console_status() in main.c
+struct poll_site{
+    unsigned short pc; // return address of the CALL 5
+    unsigned short sp;
+    unsigned short bc;
+    unsigned short de;
+    unsigned short hl;
+    unsigned short ix;
+    unsigned short iy;
+};
+
+// Everything one emulated CP/M machine owns. Nothing in here is shared with
+// other machines, so any number of them can run side by side, one thread each.
+struct machine{
+    struct cpu cpu; // first, machine_of() relies on it
+    unsigned char *ram;
+
+    // Debug maps, one entry per guest address, see memory.h. NULL without MEMORY_CHECKS.
+    unsigned short *writers;
+    unsigned char *mem_tracker;
+
+    struct jit *jit;         // NULL when not translating
+    unsigned char *code_map; // the JIT's map of translated bytes, all zeros without one
+    struct decode_cache *decoded; // NULL unless built with DISPATCH=predecoded, see decode.h
+    struct trace *trace;     // NULL when not tracing, see trace.h
+    struct profile *profile; // NULL when not profiling, see profile.h
+    bool hooks;              // any of at_stop, jit, throttling, trace or profile may be on, see machine_hooks_changed()
+
+    // Guest console
+    struct console console;
+    struct console_input input;
+
+    // Guest files, see fs.c
+    struct fs fs;
+    // Disk images behind the BIOS, see disk.c
+    struct disks disks;
+
+    // Idle loop detection, see console_status() in main.c
+    unsigned long long bios_bdos_calls;
+    unsigned spin_polls; // empty polls in a row from the same loop
+    struct poll_site spin_polls_site;
+    unsigned long long last_poll_ran;
+    unsigned long long last_poll_calls;
+
+    // Real time throttling to throttle_hz, see throttle() in main.c. The
+    // clock is looked at once cpu.cycles reaches throttle_at, never when
+    // running flat out.
+    unsigned long long throttle_hz;
+    unsigned long long throttle_at;
+    unsigned long long throttle_base_cycles;
+    unsigned long long throttle_base_ns;
+
+    // Called once the guest gets to stop_pc or has run stop_ran
+    // instructions, to write a snapshot (snapshot.c) or start serving jobs
+    // (server.c). See machine_stop_at().
+    void (*at_stop)(struct machine *m); // NULL when nothing is armed, cleared before the call
+    unsigned stop_pc;                   // 0x10000 when going by instructions
+    unsigned long long stop_ran;        // ULLONG_MAX when going by pc
+
+    char *snapshot_path; // where at_stop writes the snapshot
+
+    int job_fd; // connection of the fork server job this process runs, -1 when not one
+
+    struct native *native; // NULL unless -N, see native.h
+
+    // Command lines to run on warm boot, see ccp.c
+    struct ccp ccp;
+    unsigned short tpa_top; // where the BDOS jump at 5 goes, the stack starts just below
+
+    bool file_backed; // ram and the debug maps are ram.bin etc. in the current directory, -M
+    jmp_buf exit_jump; // machine_exit() lands in machine_run()
+    int exit_status;
+};
+
+// The interpreter and the memory accessors only get handed the cpu
+static inline struct machine *machine_of(struct cpu *cpu){
+    return (struct machine *)cpu;
+}
+
+// file_backed maps ram.bin, writers.bin and mem_tracker.bin in the current
+// directory, for watching the guest from outside. Otherwise the memory is
+// anonymous: ram still has its mirror, from a memfd, the debug maps are on
+// the heap. NULL when the JIT was asked for and this host has none.
+struct machine *machine_new(bool file_backed, bool use_jit, int in_fd, int out_fd);
+void machine_free(struct machine *m);
+
+// Load a .COM file at PROGRAM_START and set up the BIOS, BDOS and command
+// line. False if the file can not be read.
+bool machine_load(struct machine *m, const char *program, const char *argument);
+
+// Put argument in the command tail at 0x80 and the default FCBs, see
+// ccp_set_tail()
+void machine_set_argument(struct machine *m, const char *argument);
+
+// Set up the BIOS and BDOS with nothing loaded and let the CCP load the first
+// command. False when there is none.
+bool machine_boot(struct machine *m);
+
+// Set up the BIOS with the CCP and BDOS from drive A:'s system tracks, see
+// disk_boot(). False, having said why, when they are not there.
+bool machine_boot_disk(struct machine *m);
+
+// Arm m->at_stop. when is pc=addr (hex) for just before the guest runs the
+// instruction at addr, ran=count for once it has run count instructions, or
+// NULL for before the next instruction. False if when makes no sense.
+bool machine_stop_at(struct machine *m, const char *when, void (*at_stop)(struct machine *m));
+
+// Work out m->hooks again after arming at_stop, the JIT, the throttle, the
+// trace or the profile. The interpreter only looks at each of them before
+// an instruction when it is set. machine_stop_at() and machine_run() do it
+// themselves.
+void machine_hooks_changed(struct machine *m);
+
+// Run until the guest exits, returns its exit status (main.c)
+int machine_run(struct machine *m);
+
+// Stop the guest from anywhere inside machine_run()
+_Noreturn void machine_exit(struct machine *m, int status);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
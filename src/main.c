@@ -4,139 +4,81 @@
 #include <string.h>
 #include <termios.h>
 
-#include <errno.h>
-#include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <fcntl.h>
 
 #include <time.h>
+#include <getopt.h>
 #include "portable.h"
+#include "cpu.h"
+#include "machine.h"
+#include "memory.h"
+#include "block.h"
+#include "cycles.h"
+#include "trace.h"
+#include "profile.h"
+#include "pool.h"
+#include "jit.h"
+#include "decode.h"
+#include "snapshot.h"
+#include "server.h"
+#include "native.h"
 
-// LAYOUT OF MEMORY
-/*
-
-+========== 0x0
-| 0x01 -- 0x3 holds location BIOS_BASE + 3, WBOOT
-| 0x06 -- 0x08 holds location of BDOS_BASE
-| 0x100 -- Where guest program is placed in memory
-|
-|
-|
-|
-|
-| STACK -- The stack grows from here up, up to lower addresses
-| BDOS jump
-| BDOS return
-| BIOS jumps
-| BIOS returns
-+========== 0xffff
-*/
-
-
-#define SIZE_OF_RT 1
-#define SIZE_OF_JUMP 3
-#define RAM_SIZE 0x10000
-
-#define N_OF_BIOS_FN 33
-#define BIOS_RETURNS (RAM_SIZE - N_OF_BIOS_FN * SIZE_OF_RT)
-#define JUMPS_TO_BIOS_RETURNS (BIOS_RETURNS - N_OF_BIOS_FN * SIZE_OF_JUMP)
-
-#define N_OF_BDOS_FN 1
-#define BDOS_RETURN (JUMPS_TO_BIOS_RETURNS - N_OF_BDOS_FN * SIZE_OF_RT)
-#define JUMP_TO_BDOS_RETURN (BDOS_RETURN - N_OF_BDOS_FN * SIZE_OF_JUMP)
-
-#define BIOS_BASE JUMPS_TO_BIOS_RETURNS
-#define BDOS_BASE JUMP_TO_BDOS_RETURN
-#define INITIAL_SP JUMP_TO_BDOS_RETURN
-#define PROGRAM_START 0x100
-#define RET_OPCODE 0xc9
-
-
-struct cpu{
-    unsigned short pc; // Instruction Pointer  /  Program Counter
-    unsigned short sp; // stack pointer
-
-    unsigned short ix; // index x
-    unsigned short iy; // index y
-
-
-    // main registers
-    union{
-        unsigned short af;
-        struct{
-            unsigned char f;
-            unsigned char a;
-        };
-        //flags
-        struct{
-            unsigned short f_c : 1; // carry flag
-            unsigned short f_n : 1; // 1 for addition, 0 for subtraction
-            unsigned short f_pv : 1; // parity / overflow
-            unsigned short f_bit3 : 1;
-            unsigned short f_h : 1; // half carry
-            unsigned short f_bit5 : 1;
-            unsigned short f_z : 1; // zero flag
-            unsigned short f_s : 1; // negative flag
-            unsigned short f_ : 8;
-        };
-    };
-    union{
-        unsigned short bc;
-        struct{
-            unsigned char c;
-            unsigned char b;
-        };
-    };
-    union{
-        unsigned short de;
-        struct{
-            unsigned char e;
-            unsigned char d;
-        };
-    };
-    union{
-        unsigned short hl;
-        struct{
-            unsigned char l;
-            unsigned char h;
-        };
-    };
-
-    // Alternate registers
-    unsigned short af_prime;
-    unsigned short bc_prime;
-    unsigned short de_prime;
-    unsigned short hl_prime;
-};
 
 static void range_copy(unsigned char *dst, unsigned char *src, int start_idx, int end_idx);
-static void store_16(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned short val, unsigned short addr);
-
-static int is_char_waiting(int fd){
-    fd_set rfd;
-    FD_ZERO(&rfd);
-    FD_SET(fd, &rfd);
-    struct timeval timeout = (struct timeval){.tv_sec=0,.tv_usec=0,};
-    int rc = select(fd + 1, &rfd, NULL, NULL, &timeout);
-    if(rc == -1)
-        exit(93);
-    return rc;
+
+// Idle loop detection. A console status poll that found no key is recorded
+// as where it returns to (the pc after the CALL 5) plus the registers a loop
+// could be counting in. When the next poll comes back to the same place with
+// the same registers, within SPIN_GAP instructions and with no other BIOS or
+// BDOS call in between, the only thing that loop did was ask for a key.
+// After SPIN_POLLS of those in a row, each further empty poll sleeps until
+// input arrives (at most SPIN_WAIT_MS), so an idle session does not keep a
+// host core busy.
+#define SPIN_POLLS 16
+#define SPIN_GAP 64 // instructions from one poll to the next, the BDOS jumps included
+#define SPIN_WAIT_MS 100
+
+static bool same_idle_loop(struct machine *m, const struct poll_site *site){
+    return !memcmp(&m->spin_polls_site, site, sizeof *site)
+        && m->cpu.ran - m->last_poll_ran <= SPIN_GAP
+        && m->bios_bdos_calls == m->last_poll_calls + 1; // this poll only
 }
 
-static char get_char_or_NULL(int fd){
-    char data = '\0';
-    int flags = fcntl(fd, F_GETFL);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-    while(read(fd, &data, 1) == -1 && errno == EINTR)
-        ;
-    
-    // At this point assume no error, or errno is EAGIN or WEOULDBLOCK
+// Console status, also the point where pending output has to be visible
+static bool console_status(struct machine *m){
+    struct cpu *cpu = &m->cpu;
 
+    console_flush(&m->console);
+    if(console_input_ready(&m->input)){
+        m->spin_polls = 0;
+        return true;
+    }
 
-    fcntl(fd, F_SETFL, flags);
-    return data;
+    struct poll_site site = {
+        .pc = cpu->pc,
+        .sp = cpu->sp,
+        .bc = cpu->bc,
+        .de = cpu->de,
+        .hl = cpu->hl,
+        .ix = cpu->ix,
+        .iy = cpu->iy,
+    };
+    if(same_idle_loop(m, &site)){
+        if(m->spin_polls < SPIN_POLLS)
+            m->spin_polls++;
+    }else{
+        m->spin_polls = 0;
+    }
+    m->spin_polls_site = site;
+    m->last_poll_ran = cpu->ran;
+    m->last_poll_calls = m->bios_bdos_calls;
+
+    if(m->spin_polls < SPIN_POLLS)
+        return false;
+    console_input_wait(&m->input, SPIN_WAIT_MS);
+    return console_input_ready(&m->input);
 }
 
 static struct termios term_stored;
@@ -159,61 +101,136 @@ static void termio_stuff(void){
     tcsetattr(STDIN_FILENO, TCSANOW, &term_new);
 }
 
+// BDOS function 0 or a jump to 0: on to the next command, see ccp.c, or out
+static void warm_boot(struct machine *m){
+    if(ccp_warm_boot(m))
+        return;
+    console_printf(&m->console, "Good Bye\n");
+    machine_exit(m, m->ccp.stopped);
+}
+
+// BIOS CONIN: the next key, waiting for it. The session is over when the
+// input is.
+static unsigned char console_in(struct machine *m){
+    console_flush(&m->console);
+    while(!console_input_ready(&m->input))
+        console_input_wait(&m->input, SPIN_WAIT_MS);
+    if(console_input_ended(&m->input))
+        machine_exit(m, 0);
+    unsigned char c = console_input_getc(&m->input);
+    return c == '\n' ? '\r' : c; // the CCP ends lines on return
+}
+
+// BDOS 0x0a: a line into the buffer at addr, its size in the first byte, the
+// count goes in the second. Return ends it, so does a full buffer, backspace
+// and delete take back the last character.
+static void read_buffer(struct machine *m, unsigned short addr){
+    unsigned char line[1 + 0xff];
+    unsigned char max = m->ram[addr];
+    unsigned n = 0;
+
+    while(n < max){
+        unsigned char c = console_in(m);
+        if(c == '\r')
+            break;
+        if(c == 0x08 || c == 0x7f){
+            if(n){
+                n--;
+                console_printf(&m->console, "\b \b");
+            }
+            continue;
+        }
+        line[1 + n++] = c;
+        console_putc(&m->console, c);
+    }
+    console_putc(&m->console, '\r');
+    line[0] = n;
+    copy_to_guest(m, addr + 1, line, 1 + n);
+}
+
 #define NONE 42
 // documentation on CP/M functions http://www.gaby.de/cpm/manuals/archive/cpm22htm/ch5.htm
 // CP/M function processing function
 static unsigned short bdos(
-    unsigned char *restrict ram, 
+    struct machine *m,
     unsigned char function, 
     unsigned short parameter
 ){
+    unsigned char *restrict ram = m->ram;
     unsigned char tmp_byte;
     switch (function){
     case 0x19: // return currently selected drive
-        return 0; // drive A:
+        return m->fs.drive;
+    case 0x01: // Console Input, echoed
+        tmp_byte = console_in(m);
+        console_putc(&m->console, tmp_byte);
+        return tmp_byte;
     case 0x02: // Console Output
-        putchar(parameter);
-        // fflush(stdout);
+        console_putc(&m->console, parameter);
+        return NONE;
+    case 0x09: // Print String, up to a '$'
+        for(unsigned short at = parameter; ram[at] != '$' && at != (unsigned short)(parameter - 1); at++) // all of memory at most
+            console_putc(&m->console, ram[at]);
         return NONE;
-    case 0x0e: // Select Disk
-        printf("Called Select Disk with parameter %04hx\n", parameter);
+    case 0x0a: // Read Console Buffer
+        read_buffer(m, parameter);
         return NONE;
+    case 0x0c: // Version, CP/M 2.2
+        return 0x0022;
+    case 0x0d: // Reset Disk System
+        return fs_reset(m);
+    case 0x0e: // Select Disk, every drive is the same host directory
+        m->fs.drive = parameter & 0x0f;
+        return 0;
     case 0x0b: // Console Status
-        return is_char_waiting(STDIN_FILENO) ? 0xff : 0;
-    case 0x0f: // open a file
-        // Not implemented, print register values and then return 0xff for failure, maybe, I do not remember
-        printf("BDOS open %04hx  %02hhx %02hhx %02hhx %02hhx %02hhx %02hhx %02hhx %02hhx   %02hhx %02hhx %02hhx  \"%-8.8s.%-3.3s\"\n",
-            parameter,
-            ram[parameter+1],
-            ram[parameter+2],
-            ram[parameter+3],
-            ram[parameter+4],
-            ram[parameter+5],
-            ram[parameter+6],
-            ram[parameter+7],
-            ram[parameter+8],
-
-            ram[parameter+9],
-            ram[parameter+10],
-            ram[parameter+11],
-
-            ram+parameter+1,
-            ram+parameter+9
-        );
-        //exit(2);
-        return 0xff;
-    case 0x23: // get file size or something
-        printf("Did not get file size or something");
-        return 0xff;
-    case 0x00: // System Reset, exit
-        puts("Good Bye");
-        exit(0);
+        return console_status(m) ? 0xff : 0;
+    case 0x0f: // Open File
+        return fs_open(m, parameter);
+    case 0x10: // Close File
+        return fs_close_file(m, parameter);
+    case 0x11: // Search for First
+        return fs_search_first(m, parameter);
+    case 0x12: // Search for Next
+        return fs_search_next(m);
+    case 0x13: // Delete File
+        return fs_delete(m, parameter);
+    case 0x14: // Read Sequential
+        return fs_read_next(m, parameter);
+    case 0x15: // Write Sequential
+        return fs_write_next(m, parameter);
+    case 0x16: // Make File
+        return fs_make(m, parameter);
+    case 0x17: // Rename File
+        return fs_rename(m, parameter);
+    case 0x18: // Return Login Vector
+        return 1 << m->fs.drive;
+    case 0x1a: // Set DMA Address
+        m->fs.dma = parameter;
+        return NONE;
+    case 0x1b: // Get Allocation Vector
+        return fs_allocation(m);
+    case 0x1f: // Get Disk Parameter Block
+        return fs_dpb(m);
+    case 0x20: // Get/Set User Code, there is only user 0
+        return 0;
+    case 0x21: // Read Random
+        return fs_read_random(m, parameter);
+    case 0x22: // Write Random
+    case 0x28: // Write Random with Zero Fill
+        return fs_write_random(m, parameter);
+    case 0x23: // Compute File Size
+        return fs_size(m, parameter);
+    case 0x24: // Set Random Record
+        return fs_set_random(m, parameter);
+    case 0x00: // System Reset, the next command or exit
+        warm_boot(m);
+        return 0;
     case 0x06: // Direct Console I/O
         tmp_byte = parameter & 0xff;
         if(tmp_byte == 0xff){
             // printf("\n\n\nTHEY WANT INPUT\n\n\n");
             // exit(2);
-            char c = get_char_or_NULL(STDIN_FILENO);
+            char c = console_status(m) ? console_input_getc(&m->input) : '\0';
 
 			// stupid hack needs to be fixed
             if(c == '\n')
@@ -222,13 +239,11 @@ static unsigned short bdos(
 				c = '\n';
             return c;
         }else if(tmp_byte == 0xfe){
-            return is_char_waiting(STDIN_FILENO);
-        }else if(tmp_byte == 0xfd){
-            // blocking read w/o echo
-            exit(89);
+            return console_status(m);
+        }else if(tmp_byte == 0xfd){ // waits for the key, no echo
+            return console_in(m);
         }else{
-            putchar(parameter & 0xff);
-            fflush(stdout);
+            console_putc(&m->console, parameter & 0xff);
             return 0x00; // might be wrong
         }
     case 0x69: // Time
@@ -262,83 +277,153 @@ static unsigned short bdos(
 			return *(unsigned char*)&cpm_seconds;
         }
     default:
-        printf("BDOS function: %02hhx, parameter: %04hx\n", function, parameter);
-        exit(2);
+        console_printf(&m->console, "BDOS function: %02hhx, parameter: %04hx\n", function, parameter);
+        machine_exit(m, 2);
     }
 }
 
-static void bios(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned short val){
-    (void)ram;
+static void bios(struct machine *m, unsigned short val){
     switch (val)
     {
     // case 0x00: // BOOT      arrive here from cold start load
-    // case 0x03: // WBOOT
-    // case 0x06: // CONST
-    // case 0x09: // CONIN
+    case 0x03: // WBOOT
+        if(m->disks.system)
+            disk_warm_boot(m);
+        else
+            warm_boot(m);
+        break;
+    case 0x06: // CONST
+        m->cpu.a = console_status(m) ? 0xff : 0;
+        break;
+    case 0x09: // CONIN
+        m->cpu.a = console_in(m);
+        break;
     case 0x0c: // CONOUT
-        putchar(cpu->c);
-        // fflush(stdout);
+        console_putc(&m->console, m->cpu.c);
         break;
-    case 0x0f: // LIST
-    case 0x12: // PUNCH
-    case 0x15: // READER
     case 0x18: // HOME
+        disk_home(m);
+        break;
     case 0x1b: // SELDSK
+        disk_select(m);
+        break;
     case 0x1e: // SETTRK
+        disk_set_track(m);
+        break;
     case 0x21: // SETSEC
+        disk_set_sector(m);
+        break;
     case 0x24: // SETDMA
+        disk_set_dma(m);
+        break;
     case 0x27: // READ
+        disk_read(m);
+        break;
     case 0x2a: // WRITE
-    case 0x2d: // LISTST
+        disk_write(m);
+        break;
     case 0x30: // SECTRAN   sector translate subroutine
+        disk_translate(m);
+        break;
+    case 0x0f: // LIST, no printer or punch, it goes nowhere
+    case 0x12: // PUNCH
+        break;
+    case 0x15: // READER, always at the end of the tape
+        m->cpu.a = 0x1a;
+        break;
+    case 0x2d: // LISTST, always ready
+        m->cpu.a = 0xff;
+        break;
     default:
+        console_flush(&m->console);
         fprintf(stderr, "Unhandled bios call %02hx\n", val);
-        exit(1);
+        machine_exit(m, 1);
         break;
     }
 }
 
-static void do_bios_or_bdos(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned short oldpc){
+static void do_bios_or_bdos(struct machine *m, unsigned short oldpc){
+    struct cpu *cpu = &m->cpu;
+    struct profile *profile = m->profile;
+    unsigned char function = oldpc == BDOS_RETURN ? cpu->c : oldpc - BIOS_RETURNS;
+    unsigned long long start = profile ? profile_clock() : 0;
+
+    m->bios_bdos_calls++;
     if(oldpc == BDOS_RETURN){
-        cpu->hl = bdos(ram, cpu->c, cpu->de);
+        cpu->hl = bdos(m, cpu->c, cpu->de);
         cpu->a = cpu->l;
         cpu->b = cpu->h;
     }else{
-        bios(cpu, ram, (oldpc - BIOS_RETURNS) * 3);
+        bios(m, (oldpc - BIOS_RETURNS) * 3);
     }
-}
-
-#define PLACE_JMP(addr, value) do {\
-    ram[(addr) + 0] = 0xc3;\
-    ram[(addr) + 1] = (value) & 0xff;\
-    ram[(addr) + 2] = ((value) & 0xff00) >> 8;\
-} while (0)
-
-static void setup_bios_and_bdos(struct cpu *restrict const cpu, unsigned char *restrict const ram, const char **argv){
-    // Place magic opcodes (RET instructions intercepted by emulator) for BIOS
-    memset(ram + BIOS_RETURNS, RET_OPCODE, N_OF_BIOS_FN);
 
-    // Place the BIOS jump table, pointing at magic opcodes
-    for(int i = 0; i < N_OF_BIOS_FN; i++)
-        PLACE_JMP(JUMPS_TO_BIOS_RETURNS + i * 3, BIOS_RETURNS + i);
-
-    // place the BDOS entry point magic opcode
-    memset(ram + BDOS_RETURN, RET_OPCODE, N_OF_BDOS_FN);
+    if(profile){
+        unsigned long long ns = profile_clock() - start;
+        if(oldpc == BDOS_RETURN){
+            profile->bdos_calls[function]++;
+            profile->bdos_ns[function] += ns;
+        }else{
+            profile->bios_calls[function]++;
+            profile->bios_ns[function] += ns;
+        }
+    }
+}
 
-    // place the BDOS entry point jump
-    PLACE_JMP(JUMP_TO_BDOS_RETURN, BDOS_RETURN);
+// -c: hold the guest to a real clock rate. Every THROTTLE_SLICE_NS of guest
+// time the host clock is compared with cpu.cycles and the emulator sleeps off
+// whatever it is ahead by. After a long stall, like waiting for a key, it
+// starts counting afresh instead of running flat out to catch up.
+#define THROTTLE_SLICE_NS 1000000
+#define THROTTLE_SLACK_NS 50000000
+
+static void throttle_start(struct machine *m, unsigned long long hz){
+    m->throttle_hz = hz;
+    m->throttle_base_cycles = m->cpu.cycles;
+    m->throttle_base_ns = profile_clock();
+    m->throttle_at = m->cpu.cycles + hz * THROTTLE_SLICE_NS / 1000000000;
+}
 
-    cpu->sp = INITIAL_SP;
-    cpu->pc = PROGRAM_START;
-    cpu->af = 0x0000; // Not needed, already 0
+static void throttle(struct machine *m){
+    unsigned long long now = profile_clock();
+    unsigned long long guest_ns = (m->cpu.cycles - m->throttle_base_cycles) * 1e9 / m->throttle_hz;
+    unsigned long long host_ns = now - m->throttle_base_ns;
+
+    if(guest_ns > host_ns){
+        unsigned long long ahead = guest_ns - host_ns;
+        struct timespec nap = { .tv_sec = ahead / 1000000000, .tv_nsec = ahead % 1000000000 };
+        nanosleep(&nap, NULL);
+    }else if(host_ns - guest_ns > THROTTLE_SLACK_NS){
+        throttle_start(m, m->throttle_hz);
+        return;
+    }
+    m->throttle_at = m->cpu.cycles + m->throttle_hz * THROTTLE_SLICE_NS / 1000000000;
+}
 
-    PLACE_JMP(0, BIOS_BASE + 3); // Place jump to WBOOT
-    PLACE_JMP(5, BDOS_BASE); // Place JMP to BDOS
+// The guest got to where machine_stop_at() said, before running the next
+// instruction. The hook may never come back, see server.c.
+static void stop(struct machine *m){
+    void (*at_stop)(struct machine *m) = m->at_stop;
+    m->at_stop = NULL;
+    machine_hooks_changed(m);
+    at_stop(m);
+}
 
-    // Place command line argument in ram, does not support multible args yet
-    strcpy((char *)ram + 0x82, argv[2] ? argv[2] : "");
-    ram[0x81] = ' ';
-    ram[0x80] = strlen((char *)ram + 0x80);
+// Everything BEGIN_INSTRUCTION() only does when m->hooks is set, in order:
+// the stop point, the JIT, the clock, the trace and the profile. The
+// instruction about to run is cpu->ran + 1.
+static void instruction_hooks(struct machine *m){
+    struct cpu *cpu = &m->cpu;
+
+    if(m->at_stop && (cpu->pc == m->stop_pc || cpu->ran >= m->stop_ran))
+        stop(m);
+    if(m->jit)
+        jit_run(m->jit, cpu, m->ram); // returns on something only the interpreter does
+    if(cpu->cycles >= m->throttle_at)
+        throttle(m);
+    if(m->trace)
+        trace_add(m->trace, cpu, m->ram, cpu->pc, cpu->ran + 1);
+    if(m->profile)
+        m->profile->hits[cpu->pc]++;
 }
 
 #if 0
@@ -357,389 +442,602 @@ static void range_copy(unsigned char *dst, unsigned char *src, int start_idx, in
 }
 #endif
 
-static unsigned char parity(unsigned char p){
-    p = ((p >> 1) & 0x55)+(p & 0x55);
-    p = ((p >> 2) & 0x33)+(p & 0x33);
-    p = ((p >> 4) & 0x0f)+(p & 0x0f);
-    p = !(p & 1);
-
-    return p;
-}
-
-static unsigned alu_8_add(struct cpu *cpu, unsigned x, unsigned y, unsigned carry_in){
-
-    uint64_t hsum = (x & 0xf) + (y & 0xf) + (carry_in & 1);
-    int hcarry = hsum >> 4;
-    uint64_t usum = (x & 0xff) + (y & 0xff) + (carry_in & 1);
-    int carry_out = usum != (uint8_t)usum;
-    int overflow = ((usum ^ x) & (usum ^ y)) >> 7;
-    
-    uint8_t result = usum;
-    int zero = !result;
-    int neg = result >> 7;
-
-    cpu->f_z = zero;
-    cpu->f_pv = overflow;  //might need to be !overflow
-    cpu->f_c = carry_out;
-    cpu->f_s = neg;
-    cpu->f_h = hcarry;
-
-    return result;
-}
-
-static unsigned add_8(struct cpu *cpu, unsigned x, unsigned y){
-    return alu_8_add(cpu, x, y, 0);
-    cpu->f_n = 0;
-}
-
-static unsigned sub_8(struct cpu *cpu, unsigned x){
-    // return alu_8_add(cpu, x, ~y, 1);
-    // cpu->f_n = 1;
-
-    unsigned long rflags = cpu->f_pv<<11 | (cpu->f & 0xd1);
-    unsigned long src = x;
-    unsigned long src_dst = cpu->a;
-
-    __asm__ __volatile__ (
-        "pushfq\n\t"
-
-        "pushfq\n\t"
-        "andw $0xf72a,0(%%rsp)\n\t"
-        "orw %w0,0(%%rsp)\n\t"
-        "popfq\n\t"
-
-        "subb %b2, %b1\n\t"
-
-        "pushfq\n\t"
-        "popq %0\n\t"
-
-        "popfq\n\t"
-
-        :"+&q"(rflags),"+&q"(src_dst)
-        :"q"(src)
-    );
-
-    cpu->f_c  = (rflags>>0)&1;
-    cpu->f_n  = 1;
-    cpu->f_pv = (rflags>>11)&1;
-    cpu->f_h  = (rflags>>4)&1;
-    cpu->f_z  = (rflags>>6)&1;
-    cpu->f_s  = (rflags>>7)&1;
-
-    return src_dst;
-}
-
-static void inc_8(struct cpu *cpu, unsigned char *p){
-    unsigned char c = cpu->f_c;
-    *p = alu_8_add(cpu, *p, 1, 0);
-    cpu->f_n = 0;
-    cpu->f_c = c;
-}
-
-static void dec_8(struct cpu *cpu, unsigned char *p){
-    unsigned char c = cpu->f_c;
-    *p = alu_8_add(cpu, *p, (unsigned char)~1, 1); // litte scary
-    cpu->f_n = 1;
-    cpu->f_c = c;
-}
-
-static void cp_8(struct cpu *cpu, unsigned char b){
-//    alu_8_add(cpu, cpu->a, ~b, 1);
-//    cpu->f_n = 1;
-
-    unsigned long rflags = cpu->f_pv<<11 | (cpu->f & 0xd1);
-    unsigned long src = b;
-    unsigned long src_dst = cpu->a;
-
-    __asm__ __volatile__ (
-        "pushfq\n\t"
-
-        "pushfq\n\t"
-        "andw $0xf72a,0(%%rsp)\n\t"
-        "orw %w0,0(%%rsp)\n\t"
-        "popfq\n\t"
-
-        "cmpb %b2, %b1\n\t"
-
-        "pushfq\n\t"
-        "popq %0\n\t"
-
-        "popfq\n\t"
-
-        :"+&q"(rflags),"+&q"(src_dst)
-        :"q"(src)
-    );
-
-    cpu->f_c  = (rflags>>0)&1;
-    cpu->f_n  = 1;
-    cpu->f_pv = (rflags>>11)&1;
-    cpu->f_h  = (rflags>>4)&1;
-    cpu->f_z  = (rflags>>6)&1;
-    cpu->f_s  = (rflags>>7)&1;
-}
-
-static void neg_8(struct cpu *cpu, unsigned char *byte1){
-    // *byte1 = alu_8_add(cpu, 0, ~*byte1, 1);
-    // cpu->f_n = 1;
-
-    unsigned long rflags = cpu->f_pv<<11 | (cpu->f & 0xd1);
-    unsigned long src_dst = *byte1;
-
-    __asm__ __volatile__ (
-        "pushfq\n\t"
-
-        "pushfq\n\t"
-        "andw $0xf72a,0(%%rsp)\n\t"
-        "orw %w0,0(%%rsp)\n\t"
-        "popfq\n\t"
-
-        "negb %b1\n\t"
-
-        "pushfq\n\t"
-        "popq %0\n\t"
-
-        "popfq\n\t"
-
-        :"+&q"(rflags),"+&q"(src_dst)
-    );
-
-    *byte1 = src_dst;
-
-    cpu->f_c  = (rflags>>0)&1;
-    cpu->f_n  = 1;
-    cpu->f_pv = (rflags>>11)&1;
-    cpu->f_h  = (rflags>>4)&1;
-    cpu->f_z  = (rflags>>6)&1;
-    cpu->f_s  = (rflags>>7)&1;
-}
-
-// should change to be consistent with sbc_8
-static void adc_8(struct cpu *cpu, unsigned char *src_dst_ptr, unsigned char src){
-    *src_dst_ptr = alu_8_add(cpu, *src_dst_ptr, src, cpu->f_c);
-    cpu->f_n = 0;
-    //adc_8(cpu, &cpu->a, ram[cpu->hl]);
-}
-
-static unsigned sbc_8(struct cpu *cpu, unsigned x){
-    // return alu_8_add(cpu, x, ~y, 1);
-    // cpu->f_n = 1;
-
-#if 1
-    unsigned long rflags = cpu->f_pv<<11 | (cpu->f & 0xd1);
-    unsigned long src = x;
-    unsigned long src_dst = cpu->a;
-
-    __asm__ __volatile__ (
-        "pushfq\n\t"
-
-        "pushfq\n\t"
-        "andw $0xf72a,0(%%rsp)\n\t"
-        "orw %w0,0(%%rsp)\n\t"
-        "popfq\n\t"
-
-        "sbbb %b2, %b1\n\t"
-
-        "pushfq\n\t"
-        "popq %0\n\t"
-
-        "popfq\n\t"
-
-        :"+&q"(rflags),"+&q"(src_dst)
-        :"q"(src)
-    );
-
-    cpu->f_c  = (rflags>>0)&1;
-    cpu->f_n  = 1;
-    cpu->f_pv = (rflags>>11)&1;
-    cpu->f_h  = (rflags>>4)&1;
-    cpu->f_z  = (rflags>>6)&1;
-    cpu->f_s  = (rflags>>7)&1;
-
-    return src_dst;
+// Dispatch engine, picked at build time with `make DISPATCH=threaded`.
+// The switch core is one big `switch (opcode)` with nested switches for the
+// prefixes. The threaded core uses GCC's labels as values: every handler ends
+// by fetching the next opcode and jumping straight through the per prefix
+// table to the next handler, so there is no shared dispatch branch. The
+// predecoded core (`make DISPATCH=predecoded`) is the threaded one running
+// from the cache in decode.h: handlers take their operands from the cache
+// through FETCH_8/FETCH_16 instead of imm_8/imm_16. The fused core
+// (`make DISPATCH=fused`) also decodes some runs of instructions into one
+// entry with its own handler, see the fuse_ labels.
+#ifndef DISPATCH_THREADED
+#define DISPATCH_THREADED 0
 #endif
-#if 0
-    unsigned tmp = cpu->a - x - cpu->f_c;
-    cpu->f_c    = tmp >> 8;
-    cpu->f_s    = tmp >> 7;
-    cpu->f_pv   = (cpu->a ^ x ^ cpu->f_c) >> 7; //might be wrong
-    cpu->f_n    = 1;
-    cpu->f_z = !(unsigned char)tmp;
-    return (unsigned char)tmp;
+#if DISPATCH_PREDECODED && !DISPATCH_THREADED
+#error "DISPATCH_PREDECODED needs DISPATCH_THREADED"
+#endif
+#if DISPATCH_FUSED && !DISPATCH_PREDECODED
+#error "DISPATCH_FUSED needs DISPATCH_PREDECODED"
 #endif
 
-}
-
-static unsigned add16(struct cpu *cpu, unsigned x, unsigned y, unsigned carry_in){
-    uint64_t hsum = (x & 0xfff) + (y & 0xfff) + carry_in;
-    int hcarry = hsum >> 12;
-    uint64_t usum = (x & 0xffff) + (y & 0xffff) + carry_in;
-    // int64_t ssum = (int64_t)(signed short)x + (int64_t)(signed short)y + (int64_t)(signed short)carry_in;
-    unsigned carry_out = usum != (uint16_t)usum;
-    // int overflow = ssum != (int8_t)ssum;
-    
-    uint16_t result = usum;
-    // int zero = !result;
-    // int neg = result >> 15;
-
-    // cpu->f_z = zero;
-    // cpu->f_pv = overflow;  //might need to be !overflow
-    cpu->f_c = carry_out;
-    // cpu->f_s = neg;
-    cpu->f_h = hcarry;
-    // cpu->f_n   set by caller
-
-    return result;
-}
-
-static void sbc_16(struct cpu *cpu, unsigned short *pshort1, unsigned short *pshort2){
-    // Could be bug here, one of the next 4 lines is probably correct, don't know which
-//    *pshort1 = add16(cpu, *pshort1, ~*pshort2, 1);
-  //  *pshort1 = add16(cpu, *pshort1, ~cpu->f_c, 1);
-    //cpu->f_n = 1;
-
-
-    unsigned long rflags = cpu->f_pv<<11 | (cpu->f & 0xd1);
-    unsigned long src = *pshort2;
-    unsigned long src_dst = *pshort1;
-
-    __asm__ __volatile__ (
-        "pushfq\n\t"
-
-        "pushfq\n\t"
-        "andw $0xf72a,0(%%rsp)\n\t"
-        "orw %w0,0(%%rsp)\n\t"
-        "popfq\n\t"
-
-        "sbbw %w2, %w1\n\t"
-
-        "pushfq\n\t"
-        "popq %0\n\t"
-
-        "popfq\n\t"
-
-        :"+&q"(rflags),"+&q"(src_dst)
-        :"q"(src)
-    );
-
-    *pshort1 = src_dst;
-
-    cpu->f_c  = (rflags>>0)&1;
-    cpu->f_n  = 1;
-    cpu->f_pv = (rflags>>11)&1;
-    cpu->f_h  = (rflags>>4)&1;
-    cpu->f_z  = (rflags>>6)&1;
-    cpu->f_s  = (rflags>>7)&1;
-}
-
-static void or_8(struct cpu *cpu, unsigned char val){
-    cpu->a |= val;
-    cpu->f_c = 0;
-    cpu->f_n = 0;
-    cpu->f_pv = parity(cpu->a);
-    cpu->f_h = 0;
-    cpu->f_z = !cpu->a;
-    cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-}
-
-static void and_8(struct cpu *cpu, unsigned char val){
-    cpu->a &= val;
-    cpu->f_c = 0;
-    cpu->f_n = 0;
-    cpu->f_pv = parity(cpu->a);
-    cpu->f_h = 1;
-    cpu->f_z = !cpu->a;
-    cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-}
-
-static unsigned short *writers;
-static unsigned char *mem_tracker;
-
-
-static unsigned char load_8(struct cpu *restrict const cpu, const unsigned char *restrict const ram, unsigned short addr){
-    (void)cpu; // I like handing cpu even though I am not using it
-    unsigned char byte1 = ram[addr];
-    mem_tracker[addr] |= 0x01;
-    return byte1;
-}
-
-static void store_8(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned char val, unsigned short addr){
-    (void)cpu; // I like handing cpu even though I am not using it
-    ram[addr] = val; // write low bits
-
-    mem_tracker[addr] |= 0x02;
-    writers[addr] = cpu->pc;
-}
-
-static unsigned char imm_8(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
-    unsigned short addr = cpu->pc++;
-    unsigned char low = ram[addr];
-    mem_tracker[addr] |= 0x04;
-
-    if(mem_tracker[addr] & 0x02){
-        // if this happens that means the bytes after pc has been written too. If the executalbe section
-        // in ram is written to, bad stuff is probably happening.
-        printf("Detected bad stuff, address %04hx last written by %04hx\n", addr, writers[addr]);
-        exit(44);
-    }
-
-    return low;
-}
+// Register file, picked at build time with `make REGISTERS=local`. The
+// handlers name registers with the macros below. Normally they are the fields
+// of struct cpu, which the compiler has to load and store around every guest
+// memory access and call. With LOCAL_REGISTERS they are locals of
+// do_emulation() that can stay in host registers: SPILL() writes them back to
+// struct cpu before anything else looks at it (BDOS/BIOS traps, the block
+// instructions, the JIT, the tracer, stop hooks, exit) and RELOAD() picks up
+// what that changed. The flags and the alternate registers stay in struct cpu
+// either way. With GCC 12 on x86-64 it is the slower one (`make
+// bench-registers`): the locals do not all fit in host registers across the
+// dispatch loop, so they get spilled to the stack and shuffled at every
+// handler exit.
+#ifndef LOCAL_REGISTERS
+#define LOCAL_REGISTERS 0
+#endif
 
-/*
-static void push_8(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned char val){
-    cpu->sp--;
-    store_8(cpu, ram, val, cpu->sp); // push low bits
-}
-*/
-/*
-static unsigned char pop_8(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
-    return load_8(cpu, ram,cpu->sp++);
-}
-*/
+#if LOCAL_REGISTERS
+union reg_pair{
+    unsigned short w;
+    struct{
+        unsigned char lo;
+        unsigned char hi;
+    };
+};
 
-static unsigned short load_16(struct cpu *restrict const cpu, const unsigned char *restrict const ram, unsigned short addr){
-    (void)cpu; // I like handing cpu even though I am not using it
-    unsigned char byte1 = load_8(cpu, ram, addr++);
-    unsigned char byte2 = load_8(cpu, ram, addr);
+#define A r_a
+#define B r_bc.hi
+#define C r_bc.lo
+#define D r_de.hi
+#define E r_de.lo
+#define H r_hl.hi
+#define L r_hl.lo
+#define BC r_bc.w
+#define DE r_de.w
+#define HL r_hl.w
+#define PC r_pc
+#define SP r_sp
+#define IX r_ix
+#define IY r_iy
+
+#define SPILL() do {\
+    cpu->a = A; cpu->bc = BC; cpu->de = DE; cpu->hl = HL;\
+    cpu->pc = PC; cpu->sp = SP; cpu->ix = IX; cpu->iy = IY;\
+} while (0)
+#define RELOAD() do {\
+    A = cpu->a; BC = cpu->bc; DE = cpu->de; HL = cpu->hl;\
+    PC = cpu->pc; SP = cpu->sp; IX = cpu->ix; IY = cpu->iy;\
+} while (0)
 
-    return byte1 | (byte2 << 8);
+// Code bytes at the local pc. The debug maps record cpu->pc as the writer of
+// every store, so with the checks on it follows along.
+static inline unsigned char next_8(struct cpu *cpu, const unsigned char *ram, unsigned short *pc){
+    unsigned char byte = fetch_8(cpu, ram, (*pc)++);
+#if MEMORY_CHECKS
+    cpu->pc = *pc;
+#endif
+    return byte;
 }
 
-static void store_16(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned short val, unsigned short addr){
-    (void)cpu; // I like handing cpu even though I am not using it
-    store_8(cpu, ram, val, addr);                            // write low bits
-    store_8(cpu, ram, val >> 8, (unsigned short)(addr + 1)); // write high bits
+static inline unsigned short next_16(struct cpu *cpu, const unsigned char *ram, unsigned short *pc){
+    unsigned short val = fetch_16(cpu, ram, *pc);
+    *pc += 2;
+#if MEMORY_CHECKS
+    cpu->pc = *pc;
+#endif
+    return val;
 }
 
-static unsigned short pop_16(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
-    unsigned short tmp = load_16(cpu, ram, cpu->sp);
-    cpu->sp += 2;
+#define FETCH_CODE() next_8(cpu, ram, &PC)
+#define FETCH_CODE_16() next_16(cpu, ram, &PC)
+#define PUSH_16(val) (SP -= 2, store_16(cpu, ram, val, SP))
+#define POP_16() (SP += 2, load_16(cpu, ram, (unsigned short)(SP - 2)))
+#else
+#define A cpu->a
+#define B cpu->b
+#define C cpu->c
+#define D cpu->d
+#define E cpu->e
+#define H cpu->h
+#define L cpu->l
+#define BC cpu->bc
+#define DE cpu->de
+#define HL cpu->hl
+#define PC cpu->pc
+#define SP cpu->sp
+#define IX cpu->ix
+#define IY cpu->iy
+
+#define SPILL() /* nothing to write back */
+#define RELOAD()
+#define FETCH_CODE() imm_8(cpu, ram)
+#define FETCH_CODE_16() imm_16(cpu, ram)
+#define PUSH_16(val) push_16(cpu, ram, val)
+#define POP_16() pop_16(cpu, ram)
+#endif
 
-    return tmp;
-}
+// CALL, with -N a call to a routine native.c knows can be done in C instead
+#define CALL_TO(addr) do {\
+    if(m->native){\
+        SPILL();\
+        bool native = native_call(m, addr);\
+        RELOAD();\
+        if(native)\
+            break;\
+    }\
+    PUSH_16(PC);\
+    PC = addr;\
+} while (0)
 
-static void push_16(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned short val){
-    cpu->sp -= 2;
-    store_16(cpu, ram, val, cpu->sp);
-}
+#if DISPATCH_PREDECODED
+#define COUNT_CYCLES() /* the decode cache has them too */
+#define FETCH_OPCODE() /* the decode cache has it */
+#define FETCH_8() (*operand++)
+#define FETCH_16() (operand += 2, (unsigned short)(operand[-2] | operand[-1] << 8))
+#else
+#define COUNT_CYCLES() cpu->cycles += instruction_cycles(ram, PC)
+#define FETCH_OPCODE() opcode = FETCH_CODE() /* fetch next instruction byte */
+#define FETCH_8() FETCH_CODE()
+#define FETCH_16() FETCH_CODE_16()
+#endif
 
-static unsigned short imm_16(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
-    unsigned char low = imm_8(cpu, ram);
-    unsigned char high = imm_8(cpu, ram);
+// One test of m->hooks for all that can look at each instruction, so a
+// plain run pays for a single load and branch
+#define BEGIN_INSTRUCTION() do {\
+    if(m->hooks){\
+        SPILL();\
+        instruction_hooks(m);\
+        RELOAD();\
+    }\
+    cpu->ran++;\
+    COUNT_CYCLES();\
+    oldoldoldpc = oldoldpc;\
+    oldoldpc = oldpc;\
+    oldpc = PC;\
+    FETCH_OPCODE();\
+} while (0)
 
-    return high << 8 | low;
-}
+#if DISPATCH_THREADED
+#define OP(opc) op_##opc:
+#define ED_OP(opc) ed_##opc:
+#define DD_OP(opc) dd_##opc:
+#define FD_OP(opc) fd_##opc:
+#define OP_DEFAULT op_default:
+#define PREFIX_SWITCH(prefix) goto *prefix##_table[FETCH_CODE()];
+#define PREFIX_DEFAULT(prefix) prefix##_default:
+#define PREFIX_END(prefix)
+#if DISPATCH_PREDECODED
+#define NEXT do {\
+    BEGIN_INSTRUCTION();\
+    entry = &decoded[oldpc];\
+    if(!entry->handler)\
+        goto decode;\
+    PC += entry->length;\
+    cpu->cycles += entry->cycles;\
+    operand = entry->operand;\
+    goto *entry->handler;\
+} while (0)
+#else
+#define NEXT do { BEGIN_INSTRUCTION(); goto *main_table[opcode]; } while (0)
+#endif
+#else
+#define OP(opc) case opc:
+#define ED_OP(opc) case opc:
+#define DD_OP(opc) case opc:
+#define FD_OP(opc) case opc:
+#define OP_DEFAULT default:
+#define PREFIX_SWITCH(prefix) switch(FETCH_CODE()){
+#define PREFIX_DEFAULT(prefix) default:
+#define PREFIX_END(prefix) }
+#define NEXT break
+#endif
 
-static void do_emulation(struct cpu *cpu, unsigned char *restrict ram){
-    FILE *fp = fopen("debug.txt", "wb");
-    unsigned long long ran = 0;
+static void do_emulation(struct machine *m){
+    struct cpu *cpu = &m->cpu;
+    unsigned char *restrict ram = m->ram;
     unsigned short oldoldoldpc = 0xffff;
     unsigned short oldoldpc = 0xffff;
     unsigned short oldpc = 0xffff;
 
-    for(;;){
-        ran++;
+    unsigned char opcode = 0; // the predecoded core only sets it when decoding
+    unsigned char byte1;
+    unsigned char byte2;
+    unsigned char tmp_uchar; (void)tmp_uchar;
+    unsigned short tmp_ushort;
+    unsigned iterations; // of a block instruction
+#if LOCAL_REGISTERS
+    unsigned char r_a;
+    union reg_pair r_bc, r_de, r_hl;
+    unsigned short r_pc, r_sp, r_ix, r_iy;
+    RELOAD();
+#endif
+#if DISPATCH_PREDECODED
+    struct decoded *const decoded = m->decoded->entry;
+    struct decoded *entry;
+    const unsigned char *operand;
+#endif
 
+#if DISPATCH_THREADED
+    // One table per prefix, every slot not listed falls through to the prefix's failure label
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static const void *const main_table[256] = {
+        [0 ... 255] = &&op_default,
+        [0x00] = &&op_0x00,
+        [0x01] = &&op_0x01,
+        [0x02] = &&op_0x02,
+        [0x03] = &&op_0x03,
+        [0x04] = &&op_0x04,
+        [0x05] = &&op_0x05,
+        [0x06] = &&op_0x06,
+        [0x07] = &&op_0x07,
+        [0x08] = &&op_0x08,
+        [0x09] = &&op_0x09,
+        [0x0a] = &&op_0x0a,
+        [0x0b] = &&op_0x0b,
+        [0x0c] = &&op_0x0c,
+        [0x0d] = &&op_0x0d,
+        [0x0e] = &&op_0x0e,
+        [0x0f] = &&op_0x0f,
+        [0x10] = &&op_0x10,
+        [0x11] = &&op_0x11,
+        [0x12] = &&op_0x12,
+        [0x13] = &&op_0x13,
+        [0x14] = &&op_0x14,
+        [0x15] = &&op_0x15,
+        [0x16] = &&op_0x16,
+        [0x17] = &&op_0x17,
+        [0x18] = &&op_0x18,
+        [0x19] = &&op_0x19,
+        [0x1a] = &&op_0x1a,
+        [0x1b] = &&op_0x1b,
+        [0x1c] = &&op_0x1c,
+        [0x1d] = &&op_0x1d,
+        [0x1e] = &&op_0x1e,
+        [0x1f] = &&op_0x1f,
+        [0x20] = &&op_0x20,
+        [0x21] = &&op_0x21,
+        [0x22] = &&op_0x22,
+        [0x23] = &&op_0x23,
+        [0x24] = &&op_0x24,
+        [0x25] = &&op_0x25,
+        [0x26] = &&op_0x26,
+        [0x27] = &&op_0x27,
+        [0x28] = &&op_0x28,
+        [0x29] = &&op_0x29,
+        [0x2a] = &&op_0x2a,
+        [0x2b] = &&op_0x2b,
+        [0x2c] = &&op_0x2c,
+        [0x2d] = &&op_0x2d,
+        [0x2e] = &&op_0x2e,
+        [0x2f] = &&op_0x2f,
+        [0x30] = &&op_0x30,
+        [0x31] = &&op_0x31,
+        [0x32] = &&op_0x32,
+        [0x33] = &&op_0x33,
+        [0x34] = &&op_0x34,
+        [0x35] = &&op_0x35,
+        [0x36] = &&op_0x36,
+        [0x37] = &&op_0x37,
+        [0x38] = &&op_0x38,
+        [0x39] = &&op_0x39,
+        [0x3a] = &&op_0x3a,
+        [0x3b] = &&op_0x3b,
+        [0x3c] = &&op_0x3c,
+        [0x3d] = &&op_0x3d,
+        [0x3e] = &&op_0x3e,
+        [0x3f] = &&op_0x3f,
+        [0x40] = &&op_0x40,
+        [0x41] = &&op_0x41,
+        [0x42] = &&op_0x42,
+        [0x43] = &&op_0x43,
+        [0x44] = &&op_0x44,
+        [0x45] = &&op_0x45,
+        [0x46] = &&op_0x46,
+        [0x47] = &&op_0x47,
+        [0x48] = &&op_0x48,
+        [0x49] = &&op_0x49,
+        [0x4a] = &&op_0x4a,
+        [0x4b] = &&op_0x4b,
+        [0x4c] = &&op_0x4c,
+        [0x4d] = &&op_0x4d,
+        [0x4e] = &&op_0x4e,
+        [0x4f] = &&op_0x4f,
+        [0x50] = &&op_0x50,
+        [0x51] = &&op_0x51,
+        [0x52] = &&op_0x52,
+        [0x53] = &&op_0x53,
+        [0x54] = &&op_0x54,
+        [0x55] = &&op_0x55,
+        [0x56] = &&op_0x56,
+        [0x57] = &&op_0x57,
+        [0x58] = &&op_0x58,
+        [0x59] = &&op_0x59,
+        [0x5a] = &&op_0x5a,
+        [0x5b] = &&op_0x5b,
+        [0x5c] = &&op_0x5c,
+        [0x5d] = &&op_0x5d,
+        [0x5e] = &&op_0x5e,
+        [0x5f] = &&op_0x5f,
+        [0x60] = &&op_0x60,
+        [0x61] = &&op_0x61,
+        [0x62] = &&op_0x62,
+        [0x63] = &&op_0x63,
+        [0x64] = &&op_0x64,
+        [0x65] = &&op_0x65,
+        [0x66] = &&op_0x66,
+        [0x67] = &&op_0x67,
+        [0x68] = &&op_0x68,
+        [0x69] = &&op_0x69,
+        [0x6a] = &&op_0x6a,
+        [0x6b] = &&op_0x6b,
+        [0x6c] = &&op_0x6c,
+        [0x6d] = &&op_0x6d,
+        [0x6e] = &&op_0x6e,
+        [0x6f] = &&op_0x6f,
+        [0x70] = &&op_0x70,
+        [0x71] = &&op_0x71,
+        [0x72] = &&op_0x72,
+        [0x73] = &&op_0x73,
+        [0x74] = &&op_0x74,
+        [0x75] = &&op_0x75,
+        [0x76] = &&op_0x76,
+        [0x77] = &&op_0x77,
+        [0x78] = &&op_0x78,
+        [0x79] = &&op_0x79,
+        [0x7a] = &&op_0x7a,
+        [0x7b] = &&op_0x7b,
+        [0x7c] = &&op_0x7c,
+        [0x7d] = &&op_0x7d,
+        [0x7e] = &&op_0x7e,
+        [0x7f] = &&op_0x7f,
+        [0x80] = &&op_0x80,
+        [0x81] = &&op_0x81,
+        [0x82] = &&op_0x82,
+        [0x83] = &&op_0x83,
+        [0x84] = &&op_0x84,
+        [0x85] = &&op_0x85,
+        [0x86] = &&op_0x86,
+        [0x87] = &&op_0x87,
+        [0x88] = &&op_0x88,
+        [0x89] = &&op_0x89,
+        [0x8a] = &&op_0x8a,
+        [0x8b] = &&op_0x8b,
+        [0x8c] = &&op_0x8c,
+        [0x8d] = &&op_0x8d,
+        [0x8e] = &&op_0x8e,
+        [0x8f] = &&op_0x8f,
+        [0x90] = &&op_0x90,
+        [0x91] = &&op_0x91,
+        [0x92] = &&op_0x92,
+        [0x93] = &&op_0x93,
+        [0x94] = &&op_0x94,
+        [0x95] = &&op_0x95,
+        [0x96] = &&op_0x96,
+        [0x97] = &&op_0x97,
+        [0x98] = &&op_0x98,
+        [0x99] = &&op_0x99,
+        [0x9a] = &&op_0x9a,
+        [0x9b] = &&op_0x9b,
+        [0x9c] = &&op_0x9c,
+        [0x9d] = &&op_0x9d,
+        [0x9e] = &&op_0x9e,
+        [0x9f] = &&op_0x9f,
+        [0xa0] = &&op_0xa0,
+        [0xa1] = &&op_0xa1,
+        [0xa2] = &&op_0xa2,
+        [0xa3] = &&op_0xa3,
+        [0xa4] = &&op_0xa4,
+        [0xa5] = &&op_0xa5,
+        [0xa6] = &&op_0xa6,
+        [0xa7] = &&op_0xa7,
+        [0xa8] = &&op_0xa8,
+        [0xa9] = &&op_0xa9,
+        [0xaa] = &&op_0xaa,
+        [0xab] = &&op_0xab,
+        [0xac] = &&op_0xac,
+        [0xad] = &&op_0xad,
+        [0xae] = &&op_0xae,
+        [0xaf] = &&op_0xaf,
+        [0xb0] = &&op_0xb0,
+        [0xb1] = &&op_0xb1,
+        [0xb2] = &&op_0xb2,
+        [0xb3] = &&op_0xb3,
+        [0xb4] = &&op_0xb4,
+        [0xb5] = &&op_0xb5,
+        [0xb6] = &&op_0xb6,
+        [0xb7] = &&op_0xb7,
+        [0xb8] = &&op_0xb8,
+        [0xb9] = &&op_0xb9,
+        [0xba] = &&op_0xba,
+        [0xbb] = &&op_0xbb,
+        [0xbc] = &&op_0xbc,
+        [0xbd] = &&op_0xbd,
+        [0xbe] = &&op_0xbe,
+        [0xbf] = &&op_0xbf,
+        [0xc0] = &&op_0xc0,
+        [0xc1] = &&op_0xc1,
+        [0xc2] = &&op_0xc2,
+        [0xc3] = &&op_0xc3,
+        [0xc4] = &&op_0xc4,
+        [0xc5] = &&op_0xc5,
+        [0xc6] = &&op_0xc6,
+        [0xc7] = &&op_0xc7,
+        [0xc8] = &&op_0xc8,
+        [0xc9] = &&op_0xc9,
+        [0xca] = &&op_0xca,
+        [0xcb] = &&op_0xcb,
+        [0xcc] = &&op_0xcc,
+        [0xcd] = &&op_0xcd,
+        [0xce] = &&op_0xce,
+        [0xcf] = &&op_0xcf,
+        [0xd0] = &&op_0xd0,
+        [0xd1] = &&op_0xd1,
+        [0xd2] = &&op_0xd2,
+        [0xd3] = &&op_0xd3,
+        [0xd4] = &&op_0xd4,
+        [0xd5] = &&op_0xd5,
+        [0xd6] = &&op_0xd6,
+        [0xd7] = &&op_0xd7,
+        [0xd8] = &&op_0xd8,
+        [0xd9] = &&op_0xd9,
+        [0xda] = &&op_0xda,
+        [0xdb] = &&op_0xdb,
+        [0xdc] = &&op_0xdc,
+        [0xdd] = &&op_0xdd,
+        [0xde] = &&op_0xde,
+        [0xdf] = &&op_0xdf,
+        [0xe0] = &&op_0xe0,
+        [0xe1] = &&op_0xe1,
+        [0xe2] = &&op_0xe2,
+        [0xe3] = &&op_0xe3,
+        [0xe4] = &&op_0xe4,
+        [0xe5] = &&op_0xe5,
+        [0xe6] = &&op_0xe6,
+        [0xe7] = &&op_0xe7,
+        [0xe8] = &&op_0xe8,
+        [0xe9] = &&op_0xe9,
+        [0xea] = &&op_0xea,
+        [0xeb] = &&op_0xeb,
+        [0xec] = &&op_0xec,
+        [0xed] = &&op_0xed,
+        [0xee] = &&op_0xee,
+        [0xef] = &&op_0xef,
+        [0xf0] = &&op_0xf0,
+        [0xf1] = &&op_0xf1,
+        [0xf2] = &&op_0xf2,
+        [0xf3] = &&op_0xf3,
+        [0xf4] = &&op_0xf4,
+        [0xf5] = &&op_0xf5,
+        [0xf6] = &&op_0xf6,
+        [0xf7] = &&op_0xf7,
+        [0xf8] = &&op_0xf8,
+        [0xf9] = &&op_0xf9,
+        [0xfa] = &&op_0xfa,
+        [0xfb] = &&op_0xfb,
+        [0xfc] = &&op_0xfc,
+        [0xfd] = &&op_0xfd,
+        [0xfe] = &&op_0xfe,
+        [0xff] = &&op_0xff,
+    };
+    static const void *const ed_table[256] = {
+        [0 ... 255] = &&ed_default,
+        [0x42] = &&ed_0x42,
+        [0x43] = &&ed_0x43,
+        [0x44] = &&ed_0x44,
+        [0x4a] = &&ed_0x4a,
+        [0x4b] = &&ed_0x4b,
+        [0x52] = &&ed_0x52,
+        [0x53] = &&ed_0x53,
+        [0x57] = &&ed_0x57,
+        [0x5b] = &&ed_0x5b,
+        [0x6a] = &&ed_0x6a,
+        [0x7b] = &&ed_0x7b,
+        [0xb0] = &&ed_0xb0,
+        [0xb1] = &&ed_0xb1,
+        [0xb8] = &&ed_0xb8,
+        [0xb9] = &&ed_0xb9,
+    };
+    static const void *const dd_table[256] = {
+        [0 ... 255] = &&dd_default,
+        [0x21] = &&dd_0x21,
+        [0x22] = &&dd_0x22,
+        [0x2a] = &&dd_0x2a,
+        [0x39] = &&dd_0x39,
+        [0x66] = &&dd_0x66,
+        [0x6e] = &&dd_0x6e,
+        [0xe1] = &&dd_0xe1,
+        [0xe5] = &&dd_0xe5,
+        [0xf9] = &&dd_0xf9,
+    };
+    static const void *const fd_table[256] = {
+        [0 ... 255] = &&fd_default,
+        [0x21] = &&fd_0x21,
+        [0x22] = &&fd_0x22,
+        [0x2a] = &&fd_0x2a,
+        [0x36] = &&fd_0x36,
+        [0x66] = &&fd_0x66,
+        [0x6e] = &&fd_0x6e,
+        [0x77] = &&fd_0x77,
+        [0x7e] = &&fd_0x7e,
+        [0xe1] = &&fd_0xe1,
+        [0xe5] = &&fd_0xe5,
+        [0xe9] = &&fd_0xe9,
+    };
+#if DISPATCH_FUSED
+    static const void *const fused_table[FUSE_COUNT] = {
+        [FUSE_LD_A_HL_OR_A_JR_Z] = &&fuse_ld_a_hl_or_a_jr_z,
+        [FUSE_LD_A_HL_ADD_A_E_LD_E_A] = &&fuse_ld_a_hl_add_a_e_ld_e_a,
+        [FUSE_INC_HL_DJNZ] = &&fuse_inc_hl_djnz,
+        [FUSE_INC_HL_JR] = &&fuse_inc_hl_jr,
+        [FUSE_CP_JR_C] = &&fuse_cp_jr_c,
+        [FUSE_LD_A_L_OR_H_JR_NZ] = &&fuse_ld_a_l_or_h_jr_nz,
+        [FUSE_LD_C_CALL] = &&fuse_ld_c_call,
+    };
+#endif
+#pragma GCC diagnostic pop
+
+    NEXT;
+
+#if DISPATCH_PREDECODED
+decode: {
+        // First run of the instruction at oldpc. Fetch it with FETCH_CODE like the
+        // other cores do, so the debug checks see every byte, and keep the
+        // handler and operands for next time.
+        opcode = FETCH_CODE();
+        entry->handler = main_table[opcode];
+        if(opcode == 0xed)
+            entry->handler = ed_table[FETCH_CODE()];
+        else if(opcode == 0xdd)
+            entry->handler = dd_table[FETCH_CODE()];
+        else if(opcode == 0xfd)
+            entry->handler = fd_table[FETCH_CODE()];
+
+        unsigned fetched = (unsigned short)(PC - oldpc);
+        unsigned length = fetched;
+        if(entry->handler != &&op_default && entry->handler != &&ed_default && entry->handler != &&dd_default && entry->handler != &&fd_default)
+            length = decode_length(ram, oldpc);
+        for(unsigned i = fetched; i < length; i++)
+            entry->operand[i - fetched] = FETCH_CODE();
+        entry->length = length;
+        entry->cycles = instruction_cycles(ram, oldpc);
+#if DISPATCH_FUSED
+        // Not while something looks at every instruction, and only over
+        // bytes imm_8 would let run
+        unsigned char fused_operand[3];
+        unsigned fused_length;
+        enum fused fused = FUSE_NONE;
+        if(!m->at_stop && !m->trace && !m->profile)
+            fused = decode_fuse(ram, oldpc, &fused_length, fused_operand);
+        for(unsigned i = length; fused && i < fused_length; i++){
+            if(!fetch_ok(cpu, oldpc + i))
+                fused = FUSE_NONE;
+        }
+        if(fused){
+            for(unsigned i = length; i < fused_length; i++)
+                FETCH_CODE(); // the rest of the run, marked as run
+            for(unsigned short at = oldpc + length; at != (unsigned short)(oldpc + fused_length); at += decode_length(ram, at))
+                entry->cycles += instruction_cycles(ram, at);
+            entry->handler = fused_table[fused];
+            entry->length = fused_length;
+            memcpy(entry->operand, fused_operand, sizeof fused_operand);
+            m->decoded->fused++;
+        }
+#endif
+        cpu->cycles += entry->cycles;
+        for(unsigned i = 0; i < entry->length; i++)
+            m->decoded->map[(unsigned short)(oldpc + i)] = 1;
+        m->decoded->decodes++;
+
+        operand = entry->operand;
+        goto *entry->handler;
+    }
+#endif
+    {
+#else
+    for(;;){
         // printf("Bytes %02hhx %02hhx %02hhx %02hhx at 0x%04hx after %llu run\n",
         //     ram[cpu->pc],
         //     ram[cpu->pc+1],
@@ -750,33 +1048,6 @@ static void do_emulation(struct cpu *cpu, unsigned char *restrict ram){
         // );
         
         ////////////////////////////////////////////////////////////////////////////        
-        cpu->f &= 0x41;  // only Z and C matter for gorillas
-#if 0
-        const unsigned long print_start = 291000;
-        const unsigned long prints_wanted = 50000;
-
-
-        if(ran > print_start){ 
-            fprintf(fp, "%016llx Bytes %02hhx %02hhx %02hhx %02hhx pc:%04hx af:%04hx sp:%04hx hl:%04hx de:%04hx bc:%04hx ix:%04hx iy:%04hx\n",
-                ran,
-                ram[cpu->pc],
-                ram[cpu->pc+1],
-                ram[cpu->pc+2],
-                ram[cpu->pc+3],
-                cpu->pc,
-                cpu->af& 0xffd7 & 0xffef, // hide reserved bits and half carry
-                cpu->sp, 
-                cpu->hl, 
-                cpu->de,
-                cpu->bc, 
-                cpu->ix, 
-                cpu->iy
-            );
-            fflush(fp);
-            if(ran > print_start + prints_wanted)
-                exit(0);
-        }
-#endif
 
         // fprintf(stdout, "Bytes %02hhx %02hhx %02hhx %02hhx pc:%04hx af:%04hx sp:%04hx hl:%04hx de:%04hx bc:%04hx ix:%04hx iy:%04hx\n",
         //     ram[cpu->pc],
@@ -793,11 +1064,6 @@ static void do_emulation(struct cpu *cpu, unsigned char *restrict ram){
         //     cpu->iy
         // );
 
-        oldoldoldpc = oldoldpc;
-        oldoldpc = oldpc;
-        oldpc = cpu->pc;
-
-
         // if(cpu->pc >= BIOS_BASE && cpu->pc <= BIOS_BASE + 0x30){
         //     bios(cpu, ram, cpu->pc - BIOS_BASE);
         //     // ran++;
@@ -818,990 +1084,1556 @@ static void do_emulation(struct cpu *cpu, unsigned char *restrict ram){
         //     goto fail;
         // }
 
-        // fetch next instruction byte
-        unsigned char opcode = imm_8(cpu, ram);
+        BEGIN_INSTRUCTION();
+
+        switch (opcode){
+#endif
+        OP(0x00) // nop
+            NEXT;
+        OP(0xc3) // jp **
+            PC = FETCH_16();
+            NEXT;
+        OP(0x3e) // ld a,*
+            byte1 = FETCH_8();
+            A = byte1;
+            NEXT;
+        OP(0x32) // ld (**), a
+            store_8(cpu, ram, A, FETCH_16());
+            NEXT;
+        OP(0x2a) // ld hl, (**)
+            HL = load_16(cpu, ram, FETCH_16());
+            NEXT;
+        OP(0xed) // Extended Instructions
+            PREFIX_SWITCH(ed)
+            ED_OP(0x7b) // ld sp, (**)
+                SP = load_16(cpu, ram, FETCH_16());
+                NEXT;
+            ED_OP(0xb0) // ldir
+                // the whole copy at once, see block.h. Every iteration still counts as an instruction.
+                SPILL();
+                iterations = block_copy(cpu, ram, 1, oldpc);
+                RELOAD();
+                cpu->ran += iterations - 1;
+                cpu->cycles += block_cycles(iterations, BC != 0);
+                if(BC)
+                    PC = oldpc;
+                NEXT;
+            ED_OP(0x42) // sbc hl,bc
+                HL = sbc_16(cpu, HL, BC);
+                NEXT;
+            ED_OP(0x57) // some instruction I can skip doing
+                NEXT;
+            ED_OP(0x43) // ld (**),bc
+                store_16(cpu, ram, BC, FETCH_16());
+                NEXT;
+            ED_OP(0x53) // ld (**),de
+                store_16(cpu, ram, DE, FETCH_16());
+                NEXT;
+            ED_OP(0x52) // sbc hl,de
+                HL = sbc_16(cpu, HL, DE);
+                NEXT;
+            ED_OP(0x5b) // ld de,(**)
+                DE = load_16(cpu, ram, FETCH_16());
+                NEXT;
+            ED_OP(0x4b) // ld bc,(**)
+                BC = load_16(cpu, ram, FETCH_16());
+                NEXT;
+            ED_OP(0x44) // neg
+                // A = add8(cpu, 0, ~A, 1);
+                // cpu->f_n = 1;
+                A = neg_8(cpu, A);
+                NEXT;
+            ED_OP(0x6a) // adc hl,hl
+                HL = adc_16(cpu, HL, HL);
+                NEXT;
+            ED_OP(0x4a) // adc hl,bc
+                HL = adc_16(cpu, HL, BC);
+                NEXT;
+            ED_OP(0xb8) // lddr
+                SPILL();
+                iterations = block_copy(cpu, ram, -1, oldpc);
+                RELOAD();
+                cpu->ran += iterations - 1;
+                cpu->cycles += block_cycles(iterations, BC != 0);
+                if(BC)
+                    PC = oldpc;
+                NEXT;
+            ED_OP(0xb1) // cpir
+                SPILL();
+                iterations = block_compare(cpu, ram, 1);
+                RELOAD();
+                cpu->ran += iterations - 1;
+                cpu->cycles += block_cycles(iterations, 0);
+                NEXT;
+            ED_OP(0xb9) // cpdr
+                SPILL();
+                iterations = block_compare(cpu, ram, -1);
+                RELOAD();
+                cpu->ran += iterations - 1;
+                cpu->cycles += block_cycles(iterations, 0);
+                NEXT;
+            PREFIX_DEFAULT(ed)
+                console_printf(&m->console, "0xed means Extended Instruction\n");
+                goto fail;
+            PREFIX_END(ed)
+            NEXT;
+        OP(0x2b) // dec hl
+            HL--;
+            NEXT;
+        OP(0x56) // ld d, (hl)
+            D = load_8(cpu, ram, HL);
+            NEXT;
+        OP(0x5e) // ld e, (hl)
+            E = load_8(cpu, ram, HL);
+            NEXT;
+        OP(0xeb) // ex de, hl
+            tmp_ushort = DE;
+            DE = HL;
+            HL = tmp_ushort;
+            NEXT;
+        OP(0x23) // inc hl
+            HL++;
+            NEXT;
+        OP(0x19) // add hl, de
+            //cpu->f_h = ((HL & 0x0fff) + (DE & 0x0fff)) >> 12;
+            //HL += DE;
+
+            HL = add16(cpu, HL, DE, 0);
+            NEXT;
+        OP(0xd5) // push de
+            PUSH_16(DE);
+            NEXT;
+        OP(0x01) // ld bc, **
+            BC = FETCH_16();
+            NEXT;
+        OP(0xfd) // IY Instructions
+            PREFIX_SWITCH(fd)
+            FD_OP(0x21) // ld iy, **
+                IY = FETCH_16();
+                NEXT;
+            FD_OP(0xe9) // jp (iy) ...the syntex of this instruction is off
+                PC = IY;
+                NEXT;
+            FD_OP(0xe5) // push iy
+                PUSH_16(IY);
+                NEXT;
+            FD_OP(0xe1) // pop iy
+                IY = POP_16();
+                NEXT;
+            FD_OP(0x2a) // ld iy,(**)
+                IY = load_16(cpu, ram, FETCH_16());
+                NEXT;
+            FD_OP(0x22) // ld (**),iy
+                store_16(cpu, ram, IY,FETCH_16());
+                NEXT;
+            FD_OP(0x6e) // ld l,(iy+*)
+                L = load_8(cpu, ram, (unsigned short)(IY + FETCH_8()));
+                NEXT;
+            FD_OP(0x66) // ld h,(iy+*)
+                H = load_8(cpu, ram, (unsigned short)(IY + FETCH_8()));
+                NEXT;
+            FD_OP(0x7e) // ld a,(iy+*)
+                A = load_8(cpu, ram, (unsigned short)(IY + FETCH_8()));
+                NEXT;
+            FD_OP(0x36) // ld (iy+*),*
+                byte1 = FETCH_8();
+                byte2 = FETCH_8();
+                store_8(cpu, ram, byte2, IY + byte1);
+                NEXT;
+            FD_OP(0x77) // ld (iy+*),a
+                byte1 = FETCH_8();
+                store_8(cpu, ram, A, IY + byte1);
+                NEXT;
+            PREFIX_DEFAULT(fd)
+                console_printf(&m->console, "0xfd is an IY instruction\n");
+                goto fail;
+            PREFIX_END(fd)
+            NEXT;
+        OP(0x1a) // ld a, (de)
+            A = load_8(cpu, ram, DE);
+            NEXT;
+        OP(0x13) // inc de
+            DE++;
+            NEXT;
+        OP(0xfe) // cp *     probably should be something like `cp a,*` or `cp *,a`
+            // page 164 in z80 cpu manual
+            byte1 = FETCH_8();
+            cp_8(cpu, A, byte1);
+            NEXT;
+        OP(0xca) // jp z,**
+            tmp_ushort = FETCH_16();
+            if (flag_z(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0xda) // jp c,**
+            tmp_ushort = FETCH_16();
+            if (flag_c(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0xdd) // IX Instructions
+            PREFIX_SWITCH(dd)
+            DD_OP(0xe5) // push ix
+                PUSH_16(IX);
+                NEXT;
+            DD_OP(0x21) // ld ix,**
+                IX = FETCH_16();
+                NEXT;
+            DD_OP(0x39) // add ix,sp
+                IX = add16(cpu, IX, SP, 0);
+                NEXT;
+            DD_OP(0xe1) // pop ix
+                IX = POP_16();
+                NEXT;
+            DD_OP(0x6e) // ld l,(ix+*)
+                L = load_8(cpu, ram, IX + (signed char)FETCH_8());
+                NEXT;
+            DD_OP(0x66) // ld h,(ix+*)
+                H = load_8(cpu, ram, IX + (signed char)FETCH_8());
+                NEXT;
+            DD_OP(0xf9) // ld sp,ix
+                SP = IX;
+                NEXT;
+            DD_OP(0x22) // ld (**), ix
+                store_16(cpu, ram, IX, FETCH_16());
+                NEXT;
+            DD_OP(0x2a) // ld ix,(**)
+                IX = load_16(cpu, ram, FETCH_16());
+                NEXT;
+            PREFIX_DEFAULT(dd)
+                console_printf(&m->console, "0xdd means an IX instruction\n");
+                goto fail;
+            PREFIX_END(dd)
+            NEXT;
+        OP(0xc5) // push bc
+            PUSH_16(BC);
+            NEXT;
+        OP(0x6f) // ld l,a
+            L = A;
+            NEXT;
+        OP(0x26) // ld h,*
+            byte1 = FETCH_8();
+            H = byte1;
+            NEXT;
+        OP(0x39) // add hl,sp
+            HL = add16(cpu, HL, SP, 0);
+            NEXT;
+        OP(0x3a) // ld a,(**)
+            A = load_8(cpu, ram, FETCH_16());
+            NEXT;
+        OP(0xbc) // cp h
+            cp_8(cpu, A, H);
+            NEXT;
+        OP(0x30) // jr nc,*
+            byte1 = FETCH_8();
+            if(!flag_c(cpu)){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+        OP(0x46) // ld b,(hl)
+            B = load_8(cpu, ram, HL);
+            NEXT;
+        OP(0x24) // inc h
+            // byte2 = cpu->f_c;
+            // H = add8(cpu, H, 1, 0);
+            // cpu->f_c = byte2;
+            H = inc_8(cpu, H);
+            NEXT;
+        OP(0x66) // ld h,(hl)
+            H = load_8(cpu, ram, HL);
+            NEXT;
+        OP(0x68) // ld l, b
+            L = B;
+            NEXT;
+        OP(0xe9) // jp (hl)
+            PC = HL;
+            NEXT;
+        OP(0xd9) // exx
+            tmp_ushort = BC;
+            BC = cpu->bc_prime;
+            cpu->bc_prime = tmp_ushort;
 
-        unsigned char byte1;
-        unsigned char byte2;
-        unsigned char tmp_uchar; (void)tmp_uchar;
-        unsigned short tmp_ushort;
-        unsigned char *ptr_u8;
+            tmp_ushort = DE;
+            DE = cpu->de_prime;
+            cpu->de_prime = tmp_ushort;
 
+            tmp_ushort = HL;
+            HL = cpu->hl_prime;
+            cpu->hl_prime = tmp_ushort;
 
-        switch (opcode){
-        case 0x00: // nop
-            break;
-        case 0xc3: // jp **
-            cpu->pc = imm_16(cpu, ram);
-            break;
-        case 0x3e: // ld a,*
-            byte1 = imm_8(cpu, ram);
-            cpu->a = byte1;
-            break;
-        case 0x32: // ld (**), a
-            store_8(cpu, ram, cpu->a, imm_16(cpu, ram));
-            break;
-        case 0x2a: // ld hl, (**)
-            cpu->hl = load_16(cpu, ram, imm_16(cpu, ram));
-            break;
-        case 0xed: // Extended Instructions
-            switch(imm_8(cpu, ram)){
-            case 0x7b: // ld sp, (**)
-                cpu->sp = load_16(cpu, ram, imm_16(cpu, ram));
-                break;
-            case 0xb0: // ldir
-                //basically a memcpy
-                //do store_8(cpu, ram, load_8(cpu, ram, cpu->hl++), cpu->de++);
-                //while ((unsigned short)--cpu->bc);
-                cpu->f_n = 0;
-                cpu->f_h = 0;
-                cpu->f_pv = !!(cpu->bc - 1);
-                store_8(cpu, ram, load_8(cpu, ram, cpu->hl++), cpu->de++);
-                if((unsigned short)--cpu->bc)
-                    cpu->pc = oldpc;
-                break;
-            case 0x42: // sbc hl,bc
-                sbc_16(cpu, &cpu->hl, &cpu->bc);
-                break;
-            case 0x57: // some instruction I can skip doing
-                break;
-            case 0x43: // ld (**),bc
-                store_16(cpu, ram, cpu->bc, imm_16(cpu, ram));
-                break;
-            case 0x53: // ld (**),de
-                store_16(cpu, ram, cpu->de, imm_16(cpu, ram));
-                break;
-            case 0x52: // sbc hl,de
-                sbc_16(cpu, &cpu->hl, &cpu->de);
-                break;
-            case 0x5b: // ld de,(**)
-                cpu->de = load_16(cpu, ram, imm_16(cpu, ram));
+            NEXT;
+        OP(0xaf) // xor a
+            A = xor_8(cpu, A, A);
+            NEXT;
+        OP(0xa8) // xor b
+            A = xor_8(cpu, A, B);
+            NEXT;
+        OP(0xa9) // xor c
+            A = xor_8(cpu, A, C);
+            NEXT;
+        OP(0xaa) // xor d
+            A = xor_8(cpu, A, D);
+            NEXT;
+        OP(0xab) // xor e
+            A = xor_8(cpu, A, E);
+            NEXT;
+        OP(0xac) // xor h
+            A = xor_8(cpu, A, H);
+            NEXT;
+        OP(0xad) // xor l
+            A = xor_8(cpu, A, L);
+            NEXT;
+        OP(0xe5) //push hl
+            PUSH_16(HL);
+            NEXT;
+        OP(0x21) // ld hl,**
+            HL = FETCH_16();
+            NEXT;
+        OP(0x31) // ld sp,**
+            SP = FETCH_16();
+            NEXT;
+        OP(0xcd) // call **
+            tmp_ushort = FETCH_16();
+            CALL_TO(tmp_ushort);
+
+            // if(PC == 5){
+            //     cpu->hl = bdos(ram, cpu->c, cpu->de);
+            //     cpu->a = cpu->l;
+            //     cpu->b = cpu->h;
+            //     cpu->pc = pop_16(cpu, ram); // Undo the push_16 above
+            // }
+
+            NEXT;
+        OP(0xf3) // di
+            // printf("Interrupts off, di instruction not written\n");
+            // fprintf(fp, "Interrupts off, di instruction not written\n");
+            NEXT;
+        OP(0x22) // ld (**), hl
+            store_16(cpu, ram, HL, FETCH_16());
+            NEXT;
+        OP(0xe1) // pop hl
+            HL = POP_16();
+            NEXT;
+        OP(0xe3) // ex (sp),hl
+            tmp_ushort = HL;
+            HL = load_16(cpu, ram, SP);
+            store_16(cpu, ram, tmp_ushort, SP);
+            NEXT;
+        OP(0xf5) // push af
+            flags_commit(cpu);
+            PUSH_16(A << 8 | cpu->f);
+            NEXT;
+        OP(0x08) // ex af,af'
+            flags_commit(cpu);
+            tmp_ushort = A << 8 | cpu->f;
+            A = cpu->af_prime >> 8;
+            cpu->f = cpu->af_prime;
+            cpu->af_prime = tmp_ushort;
+            NEXT;
+        OP(0x4d) // ld c,l
+            C = L;
+            NEXT;
+        OP(0x44) // ld b,h
+            B = H;
+            NEXT;
+        OP(0xf9) // ld sp,hl
+            SP = HL;
+            NEXT;
+        OP(0x7d) // ld a,l
+            A = L;
+            NEXT;
+        OP(0x02) // ld (bc),a
+            store_8(cpu, ram, A, BC);
+            NEXT;
+        OP(0x03) // inc bc
+            BC++;
+            NEXT;
+        OP(0x7c) // ld a,h
+            A = H;
+            NEXT;
+        OP(0xd1) // pop de
+            DE = POP_16();
+            NEXT;
+        OP(0x7e) // ld a,(hl)
+            A = load_8(cpu, ram, HL);
+            NEXT;
+        OP(0xb4) // or h
+            A = or_8(cpu, A, H);
+            NEXT;
+        OP(0x4f) // ld c,a
+            C = A;
+            NEXT;
+        OP(0x47) // ld b,a
+            B = A;
+            NEXT;
+        OP(0xc1) // pop bc
+            BC = POP_16();
+            NEXT;
+        OP(0xb5) // or l
+            A = or_8(cpu, A, L);
+            NEXT;
+        OP(0x28) // jr z,*
+            byte1 = FETCH_8();
+            if(flag_z(cpu)){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+        OP(0x09) // add hl,bc
+            HL = add16(cpu, HL, BC, 0);
+            NEXT;
+        OP(0x4e) // ld c,(hl)
+            C = load_8(cpu, ram, HL);
+            NEXT;
+        OP(0x06) // ld b,*
+            byte1 = FETCH_8();
+            B = byte1;
+            NEXT;
+        OP(0x18) // jr *
+            byte1 = FETCH_8();
+            PC = (short)(signed char)byte1 + PC;
+            NEXT;
+        OP(0xb7) // or a
+            A = or_8(cpu, A, A);
+            NEXT;
+        OP(0xf1) // pop af
+            tmp_ushort = POP_16();
+            A = tmp_ushort >> 8;
+            cpu->f = tmp_ushort;
+            cpu->lf_op = LF_NONE;
+            NEXT;
+        OP(0xfb) // ei
+            NEXT;
+        OP(0xea) // jp pe, **
+            tmp_ushort = FETCH_16();
+            if (flag_pv(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0xe6) // and *
+            byte1 = FETCH_8();
+            A = and_8(cpu, A, byte1);
+            NEXT;
+        OP(0x87) // add a,a
+            A = add_8(cpu, A, A);
+            NEXT;
+        OP(0xc2) // jp nz,**
+            tmp_ushort = FETCH_16();
+            if (!flag_z(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0x71) // ld (hl),c
+            store_8(cpu, ram, C, HL);
+            NEXT;
+        OP(0x70) // ld (hl),b
+            store_8(cpu, ram, B, HL);
+            NEXT;
+        OP(0x73) // ld (hl),e
+            store_8(cpu, ram, E, HL);
+            NEXT;
+        OP(0x07) // rlca
+            A = A << 1 | A >> 7;
+            flags_commit(cpu);
+            cpu->f_c = A & 1;
+            cpu->f_n = 0;
+            cpu->f_h = 0;
+            NEXT;
+        OP(0xcb)
+            byte1 = FETCH_8();
+
+            if((byte1 & 0x07) == 6){ // (hl)
+                byte2 = cb_apply(cpu, byte1, load_8(cpu, ram, HL));
+                if(byte1 >> 6 != 1) // bit only reads
+                    store_8(cpu, ram, byte2, HL);
+                NEXT;
+            }
+
+            // one case per register, no pointer into the register file
+            switch (byte1 & 0x07){
+            case 0:
+                B = cb_apply(cpu, byte1, B);
                 break;
-            case 0x4b: // ld bc,(**)
-                cpu->bc = load_16(cpu, ram, imm_16(cpu, ram));
+            case 1:
+                C = cb_apply(cpu, byte1, C);
                 break;
-            case 0x44: // neg
-                // cpu->a = add8(cpu, 0, ~cpu->a, 1);
-                // cpu->f_n = 1;
-                neg_8(cpu, &cpu->a);
+            case 2:
+                D = cb_apply(cpu, byte1, D);
                 break;
-            case 0x6a: // adc hl,hl
-                cpu->hl = add16(cpu, cpu->hl, cpu->hl, cpu->f_c);
-                cpu->f_n = 0;
+            case 3:
+                E = cb_apply(cpu, byte1, E);
                 break;
-			case 0x4a: // adc hl,bc
-                cpu->hl = add16(cpu, cpu->hl, cpu->bc, cpu->f_c);
-                cpu->f_n = 0;
+            case 4:
+                H = cb_apply(cpu, byte1, H);
                 break;
-            case 0xb8: // lddr
-                // do store_8(cpu, ram, load_8(cpu, ram, cpu->hl--), cpu->de--);
-                // while ((unsigned short)--cpu->bc);
-                cpu->f_n = 0;
-                cpu->f_h = 0;
-                cpu->f_pv = !!(cpu->bc - 1);
-                store_8(cpu, ram, load_8(cpu, ram, cpu->hl--), cpu->de--);
-                if((unsigned short)--cpu->bc)
-                    cpu->pc = oldpc;
-
+            case 5:
+                L = cb_apply(cpu, byte1, L);
                 break;
-            case 0xb1: // cpir
-                cpu->f_n = 1;
-                cpu->f_h = 0;
-                cpu->f_pv = 0;
-                // store_8(cpu, ram, load_8(cpu, ram, cpu->hl--), cpu->de--);
-                cp_8(cpu, load_8(cpu, ram, cpu->hl++));
-                if((unsigned short)--cpu->bc && !cpu->f_z)
-                    cpu->pc = oldpc;
+            case 7:
+                A = cb_apply(cpu, byte1, A);
                 break;
             default:
-                puts("0xed means Extended Instruction");
-                goto fail;
+                __builtin_unreachable();
+                break;
             }
-            break;
-        case 0x2b: // dec hl
-            cpu->hl--;
-            break;
-        case 0x56: // ld d, (hl)
-            cpu->d = load_8(cpu, ram, cpu->hl);
-            break;
-        case 0x5e: // ld e, (hl)
-            cpu->e = load_8(cpu, ram, cpu->hl);
-            break;
-        case 0xeb: // ex de, hl
-            tmp_ushort = cpu->de;
-            cpu->de = cpu->hl;
-            cpu->hl = tmp_ushort;
-            break;
-        case 0x23: // inc hl
-            cpu->hl++;
-            break;
-        case 0x19: // add hl, de
-            //cpu->f_h = ((cpu->hl & 0x0fff) + (cpu->de & 0x0fff)) >> 12;
-            //cpu->hl += cpu->de;
-
-            cpu->hl = add16(cpu, cpu->hl, cpu->de, 0);
-            cpu->f_n = 0;
-            break;
-        case 0xd5: // push de
-            push_16(cpu, ram, cpu->de);
-            break;
-        case 0x01: // ld bc, **
-            cpu->bc = imm_16(cpu, ram);
-            break;
-        case 0xfd: // IY Instructions
-            switch(imm_8(cpu, ram)){
-            case 0x21: // ld iy, **
-                cpu->iy = imm_16(cpu, ram);
-                break;
-            case 0xe9: // jp (iy) ...the syntex of this instruction is off
-                cpu->pc = cpu->iy;
-                break;
-            case 0xe5: // push iy
-                push_16(cpu, ram, cpu->iy);
-                break;
-            case 0xe1: // pop iy
-                cpu->iy = pop_16(cpu, ram);
-                break;
-            case 0x2a: // ld iy,(**)
-                cpu->iy = load_16(cpu, ram, imm_16(cpu, ram));
-                break;
-            case 0x22: // ld (**),iy
-                store_16(cpu, ram, cpu->iy,imm_16(cpu, ram));
-                break;
-            case 0x6e: // ld l,(iy+*)
-                cpu->l = load_8(cpu, ram, (unsigned short)(cpu->iy + imm_8(cpu, ram)));
-                break;
-            case 0x66: // ld h,(iy+*)
-                cpu->h = load_8(cpu, ram, (unsigned short)(cpu->iy + imm_8(cpu, ram)));
-                break;
-            case 0x7e: // ld a,(iy+*)
-                cpu->a = load_8(cpu, ram, (unsigned short)(cpu->iy + imm_8(cpu, ram)));
-                break;
-            case 0x36: // ld (iy+*),*
-                byte1 = imm_8(cpu, ram);
-                byte2 = imm_8(cpu, ram);
-                store_8(cpu, ram, byte2, cpu->iy + byte1);
-                break;
-            case 0x77: // ld (iy+*),a
-                byte1 = imm_8(cpu, ram);
-                store_8(cpu, ram, cpu->a, cpu->iy + byte1);
-                break;
-            default:
-                puts("0xfd is an IY instruction");
-                goto fail;
-            }
-            break;
-        case 0x1a: // ld a, (de)
-            cpu->a = load_8(cpu, ram, cpu->de);
-            break;
-        case 0x13: // inc de
-            cpu->de++;
-            break;
-        case 0xfe: // cp *     probably should be something like `cp a,*` or `cp *,a`
-            // page 164 in z80 cpu manual
-            byte1 = imm_8(cpu, ram);
-            cp_8(cpu, byte1);
-            break;
-        case 0xca: // jp z,**
-            tmp_ushort = imm_16(cpu, ram);
-            if (cpu->f_z)
-                cpu->pc = tmp_ushort;
-            break;
-        case 0xda: // jp c,**
-            tmp_ushort = imm_16(cpu, ram);
-            if (cpu->f_c)
-                cpu->pc = tmp_ushort;
-            break;
-        case 0xdd: // IX Instructions
-            switch(imm_8(cpu, ram)){
-            case 0xe5: // push ix
-                push_16(cpu, ram, cpu->ix);
-                break;
-            case 0x21: // ld ix,**
-                cpu->ix = imm_16(cpu, ram);
-                break;
-            case 0x39: // add ix,sp
-                cpu->ix = add16(cpu, cpu->ix, cpu->sp, 0);
-                cpu->f_n = 0;
-                break;
-            case 0xe1: // pop ix
-                cpu->ix = pop_16(cpu, ram);
-                break;
-            case 0x6e: // ld l,(ix+*)
-                cpu->l = load_8(cpu, ram, cpu->ix + (signed char)imm_8(cpu, ram));
-                break;
-            case 0x66: // ld h,(ix+*)
-                cpu->h = load_8(cpu, ram, cpu->ix + (signed char)imm_8(cpu, ram));
-                break;
-            case 0xf9: // ld sp,ix
-                cpu->sp = cpu->ix;
-                break;
-            case 0x22: // ld (**), ix
-                store_16(cpu, ram, cpu->ix, imm_16(cpu, ram));
-                break;
-            case 0x2a: // ld ix,(**)
-                cpu->ix = load_16(cpu, ram, imm_16(cpu, ram));
-                break;
-            default:
-                puts("0xdd means an IX instruction");
-                goto fail;
-            }
-            break;
-        case 0xc5: // push bc
-            push_16(cpu, ram, cpu->bc);
-            break;
-        case 0x6f: // ld l,a
-            cpu->l = cpu->a;
-            break;
-        case 0x26: // ld h,*
-            byte1 = imm_8(cpu, ram);
-            cpu->h = byte1;
-            break;
-        case 0x39: // add hl,sp
-            cpu->hl = add16(cpu, cpu->hl, cpu->sp, 0);
-            cpu->f_n = 0;
-            break;
-        case 0x3a: // ld a,(**)
-            cpu->a = load_8(cpu, ram, imm_16(cpu, ram));
-            break;
-        case 0xbc: // cp h
-            cp_8(cpu, cpu->h);
-            break;
-        case 0x30: // jr nc,*
-            byte1 = imm_8(cpu, ram);
-            if(!cpu->f_c)
-                cpu->pc = (short)(signed char)byte1 + cpu->pc;
-            break;
-        case 0x46: // ld b,(hl)
-            cpu->b = load_8(cpu, ram, cpu->hl);
-            break;
-        case 0x24: // inc h
-            // byte2 = cpu->f_c;
-            // cpu->h = add8(cpu, cpu->h, 1, 0);
-            // cpu->f_c = byte2;
-            inc_8(cpu, &cpu->h);
-            break;
-        case 0x66: // ld h,(hl)
-            cpu->h = load_8(cpu, ram, cpu->hl);
-            break;
-        case 0x68: // ld l, b
-            cpu->l = cpu->b;
-            break;
-        case 0xe9: // jp (hl)
-            cpu->pc = cpu->hl;
-            break;
-        case 0xd9: // exx
-            tmp_ushort = cpu->bc;
-            cpu->bc = cpu->bc_prime;
-            cpu->bc_prime = tmp_ushort;
-
-            tmp_ushort = cpu->de;
-            cpu->de = cpu->de_prime;
-            cpu->de_prime = tmp_ushort;
-
-            tmp_ushort = cpu->hl;
-            cpu->hl = cpu->hl_prime;
-            cpu->hl_prime = tmp_ushort;
-
-            break;
-        case 0xaf: // xor a
-            cpu->a ^= cpu->a;
-            cpu->f_c = 0;
-            cpu->f_n = 0;
-            cpu->f_pv = parity(cpu->a);
-            cpu->f_h = 0;
-            cpu->f_z = !cpu->a;
-            cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-            break;
-        case 0xa8: // xor b
-            cpu->a ^= cpu->b;
-            cpu->f_c = 0;
-            cpu->f_n = 0;
-            cpu->f_pv = parity(cpu->a);
-            cpu->f_h = 0;
-            cpu->f_z = !cpu->a;
-            cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-            break;
-        case 0xa9: // xor e
-            cpu->a ^= cpu->e;
-            cpu->f_c = 0;
-            cpu->f_n = 0;
-            cpu->f_pv = parity(cpu->a);
-            cpu->f_h = 0;
-            cpu->f_z = !cpu->a;
-            cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-            break;
-        case 0xaa: // xor d
-            cpu->a ^= cpu->d;
-            cpu->f_c = 0;
-            cpu->f_n = 0;
-            cpu->f_pv = parity(cpu->a);
-            cpu->f_h = 0;
-            cpu->f_z = !cpu->a;
-            cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-            break;
-        case 0xab: // xor e
-            cpu->a ^= cpu->e;
-            cpu->f_c = 0;
-            cpu->f_n = 0;
-            cpu->f_pv = parity(cpu->a);
-            cpu->f_h = 0;
-            cpu->f_z = !cpu->a;
-            cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-            break;
-        case 0xac: // xor h
-            cpu->a ^= cpu->h;
-            cpu->f_c = 0;
-            cpu->f_n = 0;
-            cpu->f_pv = parity(cpu->a);
-            cpu->f_h = 0;
-            cpu->f_z = !cpu->a;
-            cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-            break;
-        case 0xad: // xor l
-            cpu->a ^= cpu->l;
-            cpu->f_c = 0;
-            cpu->f_n = 0;
-            cpu->f_pv = parity(cpu->a);
-            cpu->f_h = 0;
-            cpu->f_z = !cpu->a;
-            cpu->f_s = cpu->a >> 7; // take sign bit and put it in f_s
-            break;
-        case 0xe5: //push hl
-            push_16(cpu, ram, cpu->hl);
-            break;
-        case 0x21: // ld hl,**
-            cpu->hl = imm_16(cpu, ram);
-            break;
-        case 0x31: // ld sp,**
-            cpu->sp = imm_16(cpu, ram);
-            break;
-        case 0xcd: // call **
-            tmp_ushort = imm_16(cpu, ram);
-            push_16(cpu, ram, cpu->pc);
-            cpu->pc = tmp_ushort;
-
-            // if(cpu->pc == 5){
-            //     cpu->hl = bdos(ram, cpu->c, cpu->de);
-            //     cpu->a = cpu->l;
-            //     cpu->b = cpu->h;
-            //     cpu->pc = pop_16(cpu, ram); // Undo the push_16 above
-            // }
-
-            break;
-        case 0xf3: // di
-            // printf("Interrupts off, di instruction not written\n");
-            // fprintf(fp, "Interrupts off, di instruction not written\n");
-            break;
-        case 0x22: // ld (**), hl
-            store_16(cpu, ram, cpu->hl, imm_16(cpu, ram));
-            break;
-        case 0xe1: // pop hl
-            cpu->hl = pop_16(cpu, ram);
-            break;
-        case 0xe3: // ex (sp),hl
-            tmp_ushort = cpu->hl;
-            cpu->hl = load_16(cpu, ram, cpu->sp);
-            store_16(cpu, ram, tmp_ushort, cpu->sp);
-            break;
-        case 0xf5: // push af
-            push_16(cpu, ram, cpu->af);
-            break;
-        case 0x08: // ex af,af'
-            tmp_ushort = cpu->af;
-            cpu->af = cpu->af_prime;
-            cpu->af_prime = tmp_ushort;
-            break;
-        case 0x4d: // ld c,l
-            cpu->c = cpu->l;
-            break;
-        case 0x44: // ld b,h
-            cpu->b = cpu->h;
-            break;
-        case 0xf9: // ld sp,hl
-            cpu->sp = cpu->hl;
-            break;
-        case 0x7d: // ld a,l
-            cpu->a = cpu->l;
-            break;
-        case 0x02: // ld (bc),a
-            store_8(cpu, ram, cpu->a, cpu->bc);
-            break;
-        case 0x03: // inc bc
-            cpu->bc++;
-            break;
-        case 0x7c: // ld a,h
-            cpu->a = cpu->h;
-            break;
-        case 0xd1: // pop de
-            cpu->de = pop_16(cpu, ram);
-            break;
-        case 0x7e: // ld a,(hl)
-            cpu->a = load_8(cpu, ram, cpu->hl);
-            break;
-        case 0xb4: // or h
-            or_8(cpu, cpu->h);
-            break;
-        case 0x4f: // ld c,a
-            cpu->c = cpu->a;
-            break;
-        case 0x47: // ld b,a
-            cpu->b = cpu->a;
-            break;
-        case 0xc1: // pop bc
-            cpu->bc = pop_16(cpu, ram);
-            break;
-        case 0xb5: // or l
-            or_8(cpu, cpu->l);
-            break;
-        case 0x28: // jr z,*
-            byte1 = imm_8(cpu, ram);
-            if(cpu->f_z)
-                cpu->pc = (short)(signed char)byte1 + cpu->pc;
-            break;
-        case 0x09: // add hl,bc
-            cpu->hl = add16(cpu, cpu->hl, cpu->bc, 0);
-            cpu->f_n = 0;
-            break;
-        case 0x4e: // ld c,(hl)
-            cpu->c = load_8(cpu, ram, cpu->hl);
-            break;
-        case 0x06: // ld b,*
-            byte1 = imm_8(cpu, ram);
-            cpu->b = byte1;
-            break;
-        case 0x18: // jr *
-            byte1 = imm_8(cpu, ram);
-            cpu->pc = (short)(signed char)byte1 + cpu->pc;
-            break;
-        case 0xb7: // or a
-            or_8(cpu, cpu->a);
-            break;
-        case 0xf1: // pop af
-            cpu->af = pop_16(cpu, ram);
-            break;
-        case 0xfb: // ei
-            break;
-        case 0xea: // jp pe, **
-            tmp_ushort = imm_16(cpu, ram);
-            if (cpu->f_pv)
-                cpu->pc = tmp_ushort;
-            break;
-        case 0xe6: // and *
-            byte1 = imm_8(cpu, ram);
-            and_8(cpu, byte1);
-            break;
-        case 0x87: // add a,a
-            cpu->a = add_8(cpu, cpu->a, cpu->a);
-            break;
-        case 0xc2: // jp nz,**
-            tmp_ushort = imm_16(cpu, ram);
-            if (!cpu->f_z)
-                cpu->pc = tmp_ushort;
-            break;
-        case 0x71: // ld (hl),c
-            store_8(cpu, ram, cpu->c, cpu->hl);
-            break;
-        case 0x70: // ld (hl),b
-            store_8(cpu, ram, cpu->b, cpu->hl);
-            break;
-        case 0x73: // ld (hl),e
-            store_8(cpu, ram, cpu->e, cpu->hl);
-            break;
-        case 0x07: // rlca
-            cpu->a = cpu->a << 1 | cpu->a >> 7;
-            cpu->f_c = cpu->a & 1;
-            break;
-        case 0xcb:
-            byte1 = imm_8(cpu, ram);
-            
-            switch (byte1 & 0x07){
-            case 0:
-                ptr_u8 = &cpu->b;
-                break;
-            case 1:
-                ptr_u8 = &cpu->c;
-                break;
-            case 2:
-                ptr_u8 = &cpu->d;
-                break;
-            case 3:
-                ptr_u8 = &cpu->e;
-                break;
-            case 4:
-                ptr_u8 = &cpu->h;
-                break;
-            case 5:
-                ptr_u8 = &cpu->l;
-                break;
-            case 6:
-                ptr_u8 = cpu->hl + ram;
-                break;
-            case 7:
-                ptr_u8 = &cpu->a;
-                break;
-            default:
-                __builtin_unreachable();
-                break;
-            }
-
-            switch (byte1 >> 6){
-            case 0:
-                switch (byte1 >> 3 & 0x07){
-                case 0: // rlc
-                    byte2 = *ptr_u8;
-                    *ptr_u8 = *ptr_u8 << 1 | *ptr_u8 >> 7;
-                    cpu->f_c = byte2 >> 7;
-                    cpu->f_n = 0;
-                    cpu->f_h = 0;
-                    cpu->f_z = !*ptr_u8;
-                    cpu->f_s = *ptr_u8 >> 7;
-                    cpu->f_pv = parity(*ptr_u8);
-                    break;
-                case 1: // rrc
-                    cpu->f_c = *ptr_u8 & 1;
-                    *ptr_u8  = *ptr_u8 >> 1 | *ptr_u8 << 7;
-                    cpu->f_n = 0;
-                    cpu->f_h = 0;
-                    cpu->f_z = !*ptr_u8;
-                    cpu->f_s = *ptr_u8 >> 7;
-                    cpu->f_pv = parity(*ptr_u8);
-                    break;
-                case 2: // rl
-                    byte2 = *ptr_u8;
-                    *ptr_u8 = *ptr_u8 << 1 | cpu->f_c;
-                    cpu->f_c = byte2 >> 7;
-                    cpu->f_n = 0;
-                    cpu->f_h = 0;
-                    cpu->f_z = !*ptr_u8;
-                    cpu->f_s = *ptr_u8 >> 7;
-                    cpu->f_pv = parity(*ptr_u8);
-                    break;
-                case 3: // rr
-                    byte2 = *ptr_u8;
-                    *ptr_u8  = *ptr_u8 >> 1 | cpu->f_c << 7;
-                    cpu->f_c = byte2 & 1;
-                    cpu->f_n = 0;
-                    cpu->f_h = 0;
-                    cpu->f_z = !*ptr_u8;
-                    cpu->f_s = *ptr_u8 >> 7;
-                    cpu->f_pv = parity(*ptr_u8);
-
-                    break;
-                case 4: // sla
-                case 6: // sll ( undocumented )
-                    cpu->f_c = *ptr_u8 >> 7 & 1;
-                    *ptr_u8 <<= 1;
-                    cpu->f_n = 0;
-                    cpu->f_h = 0;
-                    cpu->f_z = !*ptr_u8;
-                    cpu->f_s = *ptr_u8 >> 7;
-                    cpu->f_pv = parity(*ptr_u8);
-                    break;
-                case 5: // sra
-                    puts("asdasd");
-                    exit(2);
-                    break;
-                case 7: // srl
-                    cpu->f_c = *ptr_u8 & 1;
-                    *ptr_u8 >>= 1;
-                    cpu->f_n = 0;
-                    cpu->f_h = 0;
-                    cpu->f_z = !*ptr_u8;
-                    cpu->f_s = *ptr_u8 >> 7;
-                    cpu->f_pv = parity(*ptr_u8);
-                    break;
-                default:
-                    __builtin_unreachable();
-                    break;
-                }
-                break;
-            case 1:
-                cpu->f_z = ~*ptr_u8 >> (byte1 >> 3 & 0x07);
-                cpu->f_h = 1;
-                cpu->f_n = 0;
-                break;
-            case 2:
-                *ptr_u8 &= ~(1 << (byte1 >> 3 & 0x07));
-                break;
-            case 3:
-                *ptr_u8 |= 1 << (byte1 >> 3 & 0x07);
-                break;
-            
-            default:
-                __builtin_unreachable();
-                break;
-            }
-            break;
-        case 0x3d: // dec a
+            NEXT;
+        OP(0x3d) // dec a
             //byte2 = cpu->f_c;
-            //cpu->a = add8(cpu, cpu->a, (unsigned char)~1, 1);
+            //A = add8(cpu, A, (unsigned char)~1, 1);
             //cpu->f_c = byte2;
-            dec_8(cpu, &cpu->a);
-            break;
-        case 0x20: // jr nz,*
-            byte1 = imm_8(cpu, ram);
-            if(!cpu->f_z)
-                cpu->pc = (short)(signed char)byte1 + cpu->pc;
-            break;
-        case 0x69: // ld l,c
-            cpu->l = cpu->c;
-            break;
-        case 0x6c: // ld l,h
-            cpu->l = cpu->h;
-            break;
-        case 0x6d: // ld l,l
-            cpu->l = cpu->l;
-            break;
-        case 0x60: // ld h,b
-            cpu->h = cpu->b;
-            break;
-        case 0x37: // scf
+            A = dec_8(cpu, A);
+            NEXT;
+        OP(0x20) // jr nz,*
+            byte1 = FETCH_8();
+            if(!flag_z(cpu)){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+        OP(0x69) // ld l,c
+            L = C;
+            NEXT;
+        OP(0x6c) // ld l,h
+            L = H;
+            NEXT;
+        OP(0x6d) // ld l,l
+            L = L;
+            NEXT;
+        OP(0x60) // ld h,b
+            H = B;
+            NEXT;
+        OP(0x37) // scf
+            flags_commit(cpu);
             cpu->f_n = 0;
             cpu->f_h = 0;
             cpu->f_c = 1;
-            break;
-        case 0xc9: // ret
-            cpu->pc = pop_16(cpu,ram);
+            NEXT;
+        OP(0xc9) // ret
+            PC = POP_16();
 
             // If the return was from a bios/bdos placeholder in mem, do the bios/bdos stuff
-            if(oldpc >= BDOS_BASE)
-                do_bios_or_bdos(cpu, ram, oldpc);
-            break;
-        case 0xd8: // ret c
-            if (cpu->f_c)
-                cpu->pc = pop_16(cpu,ram);
-            break;
-		case 0xd0: // ret nc
-            if (!cpu->f_c)
-                cpu->pc = pop_16(cpu,ram);
-            break;
-        case 0xc8: // ret z
-            if (cpu->f_z)
-                cpu->pc = pop_16(cpu,ram);
-            break;
-        case 0xc0: // ret nz
-            if (!cpu->f_z)
-                cpu->pc = pop_16(cpu,ram);
-            break;
-        case 0x7a: // ld a,d
-            cpu->a = cpu->d;
-            break;
-		case 0x5a: // ld e,d
-			cpu->e = cpu->d;
-			break;
-		case 0x53: // ld d,e
-			cpu->d = cpu->e;
-			break;
-        case 0xb3: // or e
-            or_8(cpu, cpu->e);
-            break;
-        case 0x38: // jr c,*
-            byte1 = imm_8(cpu, ram);
-            if(cpu->f_c)
-                cpu->pc = (short)(signed char)byte1 + cpu->pc;
-            break;
-        case 0x75: // ld (hl),l
-            store_8(cpu, ram, cpu->l, cpu->hl);
-            break;
-        case 0x77: // ld (hl),a
-            store_8(cpu, ram, cpu->a, cpu->hl);
-            break;
-        case 0x11: // ld de,**
-            cpu->de = imm_16(cpu, ram);
-            break;
-        case 0x12: // ld (de),a
-            store_8(cpu, ram, cpu->a, cpu->de);
-            break;
-        case 0x5d: // ld e,l
-            cpu->e = cpu->l;
-            break;
-        case 0x54: // ld d,h
-            cpu->d = cpu->h;
-            break;
-        case 0x0b: // dec bc
-            cpu->bc--;
-            break;
-        case 0x36: // ld (hl),*
-            store_8(cpu, ram, imm_8(cpu, ram), cpu->hl);
-            break;
-        case 0x5f: // ld e,a
-            cpu->e = cpu->a;
-            break;
-        case 0x6e: // ld l,(hl)
-            cpu->l = load_8(cpu, ram, cpu->hl);
-            break;
-        case 0x16: // ld d,*
-            cpu->d = imm_8(cpu, ram);
-            break;
-        case 0x1c: // inc e
-            inc_8(cpu, &cpu->e);
-            break;
-        case 0x1d: // dec e
-            dec_8(cpu, &cpu->e);
-            break;
-        case 0x78: // ld a,b
-            cpu->a = cpu->b;
-            break;
-        case 0xb1: // or c
-            or_8(cpu, cpu->c);
-            break;
-        case 0x57: // ld d,a
-            cpu->d = cpu->a;
-            break;
-        case 0x8e: // adc a,(hl)
-            // cpu->a = add8(cpu, cpu->a, load_16(cpu, ram, cpu->hl), cpu->f_c);
+            if(oldpc >= BDOS_BASE){
+                SPILL();
+                do_bios_or_bdos(m, oldpc);
+                RELOAD();
+            }
+            NEXT;
+        OP(0xd8) // ret c
+            if (flag_c(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0xd0) // ret nc
+            if (!flag_c(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0xc8) // ret z
+            if (flag_z(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0xc0) // ret nz
+            if (!flag_z(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0x7a) // ld a,d
+            A = D;
+            NEXT;
+        OP(0x5a) // ld e,d
+            E = D;
+            NEXT;
+        OP(0x53) // ld d,e
+            D = E;
+            NEXT;
+        OP(0xb3) // or e
+            A = or_8(cpu, A, E);
+            NEXT;
+        OP(0x38) // jr c,*
+            byte1 = FETCH_8();
+            if(flag_c(cpu)){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+        OP(0x75) // ld (hl),l
+            store_8(cpu, ram, L, HL);
+            NEXT;
+        OP(0x77) // ld (hl),a
+            store_8(cpu, ram, A, HL);
+            NEXT;
+        OP(0x11) // ld de,**
+            DE = FETCH_16();
+            NEXT;
+        OP(0x12) // ld (de),a
+            store_8(cpu, ram, A, DE);
+            NEXT;
+        OP(0x5d) // ld e,l
+            E = L;
+            NEXT;
+        OP(0x54) // ld d,h
+            D = H;
+            NEXT;
+        OP(0x0b) // dec bc
+            BC--;
+            NEXT;
+        OP(0x36) // ld (hl),*
+            store_8(cpu, ram, FETCH_8(), HL);
+            NEXT;
+        OP(0x5f) // ld e,a
+            E = A;
+            NEXT;
+        OP(0x6e) // ld l,(hl)
+            L = load_8(cpu, ram, HL);
+            NEXT;
+        OP(0x16) // ld d,*
+            D = FETCH_8();
+            NEXT;
+        OP(0x1c) // inc e
+            E = inc_8(cpu, E);
+            NEXT;
+        OP(0x1d) // dec e
+            E = dec_8(cpu, E);
+            NEXT;
+        OP(0x78) // ld a,b
+            A = B;
+            NEXT;
+        OP(0xb1) // or c
+            A = or_8(cpu, A, C);
+            NEXT;
+        OP(0x57) // ld d,a
+            D = A;
+            NEXT;
+        OP(0x8e) // adc a,(hl)
+            // A = add8(cpu, A, load_16(cpu, ram, HL), cpu->f_c);
             // cpu->f_n = 0;
-            adc_8(cpu, &cpu->a, load_8(cpu, ram, cpu->hl));
-            break;
-        case 0xce: // adc a,*
-            adc_8(cpu, &cpu->a, imm_8(cpu, ram));
-            break;
-        case 0x04: // inc b
+            A = adc_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0xce) // adc a,*
+            A = adc_8(cpu, A, FETCH_8());
+            NEXT;
+        OP(0x04) // inc b
             // byte2 = cpu->f_c;
-            // cpu->b = add8(cpu, cpu->b, 1, 0);
+            // B = add8(cpu, B, 1, 0);
             // cpu->f_c = byte2;
-            inc_8(cpu, &cpu->b);
-            break;
-        case 0xd2: // jp nc,**
-            tmp_ushort = imm_16(cpu, ram);
-            if (!cpu->f_c)
-                cpu->pc = tmp_ushort;
-            break;
-        case 0x72: // ld (hl),d
-            store_8(cpu, ram, cpu->d, cpu->hl);
-            break;
-        case 0x1f: // rra
+            B = inc_8(cpu, B);
+            NEXT;
+        OP(0xd2) // jp nc,**
+            tmp_ushort = FETCH_16();
+            if (!flag_c(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0x72) // ld (hl),d
+            store_8(cpu, ram, D, HL);
+            NEXT;
+        OP(0x1f) // rra
+            flags_commit(cpu);
             tmp_uchar = cpu->f_c;
-            cpu->f_c = cpu->a;
-            cpu->a = cpu->a >> 1 | tmp_uchar << 7;
+            cpu->f_c = A;
+            A = A >> 1 | tmp_uchar << 7;
             cpu->f_n = 0;
             cpu->f_h = 0;
-            break;
-        case 0xdc: // call c,**
-            tmp_ushort = imm_16(cpu, ram);
-            if(cpu->f_c){
-                push_16(cpu, ram, cpu->pc);
-                cpu->pc = tmp_ushort;
+            NEXT;
+        OP(0xdc) // call c,**
+            tmp_ushort = FETCH_16();
+            if(flag_c(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
             }
-            break;
-		case 0xc4: // call nz,**
-            tmp_ushort = imm_16(cpu, ram);
-            if(!cpu->f_z){
-                push_16(cpu, ram, cpu->pc);
-                cpu->pc = tmp_ushort;
+            NEXT;
+        OP(0xc4) // call nz,**
+            tmp_ushort = FETCH_16();
+            if(!flag_z(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
             }
-            break;
-        case 0xbd: // cp l
-            cp_8(cpu, cpu->l);
-            break;
-        case 0x2f: // cpl
-            cpu->a = ~cpu->a;
+            NEXT;
+        OP(0xbd) // cp l
+            cp_8(cpu, A, L);
+            NEXT;
+        OP(0x2f) // cpl
+            A = ~A;
+            flags_commit(cpu);
             cpu->f_n = 1;
             cpu->f_h = 1;
-            break;
-        case 0xd6: // sub *
-            byte1 = imm_8(cpu, ram);
-            cpu->a = sub_8(cpu, byte1);
-            break;
-        case 0x29: // add hl,hl
-            cpu->hl = add16(cpu, cpu->hl, cpu->hl, 0);
+            NEXT;
+        OP(0xd6) // sub *
+            byte1 = FETCH_8();
+            A = sub_8(cpu, A, byte1);
+            NEXT;
+        OP(0x29) // add hl,hl
+            HL = add16(cpu, HL, HL, 0);
+            NEXT;
+        OP(0x3c) // inc a
+            A = inc_8(cpu, A);
+            NEXT;
+        OP(0x8f) // adc a,a
+            A = adc_8(cpu, A, A);
+            NEXT;
+        OP(0x14) // inc d
+            D = inc_8(cpu, D);
+            NEXT;
+        OP(0x2c) // inc l
+            L = inc_8(cpu, L);
+            NEXT;
+        OP(0xb0) // or b
+            A = or_8(cpu, A, B);
+            NEXT;
+        OP(0xde) // sbc a,*
+            byte1 = FETCH_8();
+            A = sbc_8(cpu, A, byte1);
+            NEXT;
+        OP(0x98) // sbc a,b
+            A = sbc_8(cpu, A, B);
+            NEXT;
+        OP(0x99) // sbc a,c
+            A = sbc_8(cpu, A, C);
+            NEXT;
+        OP(0x9a) // sbc a,d
+            A = sbc_8(cpu, A, D);
+            NEXT;
+        OP(0x9b) // sbc a,e
+            A = sbc_8(cpu, A, E);
+            NEXT;
+        OP(0x9c) // sbc a,h
+            A = sbc_8(cpu, A, H);
+            NEXT;
+        OP(0x9d) // sbc a,l
+            A = sbc_8(cpu, A, L);
+            NEXT;
+        OP(0xa1) // and c
+            A = and_8(cpu, A, C);
+            NEXT;
+        OP(0xa0) // and b
+            A = and_8(cpu, A, B);
+            NEXT;
+        OP(0x0a) // ld a,(bc)
+            A = load_8(cpu, ram, BC);
+            NEXT;
+        OP(0x0c) // inc c
+            C = inc_8(cpu, C);
+            NEXT;
+        OP(0x0d) // dec c
+            C = dec_8(cpu, C);
+            NEXT;
+        OP(0x15) // dec d
+            D = dec_8(cpu, D);
+            NEXT;
+        OP(0xbe) // cp (hl)
+            cp_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0x05) // dec b
+            B = dec_8(cpu, B);
+            NEXT;
+        OP(0x6b) // ld l,e
+            L = E;
+            NEXT;
+        OP(0x58) // ld e,b
+            E = B;
+            NEXT;
+        OP(0x61) // ld h,c
+            H = C;
+            NEXT;
+        OP(0x62) // ld h,d
+            H = D;
+            NEXT;
+        OP(0x63) // ld h,e
+            H = E;
+            NEXT;
+        OP(0x64) // ld h,h
+            H = H;
+            NEXT;
+        OP(0x65) // ld h,l
+            H = L;
+            NEXT;
+        OP(0x67) // ld h,a
+            H = A;
+            NEXT;
+        OP(0x10) // djnz *
+            byte1 = FETCH_8();
+            if(--B){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+        OP(0x90) // sub b
+            A = sub_8(cpu, A, B);
+            NEXT;
+        OP(0x91) // sub c
+            A = sub_8(cpu, A, C);
+            NEXT;
+        OP(0x92) // sub d
+            A = sub_8(cpu, A, D);
+            NEXT;
+        OP(0x93) // sub e
+            A = sub_8(cpu, A, E);
+            NEXT;
+        OP(0x94) // sub h
+            A = sub_8(cpu, A, H);
+            NEXT;
+        OP(0x95) // sub l
+            A = sub_8(cpu, A, L);
+            NEXT;
+        OP(0x97) // sub a
+            A = sub_8(cpu, A, A);
+            NEXT;
+        OP(0xc6) // add a,*
+            byte1 = FETCH_8();
+            A = add_8(cpu, byte1, A);
+            NEXT;
+        OP(0x83) // add a,e
+            A = add_8(cpu, E, A);
+            NEXT;
+        OP(0x79) // ld a,c
+            A = C;
+            NEXT;
+        OP(0x7b) // ld a,e
+            A = E;
+            NEXT;
+        OP(0x34) // inc (hl)
+            byte1 = load_8(cpu, ram, HL);
+            byte1 = inc_8(cpu, byte1);
+            store_8(cpu, ram, byte1, HL);
+            NEXT;
+        OP(0x1e) // ld e,*
+            byte1 = FETCH_8();
+            E = byte1;
+            NEXT;
+        OP(0x2e) // ld l,*
+            byte1 = FETCH_8();
+            L = byte1;
+            NEXT;
+        OP(0x0e) // ld c,*
+            byte1 = FETCH_8();
+            C = byte1;
+            NEXT;
+        OP(0x3f) // ccf
+            flags_commit(cpu);
+            cpu->f_h = cpu->f_c;
+            cpu->f_c = !cpu->f_c;
+            NEXT;
+        // The rest of the 8080 set, which a real CCP and BDOS need
+        OP(0x0f) // rrca
+            A = A >> 1 | A << 7;
+            flags_commit(cpu);
+            cpu->f_c = A >> 7;
             cpu->f_n = 0;
+            cpu->f_h = 0;
+            NEXT;
+        OP(0x17) // rla
+            flags_commit(cpu);
+            tmp_uchar = cpu->f_c;
+            cpu->f_c = A >> 7;
+            A = A << 1 | tmp_uchar;
+            cpu->f_n = 0;
+            cpu->f_h = 0;
+            NEXT;
+        OP(0x1b) // dec de
+            DE--;
+            NEXT;
+        OP(0x33) // inc sp
+            SP++;
+            NEXT;
+        OP(0x3b) // dec sp
+            SP--;
+            NEXT;
+        OP(0x25) // dec h
+            H = dec_8(cpu, H);
+            NEXT;
+        OP(0x2d) // dec l
+            L = dec_8(cpu, L);
+            NEXT;
+        OP(0x35) // dec (hl)
+            byte1 = load_8(cpu, ram, HL);
+            byte1 = dec_8(cpu, byte1);
+            store_8(cpu, ram, byte1, HL);
+            NEXT;
+        OP(0x27) // daa
+            A = daa_8(cpu, A);
+            NEXT;
+        OP(0x40) // ld b,b
+            B = B;
+            NEXT;
+        OP(0x41) // ld b,c
+            B = C;
+            NEXT;
+        OP(0x42) // ld b,d
+            B = D;
+            NEXT;
+        OP(0x43) // ld b,e
+            B = E;
+            NEXT;
+        OP(0x45) // ld b,l
+            B = L;
+            NEXT;
+        OP(0x48) // ld c,b
+            C = B;
+            NEXT;
+        OP(0x49) // ld c,c
+            C = C;
+            NEXT;
+        OP(0x4a) // ld c,d
+            C = D;
+            NEXT;
+        OP(0x4b) // ld c,e
+            C = E;
+            NEXT;
+        OP(0x4c) // ld c,h
+            C = H;
+            NEXT;
+        OP(0x50) // ld d,b
+            D = B;
+            NEXT;
+        OP(0x51) // ld d,c
+            D = C;
+            NEXT;
+        OP(0x52) // ld d,d
+            D = D;
+            NEXT;
+        OP(0x55) // ld d,l
+            D = L;
+            NEXT;
+        OP(0x59) // ld e,c
+            E = C;
+            NEXT;
+        OP(0x5b) // ld e,e
+            E = E;
+            NEXT;
+        OP(0x5c) // ld e,h
+            E = H;
+            NEXT;
+        OP(0x6a) // ld l,d
+            L = D;
+            NEXT;
+        OP(0x74) // ld (hl),h
+            store_8(cpu, ram, H, HL);
+            NEXT;
+        OP(0x7f) // ld a,a
+            A = A;
+            NEXT;
+        OP(0x80) // add a,b
+            A = add_8(cpu, A, B);
+            NEXT;
+        OP(0x81) // add a,c
+            A = add_8(cpu, A, C);
+            NEXT;
+        OP(0x82) // add a,d
+            A = add_8(cpu, A, D);
+            NEXT;
+        OP(0x84) // add a,h
+            A = add_8(cpu, A, H);
+            NEXT;
+        OP(0x85) // add a,l
+            A = add_8(cpu, A, L);
+            NEXT;
+        OP(0x86) // add a,(hl)
+            A = add_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0x88) // adc a,b
+            A = adc_8(cpu, A, B);
+            NEXT;
+        OP(0x89) // adc a,c
+            A = adc_8(cpu, A, C);
+            NEXT;
+        OP(0x8a) // adc a,d
+            A = adc_8(cpu, A, D);
+            NEXT;
+        OP(0x8b) // adc a,e
+            A = adc_8(cpu, A, E);
+            NEXT;
+        OP(0x8c) // adc a,h
+            A = adc_8(cpu, A, H);
+            NEXT;
+        OP(0x8d) // adc a,l
+            A = adc_8(cpu, A, L);
+            NEXT;
+        OP(0x96) // sub (hl)
+            A = sub_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0x9e) // sbc a,(hl)
+            A = sbc_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0x9f) // sbc a,a
+            A = sbc_8(cpu, A, A);
+            NEXT;
+        OP(0xa2) // and d
+            A = and_8(cpu, A, D);
+            NEXT;
+        OP(0xa3) // and e
+            A = and_8(cpu, A, E);
+            NEXT;
+        OP(0xa4) // and h
+            A = and_8(cpu, A, H);
+            NEXT;
+        OP(0xa5) // and l
+            A = and_8(cpu, A, L);
+            NEXT;
+        OP(0xa6) // and (hl)
+            A = and_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0xa7) // and a
+            A = and_8(cpu, A, A);
+            NEXT;
+        OP(0xae) // xor (hl)
+            A = xor_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0xb2) // or d
+            A = or_8(cpu, A, D);
+            NEXT;
+        OP(0xb6) // or (hl)
+            A = or_8(cpu, A, load_8(cpu, ram, HL));
+            NEXT;
+        OP(0xb8) // cp b
+            cp_8(cpu, A, B);
+            NEXT;
+        OP(0xb9) // cp c
+            cp_8(cpu, A, C);
+            NEXT;
+        OP(0xba) // cp d
+            cp_8(cpu, A, D);
+            NEXT;
+        OP(0xbb) // cp e
+            cp_8(cpu, A, E);
+            NEXT;
+        OP(0xbf) // cp a
+            cp_8(cpu, A, A);
+            NEXT;
+        OP(0xee) // xor *
+            A = xor_8(cpu, A, FETCH_8());
+            NEXT;
+        OP(0xf6) // or *
+            A = or_8(cpu, A, FETCH_8());
+            NEXT;
+        OP(0xc7) // rst 0x00
+            PUSH_16(PC);
+            PC = 0x00;
+            NEXT;
+        OP(0xcc) // call z,**
+            tmp_ushort = FETCH_16();
+            if(flag_z(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
+            }
+            NEXT;
+        OP(0xcf) // rst 0x08
+            PUSH_16(PC);
+            PC = 0x08;
+            NEXT;
+        OP(0xd4) // call nc,**
+            tmp_ushort = FETCH_16();
+            if(!flag_c(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
+            }
+            NEXT;
+        OP(0xd7) // rst 0x10
+            PUSH_16(PC);
+            PC = 0x10;
+            NEXT;
+        OP(0xdf) // rst 0x18
+            PUSH_16(PC);
+            PC = 0x18;
+            NEXT;
+        OP(0xe0) // ret po
+            if (!flag_pv(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0xe2) // jp po,**
+            tmp_ushort = FETCH_16();
+            if (!flag_pv(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0xe4) // call po,**
+            tmp_ushort = FETCH_16();
+            if(!flag_pv(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
+            }
+            NEXT;
+        OP(0xe7) // rst 0x20
+            PUSH_16(PC);
+            PC = 0x20;
+            NEXT;
+        OP(0xe8) // ret pe
+            if (flag_pv(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0xec) // call pe,**
+            tmp_ushort = FETCH_16();
+            if(flag_pv(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
+            }
+            NEXT;
+        OP(0xef) // rst 0x28
+            PUSH_16(PC);
+            PC = 0x28;
+            NEXT;
+        OP(0xf0) // ret p
+            if (!flag_s(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0xf2) // jp p,**
+            tmp_ushort = FETCH_16();
+            if (!flag_s(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0xf4) // call p,**
+            tmp_ushort = FETCH_16();
+            if(!flag_s(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
+            }
+            NEXT;
+        OP(0xf7) // rst 0x30
+            PUSH_16(PC);
+            PC = 0x30;
+            NEXT;
+        OP(0xf8) // ret m
+            if (flag_s(cpu)){
+                PC = POP_16();
+                cpu->cycles += CYCLES_RET_TAKEN;
+            }
+            NEXT;
+        OP(0xfa) // jp m,**
+            tmp_ushort = FETCH_16();
+            if (flag_s(cpu))
+                PC = tmp_ushort;
+            NEXT;
+        OP(0xfc) // call m,**
+            tmp_ushort = FETCH_16();
+            if(flag_s(cpu)){
+                CALL_TO(tmp_ushort);
+                cpu->cycles += CYCLES_CALL_TAKEN;
+            }
+            NEXT;
+        OP(0xff) // rst 0x38
+            PUSH_16(PC);
+            PC = 0x38;
+            NEXT;
+        OP(0xd3) // out (*),a
+            (void)FETCH_8(); // there are no ports, the byte goes nowhere
+            NEXT;
+        OP(0xdb) // in a,(*)
+            (void)FETCH_8();
+            A = 0xff; // nothing drives the bus
+            NEXT;
+        OP(0x76) // halt
+            // Nothing raises an interrupt, it would never go on
+            console_printf(&m->console, "Halted at 0x%04hx\n", oldpc);
+            SPILL();
+            machine_exit(m, 1);
+            NEXT;
+#if DISPATCH_FUSED
+        // Fused runs, see decode_fuse(). BEGIN_INSTRUCTION counted the first
+        // instruction and the entry has the T-states of all of them, before
+        // a branch at the end is taken. The branch tests the result it
+        // depends on rather than the flags.
+fuse_ld_a_hl_or_a_jr_z:
+            cpu->ran += 2;
+            A = load_8(cpu, ram, HL);
+            A = or_8(cpu, A, A);
+            byte1 = FETCH_8();
+            if(!A){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+fuse_ld_a_hl_add_a_e_ld_e_a:
+            cpu->ran += 2;
+            A = add_8(cpu, E, load_8(cpu, ram, HL));
+            E = A;
+            NEXT;
+fuse_inc_hl_djnz:
+            cpu->ran += 1;
+            HL++;
+            byte1 = FETCH_8();
+            if(--B){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+fuse_inc_hl_jr:
+            cpu->ran += 1;
+            HL++;
+            byte1 = FETCH_8();
+            PC = (short)(signed char)byte1 + PC;
+            NEXT;
+fuse_cp_jr_c:
+            cpu->ran += 1;
+            byte1 = FETCH_8();
+            byte2 = FETCH_8();
+            cp_8(cpu, A, byte1);
+            if(A < byte1){
+                PC = (short)(signed char)byte2 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+fuse_ld_a_l_or_h_jr_nz:
+            cpu->ran += 2;
+            A = or_8(cpu, L, H);
+            byte1 = FETCH_8();
+            if(A){
+                PC = (short)(signed char)byte1 + PC;
+                cpu->cycles += CYCLES_JR_TAKEN;
+            }
+            NEXT;
+fuse_ld_c_call:
+            cpu->ran += 1;
+            C = FETCH_8();
+            tmp_ushort = FETCH_16();
+            CALL_TO(tmp_ushort);
+            NEXT;
+#endif
+        OP_DEFAULT
+            console_printf(&m->console, "plain top level instruction\n");
+fail:
+            console_printf(&m->console, "Ran at %04hx %04hx %04hx\n",oldoldoldpc,oldoldpc,oldpc);
+            console_printf(&m->console, "Bytes %02hhx %02hhx [%02hhx] %02hhx %02hhx %02hhx at 0x%04hx after %llu run\n",
+                ram[(unsigned short)(PC-2)],
+                ram[(unsigned short)(PC-1)],
+                ram[PC],
+                ram[PC+1],
+                ram[PC+2],
+                ram[PC+3],
+                PC,
+                cpu->ran
+            );
+            console_printf(&m->console, "Unknown byte %02hhx at 0x%04hx\n", opcode, oldpc);
+            SPILL();
+            machine_exit(m, 1);
+            NEXT;
+#if !DISPATCH_THREADED
+        }
+#endif
+    }
+}
+
+#undef A
+#undef B
+#undef C
+#undef D
+#undef E
+#undef H
+#undef L
+#undef BC
+#undef DE
+#undef HL
+#undef PC
+#undef SP
+#undef IX
+#undef IY
+
+int machine_run(struct machine *m){
+    machine_hooks_changed(m); // whatever was armed before the run
+    if(!setjmp(m->exit_jump))
+        do_emulation(m); // only comes back through machine_exit()
+    console_flush(&m->console);
+    return m->exit_status;
+}
+
+// -s: print instruction count and throughput to stderr when the guest exits
+static bool print_stats;
+
+static void report_stats(const struct machine *m, struct timespec run_start){
+    const struct cpu *cpu = &m->cpu;
+    const struct console *con = &m->console;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - run_start.tv_sec) + (now.tv_nsec - run_start.tv_nsec) / 1e9;
+    fprintf(stderr, "stats: instructions=%llu cycles=%llu seconds=%.6f mips=%.3f mhz=%.3f\n",
+        cpu->ran,
+        cpu->cycles,
+        seconds,
+        seconds > 0 ? cpu->ran / seconds / 1e6 : 0.0,
+        seconds > 0 ? cpu->cycles / seconds / 1e6 : 0.0
+    );
+    fprintf(stderr, "console: bytes=%llu writes=%llu writes_per_mb=%.1f\n",
+        con->bytes,
+        con->writes,
+        con->bytes ? con->writes * 1048576.0 / con->bytes : 0.0
+    );
+    if(m->fs.records)
+        fprintf(stderr, "files: records=%llu host_calls=%llu\n", m->fs.records, m->fs.host_calls);
+    if(m->decoded)
+        fprintf(stderr, "decode: decodes=%llu invalidations=%llu fused=%llu\n", m->decoded->decodes, m->decoded->invalidations, m->decoded->fused);
+    if(m->native)
+        fprintf(stderr, "native: calls=%llu verified=%llu\n", m->native->calls, m->native->verified);
+    if(m->disks.n)
+        fprintf(stderr, "disks: reads=%llu writes=%llu\n", m->disks.reads, m->disks.writes);
+    if(m->ccp.warm_loads)
+        fprintf(stderr, "ccp: warm_loads=%llu\n", m->ccp.warm_loads);
+}
+
+// The arguments joined by blanks, as much of them as a command tail holds.
+// NULL when there are none.
+static const char *command_tail(const char *const *arguments, char tail[CCP_LINE + 1]){
+    size_t n = 0;
+    if(!arguments[0])
+        return NULL;
+    tail[0] = '\0';
+    for(; *arguments && n < CCP_LINE; arguments++)
+        n += snprintf(tail + n, CCP_LINE + 1 - n, "%s%s", n ? " " : "", *arguments);
+    return tail;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "usage: %s [-s] [-j | -c mhz | -N run|verify] [-b] [-M] [-d dir] [-i image[:format]]... [-t records] [-P report [-y symbols]]\n", name);
+    fprintf(stderr, "       [-S file:pc=addr | -S file:ran=count | -F socket[:pc=addr|:ran=count]] [-C commands]\n");
+    fprintf(stderr, "       {program.com [argument]... | -R file | -C commands | -B}\n");
+    fprintf(stderr, "       %s -f socket [argument]...\n", name);
+    fprintf(stderr, "       %s [-s] [-j] [-t records] -p threads jobs.txt\n", name);
+    fprintf(stderr, "  -s  print instructions run, T-states, MIPS, effective MHz and console\n");
+    fprintf(stderr, "      writes on exit\n");
+    fprintf(stderr, "  -j  translate guest code to x86-64 and run that\n");
+    fprintf(stderr, "  -c  run no faster than a Z80 at this clock, in MHz (2, 4, 8...)\n");
+    fprintf(stderr, "  -N  run the library routines native.c knows in C when they are called\n");
+    fprintf(stderr, "      (run), or run them both ways and stop if the results differ (verify)\n");
+    fprintf(stderr, "  -b  batch output, no flush per line even on a terminal\n");
+    fprintf(stderr, "  -M  keep guest memory in ram.bin, writers.bin and mem_tracker.bin in the\n");
+    fprintf(stderr, "      current directory, for looking at from outside while it runs\n");
+    fprintf(stderr, "  -d  host directory for the guest's files, default the current one\n");
+    fprintf(stderr, "  -i  disk image behind the BIOS disk functions, one per drive from A:,\n");
+    fprintf(stderr, "      format is ibm-3740 (default) or 4mb-hd, then key=value overrides for\n");
+    fprintf(stderr, "      tracks, sectors, skew, first, block, dirs, boot and fixed\n");
+    fprintf(stderr, "  -B  boot the CP/M 2.2 on drive A:'s system tracks, its CCP and BDOS over\n");
+    fprintf(stderr, "      the BIOS and disk images here, until the input ends\n");
+    fprintf(stderr, "  -t  keep the last records instructions in trace.bin, output.trace with -p,\n");
+    fprintf(stderr, "      read them with tools/trace_dump\n");
+    fprintf(stderr, "  -P  count instructions per guest address and time BDOS and BIOS calls,\n");
+    fprintf(stderr, "      write the hotspots to report on exit\n");
+    fprintf(stderr, "  -y  name routines in the report from a .SYM file or .PRN listing\n");
+    fprintf(stderr, "  -S  write a snapshot of the machine to file when it gets to the hex address\n");
+    fprintf(stderr, "      or has run count instructions, then carry on (not with -j)\n");
+    fprintf(stderr, "  -R  start from a snapshot instead of a program, the same -i images attached\n");
+    fprintf(stderr, "  -F  fork server: run to the address or count, then fork a copy of the\n");
+    fprintf(stderr, "      machine for every job sent to socket\n");
+    fprintf(stderr, "  -C  on warm boot, run the next line of commands like the CCP would, after\n");
+    fprintf(stderr, "      any $$$.SUB left by SUBMIT; exit when there are none\n");
+    fprintf(stderr, "  -f  run a job on the fork server at socket with this stdin, stdout and\n");
+    fprintf(stderr, "      directory, the arguments as its command tail\n");
+    fprintf(stderr, "  -p  run every job in jobs.txt on that many threads, one line per job:\n");
+    fprintf(stderr, "      input output program.com [argument]\n");
+}
+
+int main(int argc, char const *argv[]) {
+    const char *name = argv[0];
+    bool use_jit = false;
+    bool batch_output = false;
+    int pool_threads = 0;
+    unsigned long long trace_records = 0;
+    const char *profile_report_path = NULL;
+    const char *symbols_path = NULL;
+    const char *files_dir = NULL;
+    const char *disk_images[DISK_DRIVES];
+    int n_disk_images = 0;
+    double clock_mhz = 0;
+    const char *snapshot_spec = NULL;
+    const char *restore_path = NULL;
+    const char *server_spec = NULL;
+    const char *server_path = NULL;
+    const char *native_mode = NULL;
+    const char *commands_path = NULL;
+    bool memory_files = false;
+    bool boot_disk = false;
+    char tail[CCP_LINE + 1];
+    int opt;
+    while((opt = getopt(argc, (char *const *)argv, "sjbBMc:d:f:i:p:t:C:F:N:P:y:R:S:")) != -1){
+        switch (opt){
+        case 's':
+            print_stats = true;
+            break;
+        case 'j':
+            use_jit = true;
+            break;
+        case 'b':
+            batch_output = true;
+            break;
+        case 'M':
+            memory_files = true;
+            break;
+        case 'B':
+            boot_disk = true;
+            break;
+        case 'c':
+            clock_mhz = strtod(optarg, NULL);
+            if(!(clock_mhz > 0)){
+                usage(name);
+                return 1;
+            }
             break;
-        case 0x3c: // inc a
-            inc_8(cpu, &cpu->a);
-            break;
-        case 0x8f: // adc a,a
-            adc_8(cpu, &cpu->a, cpu->a);
-            break;
-        case 0x14: // inc d
-            inc_8(cpu, &cpu->d);
-            break;
-        case 0x2c: // inc l
-            inc_8(cpu, &cpu->l);
-            break;
-        case 0xb0: // or b
-            or_8(cpu, cpu->b);
-            break;
-        case 0xde: // sbc a,*
-            byte1 = imm_8(cpu, ram);
-            cpu->a = sbc_8(cpu, byte1);
-            break;
-        case 0x98: // sbc a,b
-            cpu->a = sbc_8(cpu, cpu->b);
-            break;
-        case 0x99: // sbc a,c
-            cpu->a = sbc_8(cpu, cpu->c);
-            break;
-		case 0x9a: // sbc a,d
-            cpu->a = sbc_8(cpu, cpu->d);
-            break;
-		case 0x9b: // sbc a,e
-            cpu->a = sbc_8(cpu, cpu->e);
-            break;
-		case 0x9c: // sbc a,h
-            cpu->a = sbc_8(cpu, cpu->h);
-            break;
-		case 0x9d: // sbc a,l
-            cpu->a = sbc_8(cpu, cpu->l);
-            break;
-        case 0xa1: // and c
-            and_8(cpu, cpu->c);
-            break;
-        case 0xa0: // and b
-            and_8(cpu, cpu->b);
-            break;
-        case 0x0a: // ld a,(bc)
-            cpu->a = load_8(cpu, ram, cpu->bc);
-            break;
-        case 0x0c: // inc c
-            inc_8(cpu, &cpu->c);
-            break;
-        case 0x0d: // dec c
-            dec_8(cpu, &cpu->c);
-            break;
-        case 0x15: // dec d
-            dec_8(cpu, &cpu->d);
-            break;
-        case 0xbe: // cp (hl)
-            cp_8(cpu, load_8(cpu, ram, cpu->hl));
-            break;
-        case 0x05: // dec b
-            dec_8(cpu, &cpu->b);
-            break;
-        case 0x6b: // ld l,e
-            cpu->l = cpu->e;
-            break;
-		case 0x58: // ld e,b
-			cpu->e = cpu->b;
-			break;
-        case 0x61: // ld h,c
-            cpu->h = cpu->c;
-            break;
-        case 0x62: // ld h,d
-            cpu->h = cpu->d;
-            break;
-        case 0x63: // ld h,e
-            cpu->h = cpu->e;
-            break;
-        case 0x64: // ld h,h
-            cpu->h = cpu->h;
-            break;
-        case 0x65: // ld h,l
-            cpu->h = cpu->l;
-            break;
-        case 0x67: // ld h,a
-            cpu->h = cpu->a;
-            break;
-        case 0x10: // djnz *
-            byte1 = imm_8(cpu, ram);
-            if(--cpu->b)
-                cpu->pc = (short)(signed char)byte1 + cpu->pc;
-            break;
-		case 0x90: // sub b
-            cpu->a = sub_8(cpu, cpu->b);
-            break;
-		case 0x91: // sub c
-            cpu->a = sub_8(cpu, cpu->c);
-            break;
-		case 0x92: // sub d
-            cpu->a = sub_8(cpu, cpu->d);
-            break;
-		case 0x93: // sub e
-            cpu->a = sub_8(cpu, cpu->e);
-            break;
-		case 0x94: // sub h
-            cpu->a = sub_8(cpu, cpu->h);
+        case 't':
+            trace_records = strtoull(optarg, NULL, 0);
+            if(!trace_records){
+                usage(name);
+                return 1;
+            }
             break;
-		case 0x95: // sub l
-            cpu->a = sub_8(cpu, cpu->l);
+        case 'd':
+            files_dir = optarg;
             break;
-        case 0x97: // sub a
-            cpu->a = sub_8(cpu, cpu->a);
+        case 'i':
+            if(n_disk_images == DISK_DRIVES){
+                usage(name);
+                return 1;
+            }
+            disk_images[n_disk_images++] = optarg;
             break;
-        case 0xc6: // add a,*
-            byte1 = imm_8(cpu, ram);
-            cpu->a = add_8(cpu, byte1, cpu->a);
+        case 'P':
+            profile_report_path = optarg;
             break;
-        case 0x83: // add a,e
-            cpu->a = add_8(cpu, cpu->e, cpu->a);
+        case 'y':
+            symbols_path = optarg;
             break;
-        case 0x79: // ld a,c
-            cpu->a = cpu->c;
+        case 'S':
+            snapshot_spec = optarg;
             break;
-        case 0x7b: // ld a,e
-            cpu->a = cpu->e;
+        case 'R':
+            restore_path = optarg;
             break;
-        case 0x34: // inc (hl)
-            inc_8(cpu, ram + cpu->hl);
+        case 'F':
+            server_spec = optarg;
             break;
-        case 0x1e: // ld e,*
-            byte1 = imm_8(cpu, ram);
-            cpu->e = byte1;
+        case 'f':
+            server_path = optarg;
             break;
-        case 0x2e: // ld l,*
-            byte1 = imm_8(cpu, ram);
-            cpu->l = byte1;
+        case 'N':
+            native_mode = optarg;
             break;
-        case 0x0e: // ld c,*
-            byte1 = imm_8(cpu, ram);
-            cpu->c = byte1;
+        case 'C':
+            commands_path = optarg;
             break;
-        case 0x3f: // ccf
-            cpu->f_h = cpu->f_c;
-            cpu->f_c = !cpu->f_c;
+        case 'p':
+            pool_threads = atoi(optarg);
+            if(pool_threads < 1){
+                usage(name);
+                return 1;
+            }
             break;
         default:
-            puts("plain top level instruction");
-fail:
-            printf("Ran at %04hx %04hx %04hx\n",oldoldoldpc,oldoldpc,oldpc);
-            printf("Bytes %02hhx %02hhx [%02hhx] %02hhx %02hhx %02hhx at 0x%04hx after %llu run\n",
-                ram[(unsigned short)(cpu->pc-2)],
-                ram[(unsigned short)(cpu->pc-1)],
-                ram[cpu->pc],
-                ram[cpu->pc+1],
-                ram[cpu->pc+2],
-                ram[cpu->pc+3],
-                cpu->pc,
-                ran
-            );
-            printf("Unknown byte %02hhx at 0x%04hx\n", opcode, oldpc);
-            exit(1);
-            break;
+            usage(name);
+            return 1;
         }
     }
+    argv += optind - 1; // argv[1] is the program, argv[2] on its arguments, like before options existed
 
-    fclose(fp);
-}
+#if DISPATCH_PREDECODED
+    if(use_jit){ // machine_new() refuses it, the JIT's stores would leave stale decoded instructions behind
+        fprintf(stderr, "-j does not work with the predecoded core (DISPATCH_PREDECODED), run without -j\n");
+        return 1;
+    }
+#endif
+
+    if(server_path) // the job runs in the server
+        return server_request(server_path, command_tail(argv + 1, tail));
+
+    if(pool_threads){
+        if(!argv[1] || profile_report_path || files_dir || n_disk_images || clock_mhz || snapshot_spec || restore_path || server_spec || memory_files || native_mode || commands_path || boot_disk){ // single runs only
+            usage(name);
+            return 1;
+        }
+        return pool_run_file(argv[1], pool_threads, use_jit, trace_records, print_stats);
+    }
+
+    if(use_jit && (clock_mhz || snapshot_spec || native_mode)){ // translated code does not stop to look at the clock, pc or calls
+        usage(name);
+        return 1;
+    }
+    if(restore_path && argv[1]){ // the snapshot has the program in it
+        usage(name);
+        return 1;
+    }
+    if(boot_disk && (argv[1] || restore_path || commands_path || snapshot_spec || server_spec)){ // the system on the disk runs the programs, snapshots do not know where it is
+        usage(name);
+        return 1;
+    }
+    if(server_spec && (memory_files || snapshot_spec || trace_records || profile_report_path || n_disk_images || commands_path)){ // one ready point, nothing the jobs would share
+        usage(name);
+        return 1;
+    }
+    if(server_spec && use_jit && strchr(server_spec, '=')){ // translated code does not stop at each pc
+        usage(name);
+        return 1;
+    }
 
-int main(int argc, char const *argv[]) {
-    (void)argc;
     termio_stuff();
     //unsigned char ram[65536 + 3] = {0}; // 3 for printing opcode bytes easily
-    unsigned char *ram = map_a_new_file_shared("ram.bin", RAM_SIZE);
-    memset(ram, 0x76, RAM_SIZE); // Set all of ram to the HALT instruction
-    writers = map_a_new_file_shared("writers.bin", RAM_SIZE * sizeof(short)); // debug stuff
-    mem_tracker = map_a_new_file_shared("mem_tracker.bin", RAM_SIZE); // debug stuff
+    struct machine *m = machine_new(memory_files, use_jit, STDIN_FILENO, STDOUT_FILENO);
+    if(!m){
+        fprintf(stderr, "No JIT for this host, run without -j\n");
+        return 1;
+    }
+    if(batch_output)
+        m->console.interactive = false;
+    if(files_dir){
+        fs_free(&m->fs);
+        if(!fs_init(&m->fs, files_dir)){
+            fprintf(stderr, "%s: can not open the directory\n", files_dir);
+            return 1;
+        }
+    }
+    for(int i = 0; i < n_disk_images; i++){
+        if(!disk_attach(&m->disks, disk_images[i]))
+            return 1;
+    }
+    if(trace_records && !(m->trace = trace_open("trace.bin", trace_records))){
+        fprintf(stderr, "Can not trace that many instructions\n");
+        return 1;
+    }
+    if(native_mode && !(m->native = native_new(native_mode)))
+        return 1;
+    if(commands_path && !ccp_open(&m->ccp, commands_path)){
+        fprintf(stderr, "%s: can not read the commands\n", commands_path);
+        return 1;
+    }
+    if(profile_report_path){
+        m->profile = profile_new();
+        if(symbols_path && !profile_load_symbols(m->profile, symbols_path)){
+            fprintf(stderr, "%s: can not read symbols\n", symbols_path);
+            return 1;
+        }
+    }
 
+    if(snapshot_spec && !snapshot_at(m, snapshot_spec))
+        return 1;
+    if(server_spec && !server_listen(m, server_spec))
+        return 1;
 
-    FILE *fp = fopen(argv[1], "rb");
-    if (!fp){
+    if(restore_path){
+        if(!snapshot_restore(m, restore_path))
+            return 1;
+    }else if(boot_disk){
+        if(!machine_boot_disk(m))
+            return 1;
+    }else if(argv[1] ? !machine_load(m, argv[1], command_tail(argv + 2, tail)) : !machine_boot(m)){
+        console_flush(&m->console); // what the CCP had to say about it
         puts("No input file");
         return 1;
-    }else{
-        printf("got %zd bytes\n", fread(ram + 256, 1, RAM_SIZE - PROGRAM_START, fp));
-        fclose(fp);
     }
-    
-    // Initialize CPU
-    struct cpu _cpu;
-    struct cpu *cpu = &_cpu;
-    memset(cpu, 0, sizeof *cpu);
-
-    setup_bios_and_bdos(cpu, ram, argv);
-    do_emulation(cpu, ram);
 
-    return 0;
+    struct timespec run_start;
+    clock_gettime(CLOCK_MONOTONIC, &run_start);
+    if(clock_mhz)
+        throttle_start(m, clock_mhz * 1e6);
+    int status = machine_run(m);
+    if(m->job_fd != -1)
+        server_reply(m, status);
+    if(print_stats)
+        report_stats(m, run_start);
+    if(m->profile && !profile_report(m->profile, profile_report_path))
+        fprintf(stderr, "%s: can not write the profile\n", profile_report_path);
+
+    machine_free(m);
+    return status;
 }
 
 
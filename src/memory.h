@@ -0,0 +1,222 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "machine.h"
+#include "jit.h"
+#include "decode.h"
+
+// Guest memory accessors, shared by the interpreter and the JIT helpers
+
+// Debug bookkeeping, picked at build time with `make CHECKS=off`. With
+// MEMORY_CHECKS set every access updates the maps below and executing a byte
+// that was stored to stops the emulator. Without it the accessors are plain
+// ram reads and writes and the maps are never created.
+#ifndef MEMORY_CHECKS
+#define MEMORY_CHECKS 1
+#endif
+
+// The debug maps live in struct machine, one entry per guest address.
+// mem_tracker bits: 0x01 read, 0x02 written, 0x04 executed. writers holds the
+// pc of the last store.
+
+// ram is mapped twice back to back (see machine_new()), so ram[0x10000] is
+// ram[0] again. A 16-bit access is one unaligned host access even at 0xffff
+// and a run of bytes is one memcpy across the wrap. The debug maps and code
+// maps have no mirror and still wrap by hand. Little endian host, like the
+// register unions in cpu.h.
+static inline unsigned short host_load_16(const unsigned char *p){
+    unsigned short val;
+    memcpy(&val, p, sizeof val);
+    return val;
+}
+
+static inline void host_store_16(unsigned char *p, unsigned short val){
+    memcpy(p, &val, sizeof val);
+}
+
+static inline unsigned char load_8(struct cpu *restrict const cpu, const unsigned char *restrict const ram, unsigned short addr){
+    (void)cpu; // I like handing cpu even though I am not using it
+    unsigned char byte1 = ram[addr];
+#if MEMORY_CHECKS
+    machine_of(cpu)->mem_tracker[addr] |= 0x01;
+#endif
+    return byte1;
+}
+
+static inline void store_8(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned char val, unsigned short addr){
+    struct machine *m = machine_of(cpu);
+    ram[addr] = val; // write low bits
+
+#if MEMORY_CHECKS
+    m->mem_tracker[addr] |= 0x02;
+    m->writers[addr] = cpu->pc;
+#endif
+
+    if(m->code_map[addr]) // overwrote translated code
+        jit_invalidate(m->jit, addr);
+#if DISPATCH_PREDECODED
+    if(m->decoded->map[addr]) // overwrote decoded code
+        decode_invalidate(m->decoded, addr);
+#endif
+}
+
+// The code byte at addr. Cores that keep pc out of struct cpu fetch through
+// this, the others through imm_8().
+static inline unsigned char fetch_8(struct cpu *restrict const cpu, const unsigned char *restrict const ram, unsigned short addr){
+    (void)cpu;
+    unsigned char low = ram[addr];
+#if MEMORY_CHECKS
+    struct machine *m = machine_of(cpu);
+    m->mem_tracker[addr] |= 0x04;
+
+    if(m->mem_tracker[addr] & 0x02){
+        // if this happens that means the bytes after pc has been written too. If the executalbe section
+        // in ram is written to, bad stuff is probably happening.
+        console_printf(&m->console, "Detected bad stuff, address %04hx last written by %04hx\n", addr, m->writers[addr]);
+        machine_exit(m, 44);
+    }
+#endif
+
+    return low;
+}
+
+static inline unsigned char imm_8(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
+    return fetch_8(cpu, ram, cpu->pc++);
+}
+
+// For the JIT, which reads code bytes without imm_8. A byte that was stored
+// to is left for imm_8 to report.
+static inline bool fetch_ok(struct cpu *cpu, unsigned short addr){
+#if MEMORY_CHECKS
+    return !(machine_of(cpu)->mem_tracker[addr] & 0x02);
+#else
+    (void)cpu;
+    (void)addr;
+    return true;
+#endif
+}
+
+static inline void mark_executed(struct cpu *cpu, unsigned short addr){
+#if MEMORY_CHECKS
+    machine_of(cpu)->mem_tracker[addr] |= 0x04;
+#else
+    (void)cpu;
+    (void)addr;
+#endif
+}
+
+// Host data into guest memory, wrapping at 0xffff, n at most RAM_SIZE. Like
+// loading the program, this is not a store the debug checks should complain
+// about when the bytes are run later, but translations of the old bytes have
+// to go.
+static inline void copy_to_guest(struct machine *m, unsigned short addr, const unsigned char *src, unsigned n){
+    memcpy(m->ram + addr, src, n);
+    for(unsigned i = 0; i < n; i++){
+        unsigned short a = addr + i;
+#if MEMORY_CHECKS
+        m->mem_tracker[a] &= ~0x02;
+#endif
+        if(m->code_map[a])
+            jit_invalidate(m->jit, a);
+#if DISPATCH_PREDECODED
+        if(m->decoded->map[a])
+            decode_invalidate(m->decoded, a);
+#endif
+    }
+}
+
+static inline void copy_from_guest(const struct machine *m, unsigned short addr, unsigned char *dst, unsigned n){
+    memcpy(dst, m->ram + addr, n);
+}
+
+/*
+static void push_8(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned char val){
+    cpu->sp--;
+    store_8(cpu, ram, val, cpu->sp); // push low bits
+}
+*/
+/*
+static unsigned char pop_8(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
+    return load_8(cpu, ram,cpu->sp++);
+}
+*/
+
+static inline unsigned short load_16(struct cpu *restrict const cpu, const unsigned char *restrict const ram, unsigned short addr){
+    (void)cpu; // I like handing cpu even though I am not using it
+    unsigned short val = host_load_16(ram + addr);
+#if MEMORY_CHECKS
+    struct machine *m = machine_of(cpu);
+    m->mem_tracker[addr] |= 0x01;
+    m->mem_tracker[(unsigned short)(addr + 1)] |= 0x01;
+#endif
+    return val;
+}
+
+static inline void store_16(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned short val, unsigned short addr){
+    struct machine *m = machine_of(cpu);
+    unsigned short high = addr + 1;
+    host_store_16(ram + addr, val);
+
+#if MEMORY_CHECKS
+    m->mem_tracker[addr] |= 0x02;
+    m->mem_tracker[high] |= 0x02;
+    m->writers[addr] = cpu->pc;
+    m->writers[high] = cpu->pc;
+#endif
+
+    if(m->code_map[addr]) // overwrote translated code
+        jit_invalidate(m->jit, addr);
+    if(m->code_map[high])
+        jit_invalidate(m->jit, high);
+#if DISPATCH_PREDECODED
+    if(m->decoded->map[addr]) // overwrote decoded code
+        decode_invalidate(m->decoded, addr);
+    if(m->decoded->map[high])
+        decode_invalidate(m->decoded, high);
+#endif
+}
+
+static inline unsigned short pop_16(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
+    unsigned short tmp = load_16(cpu, ram, cpu->sp);
+    cpu->sp += 2;
+
+    return tmp;
+}
+
+static inline void push_16(struct cpu *restrict const cpu, unsigned char *restrict const ram, unsigned short val){
+    cpu->sp -= 2;
+    store_16(cpu, ram, val, cpu->sp);
+}
+
+static inline unsigned short fetch_16(struct cpu *restrict const cpu, const unsigned char *restrict const ram, unsigned short addr){
+#if MEMORY_CHECKS
+    unsigned char low = fetch_8(cpu, ram, addr); // checks each byte
+    unsigned char high = fetch_8(cpu, ram, addr + 1);
+
+    return high << 8 | low;
+#else
+    (void)cpu;
+    return host_load_16(ram + addr);
+#endif
+}
+
+static inline unsigned short imm_16(struct cpu *restrict const cpu, const unsigned char *restrict const ram){
+    unsigned short val = fetch_16(cpu, ram, cpu->pc);
+    cpu->pc += 2;
+    return val;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,335 @@
+// Native versions of guest library routines, see native.h
+//
+// Z80 compilers all link much the same runtime: a 16 bit multiply and
+// divide, block fills, string compares. Numeric jobs spend most of their
+// time in there. With -N, the first CALL to an address hashes the code
+// bytes there and looks them up in the registry below, and later calls to a
+// routine it knows run its C version instead, straight on the registers and
+// guest memory. Same registers, flags and memory afterwards, but no cycles
+// or instructions counted for the body. The C versions go through the
+// ALU helpers in cpu.h, so the flags come out the way this emulator's own
+// instructions leave them, undocumented bits included.
+//
+// A hit is checked against the whole routine on every call, a memcmp, so
+// code that was loaded over it since just runs as guest code. A miss keeps
+// the first bytes it was decided on and is looked up again once they
+// change, so a program loaded later, by the CCP or an overlay loader, gets
+// its routines found where the last one had other code. `-N verify`
+// lets the guest run the routine and then runs the C version on a copy of
+// the machine from before the call, and stops if the two disagree. It
+// finds the return with the at_stop hook (machine.h) rather than another
+// test in every RET, so it waits while -S or -F have that.
+//
+// The registry has the routines in bench/numeric.asm. A runtime's own
+// routines go in the table the same way, by their bytes. Only code without
+// absolute addresses in it can match wherever it was linked.
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "machine.h"
+#include "memory.h"
+#include "native.h"
+
+// Where a C version runs: on the machine itself, through the accessors in
+// memory.h so the debug maps and the code caches hear about it, or on the
+// copy -N verify took, plain bytes
+struct target{
+    struct cpu *cpu;
+    unsigned char *ram;
+    bool live;
+};
+
+static unsigned char get(const struct target *t, unsigned short addr){
+    return t->live ? load_8(t->cpu, t->ram, addr) : t->ram[addr];
+}
+
+static void put(const struct target *t, unsigned short addr, unsigned char val){
+    if(t->live)
+        store_8(t->cpu, t->ram, val, addr);
+    else
+        t->ram[addr] = val;
+}
+
+// HL = DE * BC, shift and add 16 times
+static void run_mul16(const struct target *t){
+    struct cpu *cpu = t->cpu;
+    unsigned hl = 0;
+    unsigned de = cpu->de;
+    unsigned char a = 16;
+
+    do{
+        hl = add16(cpu, hl, hl, 0);
+        de = add16(cpu, de, de, 0);
+        if(flag_c(cpu))
+            hl = add16(cpu, hl, cpu->bc, 0);
+        a = dec_8(cpu, a);
+    }while(a);
+    cpu->hl = hl;
+    cpu->de = de;
+    cpu->a = a;
+}
+
+// BC = BC / DE, HL = BC % DE, restoring division
+static void run_div16(const struct target *t){
+    struct cpu *cpu = t->cpu;
+    unsigned hl = 0;
+    unsigned char b = cpu->b;
+    unsigned char c = cpu->c;
+    unsigned char a = 16;
+
+    do{
+        c = cb_apply(cpu, 0x21, c); // sla c
+        b = cb_apply(cpu, 0x10, b); // rl b
+        hl = adc_16(cpu, hl, hl);
+        hl = sbc_16(cpu, hl, cpu->de);
+        if(flag_c(cpu))
+            hl = add16(cpu, hl, cpu->de, 0);
+        else
+            c = inc_8(cpu, c);
+        a = dec_8(cpu, a);
+    }while(a);
+    cpu->hl = hl;
+    cpu->b = b;
+    cpu->c = c;
+    cpu->a = a;
+}
+
+// A into the BC bytes from HL on, 65536 of them for BC 0
+static void run_fill(const struct target *t){
+    struct cpu *cpu = t->cpu;
+    unsigned n = cpu->bc ? cpu->bc : 0x10000;
+
+    for(unsigned i = 0; i < n; i++)
+        put(t, cpu->hl + i, cpu->a);
+    cpu->e = cpu->a;
+    cpu->hl += n;
+    cpu->bc = 0;
+    cpu->a = or_8(cpu, 0, 0);
+}
+
+// Compare the zero terminated strings at DE and HL, the flags of the last cp
+// or or
+static void run_strcmp(const struct target *t){
+    struct cpu *cpu = t->cpu;
+    unsigned char a;
+
+    for(;;){
+        a = get(t, cpu->de);
+        cp_8(cpu, a, get(t, cpu->hl));
+        if(!flag_z(cpu))
+            break;
+        a = or_8(cpu, a, a);
+        if(!a)
+            break;
+        cpu->hl++;
+        cpu->de++;
+    }
+    cpu->a = a;
+}
+
+struct routine{
+    const char *name;
+    unsigned char length;
+    unsigned char code[24];
+    void (*run)(const struct target *t);
+};
+
+static const struct routine routines[] = {
+    { "mul16", 16, {
+        0x21, 0x00, 0x00, 0x3e, 0x10, 0x29, 0xeb, 0x29, 0xeb, 0x30, 0x01, 0x09, 0x3d, 0x20, 0xf6, 0xc9,
+    }, run_mul16 },
+    { "div16", 23, {
+        0x21, 0x00, 0x00, 0x3e, 0x10, 0xcb, 0x21, 0xcb, 0x10, 0xed, 0x6a, 0xed, 0x52, 0x30, 0x03, 0x19,
+        0x18, 0x01, 0x0c, 0x3d, 0x20, 0xef, 0xc9,
+    }, run_div16 },
+    { "fill", 9, {
+        0x5f, 0x73, 0x23, 0x0b, 0x78, 0xb1, 0x20, 0xf9, 0xc9,
+    }, run_fill },
+    { "strcmp", 9, {
+        0x1a, 0xbe, 0xc0, 0xb7, 0xc8, 0x23, 0x13, 0x18, 0xf7,
+    }, run_strcmp },
+};
+
+#define N_ROUTINES (sizeof routines / sizeof routines[0])
+
+static uint32_t keys[N_ROUTINES]; // hash of each routine's first NATIVE_KEY bytes
+
+// FNV-1a
+static uint32_t hash(const unsigned char *code){
+    uint32_t h = 2166136261u;
+    for(int i = 0; i < NATIVE_KEY; i++)
+        h = (h ^ code[i]) * 16777619u;
+    return h;
+}
+
+struct native *native_new(const char *mode){
+    struct native *n;
+
+    if(strcmp(mode, "run") && strcmp(mode, "verify")){
+        fprintf(stderr, "%s: expected run or verify\n", mode);
+        return NULL;
+    }
+    n = calloc(1, sizeof *n);
+    if(!n){
+        puts("out of memory");
+        exit(1);
+    }
+    n->mode = strcmp(mode, "run") ? NATIVE_VERIFY : NATIVE_RUN;
+    for(unsigned i = 0; i < N_ROUTINES; i++)
+        keys[i] = hash(routines[i].code);
+    return n;
+}
+
+void native_free(struct native *n){
+    free(n);
+}
+
+// The first NATIVE_KEY code bytes at addr, the mirror covers a routine across 0xffff
+static uint64_t key_bytes(const unsigned char *ram, unsigned short addr){
+    uint64_t bytes;
+    _Static_assert(NATIVE_KEY == sizeof bytes, "none_bytes holds the key bytes");
+    memcpy(&bytes, ram + addr, sizeof bytes);
+    return bytes;
+}
+
+// The routine whose code is at addr, as routine_at has it. 0, not looked at,
+// when a key matched but the rest of the routine did not, so that the next
+// call looks at all of it again.
+static unsigned char look_up(struct native *n, const unsigned char *ram, unsigned short addr){
+    uint32_t key = hash(ram + addr);
+    bool near = false;
+    for(unsigned i = 0; i < N_ROUTINES; i++){
+        if(keys[i] != key)
+            continue;
+        if(!memcmp(ram + addr, routines[i].code, routines[i].length))
+            return i + 1;
+        near = true;
+    }
+    if(near)
+        return 0;
+    n->none_bytes[addr] = key_bytes(ram, addr);
+    return NATIVE_NONE;
+}
+
+static void returned(struct machine *m);
+
+// Stop at the return address, see machine_stop_at()
+static void wait_for_return(struct machine *m){
+    m->at_stop = returned;
+    m->stop_pc = m->native->return_pc;
+    m->stop_ran = ULLONG_MAX;
+    machine_hooks_changed(m);
+}
+
+bool native_call(struct machine *m, unsigned short addr){
+    struct native *n = m->native;
+    struct cpu *cpu = &m->cpu;
+    unsigned char r;
+
+    if(n->pending) // one check at a time, the calls inside it run as they are
+        return false;
+    if(n->mode == NATIVE_VERIFY && m->at_stop) // -S or -F first, then the checks
+        return false;
+    r = n->routine_at[addr];
+    if(r == NATIVE_NONE && n->none_bytes[addr] != key_bytes(m->ram, addr)) // loaded over since
+        r = 0;
+    if(!r)
+        r = n->routine_at[addr] = look_up(n, m->ram, addr);
+    if(!r || r == NATIVE_NONE)
+        return false;
+
+    const struct routine *routine = &routines[r - 1];
+    if(memcmp(m->ram + addr, routine->code, routine->length)){ // loaded over since
+        n->routine_at[addr] = 0;
+        return false;
+    }
+    for(unsigned i = 0; i < routine->length; i++){
+        if(!fetch_ok(cpu, addr + i)) // for imm_8 to report
+            return false;
+    }
+
+    if(n->mode == NATIVE_RUN){
+        struct target live = { cpu, m->ram, true };
+        store_16(cpu, m->ram, cpu->pc, cpu->sp - 2); // what the CALL leaves below the stack
+        routine->run(&live);
+        n->calls++;
+        return true;
+    }
+
+    // The guest runs it, returned() does the rest
+    n->pending = true;
+    n->routine = r - 1;
+    n->call_pc = addr;
+    n->return_pc = cpu->pc;
+    n->return_sp = cpu->sp;
+    n->before = *cpu;
+    memcpy(n->before_ram, m->ram, RAM_SIZE);
+    n->before_ram[(unsigned short)(cpu->sp - 2)] = cpu->pc; // the CALL's push
+    n->before_ram[(unsigned short)(cpu->sp - 1)] = cpu->pc >> 8;
+    wait_for_return(m);
+    return false;
+}
+
+static const struct{
+    const char *name;
+    size_t offset;
+} registers[] = {
+    { "af", offsetof(struct cpu, af) },
+    { "bc", offsetof(struct cpu, bc) },
+    { "de", offsetof(struct cpu, de) },
+    { "hl", offsetof(struct cpu, hl) },
+    { "ix", offsetof(struct cpu, ix) },
+    { "iy", offsetof(struct cpu, iy) },
+    { "sp", offsetof(struct cpu, sp) },
+    { "af'", offsetof(struct cpu, af_prime) },
+    { "bc'", offsetof(struct cpu, bc_prime) },
+    { "de'", offsetof(struct cpu, de_prime) },
+    { "hl'", offsetof(struct cpu, hl_prime) },
+};
+
+static unsigned short register_value(const struct cpu *cpu, size_t offset){
+    unsigned short val;
+    memcpy(&val, (const char *)cpu + offset, sizeof val);
+    return val;
+}
+
+// at_stop hook: the guest got to the return address of the call being checked
+static void returned(struct machine *m){
+    struct native *n = m->native;
+    struct cpu *cpu = &m->cpu;
+
+    if(cpu->sp != n->return_sp){ // a jump back there, or a deeper call's return
+        wait_for_return(m);
+        return;
+    }
+    n->pending = false;
+
+    const struct routine *routine = &routines[n->routine];
+    struct target copy = { &n->before, n->before_ram, false };
+    routine->run(&copy);
+    flags_commit(cpu);
+    flags_commit(&n->before);
+
+    for(unsigned i = 0; i < sizeof registers / sizeof registers[0]; i++){
+        unsigned short got = register_value(&n->before, registers[i].offset);
+        unsigned short want = register_value(cpu, registers[i].offset);
+        if(got != want){
+            console_flush(&m->console);
+            fprintf(stderr, "native: %s at %04hx left %s=%04hx, the guest %04hx\n", routine->name, n->call_pc, registers[i].name, got, want);
+            machine_exit(m, 1);
+        }
+    }
+    if(memcmp(n->before_ram, m->ram, RAM_SIZE)){
+        unsigned addr = 0;
+        while(n->before_ram[addr] == m->ram[addr])
+            addr++;
+        console_flush(&m->console);
+        fprintf(stderr, "native: %s at %04hx left %02hhx at %04x, the guest %02hhx\n", routine->name, n->call_pc, n->before_ram[addr], addr, m->ram[addr]);
+        machine_exit(m, 1);
+    }
+    n->verified++;
+}
@@ -0,0 +1,64 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Native versions of guest library routines, see native.c
+
+#define NATIVE_KEY 8      // code bytes hashed to find a routine
+#define NATIVE_NONE 0xff  // in routine_at, nothing known starts there
+
+enum native_mode{
+    NATIVE_RUN,    // -N run: calls to a known routine run the C version instead
+    NATIVE_VERIFY, // -N verify: the guest runs it, then the C version is checked against that
+};
+
+struct native{
+    enum native_mode mode;
+    // Per call target: 0 not looked at yet, NATIVE_NONE, or the routine + 1
+    unsigned char routine_at[0x10000];
+    // For NATIVE_NONE: the NATIVE_KEY code bytes it was decided on. No
+    // routine's key matched them, so until they change there is nothing to
+    // look up again.
+    uint64_t none_bytes[0x10000];
+
+    unsigned long long calls;    // run in C instead of by the guest
+    unsigned long long verified; // run both ways and found the same
+
+    // -N verify: the call being checked. The machine as it was right after
+    // the CALL, return address pushed, for the C version to run on once the
+    // guest is back at return_pc with the stack where it was. The machine's
+    // at_stop hook watches for return_pc.
+    bool pending;
+    unsigned char routine;
+    unsigned short call_pc;
+    unsigned short return_pc;
+    unsigned short return_sp;
+    struct cpu before;
+    unsigned char before_ram[0x10000];
+};
+
+struct machine;
+
+// mode is `run` or `verify`. NULL, after saying why on stderr, for anything else.
+struct native *native_new(const char *mode);
+void native_free(struct native *n);
+
+// The interpreter is about to call addr, cpu.pc is the return address.
+// True if the call has been taken care of: the routine's effects are in
+// place and cpu.pc is still the return address, as if it had returned.
+// With -N verify it is always false, and the machine stops if the C version
+// comes out different from the guest's once that returns.
+bool native_call(struct machine *m, unsigned short addr);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
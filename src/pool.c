@@ -0,0 +1,284 @@
+// Many machines at once
+//
+// Every job is a whole guest run: its own struct machine, console input file
+// and console output file. Workers each own a deque of job numbers. A worker
+// takes work from the top of its own deque and, once that is empty, steals
+// from the bottom of the others', so a few long jobs do not leave the rest of
+// the threads idle behind them. Jobs run to completion on the thread that
+// picked them up, there is no time slicing between guests.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "machine.h"
+#include "pool.h"
+#include "trace.h"
+
+struct job{
+    char *input;
+    char *output;
+    char *program;
+    char *argument; // NULL when there is none
+
+    int status;
+    unsigned long long ran;
+    unsigned long long cycles;
+    unsigned long long console_bytes;
+    unsigned long long console_writes;
+};
+
+// Jobs in slots[bottom] to slots[top - 1] are still waiting. The owner pops
+// at the top end, thieves take from the bottom end.
+struct deque{
+    pthread_mutex_t lock;
+    int *slots;
+    int top;
+    int bottom;
+};
+
+struct pool{
+    struct job *jobs;
+    int n_jobs;
+    struct deque *deques;
+    int n_threads;
+    bool use_jit;
+    unsigned long long trace_records; // 0 for no traces
+};
+
+struct worker{
+    struct pool *pool;
+    int id;
+};
+
+static int deque_pop(struct deque *d){
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if(d->top > d->bottom)
+        job = d->slots[--d->top];
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+static int deque_steal(struct deque *d){
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if(d->top > d->bottom)
+        job = d->slots[d->bottom++];
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+// Own deque first, then the others starting with the next worker along.
+// Nothing adds jobs once the pool runs, so one empty round means done.
+static int next_job(struct pool *pool, int id){
+    int job = deque_pop(&pool->deques[id]);
+    for(int i = 1; job == -1 && i < pool->n_threads; i++)
+        job = deque_steal(&pool->deques[(id + i) % pool->n_threads]);
+    return job;
+}
+
+// output.trace next to the job's console output
+static struct trace *open_trace(const char *output, unsigned long long records){
+    char path[4096];
+    snprintf(path, sizeof path, "%s.trace", output);
+    return trace_open(path, records);
+}
+
+static void run_job(struct pool *pool, struct job *job){
+    int in_fd = open(job->input, O_RDONLY);
+    if(in_fd == -1){
+        fprintf(stderr, "%s: %s\n", job->input, strerror(errno));
+        job->status = -1;
+        return;
+    }
+    int out_fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(out_fd == -1){
+        fprintf(stderr, "%s: %s\n", job->output, strerror(errno));
+        close(in_fd);
+        job->status = -1;
+        return;
+    }
+
+    struct machine *m = machine_new(false, pool->use_jit, in_fd, out_fd);
+    if(!m){
+        fprintf(stderr, "No JIT for this host, run without -j\n");
+        job->status = -1;
+    }else if(pool->trace_records && !(m->trace = open_trace(job->output, pool->trace_records))){
+        fprintf(stderr, "%s: Can not trace that many instructions\n", job->output);
+        job->status = -1;
+    }else if(!machine_load(m, job->program, job->argument)){
+        fprintf(stderr, "%s: No input file\n", job->program);
+        job->status = -1;
+    }else{
+        job->status = machine_run(m);
+        job->ran = m->cpu.ran;
+        job->cycles = m->cpu.cycles;
+    }
+    if(m){
+        job->console_bytes = m->console.bytes;
+        job->console_writes = m->console.writes;
+    }
+
+    machine_free(m);
+    close(out_fd);
+    close(in_fd);
+}
+
+static void *worker_main(void *arg){
+    struct worker *worker = arg;
+    struct pool *pool = worker->pool;
+    int job;
+
+    while((job = next_job(pool, worker->id)) != -1)
+        run_job(pool, &pool->jobs[job]);
+    return NULL;
+}
+
+// Split one line of the jobs file into a job, false for blank and comment lines
+static bool parse_job(char *line, struct job *job){
+    char *fields[4] = {0};
+    int n = 0;
+
+    for(char *field = strtok(line, " \t\r\n"); field && n < 4; field = strtok(NULL, " \t\r\n"))
+        fields[n++] = field;
+    if(!n || fields[0][0] == '#')
+        return false;
+    if(n < 3){
+        fprintf(stderr, "jobs file: want `input output program.com [argument]`, got \"%s\"\n", fields[0]);
+        exit(1);
+    }
+
+    *job = (struct job){
+        .input = strdup(fields[0]),
+        .output = strdup(fields[1]),
+        .program = strdup(fields[2]),
+        .argument = fields[3] ? strdup(fields[3]) : NULL,
+    };
+    return true;
+}
+
+static struct job *read_jobs(const char *jobs_file, int *n_jobs){
+    FILE *fp = fopen(jobs_file, "r");
+    if(!fp){
+        fprintf(stderr, "%s: %s\n", jobs_file, strerror(errno));
+        exit(1);
+    }
+
+    struct job *jobs = NULL;
+    int capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+
+    *n_jobs = 0;
+    while(getline(&line, &line_size, fp) != -1){
+        if(*n_jobs == capacity){
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, capacity * sizeof *jobs);
+            if(!jobs){
+                puts("out of memory");
+                exit(1);
+            }
+        }
+        if(parse_job(line, &jobs[*n_jobs]))
+            ++*n_jobs;
+    }
+
+    free(line);
+    fclose(fp);
+    return jobs;
+}
+
+int pool_run_file(const char *jobs_file, int n_threads, bool use_jit, unsigned long long trace_records, bool print_stats){
+    struct pool pool = { .n_threads = n_threads, .use_jit = use_jit, .trace_records = trace_records };
+    struct timespec start, end;
+
+    pool.jobs = read_jobs(jobs_file, &pool.n_jobs);
+    pool.deques = calloc(n_threads, sizeof *pool.deques);
+    struct worker *workers = calloc(n_threads, sizeof *workers);
+    pthread_t *threads = calloc(n_threads, sizeof *threads);
+    if(!pool.deques || !workers || !threads){
+        puts("out of memory");
+        exit(1);
+    }
+
+    // Deal the jobs out round robin, earliest job on top so each worker
+    // starts with the first of its share and thieves take the last
+    for(int i = 0; i < n_threads; i++){
+        struct deque *d = &pool.deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->slots = malloc((pool.n_jobs / n_threads + 1) * sizeof *d->slots);
+        for(int job = pool.n_jobs - 1; job >= 0; job--)
+            if(job % n_threads == i)
+                d->slots[d->top++] = job;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < n_threads; i++){
+        workers[i] = (struct worker){ .pool = &pool, .id = i };
+        if(pthread_create(&threads[i], NULL, &worker_main, &workers[i])){
+            fprintf(stderr, "Could not start thread %d\n", i);
+            exit(1);
+        }
+    }
+    for(int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int failed = 0;
+    unsigned long long ran = 0;
+    unsigned long long cycles = 0;
+    unsigned long long console_bytes = 0;
+    unsigned long long console_writes = 0;
+    for(int i = 0; i < pool.n_jobs; i++){
+        struct job *job = &pool.jobs[i];
+        if(job->status){
+            fprintf(stderr, "job %d (%s): exit status %d\n", i + 1, job->program, job->status);
+            failed++;
+        }
+        ran += job->ran;
+        cycles += job->cycles;
+        console_bytes += job->console_bytes;
+        console_writes += job->console_writes;
+        free(job->input);
+        free(job->output);
+        free(job->program);
+        free(job->argument);
+    }
+
+    if(print_stats){
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "stats: jobs=%d failed=%d threads=%d instructions=%llu cycles=%llu seconds=%.6f mips=%.3f mhz=%.3f\n",
+            pool.n_jobs,
+            failed,
+            n_threads,
+            ran,
+            cycles,
+            seconds,
+            seconds > 0 ? ran / seconds / 1e6 : 0.0,
+            seconds > 0 ? cycles / seconds / 1e6 : 0.0
+        );
+        fprintf(stderr, "console: bytes=%llu writes=%llu writes_per_mb=%.1f\n",
+            console_bytes,
+            console_writes,
+            console_bytes ? console_writes * 1048576.0 / console_bytes : 0.0
+        );
+    }
+
+    for(int i = 0; i < n_threads; i++){
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].slots);
+    }
+    free(pool.deques);
+    free(workers);
+    free(threads);
+    free(pool.jobs);
+    return failed ? 1 : 0;
+}
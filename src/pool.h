@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// Runs a batch of independent machines on a pool of threads, see pool.c
+
+// jobs_file has one job per line: `input output program.com [argument]`.
+// input is read as the guest's console input, output gets its console
+// output. Blank lines and lines starting with # are skipped.
+// trace_records other than 0 keeps that many trace records of each job in
+// output.trace. Returns 0 when every guest exited with status 0.
+int pool_run_file(const char *jobs_file, int n_threads, bool use_jit, unsigned long long trace_records, bool print_stats);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
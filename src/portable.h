@@ -17,7 +17,26 @@ void *map_an_existing_private(const char *restrict const filename, size_t *n_byt
 void *map_an_existing_readonly(const char *restrict const filename, size_t *n_bytes);
 void *map_an_existing_shared(const char *restrict const filename, size_t *n_bytes);
 
-void map_jit_buffers(void *read_write, void *read_exsc, size_t n_bytes);
+// Undo one of the map_a_new_file_* calls, n_bytes as passed to it
+void unmap_a_file(void *region, size_t n_bytes);
+
+// map_a_new_file_shared(NULL, n_bytes) is anonymous memory, with the mirror.
+// A fork()ed child still shares it with the parent, this gives the child
+// pages of its own at the same address, contents kept. POSIX only.
+void unshare_a_mirrored_memory(void *region, size_t n_bytes);
+
+// Map an existing file read/write and shared, once and without the mirror.
+// n_bytes gets its size. NULL if it can not be opened or mapped.
+void *map_a_disk_image(const char *restrict const filename, size_t *n_bytes);
+// Write the changes back to the file and unmap it
+void unmap_a_disk_image(void *region, size_t n_bytes);
+
+// Map an existing file copy on write: writes through the mapping stay in
+// this process and never reach the file. NULL if it can not be mapped.
+void *map_a_snapshot(const char *restrict const filename, size_t *n_bytes);
+void unmap_a_snapshot(void *region, size_t n_bytes);
+
+void map_jit_buffers(void **read_write, void **read_exec, size_t n_bytes);
 
 void free_jit_buffers(char *read_write, const char *read_exec, size_t n_bytes);
 
@@ -0,0 +1,293 @@
+// Guest profile
+//
+// The dispatch loop (and translated code, one counter add per guest
+// instruction) counts every instruction run at each pc, so the numbers are
+// exact rather than sampled. LDIR and the other repeating instructions count
+// once however often they repeat, so the total comes out below the -s one.
+// bdos() and bios() calls are timed on the host by function number, to show
+// when the emulated I/O rather than the guest code is what takes the time.
+// On exit the report lists the hottest routines, named from a symbol file
+// when there is one or as 256 byte pages when not, the hottest single
+// addresses and the BDOS and BIOS functions.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "machine.h"
+#include "profile.h"
+
+#define TOP_ROUTINES 20
+#define TOP_ADDRESSES 20
+
+static const char *const bdos_names[41] = {
+    "P_TERMCPM", "C_READ", "C_WRITE", "A_READ", "A_WRITE", "L_WRITE", "C_RAWIO", "A_STATIN",
+    "A_STATOUT", "C_WRITESTR", "C_READSTR", "C_STAT", "S_BDOSVER", "DRV_ALLRESET", "DRV_SET", "F_OPEN",
+    "F_CLOSE", "F_SFIRST", "F_SNEXT", "F_DELETE", "F_READ", "F_WRITE", "F_MAKE", "F_RENAME",
+    "DRV_LOGINVEC", "DRV_GET", "F_DMAOFF", "DRV_ALLOCVEC", "DRV_SETRO", "DRV_ROVEC", "F_ATTRIB", "DRV_DPB",
+    "F_USERNUM", "F_READRAND", "F_WRITERAND", "F_SIZE", "F_RANDREC", "DRV_RESET", "", "",
+    "F_WRITEZF",
+};
+
+static const char *const bios_names[17] = {
+    "BOOT", "WBOOT", "CONST", "CONIN", "CONOUT", "LIST", "PUNCH", "READER",
+    "HOME", "SELDSK", "SETTRK", "SETSEC", "SETDMA", "READ", "WRITE", "LISTST",
+    "SECTRAN",
+};
+
+static void add_symbol(struct profile *p, unsigned short addr, const char *name, size_t len){
+    struct symbol *grown = realloc(p->symbols, (p->n_symbols + 1) * sizeof *grown);
+    if(!grown){
+        puts("out of memory");
+        exit(1);
+    }
+    p->symbols = grown;
+
+    struct symbol *s = &p->symbols[p->n_symbols++];
+    s->addr = addr;
+    if(len > sizeof s->name - 1)
+        len = sizeof s->name - 1;
+    memcpy(s->name, name, len);
+    s->name[len] = '\0';
+}
+
+static int by_addr(const void *a, const void *b){
+    const struct symbol *x = a, *y = b;
+    return x->addr - y->addr;
+}
+
+struct profile *profile_new(void){
+    struct profile *p = calloc(1, sizeof *p);
+    if(!p){
+        puts("out of memory");
+        exit(1);
+    }
+
+    // The emulator's own entry points, so time spent there has a name
+    add_symbol(p, BDOS_BASE, "(bdos)", 6);
+    add_symbol(p, BIOS_BASE, "(bios)", 6);
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    return p;
+}
+
+void profile_free(struct profile *p){
+    if(!p)
+        return;
+    free(p->symbols);
+    free(p);
+}
+
+// Four hex digits, optionally followed by H or the ' M80 puts on relocatable values
+static bool parse_addr(const char *word, size_t len, unsigned short *addr){
+    if(len > 4 && (word[4] == 'H' || word[4] == 'h' || word[4] == '\'') )
+        len--;
+    if(len != 4)
+        return false;
+    for(size_t i = 0; i < 4; i++)
+        if(!isxdigit((unsigned char)word[i]))
+            return false;
+    *addr = strtoul(word, NULL, 16);
+    return true;
+}
+
+static bool is_name(const char *word, size_t len){
+    if(!len || !(isalpha((unsigned char)word[0]) || strchr("_.?@$", word[0])))
+        return false;
+    for(size_t i = 1; i < len; i++)
+        if(!isalnum((unsigned char)word[i]) && !strchr("_.?@$", word[i]))
+            return false;
+    return true;
+}
+
+// Symbol files pair an address with a name, in either order and several to
+// a line: L80 and ZSM .SYM files are `0100 START  0123 LOOP`, the symbol
+// table at the end of a .PRN listing depends on the assembler. In a listing
+// only the part after the line mentioning "symbol" is read, the code above
+// it has addresses next to all sorts of things.
+bool profile_load_symbols(struct profile *p, const char *path){
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        return false;
+
+    char line[512];
+    bool listing = false;
+    while(fgets(line, sizeof line, fp)){
+        for(char *c = line; *c; c++){
+            if(!strncasecmp(c, "symbol", 6)){
+                listing = true;
+                break;
+            }
+        }
+    }
+    rewind(fp);
+
+    bool in_table = !listing;
+    while(fgets(line, sizeof line, fp)){
+        if(!in_table){
+            for(char *c = line; *c && !in_table; c++)
+                in_table = !strncasecmp(c, "symbol", 6);
+            continue;
+        }
+
+        const char *words[64];
+        size_t lens[64];
+        int n = 0;
+        for(char *c = line; *c && n < 64;){
+            while(*c && isspace((unsigned char)*c))
+                c++;
+            if(!*c)
+                break;
+            words[n] = c;
+            while(*c && !isspace((unsigned char)*c))
+                c++;
+            lens[n] = c - words[n];
+            if(lens[n] && words[n][lens[n] - 1] == ':') // labels in some tables
+                lens[n]--;
+            n++;
+        }
+
+        for(int i = 0; i + 1 < n; i++){
+            unsigned short addr;
+            if(parse_addr(words[i], lens[i], &addr) && is_name(words[i + 1], lens[i + 1])){
+                add_symbol(p, addr, words[i + 1], lens[i + 1]);
+                i++;
+            }else if(is_name(words[i], lens[i]) && parse_addr(words[i + 1], lens[i + 1], &addr)){
+                add_symbol(p, addr, words[i], lens[i]);
+                i++;
+            }
+        }
+    }
+    fclose(fp);
+
+    qsort(p->symbols, p->n_symbols, sizeof *p->symbols, &by_addr);
+    return true;
+}
+
+// Last symbol at or below addr, NULL when there is none
+static const struct symbol *symbol_at(const struct profile *p, unsigned short addr){
+    int lo = 0, hi = p->n_symbols; // answer is below hi
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(p->symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &p->symbols[lo - 1] : NULL;
+}
+
+// Routines are the symbols, then the 256 pages for code below the first one
+struct routine{
+    unsigned long long hits;
+    unsigned lo, hi; // lowest and highest address run
+    const char *name;
+};
+
+static int by_hits(const void *a, const void *b){
+    const struct routine *x = a, *y = b;
+    return (x->hits < y->hits) - (x->hits > y->hits);
+}
+
+struct address{
+    unsigned long long hits;
+    unsigned short pc;
+};
+
+static int by_address_hits(const void *a, const void *b){
+    const struct address *x = a, *y = b;
+    return (x->hits < y->hits) - (x->hits > y->hits);
+}
+
+bool profile_report(const struct profile *p, const char *path){
+    FILE *fp = fopen(path, "w");
+    if(!fp)
+        return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - p->start.tv_sec) + (now.tv_nsec - p->start.tv_nsec) / 1e9;
+
+    unsigned long long total = 0;
+    for(unsigned pc = 0; pc < 0x10000; pc++)
+        total += p->hits[pc];
+    double percent = total ? 100.0 / total : 0.0;
+    fprintf(fp, "instructions=%llu seconds=%.6f\n", total, seconds);
+
+    int n_routines = p->n_symbols + 256;
+    struct routine *routines = calloc(n_routines, sizeof *routines);
+    struct address *hot = malloc(0x10000 * sizeof *hot);
+    int n_hot = 0;
+    if(!routines || !hot){
+        puts("out of memory");
+        exit(1);
+    }
+    for(int i = 0; i < n_routines; i++)
+        routines[i].lo = 0x10000;
+
+    for(unsigned pc = 0; pc < 0x10000; pc++){
+        if(!p->hits[pc])
+            continue;
+        hot[n_hot++] = (struct address){ p->hits[pc], pc };
+
+        const struct symbol *s = symbol_at(p, pc);
+        struct routine *r = s ? &routines[s - p->symbols] : &routines[p->n_symbols + (pc >> 8)];
+        r->hits += p->hits[pc];
+        r->name = s ? s->name : NULL;
+        if(pc < r->lo)
+            r->lo = pc;
+        if(pc > r->hi)
+            r->hi = pc;
+    }
+
+    qsort(routines, n_routines, sizeof *routines, &by_hits);
+    fprintf(fp, "\nhottest routines\n%14s %7s  %-9s  %s\n", "instructions", "%", "run", "routine");
+    for(int i = 0; i < n_routines && i < TOP_ROUTINES && routines[i].hits; i++){
+        const struct routine *r = &routines[i];
+        fprintf(fp, "%14llu %7.3f  %04x-%04x  ", r->hits, r->hits * percent, r->lo, r->hi);
+        if(r->name)
+            fprintf(fp, "%s\n", r->name);
+        else
+            fprintf(fp, "page %02x\n", r->lo >> 8);
+    }
+
+    qsort(hot, n_hot, sizeof *hot, &by_address_hits);
+    fprintf(fp, "\nhottest addresses\n%14s %7s  %-4s  %s\n", "instructions", "%", "pc", "symbol");
+    for(int i = 0; i < n_hot && i < TOP_ADDRESSES; i++){
+        const struct symbol *s = symbol_at(p, hot[i].pc);
+        fprintf(fp, "%14llu %7.3f  %04x  ", hot[i].hits, hot[i].hits * percent, hot[i].pc);
+        if(s)
+            fprintf(fp, "%s+%x\n", s->name, hot[i].pc - s->addr);
+        else
+            fprintf(fp, "-\n");
+    }
+
+    fprintf(fp, "\nhost time in bdos and bios\n%-20s %12s %12s %7s %10s\n", "function", "calls", "ms", "%", "us/call");
+    for(int i = 0; i < 256 + 64; i++){
+        bool is_bdos = i < 256;
+        int fn = is_bdos ? i : i - 256;
+        unsigned long long calls = is_bdos ? p->bdos_calls[fn] : p->bios_calls[fn];
+        unsigned long long ns = is_bdos ? p->bdos_ns[fn] : p->bios_ns[fn];
+        if(!calls)
+            continue;
+
+        char name[32];
+        if(is_bdos)
+            snprintf(name, sizeof name, "bdos %02x %s", fn, fn < 41 ? bdos_names[fn] : "");
+        else
+            snprintf(name, sizeof name, "bios %02x %s", fn, fn < 17 ? bios_names[fn] : "");
+        fprintf(fp, "%-20s %12llu %12.3f %7.3f %10.3f\n",
+            name,
+            calls,
+            ns / 1e6,
+            seconds > 0 ? ns / 1e7 / seconds : 0.0,
+            ns / 1e3 / calls
+        );
+    }
+
+    free(hot);
+    free(routines);
+    fclose(fp);
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <time.h>
+
+// Guest profile, see profile.c
+
+struct symbol{
+    unsigned short addr;
+    char name[32];
+};
+
+struct profile{
+    unsigned long long hits[0x10000]; // instructions run at each pc
+
+    // Host time spent handling each BDOS and BIOS function
+    unsigned long long bdos_calls[256];
+    unsigned long long bdos_ns[256];
+    unsigned long long bios_calls[64];
+    unsigned long long bios_ns[64];
+
+    struct symbol *symbols; // sorted by address
+    int n_symbols;
+    struct timespec start;
+};
+
+struct profile *profile_new(void);
+void profile_free(struct profile *p);
+
+// Name routines from a .SYM file (L80, ZSM) or the symbol table of a .PRN
+// listing. False if it can not be read.
+bool profile_load_symbols(struct profile *p, const char *path);
+
+// Nanoseconds on the host clock, for timing BDOS and BIOS calls
+static inline unsigned long long profile_clock(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Write the report to path, false if it can not be written
+bool profile_report(const struct profile *p, const char *path);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
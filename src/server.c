@@ -0,0 +1,210 @@
+// Fork server
+//
+// The server boots one program to a ready point, after its startup code has
+// run, and stops there. Every job that connects to its Unix socket gets a
+// fork() of that machine: guest memory, JIT translations and all, copied on
+// write, so a job starts where the startup left off without running it
+// again. The client hands over its stdin, stdout and current directory with
+// SCM_RIGHTS plus the command tail, and gets the exit status back as four
+// bytes once the guest exits.
+//
+// Guest memory is never ram.bin here, and each job gives itself its own copy
+// of the mirrored memfd pages, which fork() does not copy on write.
+// Otherwise the jobs would all write to the same pages.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "portable.h"
+#include "machine.h"
+#include "server.h"
+
+#define SERVER_FDS 3 // console input, console output, directory
+
+static int listen_fd = -1; // one server per process, it never comes back from serve()
+
+static bool socket_address(struct sockaddr_un *addr, const char *path){
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof addr->sun_path){
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+// In the child: take the job off conn and point the machine at it
+static bool start_job(struct machine *m, int conn){
+    char tail[SERVER_TAIL + 1];
+    union{
+        struct cmsghdr header;
+        char space[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { tail, sizeof tail };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.space,
+        .msg_controllen = sizeof control.space,
+    };
+
+    ssize_t n = recvmsg(conn, &msg, 0);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if(n <= 0 || tail[n - 1] || !c || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(SERVER_FDS * sizeof(int)))
+        return false;
+    int fds[SERVER_FDS];
+    memcpy(fds, CMSG_DATA(c), sizeof fds);
+
+    // The job's directory, keeping where the guest's DMA and drive were
+    unsigned short dma = m->fs.dma;
+    unsigned char drive = m->fs.drive;
+    fs_free(&m->fs);
+    if(fchdir(fds[2]) == -1 || !fs_init(&m->fs, "."))
+        return false;
+    close(fds[2]);
+    m->fs.dma = dma;
+    m->fs.drive = drive;
+
+    unshare_a_mirrored_memory(m->ram, RAM_SIZE);
+
+    console_init(&m->console, fds[1]);
+    console_input_init(&m->input, fds[0]); // the server's reader thread did not come along
+    machine_set_argument(m, tail);
+    m->job_fd = conn;
+    return true;
+}
+
+// at_stop hook: the ready point. Only the children come back, each running one job.
+static void serve(struct machine *m){
+    console_flush(&m->console);
+    signal(SIGCHLD, SIG_IGN); // nobody waits for the jobs
+    fprintf(stderr, "server: ready after %llu instructions\n", m->cpu.ran);
+
+    for(;;){
+        int conn = accept(listen_fd, NULL, NULL);
+        if(conn == -1){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("server: accept");
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if(!pid){
+            close(listen_fd);
+            signal(SIGCHLD, SIG_DFL);
+            if(!start_job(m, conn))
+                _exit(1);
+            return;
+        }
+        if(pid == -1)
+            perror("server: fork");
+        close(conn);
+    }
+}
+
+bool server_listen(struct machine *m, const char *spec){
+    const char *colon = strrchr(spec, ':');
+    const char *when = NULL;
+    if(colon && (!strncmp(colon + 1, "pc=", 3) || !strncmp(colon + 1, "ran=", 4)))
+        when = colon + 1;
+    else
+        colon = spec + strlen(spec);
+
+    char path[sizeof ((struct sockaddr_un *)0)->sun_path + 1];
+    struct sockaddr_un addr;
+    snprintf(path, sizeof path, "%.*s", (int)(colon - spec), spec);
+    if(!socket_address(&addr, path))
+        return false;
+    if(!machine_stop_at(m, when, serve)){
+        fprintf(stderr, "%s: expected path, path:pc=addr or path:ran=count\n", spec);
+        return false;
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path); // left over from an earlier server
+    if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 || listen(listen_fd, SOMAXCONN) == -1){
+        fprintf(stderr, "%s: can not listen: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void server_reply(struct machine *m, int status){
+    unsigned char bytes[4] = { status, status >> 8, status >> 16, status >> 24 };
+    if(write(m->job_fd, bytes, sizeof bytes) != sizeof bytes)
+        perror("server: reply");
+    close(m->job_fd);
+    m->job_fd = -1;
+}
+
+int server_request(const char *path, const char *argument){
+    struct sockaddr_un addr;
+    if(!argument)
+        argument = "";
+    if(strlen(argument) > SERVER_TAIL){
+        fprintf(stderr, "argument longer than %d characters\n", SERVER_TAIL);
+        return 1;
+    }
+    if(!socket_address(&addr, path))
+        return 1;
+
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(conn == -1 || connect(conn, (struct sockaddr *)&addr, sizeof addr) == -1){
+        fprintf(stderr, "%s: can not connect: %s\n", path, strerror(errno));
+        return 1;
+    }
+    int dir = open(".", O_RDONLY | O_DIRECTORY);
+    if(dir == -1){
+        perror("can not open the current directory");
+        return 1;
+    }
+
+    int fds[SERVER_FDS] = { STDIN_FILENO, STDOUT_FILENO, dir };
+    union{
+        struct cmsghdr header;
+        char space[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { (void *)argument, strlen(argument) + 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.space,
+        .msg_controllen = sizeof control.space,
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(c), fds, sizeof fds);
+    if(sendmsg(conn, &msg, 0) == -1){
+        fprintf(stderr, "%s: can not send the job: %s\n", path, strerror(errno));
+        return 1;
+    }
+    close(dir);
+
+    unsigned char bytes[4];
+    size_t got = 0;
+    while(got < sizeof bytes){
+        ssize_t n = read(conn, bytes + got, sizeof bytes - got);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0){
+            fprintf(stderr, "%s: the job died\n", path);
+            return 1;
+        }
+        got += n;
+    }
+    close(conn);
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (unsigned)bytes[3] << 24;
+}
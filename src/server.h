@@ -0,0 +1,32 @@
+#ifndef SERVER_H
+#define SERVER_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// Fork server, see server.c
+
+#define SERVER_TAIL 126 // longest command tail, it has to fit 0x82 to 0xff
+
+struct machine;
+
+// Listen on the Unix socket in spec, which is path[:pc=addr|:ran=count], and
+// start serving jobs once the guest gets there (see machine_stop_at()), or
+// right away. False, after saying why on stderr, if it can not listen.
+bool server_listen(struct machine *m, const char *spec);
+
+// Send the exit status of the job this process ran back to its client
+void server_reply(struct machine *m, int status);
+
+// Run one job on the server at path with this process' stdin, stdout and
+// current directory, argument as the command tail. Returns the guest's exit
+// status, 1 after saying why on stderr if the job could not be run.
+int server_request(const char *path, const char *argument);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,167 @@
+// Machine snapshots for a warm start, see snapshot.h
+//
+// Writing one is plain stdio. Restoring maps the file copy on write and copies
+// the 64 KiB into the machine's mirrored memory, so a program that took
+// millions of instructions to set itself up starts from there after one mmap
+// and a memcpy. A private file mapping can not have the mirror, see memory.h,
+// so guest memory can not simply point into it. The debug maps start out
+// empty, and what snapshot.h says is not saved stays as the fresh machine
+// has it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "portable.h"
+#include "machine.h"
+#include "snapshot.h"
+
+static bool write_snapshot(struct machine *m, const char *path){
+    struct cpu *cpu = &m->cpu;
+    struct snapshot_header h;
+    static const unsigned char padding[SNAPSHOT_RAM_OFFSET];
+
+    flags_commit(cpu);
+    console_flush(&m->console); // so its counters cover everything printed so far
+    memset(&h, 0, sizeof h); // no stray bytes in the padding either
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+    h.version = SNAPSHOT_VERSION;
+    h.ram_offset = SNAPSHOT_RAM_OFFSET;
+
+    h.pc = cpu->pc;
+    h.sp = cpu->sp;
+    h.ix = cpu->ix;
+    h.iy = cpu->iy;
+    h.af = cpu->af;
+    h.bc = cpu->bc;
+    h.de = cpu->de;
+    h.hl = cpu->hl;
+    h.af_prime = cpu->af_prime;
+    h.bc_prime = cpu->bc_prime;
+    h.de_prime = cpu->de_prime;
+    h.hl_prime = cpu->hl_prime;
+    h.ran = cpu->ran;
+    h.cycles = cpu->cycles;
+
+    h.fs_dma = m->fs.dma;
+    h.fs_drive = m->fs.drive;
+
+    h.n_drives = m->disks.n;
+    h.disk_selected = m->disks.selected;
+    h.disk_track = m->disks.track;
+    h.disk_sector = m->disks.sector;
+    h.disk_dma = m->disks.dma;
+    for(int i = 0; i < m->disks.n; i++){
+        h.dph[i] = m->disks.drive[i].dph;
+        h.format[i] = m->disks.drive[i].format;
+    }
+    h.disk_reads = m->disks.reads;
+    h.disk_writes = m->disks.writes;
+
+    h.console_bytes = m->console.bytes;
+    h.console_writes = m->console.writes;
+    h.bios_bdos_calls = m->bios_bdos_calls;
+
+    FILE *fp = fopen(path, "wb");
+    if(!fp)
+        return false;
+    bool ok = fwrite(&h, sizeof h, 1, fp) == 1
+        && fwrite(padding, SNAPSHOT_RAM_OFFSET - sizeof h, 1, fp) == 1
+        && fwrite(m->ram, RAM_SIZE, 1, fp) == 1;
+    return fclose(fp) == 0 && ok;
+}
+
+static void write_at_stop(struct machine *m){
+    if(!write_snapshot(m, m->snapshot_path)){
+        fprintf(stderr, "%s: can not write the snapshot\n", m->snapshot_path);
+        machine_exit(m, 1);
+    }
+}
+
+bool snapshot_at(struct machine *m, const char *spec){
+    const char *colon = strrchr(spec, ':');
+    if(!colon || colon == spec || !machine_stop_at(m, colon + 1, write_at_stop)){
+        fprintf(stderr, "%s: expected file:pc=addr or file:ran=count\n", spec);
+        return false;
+    }
+
+    m->snapshot_path = malloc(colon - spec + 1);
+    if(!m->snapshot_path){
+        puts("out of memory");
+        exit(1);
+    }
+    memcpy(m->snapshot_path, spec, colon - spec);
+    m->snapshot_path[colon - spec] = '\0';
+    return true;
+}
+
+static bool same_format(const struct disk_format *a, const struct disk_format *b){
+    return a->tracks == b->tracks && a->sectors == b->sectors && a->skew == b->skew
+        && a->first_sector == b->first_sector && a->block == b->block && a->dirs == b->dirs
+        && a->boot == b->boot && a->fixed == b->fixed;
+}
+
+bool snapshot_restore(struct machine *m, const char *path){
+    struct cpu *cpu = &m->cpu;
+    size_t n_bytes;
+    unsigned char *map = map_a_snapshot(path, &n_bytes);
+    if(!map){
+        fprintf(stderr, "%s: can not map the snapshot\n", path);
+        return false;
+    }
+
+    const struct snapshot_header *h = (const struct snapshot_header *)map;
+    const char *problem = NULL;
+    if(n_bytes < sizeof *h || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof h->magic) || h->version != SNAPSHOT_VERSION)
+        problem = "not a snapshot, or from another version";
+    else if(h->ram_offset % SNAPSHOT_RAM_OFFSET || n_bytes < h->ram_offset + (size_t)RAM_SIZE)
+        problem = "truncated";
+    else if(h->n_drives != m->disks.n)
+        problem = "written with a different number of disk images";
+    for(int i = 0; !problem && i < m->disks.n; i++){
+        if(!same_format(&h->format[i], &m->disks.drive[i].format))
+            problem = "written with disk images of a different format";
+    }
+    if(problem){
+        fprintf(stderr, "%s: %s\n", path, problem);
+        unmap_a_snapshot(map, n_bytes);
+        return false;
+    }
+
+    memcpy(m->ram, map + h->ram_offset, RAM_SIZE);
+    m->tpa_top = m->ram[6] | m->ram[7] << 8; // the BDOS jump at 5 has it
+
+    cpu->pc = h->pc;
+    cpu->sp = h->sp;
+    cpu->ix = h->ix;
+    cpu->iy = h->iy;
+    cpu->af = h->af;
+    cpu->bc = h->bc;
+    cpu->de = h->de;
+    cpu->hl = h->hl;
+    cpu->af_prime = h->af_prime;
+    cpu->bc_prime = h->bc_prime;
+    cpu->de_prime = h->de_prime;
+    cpu->hl_prime = h->hl_prime;
+    cpu->lf_op = LF_NONE;
+    cpu->ran = h->ran;
+    cpu->cycles = h->cycles;
+
+    m->fs.dma = h->fs_dma;
+    m->fs.drive = h->fs_drive;
+
+    m->disks.selected = h->disk_selected;
+    m->disks.track = h->disk_track;
+    m->disks.sector = h->disk_sector;
+    m->disks.dma = h->disk_dma;
+    for(int i = 0; i < m->disks.n; i++)
+        m->disks.drive[i].dph = h->dph[i];
+    m->disks.reads = h->disk_reads;
+    m->disks.writes = h->disk_writes;
+
+    m->console.bytes = h->console_bytes;
+    m->console.writes = h->console_writes;
+    m->bios_bdos_calls = h->bios_bdos_calls;
+    unmap_a_snapshot(map, n_bytes);
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "disk.h"
+
+// Machine snapshots for a warm start, see snapshot.c
+//
+// A snapshot is this header, padded to one page, then the 64 KiB of guest
+// memory. Restoring maps the whole file private and copies the memory out.
+//
+// Nothing else is saved: not the built-in CCP's queue of commands and SUBMIT
+// batch, not -N's routine table or the check it has pending, not the BDOS's
+// cache of open host files. A restore in the middle of a SUBMIT or with -N
+// starts without that state. Files the guest has open are opened again by
+// the name in their FCB, as the host directory has them at restore time.
+
+#define SNAPSHOT_MAGIC "Z80SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_RAM_OFFSET 4096 // page aligned, guest memory starts here
+
+struct snapshot_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t ram_offset;
+
+    // Registers, with the flags committed to F
+    uint16_t pc, sp, ix, iy;
+    uint16_t af, bc, de, hl;
+    uint16_t af_prime, bc_prime, de_prime, hl_prime;
+    uint64_t ran;
+    uint64_t cycles;
+
+    // BDOS files, the host files themselves are not saved
+    uint16_t fs_dma;
+    uint8_t fs_drive;
+
+    // BIOS disks, the images are attached again with -i
+    uint8_t n_drives;
+    uint8_t disk_selected;
+    uint16_t disk_track;
+    uint16_t disk_sector;
+    uint16_t disk_dma;
+    uint16_t dph[DISK_DRIVES];
+    struct disk_format format[DISK_DRIVES];
+    uint64_t disk_reads;
+    uint64_t disk_writes;
+
+    uint64_t console_bytes;
+    uint64_t console_writes;
+    uint64_t bios_bdos_calls;
+};
+
+struct machine;
+
+// Arm the snapshot: spec is file:pc=addr to write it when the guest is about
+// to run the instruction at addr, or file:ran=count once it has run count
+// instructions. It is written once, then the guest carries on. False, after
+// saying why on stderr, if spec makes no sense.
+bool snapshot_at(struct machine *m, const char *spec);
+
+// Replace the guest memory and state of a fresh machine with the snapshot in
+// path. The same disk images must be attached already. False, after saying
+// why on stderr, if it can not be used.
+bool snapshot_restore(struct machine *m, const char *path);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
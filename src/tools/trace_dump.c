@@ -0,0 +1,116 @@
+// Print the records of a trace file written with CPM_emu -t, oldest first
+//
+// trace_dump [-n last] [-a pc[-pc]] [-r count[-count]] [-m] trace.bin
+//   -n  only the last records, before the other filters
+//   -a  only instructions at pc or in the range of addresses, hex
+//   -r  only instructions with the count or in the range of counts
+//   -m  hide the reserved flag bits and half carry, for comparing against
+//       emulators that do not get those right
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static void usage(const char *name){
+    fprintf(stderr, "usage: %s [-n last] [-a pc[-pc]] [-r count[-count]] [-m] trace.bin\n", name);
+    exit(1);
+}
+
+// "lo" or "lo-hi" in base
+static void parse_range(const char *text, int base, unsigned long long *lo, unsigned long long *hi){
+    char *end;
+    *lo = *hi = strtoull(text, &end, base);
+    if(*end == '-')
+        *hi = strtoull(end + 1, &end, base);
+    if(*end || *hi < *lo){
+        fprintf(stderr, "bad range \"%s\"\n", text);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]){
+    unsigned long long last = 0;
+    unsigned long long pc_lo = 0, pc_hi = 0xffff;
+    unsigned long long ran_lo = 0, ran_hi = ~0ull;
+    bool mask_flags = false;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:a:r:m")) != -1){
+        switch (opt){
+        case 'n':
+            last = strtoull(optarg, NULL, 0);
+            break;
+        case 'a':
+            parse_range(optarg, 16, &pc_lo, &pc_hi);
+            break;
+        case 'r':
+            parse_range(optarg, 0, &ran_lo, &ran_hi);
+            break;
+        case 'm':
+            mask_flags = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1)
+        usage(argv[0]);
+
+    FILE *fp = fopen(argv[optind], "rb");
+    if(!fp){
+        perror(argv[optind]);
+        return 1;
+    }
+
+    struct trace_header header;
+    if(fread(&header, sizeof header, 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof header.magic)){
+        fprintf(stderr, "%s: not a trace file\n", argv[optind]);
+        return 1;
+    }
+    if(header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record)){
+        fprintf(stderr, "%s: trace version %u, this tool reads version %u\n", argv[optind], header.version, TRACE_VERSION);
+        return 1;
+    }
+
+    // Until the ring wraps the oldest record is the first one
+    unsigned long long count = header.written < header.capacity ? header.written : header.capacity;
+    unsigned long long first = header.written - count;
+    if(last && last < count){
+        first += count - last;
+        count = last;
+    }
+
+    for(unsigned long long i = first; i < first + count; i++){
+        struct trace_record r;
+        unsigned long long slot = i & (header.capacity - 1);
+        if(((i == first || !slot) && fseek(fp, TRACE_HEADER_SIZE + slot * sizeof r, SEEK_SET)) || fread(&r, sizeof r, 1, fp) != 1){
+            fprintf(stderr, "%s: cut short\n", argv[optind]);
+            return 1;
+        }
+        if(r.pc < pc_lo || r.pc > pc_hi || r.ran < ran_lo || r.ran > ran_hi)
+            continue;
+
+        printf("%016llx Bytes %02x %02x %02x %02x pc:%04x af:%04x sp:%04x hl:%04x de:%04x bc:%04x ix:%04x iy:%04x\n",
+            (unsigned long long)r.ran,
+            r.bytes[0],
+            r.bytes[1],
+            r.bytes[2],
+            r.bytes[3],
+            r.pc,
+            mask_flags ? r.af & 0xffd7 & 0xffef : r.af,
+            r.sp,
+            r.hl,
+            r.de,
+            r.bc,
+            r.ix,
+            r.iy
+        );
+    }
+
+    fclose(fp);
+    return 0;
+}
@@ -0,0 +1,46 @@
+// Instruction trace
+//
+// A fixed size binary record per instruction goes into a ring mapped from a
+// file, so turning it on costs a handful of stores per instruction and no
+// system calls. Because the mapping is shared with the file, the last records
+// are on disk even when the emulator crashes or gets killed. tools/trace_dump
+// turns a trace file back into text.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "portable.h"
+#include "trace.h"
+
+struct trace *trace_open(const char *path, unsigned long long n_records){
+    unsigned long long capacity = TRACE_MIN_RECORDS;
+    while(capacity < n_records){
+        capacity <<= 1;
+        if(capacity > (1ull << 32))
+            return NULL;
+    }
+
+    struct trace *t = malloc(sizeof *t);
+    if(!t)
+        return NULL;
+    t->n_bytes = TRACE_HEADER_SIZE + capacity * sizeof(struct trace_record);
+    t->mask = capacity - 1;
+
+    unsigned char *region = map_a_new_file_shared(path, t->n_bytes);
+    t->header = (struct trace_header *)region;
+    t->records = (struct trace_record *)(region + TRACE_HEADER_SIZE);
+
+    memcpy(t->header->magic, TRACE_MAGIC, sizeof t->header->magic);
+    t->header->version = TRACE_VERSION;
+    t->header->record_size = sizeof(struct trace_record);
+    t->header->capacity = capacity;
+    t->header->written = 0;
+    return t;
+}
+
+void trace_close(struct trace *t){
+    if(!t)
+        return;
+    unmap_a_file(t->header, t->n_bytes);
+    free(t);
+}
@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+// Instruction trace, see trace.c. The file layout below is also read by
+// tools/trace_dump.c, bump TRACE_VERSION when it changes.
+
+#define TRACE_MAGIC "Z80TRACE"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 4096 // records start on the next page
+#define TRACE_MIN_RECORDS 128  // one page of records, keeps the mapping page sized
+
+// One instruction, registers as they were before it ran
+struct trace_record{
+    uint64_t ran; // instruction count, the first one is 1
+    uint16_t pc;
+    uint16_t af;
+    uint16_t bc;
+    uint16_t de;
+    uint16_t hl;
+    uint16_t ix;
+    uint16_t iy;
+    uint16_t sp;
+    uint8_t bytes[4]; // opcode bytes at pc
+    uint32_t unused;
+};
+_Static_assert(sizeof(struct trace_record) == 32, "trace records are written to disk as is");
+
+struct trace_header{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity; // records in the ring, a power of two
+    uint64_t written;  // records ever written, the newest is at (written - 1) & (capacity - 1)
+};
+
+struct trace{
+    struct trace_header *header;
+    struct trace_record *records;
+    uint64_t mask;
+    size_t n_bytes; // of the mapping
+};
+
+// Map path as a ring of at least n_records records, rounded up to a power of
+// two. The file stays behind with the last records when the process ends,
+// however it ends. NULL when n_records is too large.
+struct trace *trace_open(const char *path, unsigned long long n_records);
+void trace_close(struct trace *t);
+
+static inline void trace_add(struct trace *t, const struct cpu *cpu, const unsigned char *ram, unsigned short pc, unsigned long long ran){
+    uint64_t written = t->header->written;
+    struct trace_record *r = &t->records[written & t->mask];
+
+    r->ran = ran;
+    r->pc = pc;
+    r->af = cpu->a << 8 | flags_value(cpu);
+    r->bc = cpu->bc;
+    r->de = cpu->de;
+    r->hl = cpu->hl;
+    r->ix = cpu->ix;
+    r->iy = cpu->iy;
+    r->sp = cpu->sp;
+    r->bytes[0] = ram[pc];
+    r->bytes[1] = ram[(unsigned short)(pc + 1)];
+    r->bytes[2] = ram[(unsigned short)(pc + 2)];
+    r->bytes[3] = ram[(unsigned short)(pc + 3)];
+    t->header->written = written + 1;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif
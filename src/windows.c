@@ -179,6 +179,63 @@ void *map_an_existing_shared(const char *restrict const filename, size_t *n_byte
     return whole_region;
 }
 
+void unmap_a_file(void *region, size_t n_bytes){
+    UnmapViewOfFile(region);
+    UnmapViewOfFile((char *)region + n_bytes);
+}
+
+void *map_a_disk_image(const char *restrict const filename, size_t *n_bytes){
+    HANDLE fh = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if(fh == INVALID_HANDLE_VALUE)
+        return NULL;
+    if(!GetFileSizeEx(fh, &size) || !size.QuadPart){
+        CloseHandle(fh);
+        return NULL;
+    }
+
+    HANDLE section = CreateFileMapping(fh, NULL, PAGE_READWRITE, 0, 0, NULL);
+    CloseHandle(fh);
+    if(!section)
+        return NULL;
+    void *region = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, 0);
+    CloseHandle(section);
+    if(region)
+        *n_bytes = size.QuadPart;
+    return region;
+}
+
+void unmap_a_disk_image(void *region, size_t n_bytes){
+    FlushViewOfFile(region, n_bytes);
+    UnmapViewOfFile(region);
+}
+
+void *map_a_snapshot(const char *restrict const filename, size_t *n_bytes){
+    HANDLE fh = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if(fh == INVALID_HANDLE_VALUE)
+        return NULL;
+    if(!GetFileSizeEx(fh, &size) || !size.QuadPart){
+        CloseHandle(fh);
+        return NULL;
+    }
+
+    HANDLE section = CreateFileMapping(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(fh);
+    if(!section)
+        return NULL;
+    void *region = MapViewOfFile(section, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(section);
+    if(region)
+        *n_bytes = size.QuadPart;
+    return region;
+}
+
+void unmap_a_snapshot(void *region, size_t n_bytes){
+    (void)n_bytes;
+    UnmapViewOfFile(region);
+}
+
 void map_jit_buffers(void **read_write, void **read_exec, size_t n_bytes){
     HANDLE fh = INVALID_FILE_HANDLE;
 